@@ -0,0 +1,297 @@
+#include "clarkclean.h"
+
+#include "../fftconvolver.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+template<typename ImageSetType>
+void ClarkClean<ImageSetType>::ExecuteMajorIteration(ImageSetType& dataImage, ImageSetType& modelImage, std::vector<double*> psfImages, size_t width, size_t height, bool& reachedStopGain)
+{
+	if(this->_stopOnNegativeComponent)
+		this->_allowNegativeComponents = true;
+	_width = width;
+	_height = height;
+	// The patch should fit in the PSF around its centre pixel (width/2, height/2)
+	const size_t minSize = std::min(width, height);
+	_patchRadius = std::min(minSize / 4, (minSize - 1) / 2);
+	_patchSize = _patchRadius * 2 + 1;
+
+	size_t peakIndex = findPeak(dataImage);
+	double peakNormalized = (peakIndex == _width*_height) ? 0.0 : dataImage.JoinedValueNormalized(peakIndex);
+	std::cout << "Initial peak: " << peakDescription(dataImage, peakIndex) << '\n';
+	double firstThreshold = this->_threshold, stopGainThreshold = std::fabs(peakNormalized)*(1.0-this->_stopGain);
+	if(stopGainThreshold > firstThreshold)
+	{
+		firstThreshold = stopGainThreshold;
+		std::cout << "Next major iteration at: " << stopGainThreshold << '\n';
+	}
+	else if(this->_stopGain != 1.0) {
+		std::cout << "Major iteration threshold reached global threshold of " << this->_threshold << ": final major iteration.\n";
+	}
+
+	std::vector<ao::uvector<double>> patches;
+	double sidelobeRatio;
+	makePatches(psfImages, patches, sidelobeRatio);
+	std::cout << "Using PSF patch of " << _patchSize << " x " << _patchSize << " pixels, largest sidelobe outside patch: " << sidelobeRatio << '\n';
+
+	const size_t imageCount = dataImage.ImageCount();
+	ImageSetType components(width*height, dataImage);
+	std::vector<double*> dataPtrs(imageCount), componentPtrs(imageCount);
+	std::vector<const double*> patchPtrs(imageCount);
+	for(size_t i=0; i!=imageCount; ++i)
+	{
+		dataPtrs[i] = dataImage.GetImage(i);
+		componentPtrs[i] = components.GetImage(i);
+		patchPtrs[i] = patches[ImageSetType::PSFIndex(i)].data();
+	}
+
+	ao::uvector<size_t> activePixels;
+	ao::uvector<double> originalValues, componentValues(imageCount);
+	size_t cycleIndex = 0;
+	while(std::fabs(peakNormalized) > firstThreshold && this->_iterationNumber < this->_maxIter && !(dataImage.IsComponentNegative(peakIndex) && this->_stopOnNegativeComponent))
+	{
+		const double cycleThreshold = selectActivePixels(dataImage, std::max(firstThreshold, std::fabs(peakNormalized) * sidelobeRatio), peakIndex, activePixels);
+		const size_t activeCount = activePixels.size();
+
+		// The minor cycle changes the active pixels in the residuals. They are restored
+		// afterwards, because the FFT subtraction also subtracts the components from them.
+		originalValues.resize(activeCount * imageCount);
+		for(size_t i=0; i!=imageCount; ++i)
+		{
+			for(size_t j=0; j!=activeCount; ++j)
+				originalValues[i*activeCount + j] = dataPtrs[i][activePixels[j]];
+			std::fill(componentPtrs[i], componentPtrs[i] + width*height, 0.0);
+		}
+
+		const size_t firstIteration = this->_iterationNumber;
+		double activePeak = peakValue(dataImage, peakIndex);
+		do {
+			for(size_t i=0; i!=imageCount; ++i)
+			{
+				componentValues[i] = this->_subtractionGain * dataPtrs[i][peakIndex];
+				componentPtrs[i][peakIndex] += componentValues[i];
+			}
+			modelImage.AddComponent(dataImage, peakIndex, this->_subtractionGain);
+
+			const int
+				peakX = peakIndex % _width, peakY = peakIndex / _width,
+				radius = _patchRadius, patchSize = _patchSize;
+			for(size_t j=0; j!=activeCount; ++j)
+			{
+				const size_t index = activePixels[j];
+				const int
+					dx = int(index % _width) - peakX + radius,
+					dy = int(index / _width) - peakY + radius;
+				if(dx >= 0 && dy >= 0 && dx < patchSize && dy < patchSize)
+				{
+					const size_t patchIndex = dx + dy*patchSize;
+					for(size_t i=0; i!=imageCount; ++i)
+						dataPtrs[i][index] -= componentValues[i] * patchPtrs[i][patchIndex];
+				}
+			}
+			++this->_iterationNumber;
+
+			activePeak = std::numeric_limits<double>::min();
+			size_t nextPeakIndex = _width * _height;
+			for(size_t j=0; j!=activeCount; ++j)
+			{
+				double value = peakValue(dataImage, activePixels[j]);
+				if(std::isfinite(value) && value > activePeak)
+				{
+					activePeak = value;
+					nextPeakIndex = activePixels[j];
+				}
+			}
+			if(nextPeakIndex == _width * _height)
+				break;
+			peakIndex = nextPeakIndex;
+		} while(activePeak > cycleThreshold && this->_iterationNumber < this->_maxIter && !(dataImage.IsComponentNegative(peakIndex) && this->_stopOnNegativeComponent));
+
+		for(size_t i=0; i!=imageCount; ++i)
+		{
+			for(size_t j=0; j!=activeCount; ++j)
+				dataPtrs[i][activePixels[j]] = originalValues[i*activeCount + j];
+		}
+		subtractComponents(dataImage, components, psfImages);
+
+		peakIndex = findPeak(dataImage);
+		peakNormalized = (peakIndex == _width*_height) ? 0.0 : dataImage.JoinedValueNormalized(peakIndex);
+		++cycleIndex;
+		std::cout << "Cycle " << cycleIndex << ": " << (this->_iterationNumber - firstIteration) << " components on " << activeCount << " pixels, down to " << cycleThreshold << " Jy, iteration " << this->_iterationNumber << ", peak " << peakDescription(dataImage, peakIndex) << '\n';
+	}
+	std::cout << "Stopped on peak " << peakNormalized << '\n';
+	reachedStopGain = std::fabs(peakNormalized) <= stopGainThreshold && (peakNormalized != 0.0);
+}
+
+template<typename ImageSetType>
+size_t ClarkClean<ImageSetType>::findPeak(const ImageSetType& image) const
+{
+	double peakMax = std::numeric_limits<double>::min();
+	size_t peakIndex = _width * _height;
+
+	const size_t
+		horBorderSize = floor(_width*this->CleanBorderRatio()),
+		verBorderSize = floor(_height*this->CleanBorderRatio());
+	size_t xiStart = horBorderSize, xiEnd = _width - horBorderSize;
+	size_t yiStart = verBorderSize, yiEnd = _height - verBorderSize;
+	if(xiEnd < xiStart) xiEnd = xiStart;
+	if(yiEnd < yiStart) yiEnd = yiStart;
+	for(size_t yi=yiStart; yi!=yiEnd; ++yi)
+	{
+		size_t index=yi*_width + xiStart;
+		for(size_t xi=xiStart; xi!=xiEnd; ++xi)
+		{
+			if(this->_cleanMask == 0 || this->_cleanMask[index])
+			{
+				double value = peakValue(image, index);
+				if(std::isfinite(value) && value > peakMax)
+				{
+					peakIndex = index;
+					peakMax = value;
+				}
+			}
+			++index;
+		}
+	}
+	return peakIndex;
+}
+
+template<typename ImageSetType>
+void ClarkClean<ImageSetType>::makePatches(const std::vector<double*>& psfImages, std::vector<ao::uvector<double>>& patches, double& sidelobeRatio) const
+{
+	const size_t
+		centreX = _width/2, centreY = _height/2,
+		patchStartX = centreX - _patchRadius, patchStartY = centreY - _patchRadius;
+	patches.resize(psfImages.size());
+	sidelobeRatio = 0.0;
+	for(size_t p=0; p!=psfImages.size(); ++p)
+	{
+		const double* psf = psfImages[p];
+		patches[p].resize(_patchSize * _patchSize);
+		for(size_t y=0; y!=_patchSize; ++y)
+		{
+			const double* psfRow = &psf[(patchStartY + y) * _width + patchStartX];
+			std::copy(psfRow, psfRow + _patchSize, &patches[p][y * _patchSize]);
+		}
+
+		double maxSidelobe = 0.0;
+		for(size_t y=0; y!=_height; ++y)
+		{
+			const bool isPatchRow = y >= patchStartY && y < patchStartY + _patchSize;
+			for(size_t x=0; x!=_width; ++x)
+			{
+				if(!isPatchRow || x < patchStartX || x >= patchStartX + _patchSize)
+					maxSidelobe = std::max(maxSidelobe, std::fabs(psf[y * _width + x]));
+			}
+		}
+		const double centreValue = std::fabs(psf[centreY * _width + centreX]);
+		sidelobeRatio = std::max(sidelobeRatio, (centreValue == 0.0) ? 1.0 : maxSidelobe / centreValue);
+	}
+}
+
+template<typename ImageSetType>
+double ClarkClean<ImageSetType>::selectActivePixels(const ImageSetType& image, double threshold, size_t peakIndex, ao::uvector<size_t>& activePixels) const
+{
+	activePixels.clear();
+	const size_t
+		horBorderSize = floor(_width*this->CleanBorderRatio()),
+		verBorderSize = floor(_height*this->CleanBorderRatio());
+	size_t xiStart = horBorderSize, xiEnd = _width - horBorderSize;
+	size_t yiStart = verBorderSize, yiEnd = _height - verBorderSize;
+	if(xiEnd < xiStart) xiEnd = xiStart;
+	if(yiEnd < yiStart) yiEnd = yiStart;
+	for(size_t yi=yiStart; yi!=yiEnd; ++yi)
+	{
+		size_t index=yi*_width + xiStart;
+		for(size_t xi=xiStart; xi!=xiEnd; ++xi)
+		{
+			if(this->_cleanMask == 0 || this->_cleanMask[index])
+			{
+				double value = peakValue(image, index);
+				// The peak is always selected, also when the PSF sidelobes are as high as the peak
+				if((std::isfinite(value) && value > threshold) || index == peakIndex)
+					activePixels.push_back(index);
+			}
+			++index;
+		}
+	}
+
+	if(activePixels.size() > _maxActivePixels)
+	{
+		// Only keep the brightest pixels, and clean down to the faintest of those
+		std::nth_element(activePixels.begin(), activePixels.begin() + (_maxActivePixels - 1), activePixels.end(),
+			[&](size_t a, size_t b) { return peakValue(image, a) > peakValue(image, b); });
+		threshold = std::max(threshold, peakValue(image, activePixels[_maxActivePixels - 1]));
+		activePixels.resize(_maxActivePixels);
+		std::sort(activePixels.begin(), activePixels.end());
+	}
+	return threshold;
+}
+
+template<typename ImageSetType>
+void ClarkClean<ImageSetType>::subtractComponents(ImageSetType& dataImage, ImageSetType& components, const std::vector<double*>& psfImages) const
+{
+	// The images are padded to twice their size, so that the circular convolution
+	// does not wrap PSF sidelobes around the edges.
+	const size_t
+		paddedWidth = _width * 2, paddedHeight = _height * 2,
+		shiftX = _width - _width/2, shiftY = _height - _height/2;
+	ao::uvector<double> padded(paddedWidth * paddedHeight), kernel(paddedWidth * paddedHeight);
+	size_t kernelPsfIndex = psfImages.size();
+	for(size_t i=0; i!=dataImage.ImageCount(); ++i)
+	{
+		const double* componentImage = components.GetImage(i);
+		bool hasComponents = false;
+		for(size_t j=0; j!=_width*_height && !hasComponents; ++j)
+			hasComponents = componentImage[j] != 0.0;
+		if(!hasComponents)
+			continue;
+
+		const size_t psfIndex = ImageSetType::PSFIndex(i);
+		if(psfIndex != kernelPsfIndex)
+		{
+			std::fill(padded.begin(), padded.end(), 0.0);
+			const double* psf = psfImages[psfIndex];
+			for(size_t y=0; y!=_height; ++y)
+				std::copy(&psf[y * _width], &psf[(y+1) * _width], &padded[(y + shiftY) * paddedWidth + shiftX]);
+			FFTConvolver::PrepareKernel(kernel.data(), padded.data(), paddedWidth, paddedHeight);
+			kernelPsfIndex = psfIndex;
+		}
+
+		std::fill(padded.begin(), padded.end(), 0.0);
+		for(size_t y=0; y!=_height; ++y)
+			std::copy(&componentImage[y * _width], &componentImage[(y+1) * _width], &padded[y * paddedWidth]);
+		FFTConvolver::ConvolveSameSize(padded.data(), kernel.data(), paddedWidth, paddedHeight);
+
+		double* image = dataImage.GetImage(i);
+		for(size_t y=0; y!=_height; ++y)
+		{
+			const double* convolvedRow = &padded[y * paddedWidth];
+			double* imageRow = &image[y * _width];
+			for(size_t x=0; x!=_width; ++x)
+				imageRow[x] -= convolvedRow[x];
+		}
+	}
+}
+
+template<typename ImageSetType>
+std::string ClarkClean<ImageSetType>::peakDescription(const ImageSetType& image, size_t index) const
+{
+	std::ostringstream str;
+	if(index == _width * _height)
+		str << "none";
+	else
+		str << image.JoinedValueNormalized(index) << " Jy at " << (index % _width) << "," << (index / _width);
+	return str.str();
+}
+
+template class ClarkClean<deconvolution::SingleImageSet>;
+template class ClarkClean<deconvolution::PolarizedImageSet<2>>;
+template class ClarkClean<deconvolution::PolarizedImageSet<4>>;
+
+template class ClarkClean<deconvolution::MultiImageSet<deconvolution::SingleImageSet>>;
+template class ClarkClean<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<2>>>;
+template class ClarkClean<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<4>>>;
@@ -0,0 +1,72 @@
+#ifndef CLARK_CLEAN_H
+#define CLARK_CLEAN_H
+
+#include "deconvolutionalgorithm.h"
+#include "imageset.h"
+
+#include "../uvector.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Clark clean (Clark 1980, "An efficient implementation of the algorithm 'CLEAN'").
+ *
+ * Every cycle selects the pixels that are brighter than the largest sidelobe of
+ * the PSF outside a central PSF patch, times the current peak. A Hogbom clean is
+ * performed on those pixels only, using the PSF patch. Afterwards, the components
+ * of the cycle are subtracted exactly from the full residual images with an FFT
+ * convolution with the full PSF. This makes the cost of a component proportional to
+ * the number of selected pixels instead of the number of pixels in the image.
+ *
+ * The peak is searched in the joined value of the image set, like @ref JoinedClean
+ * does, so that the algorithm can also be used for joined polarization and joined
+ * frequency cleaning.
+ */
+template<typename ImageSetType>
+class ClarkClean : public TypedDeconvolutionAlgorithm<ImageSetType>
+{
+public:
+	ClarkClean() : _maxActivePixels(1<<18)
+	{ }
+
+	virtual void ExecuteMajorIteration(ImageSetType& dataImage, ImageSetType& modelImage, std::vector<double*> psfImages, size_t width, size_t height, bool& reachedStopGain);
+
+private:
+	size_t _width, _height;
+	size_t _patchRadius, _patchSize;
+	const size_t _maxActivePixels;
+
+	/**
+	 * Peak value used for thresholds and for finding components. With negative
+	 * components, it is the absolute normalized joined value.
+	 */
+	double peakValue(const ImageSetType& image, size_t index) const
+	{
+		double value = image.JoinedValueNormalized(index);
+		return this->_allowNegativeComponents ? std::fabs(value) : value;
+	}
+
+	/**
+	 * Returns the index of the peak within the clean border and mask, or width*height when
+	 * there is no finite value.
+	 */
+	size_t findPeak(const ImageSetType& image) const;
+
+	void makePatches(const std::vector<double*>& psfImages, std::vector<ao::uvector<double>>& patches, double& sidelobeRatio) const;
+
+	/**
+	 * Selects the pixels above the threshold and returns the threshold, which is raised when
+	 * too many pixels were selected.
+	 */
+	double selectActivePixels(const ImageSetType& image, double threshold, size_t peakIndex, ao::uvector<size_t>& activePixels) const;
+
+	/**
+	 * Subtract the components from the full images by convolving them with the PSFs.
+	 */
+	void subtractComponents(ImageSetType& dataImage, ImageSetType& components, const std::vector<double*>& psfImages) const;
+
+	std::string peakDescription(const ImageSetType& image, size_t index) const;
+};
+
+#endif
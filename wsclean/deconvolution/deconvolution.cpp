@@ -1,9 +1,11 @@
 #include "deconvolution.h"
 
+#include "clarkclean.h"
 #include "deconvolutionalgorithm.h"
 #include "joinedclean.h"
 #include "simpleclean.h"
 #include "moresane.h"
+#include "moresanehelper.h"
 #include "multiscaledeconvolution.h"
 #include "fastmultiscaleclean.h"
 #include "iuwtdeconvolution.h"
@@ -18,11 +20,36 @@ Deconvolution::Deconvolution() :
 	_stopOnNegative(false),
 	_multiscale(false), _fastMultiscale(false),
 	_multiscaleThresholdBias(0.7), _multiscaleScaleBias(0.6),
+	_multiscaleFastSubMinorLoop(false),
+	_multiscalePSFCropTolerance(0.0),
 	_cleanBorderRatio(0.05),
 	_fitsMask(), _casaMask(),
 	_useMoreSane(false),
 	_useIUWT(false),
-	_moreSaneLocation(), _moreSaneArgs()
+	_useClark(false),
+	_moreSaneLocation(), _moreSaneArgs(),
+	_moreSanePersistent(false)
+{
+}
+
+Deconvolution::Deconvolution(const Deconvolution& source) :
+	_threshold(source._threshold), _gain(source._gain), _mGain(source._mGain),
+	_nIter(source._nIter),
+	_allowNegative(source._allowNegative),
+	_stopOnNegative(source._stopOnNegative),
+	_multiscale(source._multiscale), _fastMultiscale(source._fastMultiscale),
+	_multiscaleThresholdBias(source._multiscaleThresholdBias), _multiscaleScaleBias(source._multiscaleScaleBias),
+	_multiscaleFastSubMinorLoop(source._multiscaleFastSubMinorLoop),
+	_multiscalePSFCropTolerance(source._multiscalePSFCropTolerance),
+	_cleanBorderRatio(source._cleanBorderRatio),
+	_fitsMask(source._fitsMask), _casaMask(source._casaMask),
+	_useMoreSane(source._useMoreSane),
+	_useIUWT(source._useIUWT),
+	_useClark(source._useClark),
+	_moreSaneLocation(source._moreSaneLocation), _moreSaneArgs(source._moreSaneArgs),
+	_moreSaneSigmaLevels(source._moreSaneSigmaLevels),
+	_moreSanePersistent(source._moreSanePersistent),
+	_prefixName(source._prefixName)
 {
 }
 
@@ -230,7 +257,15 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 	
 	if(_useMoreSane)
 	{
-		_cleanAlgorithm.reset(new MoreSane(_moreSaneLocation, _moreSaneArgs, _moreSaneSigmaLevels, _prefixName));
+		MoreSane* moreSane = new MoreSane(_moreSaneLocation, _moreSaneArgs, _moreSaneSigmaLevels, _prefixName);
+		_cleanAlgorithm.reset(moreSane);
+		if(_moreSanePersistent)
+		{
+			// The helper is started once and kept for all groups and major iterations
+			if(_moreSaneHelper == 0)
+				_moreSaneHelper.reset(new MoreSaneHelper(_moreSaneLocation));
+			moreSane->SetHelper(_moreSaneHelper.get());
+		}
 	}
 	else if(_useIUWT)
 	{
@@ -266,6 +301,12 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 					<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<2>>>(beamSize, pixelScaleX, pixelScaleY));
 				}
 			}
+			else if(_useClark) {
+				if(_squaredCount == 4)
+					_cleanAlgorithm.reset(new ClarkClean<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<4>>>());
+				else
+					_cleanAlgorithm.reset(new ClarkClean<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<2>>>());
+			}
 			else {
 				if(_squaredCount == 4)
 					_cleanAlgorithm.reset(new JoinedClean<deconvolution::MultiImageSet<deconvolution::PolarizedImageSet<4>>>());
@@ -281,6 +322,13 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 				else
 					_cleanAlgorithm.reset(new FastMultiScaleClean<deconvolution::PolarizedImageSet<2>>(beamSize, pixelScaleX, pixelScaleY));
 			}
+			else if(_useClark)
+			{
+				if(_squaredCount == 4)
+					_cleanAlgorithm.reset(new ClarkClean<deconvolution::PolarizedImageSet<4>>());
+				else
+					_cleanAlgorithm.reset(new ClarkClean<deconvolution::PolarizedImageSet<2>>());
+			}
 			else
 			{
 				if(_squaredCount == 4)
@@ -295,12 +343,16 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 		{
 			if(_fastMultiscale)
 				_cleanAlgorithm.reset(new FastMultiScaleClean<deconvolution::MultiImageSet<deconvolution::SingleImageSet>>(beamSize, pixelScaleX, pixelScaleY));
+			else if(_useClark)
+				_cleanAlgorithm.reset(new ClarkClean<deconvolution::MultiImageSet<deconvolution::SingleImageSet>>());
 			else
 				_cleanAlgorithm.reset(new JoinedClean<deconvolution::MultiImageSet<deconvolution::SingleImageSet>>());
 		}
 		else {
 			if(_fastMultiscale)
 				_cleanAlgorithm.reset(new FastMultiScaleClean<deconvolution::SingleImageSet>(beamSize, pixelScaleX, pixelScaleY));
+			else if(_useClark)
+				_cleanAlgorithm.reset(new ClarkClean<deconvolution::SingleImageSet>());
 			else
 				_cleanAlgorithm.reset(new SimpleClean());
 		}
@@ -316,6 +368,8 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 	_cleanAlgorithm->SetThreadCount(threadCount);
 	_cleanAlgorithm->SetMultiscaleScaleBias(_multiscaleScaleBias);
 	_cleanAlgorithm->SetMultiscaleThresholdBias(_multiscaleThresholdBias);
+	_cleanAlgorithm->SetMultiscaleFastSubMinorLoop(_multiscaleFastSubMinorLoop);
+	_cleanAlgorithm->SetMultiscalePSFCropTolerance(_multiscalePSFCropTolerance);
 	
 	if(!_fitsMask.empty())
 	{
@@ -12,6 +12,11 @@ class Deconvolution
 {
 public:
 	Deconvolution();
+	/**
+	 * Creates a deconvolution with the settings of source, but without an initialized
+	 * algorithm or images, so that independent groups can be deconvolved concurrently.
+	 */
+	Deconvolution(const Deconvolution& source);
 	~Deconvolution();
 	
 	void Perform(const class ImagingTable& groupTable, bool& reachedMajorThreshold, size_t majorIterationNr);
@@ -33,6 +38,7 @@ public:
 	void SetFitsMask(const std::string& fitsMask) { _fitsMask = fitsMask; }
 	
 	void SetCASAMask(const std::string& casaMask) { _casaMask = casaMask; }
+	const std::string& CASAMask() const { return _casaMask; }
 	
 	void SetAllowNegativeComponents(bool allowNegative) { _allowNegative = allowNegative; }
 	bool AllowNegativeComponents() const { return _allowNegative; }
@@ -46,11 +52,20 @@ public:
 	{ _multiscaleThresholdBias = thresholdBias; }
 	void SetMultiscaleScaleBias(double scaleBias)
 	{ _multiscaleScaleBias = scaleBias; }
+	void SetMultiscaleFastSubMinorLoop(bool fastSubMinorLoop)
+	{ _multiscaleFastSubMinorLoop = fastSubMinorLoop; }
+	void SetMultiscalePSFCropTolerance(double psfCropTolerance)
+	{ _multiscalePSFCropTolerance = psfCropTolerance; }
 	void SetUseMoreSane(bool useMoreSane) { _useMoreSane = useMoreSane; }
 	void SetUseIUWT(bool useIUWT) { _useIUWT = useIUWT; }
+	void SetUseClark(bool useClark) { _useClark = useClark; }
 	void SetMoreSaneLocation(const std::string& location) { _moreSaneLocation = location; }
 	void SetMoreSaneArgs(const std::string& arguments) { _moreSaneArgs = arguments; }
 	void SetMoreSaneSigmaLevels(const std::vector<std::string> &slevels) { _moreSaneSigmaLevels = slevels; }
+	/**
+	 * Keep MoreSane running in a helper process during the whole run, see MoreSaneHelper.
+	 */
+	void SetMoreSanePersistent(bool moreSanePersistent) { _moreSanePersistent = moreSanePersistent; }
         void SetPrefixName(const std::string& prefixName) { _prefixName = prefixName; }
 	
 	void InitializeDeconvolutionAlgorithm(const ImagingTable& groupTable, PolarizationEnum psfPolarization, ImageBufferAllocator* imageAllocator, size_t imgWidth, size_t imgHeight, double pixelScaleX, double pixelScaleY, size_t outputChannels, double beamSize, size_t threadCount);
@@ -73,6 +88,7 @@ public:
 	bool FastMultiScale() const { return _fastMultiscale; }
 	bool UseMoreSane() const { return _useMoreSane; }
 	bool UseIUWT() const { return _useIUWT; }
+	bool UseClark() const { return _useClark; }
 	bool IsInitialized() const { return _cleanAlgorithm != 0; }
 private:
 	void performDynamicClean(const class ImagingTable& groupTable, bool& reachedMajorThreshold, size_t majorIterationNr);
@@ -90,13 +106,18 @@ private:
 	bool _allowNegative, _stopOnNegative;
 	bool _multiscale, _fastMultiscale;
 	double _multiscaleThresholdBias, _multiscaleScaleBias;
+	bool _multiscaleFastSubMinorLoop;
+	double _multiscalePSFCropTolerance;
 	double _cleanBorderRatio;
 	std::string _fitsMask, _casaMask;
-	bool _useMoreSane, _useIUWT;
+	bool _useMoreSane, _useIUWT, _useClark;
 	std::string _moreSaneLocation, _moreSaneArgs;
 	std::vector<std::string> _moreSaneSigmaLevels;
+	bool _moreSanePersistent;
 	std::string _prefixName;
 	
+	std::unique_ptr<class MoreSaneHelper> _moreSaneHelper;
+	
 	std::unique_ptr<class DeconvolutionAlgorithm> _cleanAlgorithm;
 	
 	ao::uvector<bool> _cleanMask;
@@ -14,6 +14,8 @@ DeconvolutionAlgorithm::DeconvolutionAlgorithm() :
 	_cleanBorderRatio(0.05),
 	_multiscaleThresholdBias(0.7),
 	_multiscaleScaleBias(0.6),
+	_multiscaleFastSubMinorLoop(false),
+	_multiscalePSFCropTolerance(0.0),
 	_maxIter(500),
 	_iterationNumber(0),
 	_threadCount(sysconf(_SC_NPROCESSORS_ONLN)),
@@ -75,11 +75,21 @@ public:
 	{
 		_multiscaleScaleBias = bias;
 	}
+	void SetMultiscaleFastSubMinorLoop(bool fastSubMinorLoop)
+	{
+		_multiscaleFastSubMinorLoop = fastSubMinorLoop;
+	}
+	void SetMultiscalePSFCropTolerance(double psfCropTolerance)
+	{
+		_multiscalePSFCropTolerance = psfCropTolerance;
+	}
 protected:
 	DeconvolutionAlgorithm();
 	
 	double _threshold, _subtractionGain, _stopGain, _cleanBorderRatio;
 	double _multiscaleThresholdBias, _multiscaleScaleBias;
+	bool _multiscaleFastSubMinorLoop;
+	double _multiscalePSFCropTolerance;
 	size_t _maxIter, _iterationNumber, _threadCount;
 	bool _allowNegativeComponents, _stopOnNegativeComponent;
 	const bool* _cleanMask;
@@ -70,43 +70,17 @@ public:
 	
 	void GetIntegrated(double* dest, double* scratch) const
 	{
-		double nImagesAdded = 0.0;
-		for(size_t sqIndex = 0; sqIndex!=_imagingTable.SquaredGroupCount(); ++sqIndex)
-		{
-			ImagingTable subTable = _imagingTable.GetSquaredGroup(sqIndex);
-			nImagesAdded += sqrt(subTable.EntryCount());
-			if(subTable.EntryCount() == 1)
-			{
-				const ImagingTableEntry& entry = subTable[0];
-				size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
-				assign(scratch, _images[imageIndex]);
-			}
-			else {
-				for(size_t eIndex = 0; eIndex!=subTable.EntryCount(); ++eIndex)
-				{
-					const ImagingTableEntry& entry = subTable[eIndex];
-					size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
-					if(eIndex == 0)
-					{
-						assign(scratch, _images[0]);
-						square(scratch);
-					}
-					else {
-						addSquared(scratch, _images[imageIndex]);
-					}
-				}
-				squareRoot(scratch);
-			}
-			
-			if(sqIndex == 0)
-				assign(dest, scratch);
-			else
-				add(dest, scratch);
-		}
-		if(nImagesAdded > 0.0)
-			multiply(dest, 1.0/nImagesAdded);
-		else
-			assign(dest, 0.0);
+		integrate(dest, scratch, Area(_imageSize, 0, _imageSize, 0, 1));
+	}
+	
+	/**
+	 * Like GetIntegrated(), but only calculates the pixels in [startX, endX) x [startY, endY)
+	 * of images with the given width. The pixels are the same as those calculated by
+	 * GetIntegrated(), and the other pixels of dest and scratch are not changed.
+	 */
+	void GetIntegrated(double* dest, double* scratch, size_t width, size_t startX, size_t endX, size_t startY, size_t endY) const
+	{
+		integrate(dest, scratch, Area(width, startX, endX, startY, endY));
 	}
 	
 	void GetIntegratedPSF(double* dest, const ao::uvector<const double*>& psfs)
@@ -174,6 +148,75 @@ public:
 			addFactor(_images[i], rhs._images[i], factor);
 	}
 private:
+	/**
+	 * Rectangular area of images with rows of the given width.
+	 */
+	struct Area
+	{
+		Area(size_t _width, size_t _startX, size_t _endX, size_t _startY, size_t _endY) :
+			width(_width), startX(_startX), endX(_endX), startY(_startY), endY(_endY)
+		{ }
+		
+		template<typename Function>
+		void ForEach(Function function) const
+		{
+			for(size_t y=startY; y!=endY; ++y)
+			{
+				const size_t end = y*width + endX;
+				for(size_t i=y*width + startX; i!=end; ++i)
+					function(i);
+			}
+		}
+		
+		size_t width, startX, endX, startY, endY;
+	};
+	
+	void integrate(double* dest, double* scratch, const Area& area) const
+	{
+		double nImagesAdded = 0.0;
+		for(size_t sqIndex = 0; sqIndex!=_imagingTable.SquaredGroupCount(); ++sqIndex)
+		{
+			ImagingTable subTable = _imagingTable.GetSquaredGroup(sqIndex);
+			nImagesAdded += sqrt(subTable.EntryCount());
+			if(subTable.EntryCount() == 1)
+			{
+				const ImagingTableEntry& entry = subTable[0];
+				size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
+				const double* image = _images[imageIndex];
+				area.ForEach([&](size_t i) { scratch[i] = image[i]; });
+			}
+			else {
+				for(size_t eIndex = 0; eIndex!=subTable.EntryCount(); ++eIndex)
+				{
+					const ImagingTableEntry& entry = subTable[eIndex];
+					size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
+					if(eIndex == 0)
+					{
+						const double* image = _images[0];
+						area.ForEach([&](size_t i) { scratch[i] = image[i]; scratch[i] *= scratch[i]; });
+					}
+					else {
+						const double* image = _images[imageIndex];
+						area.ForEach([&](size_t i) { scratch[i] += image[i]*image[i]; });
+					}
+				}
+				area.ForEach([&](size_t i) { scratch[i] = sqrt(scratch[i]); });
+			}
+			
+			if(sqIndex == 0)
+				area.ForEach([&](size_t i) { dest[i] = scratch[i]; });
+			else
+				area.ForEach([&](size_t i) { dest[i] += scratch[i]; });
+		}
+		if(nImagesAdded > 0.0)
+		{
+			const double factor = 1.0/nImagesAdded;
+			area.ForEach([&](size_t i) { dest[i] *= factor; });
+		}
+		else
+			area.ForEach([&](size_t i) { dest[i] = 0.0; });
+	}
+	
 	void assign(double* lhs, const double* rhs) const
 	{
 		memcpy(lhs, rhs, sizeof(double) * _imageSize);
@@ -112,18 +112,25 @@ void FastMultiScaleClean<ImageSetType>::executeMajorIterationForScale(double cur
 	MakeShapeFunction(currentScale * rescaleFactor, shape, kernelSize);
 	memset(kernelImage, 0, sizeof(double) * _rescaledWidth * _rescaledHeight);
 	FFTConvolver::PrepareSmallKernel(kernelImage, _rescaledWidth, _rescaledHeight, shape.data(), kernelSize);
+	FFTConvolver::PreparedKernel preparedKernel;
+	preparedKernel.Prepare(kernelImage, _rescaledWidth, _rescaledHeight);
+	ao::uvector<double*> convolveList;
 	for(size_t i=0; i!=largeScaleImage.ImageCount(); ++i)
-		FFTConvolver::ConvolveSameSize(largeScaleImage.GetImage(i), kernelImage, _rescaledWidth, _rescaledHeight);
-	for(size_t i=0; i!=scaledPsfs.size(); ++i) {
-		FFTConvolver::ConvolveSameSize(scaledPsfs[i], kernelImage, _rescaledWidth, _rescaledHeight);
-		FFTConvolver::ConvolveSameSize(scaledPsfs[i], kernelImage, _rescaledWidth, _rescaledHeight);
-	}
+		convolveList.push_back(largeScaleImage.GetImage(i));
+	convolveList.insert(convolveList.end(), scaledPsfs.begin(), scaledPsfs.end());
+	FFTConvolver::ConvolveSameSize(convolveList, preparedKernel, cpuCount);
+	// The psfs are convolved twice
+	convolveList.assign(scaledPsfs.begin(), scaledPsfs.end());
+	FFTConvolver::ConvolveSameSize(convolveList, preparedKernel, cpuCount);
 	
 	MakeShapeFunction(nextScale * rescaleFactor, shape, kernelSize);
 	memset(kernelImage, 0, sizeof(double) * _rescaledWidth * _rescaledHeight);
 	FFTConvolver::PrepareSmallKernel(kernelImage, _rescaledWidth, _rescaledHeight, shape.data(), kernelSize);
+	preparedKernel.Prepare(kernelImage, _rescaledWidth, _rescaledHeight);
+	convolveList.clear();
 	for(size_t i=0; i!=nextScaleImage.ImageCount(); ++i)
-		FFTConvolver::ConvolveSameSize(nextScaleImage.GetImage(i), kernelImage, _rescaledWidth, _rescaledHeight);
+		convolveList.push_back(nextScaleImage.GetImage(i));
+	FFTConvolver::ConvolveSameSize(convolveList, preparedKernel, cpuCount);
 	
 	//FitsWriter writer;
 	//writer.SetImageDimensions(_rescaledWidth, _rescaledHeight);
@@ -222,13 +229,14 @@ void FastMultiScaleClean<ImageSetType>::executeMajorIterationForScale(double cur
 	MakeShapeFunction(currentScale * rescaleFactor, shape, kernelSize);
 	memset(kernelImage, 0, sizeof(double) * _rescaledWidth * _rescaledHeight);
 	FFTConvolver::PrepareSmallKernel(kernelImage, _rescaledWidth, _rescaledHeight, shape.data(), kernelSize);
+	preparedKernel.Prepare(kernelImage, _rescaledWidth, _rescaledHeight);
 	
 	double* convolvedModel = allocator.Allocate(_originalWidth * _originalHeight);
 	double* preparedPsf = allocator.Allocate(_originalWidth * _originalHeight);
 	FFTResampler modelResampler(_rescaledWidth, _rescaledHeight, _originalWidth, _originalHeight, cpuCount, false);
 	for(size_t i=0; i!=currentScaleModel.ImageCount(); ++i)
 	{
-		FFTConvolver::ConvolveSameSize(currentScaleModel.GetImage(i), kernelImage, _rescaledWidth, _rescaledHeight);
+		FFTConvolver::ConvolveSameSize(currentScaleModel.GetImage(i), preparedKernel);
 		//writer.SetImageDimensions(_rescaledWidth, _rescaledHeight);
 		//writer.Write("multiscale-model-small.fits", currentScaleModel.GetImage(i));
 		modelResampler.RunSingle(currentScaleModel.GetImage(i), convolvedModel);
@@ -11,6 +11,13 @@ void JoinedClean<ImageSetType>::ExecuteMajorIteration(ImageSetType& dataImage, I
 		this->_allowNegativeComponents = true;
 	_width = width;
 	_height = height;
+	if(this->_cleanMask != 0)
+	{
+		const size_t
+			horBorderSize = floor(_width*this->CleanBorderRatio()),
+			verBorderSize = floor(_height*this->CleanBorderRatio());
+		_maskSpans = MaskSpans(this->_cleanMask, _width, _height, horBorderSize, _width - horBorderSize, verBorderSize, _height - verBorderSize);
+	}
 	
 	size_t componentX=0, componentY=0;
 	findPeak(dataImage, componentX, componentY);
@@ -132,33 +139,24 @@ void JoinedClean<ImageSetType>::findPeak(const ImageSetType& image, size_t& x, s
 }
 
 template<typename ImageSetType>
-void JoinedClean<ImageSetType>::findPeak(const ImageSetType& image, size_t& x, size_t& y, size_t startY, size_t stopY, const bool* mask) const
+void JoinedClean<ImageSetType>::findPeak(const ImageSetType& image, size_t& x, size_t& y, size_t startY, size_t stopY, const MaskSpans& maskSpans) const
 {
 	double peakMax = std::numeric_limits<double>::min();
 	size_t peakIndex = _width * _height;
 	
-	const size_t
-		horBorderSize = floor(_width*this->CleanBorderRatio()),
-		verBorderSize = floor(_height*this->CleanBorderRatio());
-	size_t xiStart = horBorderSize, xiEnd = _width - horBorderSize;
-	size_t yiStart = std::max(startY, verBorderSize), yiEnd = std::min(stopY, _height - verBorderSize);
-	if(xiEnd < xiStart) xiEnd = xiStart;
-	if(yiEnd < yiStart) yiEnd = yiStart;
-	for(size_t yi=yiStart; yi!=yiEnd; ++yi)
+	for(size_t s=maskSpans.FirstSpan(startY); s!=maskSpans.SpanCount() && maskSpans[s].y < stopY; ++s)
 	{
-		size_t index=yi*_width + xiStart;
-		for(size_t xi=xiStart; xi!=xiEnd; ++xi)
+		const MaskSpans::Span& span = maskSpans[s];
+		size_t index = span.y*_width + span.startX;
+		for(size_t xi=span.startX; xi!=span.endX; ++xi)
 		{
-			if(mask[index])
+			double value = image.AbsJoinedValue(index);
+			if(std::isfinite(value))
 			{
-				double value = image.AbsJoinedValue(index);
-				if(std::isfinite(value))
+				if(value > peakMax)
 				{
-					if(value > peakMax)
-					{
-						peakIndex = index;
-						peakMax = value;
-					}
+					peakIndex = index;
+					peakMax = value;
 				}
 			}
 			++index;
@@ -192,7 +190,7 @@ void JoinedClean<ImageSetType>::cleanThreadFunc(ao::lane<CleanTask> *taskLane, a
 		if(this->_cleanMask == 0)
 			findPeak(*cleanData.dataImage, result.nextPeakX, result.nextPeakY, cleanData.startY, cleanData.endY);
 		else
-			findPeak(*cleanData.dataImage, result.nextPeakX, result.nextPeakY, cleanData.startY, cleanData.endY, this->_cleanMask);
+			findPeak(*cleanData.dataImage, result.nextPeakX, result.nextPeakY, cleanData.startY, cleanData.endY, _maskSpans);
 		if(result.nextPeakX < _width)
 			result.peakLevelUnnormalized = cleanData.dataImage->AbsJoinedValue(result.nextPeakX + result.nextPeakY*_width);
 		else
@@ -3,6 +3,7 @@
 
 #include "deconvolutionalgorithm.h"
 #include "imageset.h"
+#include "maskspans.h"
 #include "simpleclean.h"
 
 namespace ao {
@@ -17,6 +18,8 @@ public:
 	
 private:
 	size_t _width, _height;
+	// Unmasked pixels within the clean border, when a clean mask is used
+	MaskSpans _maskSpans;
 	
 	struct CleanTask
 	{
@@ -42,10 +45,10 @@ private:
 		if(this->_cleanMask == 0)
 			findPeak(image, x, y, 0, _height);
 		else
-			findPeak(image, x, y, 0, _height, this->_cleanMask);
+			findPeak(image, x, y, 0, _height, _maskSpans);
 	}
 	void findPeak(const ImageSetType& image, size_t& x, size_t& y, size_t startY, size_t stopY) const;
-	void findPeak(const ImageSetType& image, size_t& x, size_t& y, size_t startY, size_t stopY, const bool* mask) const;
+	void findPeak(const ImageSetType& image, size_t& x, size_t& y, size_t startY, size_t stopY, const MaskSpans& maskSpans) const;
 	
 	std::string peakDescription(const ImageSetType& image, size_t& x, size_t& y);
 	void cleanThreadFunc(ao::lane<CleanTask>* taskLane, ao::lane<CleanResult>* resultLane, CleanThreadData cleanData);
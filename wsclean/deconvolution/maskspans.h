@@ -0,0 +1,102 @@
+#ifndef MASK_SPANS_H
+#define MASK_SPANS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Run-length representation of the pixels of a clean mask that are set, within a
+ * rectangular region of the image. The spans are sorted in row-major order, so
+ * that searching through the spans in order visits the pixels in the same order as
+ * a scan of the full region would.
+ *
+ * With tight masks, only a small fraction of the pixels can be cleaned, and searching
+ * the spans makes the cost of a peak search scale with the area of the mask instead
+ * of the area of the image.
+ */
+class MaskSpans
+{
+public:
+	struct Span
+	{
+		size_t y, startX, endX;
+	};
+
+	MaskSpans() :
+		_mask(0), _width(0), _height(0),
+		_startX(0), _endX(0), _startY(0), _endY(0),
+		_pixelCount(0)
+	{ }
+
+	MaskSpans(const bool* mask, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY) :
+		_mask(mask), _width(width), _height(height),
+		_startX(startX), _endX(std::max(startX, endX)),
+		_startY(startY), _endY(std::max(startY, endY)),
+		_pixelCount(0)
+	{
+		for(size_t y=_startY; y!=_endY; ++y)
+		{
+			const bool* maskRow = &mask[y * width];
+			size_t x = _startX;
+			while(x != _endX)
+			{
+				while(x != _endX && !maskRow[x]) ++x;
+				if(x != _endX)
+				{
+					Span span;
+					span.y = y;
+					span.startX = x;
+					while(x != _endX && maskRow[x]) ++x;
+					span.endX = x;
+					_pixelCount += span.endX - span.startX;
+					_spans.push_back(span);
+				}
+			}
+		}
+	}
+
+	const bool* Mask() const { return _mask; }
+	size_t Width() const { return _width; }
+	size_t Height() const { return _height; }
+	size_t StartX() const { return _startX; }
+	size_t EndX() const { return _endX; }
+	size_t StartY() const { return _startY; }
+	size_t EndY() const { return _endY; }
+
+	size_t SpanCount() const { return _spans.size(); }
+	size_t PixelCount() const { return _pixelCount; }
+	const Span& operator[](size_t index) const { return _spans[index]; }
+
+	/**
+	 * Whether the spans are on average so short that testing the mask per pixel over the
+	 * region is faster than visiting the spans.
+	 */
+	bool IsFragmented() const { return _pixelCount < _spans.size() * 8; }
+
+	/**
+	 * Index of the first span on row y or on a later row.
+	 */
+	size_t FirstSpan(size_t y) const
+	{
+		size_t first = 0, last = _spans.size();
+		while(first != last)
+		{
+			size_t middle = (first + last) / 2;
+			if(_spans[middle].y < y)
+				first = middle + 1;
+			else
+				last = middle;
+		}
+		return first;
+	}
+
+private:
+	const bool* _mask;
+	size_t _width, _height;
+	size_t _startX, _endX, _startY, _endY;
+	size_t _pixelCount;
+	std::vector<Span> _spans;
+};
+
+#endif
@@ -9,6 +9,8 @@
 #include "../fitswriter.h"
 #include "../fftconvolver.h"
 
+#include "moresanehelper.h"
+
 void MoreSane::ExecuteMajorIteration(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height, bool& reachedMajorThreshold)
 {
 	if(_iterationNumber!=0)
@@ -22,6 +24,33 @@ void MoreSane::ExecuteMajorIteration(double* dataImage, double* modelImage, cons
 		for(size_t i=0; i!=width*height; ++i)
 			dataImage[i] += modelImage[i];
 	}
+	
+	if(_helper != 0)
+		runInHelper(dataImage, modelImage, psfImage, width, height);
+	else
+		runWithFiles(dataImage, modelImage, psfImage, width, height);
+	
+	++_iterationNumber;
+	
+	reachedMajorThreshold = _iterationNumber<_maxIter;
+}
+
+void MoreSane::runInHelper(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height)
+{
+	std::ostringstream arguments;
+	if(!_allowNegativeComponents)
+		arguments << "-ep ";
+	if(!_moresaneArguments.empty())
+		arguments << _moresaneArguments << ' ';
+	if(!_moresaneSigmaLevels.empty())
+		arguments << "-sl " << _moresaneSigmaLevels[std::min(_iterationNumber,_moresaneSigmaLevels.size()-1)];
+	
+	std::cout << "Running MoreSane in helper process with arguments: " << arguments.str() << std::endl;
+	_helper->Deconvolve(dataImage, modelImage, psfImage, _cleanMask, width, height, arguments.str());
+}
+
+void MoreSane::runWithFiles(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height)
+{
 	std::ostringstream outputStr;
 	outputStr << _prefixName << "-tmp-moresaneoutput" << _iterationNumber;
 	const std::string
@@ -86,8 +115,4 @@ void MoreSane::ExecuteMajorIteration(double* dataImage, double* modelImage, cons
 	unlink(maskName.c_str());
 	unlink((outputName+"_model.fits").c_str());
 	unlink((outputName+"_residual.fits").c_str());
-	
-	++_iterationNumber;
-	
-	reachedMajorThreshold = _iterationNumber<_maxIter;
 }
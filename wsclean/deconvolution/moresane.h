@@ -12,9 +12,15 @@ class MoreSane : public TypedDeconvolutionAlgorithm<deconvolution::SingleImageSe
 		MoreSane(const std::string& moreSaneLocation, const std::string& moresaneArguments, 
 		         const std::vector<std::string> &moresaneSigmaLevels, const std::string &prefixName) 
                 : _moresaneLocation(moreSaneLocation), _moresaneArguments(moresaneArguments), 
-                _moresaneSigmaLevels(moresaneSigmaLevels), _prefixName(prefixName)
+                _moresaneSigmaLevels(moresaneSigmaLevels), _prefixName(prefixName), _helper(0)
 		{ }
 		
+		/**
+		 * Run MoreSane in the given helper process instead of starting a new Python process
+		 * for every major iteration. The helper is not owned.
+		 */
+		void SetHelper(class MoreSaneHelper* helper) { _helper = helper; }
+		
     virtual void ExecuteMajorIteration(ImageSet& dataImage, ImageSet& modelImage, std::vector<double*> psfImages, size_t width, size_t height, bool& reachedMajorThreshold)
 		{
       _allocator = dataImage.Allocator();
@@ -23,12 +29,16 @@ class MoreSane : public TypedDeconvolutionAlgorithm<deconvolution::SingleImageSe
 		
 		void ExecuteMajorIteration(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height, bool& reachedMajorThreshold);
 	private:
+		void runInHelper(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height);
+		void runWithFiles(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height);
+		
 		const std::string _moresaneLocation, _moresaneArguments;
 
 		const std::vector<std::string> _moresaneSigmaLevels;
 		const std::string _prefixName;
 		
 		ImageBufferAllocator* _allocator;
+		class MoreSaneHelper* _helper;
 };
 
 #endif
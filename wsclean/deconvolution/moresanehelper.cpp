@@ -0,0 +1,300 @@
+#include "moresanehelper.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+const double MoreSaneHelper::_stopTimeout = 10.0;
+
+const char* MoreSaneHelper::_helperProgram =
+	"import mmap, os, runpy, shlex, shutil, sys, tempfile\n"
+	"import numpy\n"
+	"try:\n"
+	"\tfrom astropy.io import fits\n"
+	"except ImportError:\n"
+	"\timport pyfits as fits\n"
+	"\n"
+	"location = sys.argv[1]\n"
+	"memoryFd, commandFd, replyFd = [int(fd) for fd in sys.argv[2:5]]\n"
+	"commands = os.fdopen(commandFd, 'r')\n"
+	"replies = os.fdopen(replyFd, 'w')\n"
+	"workDir = tempfile.mkdtemp(prefix='wsclean-moresane-', dir='/dev/shm' if os.path.isdir('/dev/shm') else None)\n"
+	"\n"
+	"def deconvolve(width, height, useMask, arguments):\n"
+	"\tmemory = mmap.mmap(memoryFd, os.fstat(memoryFd).st_size)\n"
+	"\tdef image(index):\n"
+	"\t\treturn numpy.frombuffer(memory, dtype=numpy.float64, count=width*height, offset=index*width*height*8).reshape(height, width)\n"
+	"\tdirtyName, psfName, maskName, outputName = [os.path.join(workDir, name) for name in ('dirty.fits', 'psf.fits', 'mask.fits', 'output')]\n"
+	"\tinputs = [(dirtyName, 0), (psfName, 1)]\n"
+	"\tif useMask:\n"
+	"\t\tinputs.append((maskName, 2))\n"
+	"\t\targuments = ['-m', maskName] + arguments\n"
+	"\tfor name, index in inputs:\n"
+	"\t\tif os.path.exists(name):\n"
+	"\t\t\tos.remove(name)\n"
+	"\t\tfits.PrimaryHDU(image(index)).writeto(name)\n"
+	"\tsys.argv = [location] + arguments + [dirtyName, psfName, outputName]\n"
+	"\ttry:\n"
+	"\t\trunpy.run_path(location, run_name='__main__')\n"
+	"\texcept SystemExit as e:\n"
+	"\t\tif e.code:\n"
+	"\t\t\traise RuntimeError('MoreSane exited with status ' + str(e.code))\n"
+	"\tfor name, index in ((outputName + '_model.fits', 3), (outputName + '_residual.fits', 4)):\n"
+	"\t\timage(index)[:] = numpy.asarray(fits.getdata(name), dtype=numpy.float64).reshape(height, width)\n"
+	"\t\tos.remove(name)\n"
+	"\n"
+	"try:\n"
+	"\twhile True:\n"
+	"\t\tcommand = commands.readline().split()\n"
+	"\t\tif len(command) == 0 or command[0] == 'quit':\n"
+	"\t\t\tbreak\n"
+	"\t\targuments = shlex.split(commands.readline())\n"
+	"\t\ttry:\n"
+	"\t\t\tdeconvolve(int(command[1]), int(command[2]), command[3] == '1', arguments)\n"
+	"\t\t\treplies.write('ok\\n')\n"
+	"\t\texcept Exception as e:\n"
+	"\t\t\treplies.write('error ' + ' '.join(str(e).split()) + '\\n')\n"
+	"\t\treplies.flush()\n"
+	"finally:\n"
+	"\tshutil.rmtree(workDir, True)\n";
+
+MoreSaneHelper::MoreSaneHelper(const std::string& moresaneLocation) :
+	_moresaneLocation(moresaneLocation),
+	_memoryFd(-1), _commandFd(-1), _replyFd(-1),
+	_pid(0),
+	_memory(0), _memorySize(0)
+{
+	start();
+}
+
+MoreSaneHelper::~MoreSaneHelper()
+{
+	stop();
+}
+
+void MoreSaneHelper::start()
+{
+	// All descriptors are created with close-on-exec, so that processes that other threads
+	// start while the helper is being started do not inherit them. The child clears the
+	// flag of the descriptors that the helper needs.
+	// memfd_create() is called through syscall(), because older C libraries do not
+	// provide it. Without it, an unlinked temporary file is used.
+#ifdef SYS_memfd_create
+	_memoryFd = syscall(SYS_memfd_create, "wsclean-moresane", MFD_CLOEXEC);
+#endif
+	if(_memoryFd == -1)
+	{
+		char name[] = "/tmp/wsclean-moresane-XXXXXX";
+		_memoryFd = mkostemp(name, O_CLOEXEC);
+		if(_memoryFd != -1)
+			unlink(name);
+	}
+	if(_memoryFd == -1)
+		throw std::runtime_error("Could not create shared memory for the MoreSane helper");
+	
+	int commandPipe[2], replyPipe[2];
+	if(pipe2(commandPipe, O_CLOEXEC) != 0)
+		throw std::runtime_error("Could not create pipe for the MoreSane helper");
+	if(pipe2(replyPipe, O_CLOEXEC) != 0)
+	{
+		close(commandPipe[0]);
+		close(commandPipe[1]);
+		throw std::runtime_error("Could not create pipe for the MoreSane helper");
+	}
+	
+	// The arguments are made before forking, because the child may only call exec
+	std::ostringstream memoryFdStr, commandFdStr, replyFdStr;
+	memoryFdStr << _memoryFd;
+	commandFdStr << commandPipe[0];
+	replyFdStr << replyPipe[1];
+	const std::string memoryArg = memoryFdStr.str(), commandArg = commandFdStr.str(), replyArg = replyFdStr.str();
+	
+	std::cout << "Starting MoreSane helper process for " << _moresaneLocation << std::endl;
+	_pid = fork();
+	switch(_pid) {
+		case -1: // Error
+			throw std::runtime_error("Could not fork() new process for the MoreSane helper");
+		case 0: // Child
+			fcntl(_memoryFd, F_SETFD, 0);
+			fcntl(commandPipe[0], F_SETFD, 0);
+			fcntl(replyPipe[1], F_SETFD, 0);
+			execlp("python", "python", "-c", _helperProgram, _moresaneLocation.c_str(), memoryArg.c_str(), commandArg.c_str(), replyArg.c_str(), (char*) 0);
+			_exit(127);
+	}
+	close(commandPipe[0]);
+	close(replyPipe[1]);
+	_commandFd = commandPipe[1];
+	_replyFd = replyPipe[0];
+}
+
+void MoreSaneHelper::stop()
+{
+	// Closing the command pipe makes the helper quit once it has finished its current
+	// command. If it does not quit in time, e.g. because MoreSane hangs, it is killed.
+	if(_commandFd != -1)
+		close(_commandFd);
+	if(_pid > 0)
+	{
+		if(!waitForExit(_pid, _stopTimeout))
+		{
+			std::cerr << "The MoreSane helper process did not stop, killing it.\n";
+			kill(_pid, SIGKILL);
+			waitForExit(_pid, -1.0);
+		}
+		_pid = 0;
+	}
+	if(_replyFd != -1)
+		close(_replyFd);
+	if(_memory != 0)
+		munmap(_memory, _memorySize);
+	if(_memoryFd != -1)
+		close(_memoryFd);
+}
+
+bool MoreSaneHelper::waitForExit(pid_t pid, double timeout)
+{
+	const useconds_t pollInterval = 10000;
+	double waited = 0.0;
+	while(true)
+	{
+		int pStatus;
+		const pid_t pidReturn = waitpid(pid, &pStatus, timeout < 0.0 ? 0 : WNOHANG);
+		if(pidReturn == pid || (pidReturn == -1 && errno != EINTR))
+			return true;
+		if(pidReturn == 0)
+		{
+			if(waited >= timeout)
+				return false;
+			usleep(pollInterval);
+			waited += pollInterval * 1e-6;
+		}
+	}
+}
+
+void MoreSaneHelper::Deconvolve(double* dataImage, double* modelImage, const double* psfImage, const bool* cleanMask, size_t width, size_t height, const std::string& arguments)
+{
+	if(_pid <= 0)
+		throw std::runtime_error("The MoreSane helper process has stopped");
+	
+	const size_t imageSize = width * height;
+	reserveMemory(imageSize * 5);
+	memcpy(_memory, dataImage, imageSize * sizeof(double));
+	memcpy(_memory + imageSize, psfImage, imageSize * sizeof(double));
+	if(cleanMask != 0)
+	{
+		double* mask = _memory + imageSize*2;
+		for(size_t i=0; i!=imageSize; ++i)
+			mask[i] = cleanMask[i] ? 1.0 : 0.0;
+	}
+	
+	std::ostringstream command;
+	command << "deconvolve " << width << ' ' << height << ' ' << (cleanMask==0 ? 0 : 1) << '\n'
+		<< arguments << '\n';
+	writeCommand(command.str());
+	const std::string reply = readReply();
+	if(reply != "ok")
+		throw std::runtime_error("MoreSane helper reported: " + reply);
+	
+	memcpy(modelImage, _memory + imageSize*3, imageSize * sizeof(double));
+	memcpy(dataImage, _memory + imageSize*4, imageSize * sizeof(double));
+}
+
+void MoreSaneHelper::reserveMemory(size_t doubleCount)
+{
+	const size_t size = doubleCount * sizeof(double);
+	if(size > _memorySize)
+	{
+		if(_memory != 0)
+		{
+			munmap(_memory, _memorySize);
+			_memory = 0;
+			_memorySize = 0;
+		}
+		if(ftruncate(_memoryFd, size) != 0)
+			throw std::runtime_error("Could not resize shared memory for the MoreSane helper");
+		void* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, _memoryFd, 0);
+		if(memory == MAP_FAILED)
+			throw std::runtime_error("Could not map shared memory for the MoreSane helper");
+		_memory = reinterpret_cast<double*>(memory);
+		_memorySize = size;
+	}
+}
+
+void MoreSaneHelper::writeCommand(const std::string& command)
+{
+	// Writing to the pipe of a helper that has stopped raises SIGPIPE, which would
+	// terminate wsclean. The signal is therefore blocked in this thread during the write,
+	// so that the write fails with EPIPE instead. A SIGPIPE that became pending is
+	// consumed before the signal mask is restored.
+	sigset_t pipeSet, oldSet;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+	
+	const char* data = command.c_str();
+	size_t remaining = command.size();
+	int error = 0;
+	while(remaining != 0)
+	{
+		ssize_t written = write(_commandFd, data, remaining);
+		if(written == -1)
+		{
+			if(errno != EINTR)
+			{
+				error = errno;
+				break;
+			}
+		}
+		else {
+			data += written;
+			remaining -= written;
+		}
+	}
+	
+	if(error == EPIPE && !sigismember(&oldSet, SIGPIPE))
+	{
+		const struct timespec noWait = { 0, 0 };
+		while(sigtimedwait(&pipeSet, 0, &noWait) == -1 && errno == EINTR)
+			;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, 0);
+	
+	if(error == EPIPE)
+		throw std::runtime_error("The MoreSane helper process has stopped");
+	else if(error != 0)
+		throw std::runtime_error("Could not send command to the MoreSane helper");
+}
+
+std::string MoreSaneHelper::readReply()
+{
+	std::string reply;
+	char c;
+	while(true)
+	{
+		ssize_t result = read(_replyFd, &c, 1);
+		if(result == -1 && errno == EINTR)
+			continue;
+		if(result != 1)
+			throw std::runtime_error("The MoreSane helper process stopped unexpectedly");
+		if(c == '\n')
+			return reply;
+		reply += c;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef MORESANE_HELPER_H
+#define MORESANE_HELPER_H
+
+#include <string>
+
+#include <sys/types.h>
+
+/**
+ * A Python process that keeps running during all major iterations and runs MoreSane
+ * on request. The Python interpreter and MoreSane's modules are therefore loaded only once.
+ *
+ * The images are exchanged through a shared memory file (memfd) that both processes map,
+ * and commands and replies are exchanged as lines of text through two pipes. A command
+ * consists of the line "deconvolve <width> <height> <usemask>", followed by a line with
+ * the MoreSane arguments. The shared memory then holds the dirty image, the psf and the
+ * mask, and on a reply of "ok" the model and residual follow. On failure, the reply is
+ * "error <message>". The process stops when the command pipe is closed.
+ *
+ * MoreSane itself still reads and writes FITS files, which the helper keeps in /dev/shm.
+ */
+class MoreSaneHelper
+{
+public:
+	explicit MoreSaneHelper(const std::string& moresaneLocation);
+	~MoreSaneHelper();
+
+	/**
+	 * Runs MoreSane on dataImage, which is replaced by the residual.
+	 * @param cleanMask The mask, or zero to not use a mask.
+	 * @param arguments Arguments passed to MoreSane, excluding the mask and file names.
+	 */
+	void Deconvolve(double* dataImage, double* modelImage, const double* psfImage, const bool* cleanMask, size_t width, size_t height, const std::string& arguments);
+
+private:
+	MoreSaneHelper(const MoreSaneHelper&) = delete;
+	MoreSaneHelper& operator=(const MoreSaneHelper&) = delete;
+
+	void start();
+	void stop();
+	
+	/**
+	 * Waits until the process has exited and reaps it.
+	 * @param timeout Maximum time to wait in seconds, or negative to wait without limit.
+	 * @returns false when the process was still running after the timeout.
+	 */
+	static bool waitForExit(pid_t pid, double timeout);
+	void reserveMemory(size_t imageSize);
+	void writeCommand(const std::string& command);
+	std::string readReply();
+
+	const std::string _moresaneLocation;
+	int _memoryFd, _commandFd, _replyFd;
+	pid_t _pid;
+	double* _memory;
+	size_t _memorySize;
+
+	static const char* _helperProgram;
+	// Seconds that stop() waits for the helper to quit before killing it
+	static const double _stopTimeout;
+};
+
+#endif
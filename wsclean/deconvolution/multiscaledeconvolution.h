@@ -10,6 +10,7 @@
 #include "dynamicset.h"
 
 #include "../multiscale/multiscalealgorithm.h"
+#include "../multiscale/multiscaletransforms.h"
 
 #include "../wsclean/imagingtable.h"
 
@@ -23,10 +24,17 @@ public:
 	
 	virtual void ExecuteMajorIteration(DynamicSet& dataImage, DynamicSet& modelImage, const ao::uvector<const double*>& psfImages, size_t width, size_t height, bool& reachedMajorThreshold)
 	{
-		MultiScaleAlgorithm algorithm(_allocator, width, height, _beamSizeInPixels, _threshold, _subtractionGain, _stopGain, _cleanBorderRatio, _allowNegativeComponents, _multiscaleScaleBias, _threadCount);
+		// The transforms keep the FFT plans and transformed scale kernels, and are
+		// therefore kept for all major iterations
+		if(_transforms == 0 || _transforms->Width() != width || _transforms->Height() != height)
+			_transforms.reset(new MultiScaleTransforms(width, height));
+		
+		MultiScaleAlgorithm algorithm(_allocator, *_transforms, width, height, _beamSizeInPixels, _threshold, _subtractionGain, _stopGain, _cleanBorderRatio, _allowNegativeComponents, _multiscaleScaleBias, _threadCount);
 		
 		if(_cleanMask != 0)
 			algorithm.SetCleanMask(_cleanMask);
+		algorithm.SetFastSubMinorLoop(_multiscaleFastSubMinorLoop);
+		algorithm.SetPSFCropTolerance(_multiscalePSFCropTolerance);
 		
 		algorithm.PerformMajorIteration(_iterationNumber, MaxNIter(), modelImage, dataImage, psfImages, reachedMajorThreshold);
 	}
@@ -34,6 +42,7 @@ public:
 private:
 	class ImageBufferAllocator& _allocator;
 	double _beamSizeInPixels;
+	std::unique_ptr<MultiScaleTransforms> _transforms;
 };
 
 #endif
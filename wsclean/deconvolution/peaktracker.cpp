@@ -0,0 +1,224 @@
+#include "peaktracker.h"
+#include "simpleclean.h"
+
+#include <algorithm>
+#include <cmath>
+
+const size_t PeakTracker::_tileSize = 64;
+
+PeakTracker::PeakTracker(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, const double* psf, size_t psfWidth, size_t psfHeight) :
+	_image(image),
+	_width(width),
+	_height(height),
+	_cleanMask(cleanMask),
+	_allowNegativeComponents(allowNegativeComponents),
+	_psf(psf),
+	_psfWidth(psfWidth),
+	_psfHeight(psfHeight)
+{
+	if(endX < startX) endX = startX;
+	if(endY < startY) endY = startY;
+	_tilesX = (endX - startX + _tileSize - 1) / _tileSize;
+	_tilesY = (endY - startY + _tileSize - 1) / _tileSize;
+	_tiles.resize(_tilesX * _tilesY);
+	if(_cleanMask != 0)
+		_tileSpans.reserve(_tiles.size());
+	for(size_t ty=0; ty!=_tilesY; ++ty)
+	{
+		for(size_t tx=0; tx!=_tilesX; ++tx)
+		{
+			Tile& tile = _tiles[tx + ty*_tilesX];
+			tile.startX = startX + tx*_tileSize;
+			tile.endX = std::min(tile.startX + _tileSize, endX);
+			tile.startY = startY + ty*_tileSize;
+			tile.endY = std::min(tile.startY + _tileSize, endY);
+			tile.bound = std::numeric_limits<double>::infinity();
+			tile.peakIndex = _width * _height;
+			tile.isExact = false;
+			if(_cleanMask != 0)
+			{
+				_tileSpans.push_back(MaskSpans(_cleanMask, _width, _height, tile.startX, tile.endX, tile.startY, tile.endY));
+				if(_tileSpans.back().PixelCount() == 0)
+				{
+					tile.bound = std::numeric_limits<double>::min();
+					tile.isExact = true;
+				}
+			}
+		}
+	}
+
+	_leafCount = 1;
+	while(_leafCount < _tiles.size())
+		_leafCount *= 2;
+	_tree.assign(_leafCount * 2, _noTile);
+	for(size_t i=0; i!=_tiles.size(); ++i)
+		_tree[_leafCount + i] = i;
+	for(size_t node=_leafCount-1; node!=0; --node)
+		_tree[node] = bestOf(_tree[node*2], _tree[node*2+1]);
+
+	_psfTilesX = (_psfWidth + _tileSize - 1) / _tileSize;
+	_psfTilesY = (_psfHeight + _tileSize - 1) / _tileSize;
+	_psfTileMax.assign(_psfTilesX * _psfTilesY, 0.0);
+	for(size_t y=0; y!=_psfHeight; ++y)
+	{
+		const double* psfRow = &_psf[y * _psfWidth];
+		double* maxRow = &_psfTileMax[(y / _tileSize) * _psfTilesX];
+		for(size_t x=0; x!=_psfWidth; ++x)
+		{
+			double& tileMax = maxRow[x / _tileSize];
+			tileMax = std::max(tileMax, std::fabs(psfRow[x]));
+		}
+	}
+}
+
+void PeakTracker::Subtract(size_t x, size_t y, double factor)
+{
+	// Same area as the one changed by SimpleClean::PartialSubtractImage()
+	const int
+		offsetX = int(x) - int(_psfWidth/2),
+		offsetY = int(y) - int(_psfHeight/2);
+	const double absFactor = std::fabs(factor);
+	// Only the tiles that overlap with the PSF are visited
+	size_t firstTileX, endTileX, firstTileY, endTileY;
+	if(!overlappingTiles(offsetX, offsetX + int(_psfWidth), offsetY, offsetY + int(_psfHeight), firstTileX, endTileX, firstTileY, endTileY))
+		return;
+	for(size_t ty=firstTileY; ty<endTileY; ++ty)
+	{
+		for(size_t tx=firstTileX; tx<endTileX; ++tx)
+			subtractFromTile(tx + ty*_tilesX, offsetX, offsetY, absFactor);
+	}
+}
+
+void PeakTracker::Invalidate(size_t startX, size_t endX, size_t startY, size_t endY)
+{
+	size_t firstTileX, endTileX, firstTileY, endTileY;
+	if(!overlappingTiles(startX, endX, startY, endY, firstTileX, endTileX, firstTileY, endTileY))
+		return;
+	for(size_t ty=firstTileY; ty<endTileY; ++ty)
+	{
+		for(size_t tx=firstTileX; tx<endTileX; ++tx)
+		{
+			const size_t tileIndex = tx + ty*_tilesX;
+			// Tiles without unmasked pixels never have a peak
+			if(_cleanMask != 0 && _tileSpans[tileIndex].PixelCount() == 0)
+				continue;
+			Tile& tile = _tiles[tileIndex];
+			tile.bound = std::numeric_limits<double>::infinity();
+			tile.isExact = false;
+			updateTree(tileIndex);
+		}
+	}
+}
+
+bool PeakTracker::overlappingTiles(int startX, int endX, int startY, int endY, size_t& firstTileX, size_t& endTileX, size_t& firstTileY, size_t& endTileY) const
+{
+	if(_tiles.empty() || startX >= endX || startY >= endY)
+		return false;
+	const int
+		tileSize = _tileSize,
+		regionStartX = _tiles[0].startX,
+		regionStartY = _tiles[0].startY,
+		lastTileX = endX - regionStartX,
+		lastTileY = endY - regionStartY;
+	if(lastTileX <= 0 || lastTileY <= 0)
+		return false;
+	firstTileX = std::max(startX - regionStartX, 0) / tileSize;
+	firstTileY = std::max(startY - regionStartY, 0) / tileSize;
+	endTileX = std::min<size_t>((lastTileX - 1) / tileSize + 1, _tilesX);
+	endTileY = std::min<size_t>((lastTileY - 1) / tileSize + 1, _tilesY);
+	return firstTileX < endTileX && firstTileY < endTileY;
+}
+
+void PeakTracker::subtractFromTile(size_t tileIndex, int offsetX, int offsetY, double absFactor)
+{
+	Tile& tile = _tiles[tileIndex];
+	const int
+		psfStartX = std::max(int(tile.startX) - offsetX, 0),
+		psfEndX = std::min(int(tile.endX) - offsetX, int(_psfWidth)),
+		psfStartY = std::max(int(tile.startY) - offsetY, 0),
+		psfEndY = std::min(int(tile.endY) - offsetY, int(_psfHeight));
+	if(psfStartX < psfEndX && psfStartY < psfEndY)
+	{
+		const double increase = absFactor * psfWindowMax(psfStartX, psfEndX, psfStartY, psfEndY);
+		if(increase != 0.0 && tile.bound != std::numeric_limits<double>::infinity())
+		{
+			// Slightly widen the bound to allow for rounding in the subtraction
+			tile.bound += increase + 1e-12 * (std::fabs(tile.bound) + increase);
+			tile.isExact = false;
+			updateTree(tileIndex);
+		}
+	}
+}
+
+double PeakTracker::FindPeak(size_t& x, size_t& y)
+{
+	if(_tiles.empty())
+	{
+		x = _width; y = _height;
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	size_t best = _tree[1];
+	while(!_tiles[best].isExact)
+	{
+		scanTile(best);
+		updateTree(best);
+		best = _tree[1];
+	}
+	const Tile& tile = _tiles[best];
+	if(tile.peakIndex == _width * _height)
+	{
+		x = _width; y = _height;
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	x = tile.peakIndex % _width;
+	y = tile.peakIndex / _width;
+	return _image[tile.peakIndex];
+}
+
+void PeakTracker::scanTile(size_t tileIndex)
+{
+	// Without a peak, the bound becomes the smallest value that is considered
+	Tile& tile = _tiles[tileIndex];
+	double peak;
+	if(_cleanMask == 0)
+		tile.peakIndex = SimpleClean::FindPeakInRegion(_image, _width, _height, tile.startX, tile.endX, tile.startY, tile.endY, 0, _allowNegativeComponents, peak);
+	else
+		tile.peakIndex = SimpleClean::FindPeakInSpans(_image, _tileSpans[tileIndex], tile.startY, tile.endY, _allowNegativeComponents, peak);
+	tile.bound = peak;
+	tile.isExact = true;
+}
+
+void PeakTracker::updateTree(size_t tileIndex)
+{
+	size_t node = (_leafCount + tileIndex) / 2;
+	while(node != 0)
+	{
+		_tree[node] = bestOf(_tree[node*2], _tree[node*2+1]);
+		node /= 2;
+	}
+}
+
+size_t PeakTracker::bestOf(size_t tileA, size_t tileB) const
+{
+	if(tileA == _noTile) return tileB;
+	if(tileB == _noTile) return tileA;
+	const Tile &a = _tiles[tileA], &b = _tiles[tileB];
+	if(a.bound != b.bound)
+		return a.bound > b.bound ? tileA : tileB;
+	// On equal bounds, a tile that is not exact might still hold the same value
+	// at an earlier position, so it should be scanned first.
+	if(a.isExact != b.isExact)
+		return a.isExact ? tileB : tileA;
+	return a.peakIndex <= b.peakIndex ? tileA : tileB;
+}
+
+double PeakTracker::psfWindowMax(int psfStartX, int psfEndX, int psfStartY, int psfEndY) const
+{
+	double result = 0.0;
+	for(size_t ty=psfStartY/_tileSize; ty<=(psfEndY-1)/_tileSize; ++ty)
+	{
+		for(size_t tx=psfStartX/_tileSize; tx<=(psfEndX-1)/_tileSize; ++tx)
+			result = std::max(result, _psfTileMax[tx + ty*_psfTilesX]);
+	}
+	return result;
+}
@@ -0,0 +1,102 @@
+#ifndef PEAK_TRACKER_H
+#define PEAK_TRACKER_H
+
+#include "maskspans.h"
+
+#include "../uvector.h"
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+/**
+ * Keeps track of the peak in (a region of) an image from which PSFs are subtracted,
+ * without scanning the full region after every subtraction.
+ *
+ * The region is divided in tiles. For each tile, an upper bound of its peak value is
+ * kept, together with whether the bound is exact, i.e. the tile has been scanned since the
+ * last subtraction that changed it. A subtraction raises the bound of a tile by the
+ * largest absolute PSF value that falls on that tile times the subtracted flux. The
+ * tile with the highest bound is found with a tournament tree; only when it is not
+ * exact, it is scanned and the search is repeated. Hence, only tiles that might
+ * contain the peak are scanned.
+ *
+ * With a clean mask, the mask of each tile is converted to spans, so that tiles
+ * are scanned in time proportional to their unmasked area, and tiles without unmasked
+ * pixels are never scanned.
+ *
+ * The result is the same as that of scanning the full region, i.e. the first pixel
+ * in row-major order with the highest value.
+ */
+class PeakTracker
+{
+public:
+	/**
+	 * @param image Image of size width x height that is cleaned.
+	 * @param startX,endX,startY,endY Region in which the peak is searched.
+	 * @param cleanMask Optional mask of pixels that may be cleaned, or zero.
+	 * @param psf PSF of size psfWidth x psfHeight, centred on (psfWidth/2, psfHeight/2).
+	 */
+	PeakTracker(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, const double* psf, size_t psfWidth, size_t psfHeight);
+
+	/**
+	 * Should be called after factor times the PSF, centred on (x, y), was subtracted from the image.
+	 */
+	void Subtract(size_t x, size_t y, double factor);
+
+	/**
+	 * Should be called after the image was changed in another way in the area
+	 * [startX, endX) x [startY, endY). The tiles that overlap with it are scanned again when
+	 * the peak is searched. The PSF is not used, so it may be empty when only this is called.
+	 */
+	void Invalidate(size_t startX, size_t endX, size_t startY, size_t endY);
+
+	/**
+	 * Returns the value of the peak and sets its position, or returns NaN when the
+	 * region has no finite (unmasked) values.
+	 */
+	double FindPeak(size_t& x, size_t& y);
+
+private:
+	struct Tile
+	{
+		size_t startX, endX, startY, endY;
+		double bound;
+		size_t peakIndex;
+		bool isExact;
+	};
+
+	/**
+	 * Sets the range of tiles that overlap with the area [startX, endX) x [startY, endY), which
+	 * may extend outside the image. Returns false when no tiles overlap.
+	 */
+	bool overlappingTiles(int startX, int endX, int startY, int endY, size_t& firstTileX, size_t& endTileX, size_t& firstTileY, size_t& endTileY) const;
+	void subtractFromTile(size_t tileIndex, int offsetX, int offsetY, double absFactor);
+	void scanTile(size_t tileIndex);
+	void updateTree(size_t tileIndex);
+	size_t bestOf(size_t tileA, size_t tileB) const;
+	double psfWindowMax(int psfStartX, int psfEndX, int psfStartY, int psfEndY) const;
+
+	const double* _image;
+	size_t _width, _height;
+	const bool* _cleanMask;
+	bool _allowNegativeComponents;
+	const double* _psf;
+	size_t _psfWidth, _psfHeight;
+
+	size_t _tilesX, _tilesY;
+	ao::uvector<Tile> _tiles;
+	// With a clean mask, the unmasked pixels of each tile
+	std::vector<MaskSpans> _tileSpans;
+	// Tournament tree: node i holds the best tile of nodes 2i and 2i+1; leaves start at _leafCount
+	size_t _leafCount;
+	ao::uvector<size_t> _tree;
+	// Maximum absolute PSF value per tile of the PSF, with tiles aligned at the PSF origin
+	size_t _psfTilesX, _psfTilesY;
+	ao::uvector<double> _psfTileMax;
+
+	static const size_t _tileSize;
+	static const size_t _noTile = std::numeric_limits<size_t>::max();
+};
+
+#endif
@@ -1,16 +1,19 @@
 #include "simpleclean.h"
+#include "peaktracker.h"
 
 #include "../imagecoordinates.h"
 
-#include "../lane.h"
 #include "../areaset.h"
 
 #include <boost/thread/thread.hpp>
 #include <emmintrin.h>
 #include <immintrin.h>
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
+#include <stdexcept>
 
 double SimpleClean::FindPeakSimple(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, double borderRatio)
 {
@@ -54,42 +57,303 @@ double SimpleClean::FindPeakSimple(const double *image, size_t width, size_t hei
 	}
 }
 
-double SimpleClean::FindPeak(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, const bool* cleanMask, double borderRatio)
+void SimpleClean::GetPeakSearchRegion(size_t width, size_t height, double borderRatio, size_t& startX, size_t& endX, size_t& startY, size_t& endY)
 {
-	double peakMax = std::numeric_limits<double>::min();
-	x = width; y = height;
-	
+#if defined __AVX__ && !defined FORCE_NON_AVX
+	// FindPeakAVX() rounds the border sizes down
+	const size_t horBorderSize = floor(width*borderRatio), verBorderSize = floor(height*borderRatio);
+#else
 	const size_t horBorderSize = round(width*borderRatio), verBorderSize = round(height*borderRatio);
+#endif
+	startX = horBorderSize;
+	endX = width - horBorderSize;
+	startY = std::max(startY, verBorderSize);
+	endY = std::min(endY, height - verBorderSize);
+	if(endX < startX) endX = startX;
+	if(endY < startY) endY = startY;
+}
+
+double SimpleClean::FindPeak(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, const MaskSpans& maskSpans)
+{
+	double peakMax;
+	const size_t peakIndex = FindPeakInSpans(image, maskSpans, startY, endY, allowNegativeComponents, peakMax);
+	if(peakIndex == width * height)
+	{
+		x = width; y = height;
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	else {
+		x = peakIndex % width;
+		y = peakIndex / width;
+		return image[peakIndex];
+	}
+}
+
+MaskSpans SimpleClean::MakeMaskSpans(const bool* cleanMask, size_t width, size_t height, double borderRatio)
+{
+	// Same area as searched by FindPeak() with a mask
+	const size_t horBorderSize = round(width*borderRatio);
+	size_t xiStart = horBorderSize, xiEnd = width - horBorderSize;
+	if(xiEnd < xiStart) xiEnd = xiStart;
+	return MaskSpans(cleanMask, width, height, xiStart, xiEnd, 0, height);
+}
+
+double SimpleClean::FindPeak(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, const bool* cleanMask, double borderRatio)
+{
+	const size_t horBorderSize = round(width*borderRatio);
 	size_t xiStart = horBorderSize, xiEnd = width - horBorderSize;
-	size_t yiStart = std::max(startY, verBorderSize), yiEnd = std::min(endY, height - verBorderSize);
 	if(xiEnd < xiStart) xiEnd = xiStart;
-	if(yiEnd < yiStart) yiEnd = yiStart;
 	
-	for(size_t yi=startY; yi!=endY; ++yi)
+	double peakMax;
+	const size_t peakIndex = FindPeakInRegion(image, width, height, xiStart, xiEnd, startY, endY, cleanMask, allowNegativeComponents, peakMax);
+	if(peakIndex == width * height)
 	{
-		const double *imgIter = &image[yi*width+xiStart];
-		const bool* cleanMaskPtr = &cleanMask[yi*width+xiStart];
-		for(size_t xi=xiStart; xi!=xiEnd; ++xi)
+		x = width; y = height;
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	else {
+		x = peakIndex % width;
+		y = peakIndex / width;
+		return image[peakIndex];
+	}
+}
+
+/*
+ * Implementations of FindPeakInRegion(). The SIMD versions compare a vector of values
+ * with the current peak, and combine the result with the mask bits of the pixels. Only
+ * when a value in the vector is a new candidate, the values are tested one by one, so that
+ * the first pixel with the highest value is found like in the scalar version.
+ */
+namespace {
+	template<bool AllowNegativeComponents, bool UseMask>
+	size_t findPeakInRegionSimple(const double* image, size_t width, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, size_t peakIndex, double& peakMax)
+	{
+		for(size_t yi=startY; yi!=endY; ++yi)
 		{
-			double value = *imgIter;
-			if(std::isfinite(value))
+			size_t index = yi*width + startX;
+			for(size_t xi=startX; xi!=endX; ++xi)
 			{
-				if(allowNegativeComponents) value = std::fabs(value);
-				if(value > peakMax && *cleanMaskPtr)
+				double value = image[index];
+				if(AllowNegativeComponents) value = std::fabs(value);
+				if(value > peakMax && std::isfinite(value) && (!UseMask || cleanMask[index]))
 				{
-					x = xi;
-					y = yi;
-					peakMax = std::fabs(value);
+					peakIndex = index;
+					peakMax = value;
 				}
+				++index;
 			}
-			++imgIter;
-			++cleanMaskPtr;
 		}
+		return peakIndex;
+	}
+	
+	/**
+	 * Returns a bit per pixel that is set when the pixel is in the mask.
+	 */
+	inline unsigned maskBits(const bool* cleanMask, size_t count)
+	{
+		__m128i bytes;
+		if(count == 8)
+			bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(cleanMask));
+		else {
+			int32_t word;
+			memcpy(&word, cleanMask, sizeof(word));
+			bytes = _mm_cvtsi32_si128(word);
+		}
+		const unsigned unmasked = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+		return ~unmasked & ((1u << count) - 1);
+	}
+	
+	template<bool AllowNegativeComponents>
+	inline void updatePeak(const double* values, size_t index, unsigned candidates, size_t& peakIndex, double& peakMax)
+	{
+		for(size_t i=0; candidates!=0; ++i, candidates >>= 1)
+		{
+			if(candidates & 1)
+			{
+				double value = AllowNegativeComponents ? std::fabs(values[i]) : values[i];
+				if(value > peakMax)
+				{
+					peakIndex = index + i;
+					peakMax = value;
+				}
+			}
+		}
+	}
+	
+#if defined __AVX__ && !defined FORCE_NON_AVX
+	template<bool AllowNegativeComponents, bool UseMask>
+	size_t findPeakInRegionAVX(const double* image, size_t width, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, size_t peakIndex, double& peakMax)
+	{
+		const __m256d signMask = _mm256_set1_pd(-0.0), infinity = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+		__m256d mPeakMax = _mm256_set1_pd(peakMax);
+		for(size_t yi=startY; yi!=endY; ++yi)
+		{
+			size_t index = yi*width + startX;
+			const size_t endIndex = yi*width + endX;
+			for(; index+4 <= endIndex; index+=4)
+			{
+				__m256d value = _mm256_loadu_pd(&image[index]);
+				if(AllowNegativeComponents)
+					value = _mm256_andnot_pd(signMask, value);
+				// Ordered comparisons are false for NaNs; the second one excludes infinity
+				const __m256d isCandidate = _mm256_and_pd(
+					_mm256_cmp_pd(value, mPeakMax, _CMP_GT_OQ),
+					_mm256_cmp_pd(value, infinity, _CMP_LT_OQ));
+				unsigned candidates = _mm256_movemask_pd(isCandidate);
+				if(candidates != 0)
+				{
+					if(UseMask)
+						candidates &= maskBits(&cleanMask[index], 4);
+					if(candidates != 0)
+					{
+						updatePeak<AllowNegativeComponents>(&image[index], index, candidates, peakIndex, peakMax);
+						mPeakMax = _mm256_set1_pd(peakMax);
+					}
+				}
+			}
+			peakIndex = findPeakInRegionSimple<AllowNegativeComponents, UseMask>(image, width, index - yi*width, endX, yi, yi+1, cleanMask, peakIndex, peakMax);
+			mPeakMax = _mm256_set1_pd(peakMax);
+		}
+		return peakIndex;
+	}
+#endif
+	
+#if defined __GNUC__ && defined __x86_64__ && !defined FORCE_NON_AVX
+#define SIMPLE_CLEAN_AVX512_DISPATCH
+	/**
+	 * AVX-512 version, which is compiled for AVX-512 regardless of the compiler flags and is
+	 * only called after checking that the processor supports it.
+	 */
+	template<bool AllowNegativeComponents, bool UseMask>
+	__attribute__((target("avx512f")))
+	size_t findPeakInRegionAVX512(const double* image, size_t width, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, size_t peakIndex, double& peakMax)
+	{
+		const __m512d infinity = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+		__m512d mPeakMax = _mm512_set1_pd(peakMax);
+		for(size_t yi=startY; yi!=endY; ++yi)
+		{
+			size_t index = yi*width + startX;
+			const size_t endIndex = yi*width + endX;
+			for(; index+8 <= endIndex; index+=8)
+			{
+				__m512d value = _mm512_loadu_pd(&image[index]);
+				if(AllowNegativeComponents)
+					value = _mm512_abs_pd(value);
+				__mmask8 candidates = _mm512_cmp_pd_mask(value, infinity, _CMP_LT_OQ);
+				if(UseMask)
+					candidates &= maskBits(&cleanMask[index], 8);
+				candidates = _mm512_mask_cmp_pd_mask(candidates, value, mPeakMax, _CMP_GT_OQ);
+				if(candidates != 0)
+				{
+					updatePeak<AllowNegativeComponents>(&image[index], index, candidates, peakIndex, peakMax);
+					mPeakMax = _mm512_set1_pd(peakMax);
+				}
+			}
+			peakIndex = findPeakInRegionSimple<AllowNegativeComponents, UseMask>(image, width, index - yi*width, endX, yi, yi+1, cleanMask, peakIndex, peakMax);
+			mPeakMax = _mm512_set1_pd(peakMax);
+		}
+		return peakIndex;
+	}
+	
+	bool hasAVX512()
+	{
+		static const bool hasAVX512 = __builtin_cpu_supports("avx512f");
+		return hasAVX512;
+	}
+#endif
+	
+	SimpleClean::PeakSearchTarget bestPeakSearchTarget()
+	{
+#ifdef SIMPLE_CLEAN_AVX512_DISPATCH
+		if(hasAVX512())
+			return SimpleClean::AVX512PeakSearch;
+#endif
+#if defined __AVX__ && !defined FORCE_NON_AVX
+		return SimpleClean::AVXPeakSearch;
+#else
+		return SimpleClean::ScalarPeakSearch;
+#endif
+	}
+	
+	template<bool AllowNegativeComponents, bool UseMask>
+	size_t findPeakInRegion(SimpleClean::PeakSearchTarget target, const double* image, size_t width, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, size_t peakIndex, double& peakMax)
+	{
+		switch(target)
+		{
+#ifdef SIMPLE_CLEAN_AVX512_DISPATCH
+			case SimpleClean::AVX512PeakSearch:
+				return findPeakInRegionAVX512<AllowNegativeComponents, UseMask>(image, width, startX, endX, startY, endY, cleanMask, peakIndex, peakMax);
+#endif
+#if defined __AVX__ && !defined FORCE_NON_AVX
+			case SimpleClean::AVXPeakSearch:
+				return findPeakInRegionAVX<AllowNegativeComponents, UseMask>(image, width, startX, endX, startY, endY, cleanMask, peakIndex, peakMax);
+#endif
+			default:
+				return findPeakInRegionSimple<AllowNegativeComponents, UseMask>(image, width, startX, endX, startY, endY, cleanMask, peakIndex, peakMax);
+		}
+	}
+	
+	template<bool AllowNegativeComponents>
+	size_t findPeakInSpans(const double* image, const MaskSpans& maskSpans, size_t startY, size_t endY, size_t peakIndex, double& peakMax)
+	{
+		const SimpleClean::PeakSearchTarget target = bestPeakSearchTarget();
+		for(size_t s=maskSpans.FirstSpan(startY); s!=maskSpans.SpanCount() && maskSpans[s].y < endY; ++s)
+		{
+			const MaskSpans::Span& span = maskSpans[s];
+			peakIndex = findPeakInRegion<AllowNegativeComponents, false>(target, image, maskSpans.Width(), span.startX, span.endX, span.y, span.y+1, 0, peakIndex, peakMax);
+		}
+		return peakIndex;
+	}
+}
+
+bool SimpleClean::HasPeakSearchTarget(PeakSearchTarget target)
+{
+	switch(target)
+	{
+		case ScalarPeakSearch:
+			return true;
+		case AVXPeakSearch:
+#if defined __AVX__ && !defined FORCE_NON_AVX
+			return true;
+#else
+			return false;
+#endif
+		case AVX512PeakSearch:
+#ifdef SIMPLE_CLEAN_AVX512_DISPATCH
+			return hasAVX512();
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+size_t SimpleClean::FindPeakInRegion(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, double& peakValue)
+{
+	return FindPeakInRegion(image, width, height, startX, endX, startY, endY, cleanMask, allowNegativeComponents, peakValue, bestPeakSearchTarget());
+}
+
+size_t SimpleClean::FindPeakInRegion(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, double& peakValue, PeakSearchTarget target)
+{
+	if(!HasPeakSearchTarget(target))
+		throw std::runtime_error("The requested peak search implementation is not available");
+	peakValue = std::numeric_limits<double>::min();
+	const size_t noPeak = width * height;
+	if(endX <= startX || endY <= startY)
+		return noPeak;
+	if(allowNegativeComponents)
+	{
+		if(cleanMask == 0)
+			return findPeakInRegion<true, false>(target, image, width, startX, endX, startY, endY, cleanMask, noPeak, peakValue);
+		else
+			return findPeakInRegion<true, true>(target, image, width, startX, endX, startY, endY, cleanMask, noPeak, peakValue);
+	}
+	else {
+		if(cleanMask == 0)
+			return findPeakInRegion<false, false>(target, image, width, startX, endX, startY, endY, cleanMask, noPeak, peakValue);
+		else
+			return findPeakInRegion<false, true>(target, image, width, startX, endX, startY, endY, cleanMask, noPeak, peakValue);
 	}
-	if(y == height)
-		return std::numeric_limits<double>::quiet_NaN();
-	else
-		return image[x + y*width];
 }
 
 #if defined __AVX__ && !defined FORCE_NON_AVX
@@ -365,14 +629,21 @@ void SimpleClean::ExecuteMajorIteration(double* dataImage, double* modelImage, c
 		std::cout << "Major iteration threshold reached global threshold of " << _threshold << ": final major iteration.\n";
 	}
 
-	std::vector<ao::lane<CleanTask>*> taskLanes(_threadCount);
-	std::vector<ao::lane<CleanResult>*> resultLanes(_threadCount);
-	boost::thread_group threadGroup;
+	// Every thread cleans its own stripe of rows for the whole minor loop. Threads
+	// meet once per iteration at a barrier, after which every thread selects
+	// the same next component from the published peaks of all stripes.
+	SharedCleanData shared(_threadCount);
+	shared.modelImage = modelImage;
+	shared.firstThreshold = firstThreshold;
+	shared.componentX = componentX;
+	shared.componentY = componentY;
+	shared.peak = peak;
+	shared.iterationNumber = _iterationNumber;
+	std::vector<CleanThreadData> threadData(_threadCount);
 	for(size_t i=0; i!=_threadCount; ++i)
 	{
-		taskLanes[i] = new ao::lane<CleanTask>(1);
-		resultLanes[i] = new ao::lane<CleanResult>(1);
-		CleanThreadData cleanThreadData;
+		CleanThreadData& cleanThreadData = threadData[i];
+		cleanThreadData.threadIndex = i;
 		cleanThreadData.imgWidth = width;
 		cleanThreadData.imgHeight = height;
 		cleanThreadData.dataImage = dataImage;
@@ -381,66 +652,97 @@ void SimpleClean::ExecuteMajorIteration(double* dataImage, double* modelImage, c
 		cleanThreadData.psfImage = psfImage;
 		cleanThreadData.startY = (height*i)/_threadCount;
 		cleanThreadData.endY = height*(i+1)/_threadCount;
-		threadGroup.add_thread(new boost::thread(&SimpleClean::cleanThreadFunc, this, &*taskLanes[i], &*resultLanes[i], cleanThreadData));
 	}
-	while(fabs(peak) > firstThreshold && _iterationNumber < _maxIter && (peak >= 0.0 || !_stopOnNegativeComponent))
+	boost::thread_group threadGroup;
+	for(size_t i=1; i<_threadCount; ++i)
+		threadGroup.add_thread(new boost::thread(&SimpleClean::cleanThreadFunc, this, threadData[i], &shared));
+	// The calling thread cleans the first stripe and updates the model
+	cleanThreadFunc(threadData[0], &shared);
+	threadGroup.join_all();
+	
+	peak = shared.peak;
+	_iterationNumber = shared.iterationNumber;
+	std::cout << "Stopped on peak " << peak << '\n';
+	reachedStopGain = (fabs(peak) <= stopGainThreshold) && (peak != 0.0);
+}
+
+void SimpleClean::cleanThreadFunc(CleanThreadData cleanData, SharedCleanData* shared)
+{
+	// The tracker searches the same area as FindPeak() would, but only rescans the parts
+	// of the image in which the subtractions might have moved the peak.
+	const size_t
+		width = cleanData.imgWidth, height = cleanData.imgHeight,
+		horBorderSize = round(width*CleanBorderRatio()), verBorderSize = round(height*CleanBorderRatio());
+	size_t startY = cleanData.startY, endY = cleanData.endY;
+	if(_cleanMask == 0)
 	{
-		if(
-			(_iterationNumber <= 100 && _iterationNumber % 10 == 0) ||
-			(_iterationNumber <= 1000 && _iterationNumber % 100 == 0) ||
-			_iterationNumber % 1000 == 0)
-			std::cout << "Iteration " << _iterationNumber << ": (" << componentX << ',' << componentY << "), " << peak << " Jy\n";
+		startY = std::max(startY, verBorderSize);
+		endY = std::min(endY, height - verBorderSize);
+	}
+	PeakTracker tracker(cleanData.dataImage, width, height, horBorderSize, width - horBorderSize, startY, endY, _cleanMask, _allowNegativeComponents, cleanData.psfImage, cleanData.psfWidth, cleanData.psfHeight);
+	
+	const bool isFirstThread = cleanData.threadIndex == 0;
+	size_t
+		componentX = shared->componentX, componentY = shared->componentY,
+		iterationNumber = shared->iterationNumber;
+	double peak = shared->peak;
+	// Results are published in two alternating sets: a thread can only overwrite
+	// a set after all threads have passed the next barrier, and thus have read it.
+	size_t resultSet = 0;
+	while(fabs(peak) > shared->firstThreshold && iterationNumber < _maxIter && (peak >= 0.0 || !_stopOnNegativeComponent))
+	{
+		if(isFirstThread)
+		{
+			if(
+				(iterationNumber <= 100 && iterationNumber % 10 == 0) ||
+				(iterationNumber <= 1000 && iterationNumber % 100 == 0) ||
+				iterationNumber % 1000 == 0)
+				std::cout << "Iteration " << iterationNumber << ": (" << componentX << ',' << componentY << "), " << peak << " Jy\n";
+			shared->modelImage[componentX + componentY*width] += _subtractionGain * peak;
+		}
 		
-		CleanTask task;
-		task.cleanCompX = componentX;
-		task.cleanCompY = componentY;
-		task.peakLevel = peak;
-		for(size_t i=0; i!=_threadCount; ++i)
-			taskLanes[i]->write(task);
+		PartialSubtractImage(cleanData.dataImage, cleanData.imgWidth, cleanData.imgHeight, cleanData.psfImage, cleanData.psfWidth, cleanData.psfHeight, componentX, componentY, _subtractionGain * peak, cleanData.startY, cleanData.endY);
+		tracker.Subtract(componentX, componentY, _subtractionGain * peak);
 		
-		modelImage[componentX + componentY*width] += _subtractionGain * peak;
+		CleanResult& result = shared->results[resultSet * _threadCount + cleanData.threadIndex];
+		result.peakLevel = tracker.FindPeak(result.nextPeakX, result.nextPeakY);
+		
+		shared->barrier.wait();
 		
+		const CleanResult* results = &shared->results[resultSet * _threadCount];
 		peak = 0.0;
 		for(size_t i=0; i!=_threadCount; ++i)
 		{
-			CleanResult result;
-			resultLanes[i]->read(result);
-			if(std::isfinite(result.peakLevel) && fabs(result.peakLevel) >= fabs(peak))
+			if(std::isfinite(results[i].peakLevel) && fabs(results[i].peakLevel) >= fabs(peak))
 			{
-				peak = result.peakLevel;
-				componentX = result.nextPeakX;
-				componentY = result.nextPeakY;
+				peak = results[i].peakLevel;
+				componentX = results[i].nextPeakX;
+				componentY = results[i].nextPeakY;
 			}
 		}
-		
-		++_iterationNumber;
+		resultSet = 1 - resultSet;
+		++iterationNumber;
 	}
-	for(size_t i=0; i!=_threadCount; ++i)
-		taskLanes[i]->write_end();
-	threadGroup.join_all();
-	for(size_t i=0; i!=_threadCount; ++i)
+	if(isFirstThread)
 	{
-		delete taskLanes[i];
-		delete resultLanes[i];
+		shared->peak = peak;
+		shared->iterationNumber = iterationNumber;
 	}
-	std::cout << "Stopped on peak " << peak << '\n';
-	reachedStopGain = (fabs(peak) <= stopGainThreshold) && (peak != 0.0);
 }
 
-void SimpleClean::cleanThreadFunc(ao::lane<CleanTask> *taskLane, ao::lane<CleanResult> *resultLane, CleanThreadData cleanData)
+size_t SimpleClean::FindPeakInSpans(const double* image, const MaskSpans& maskSpans, size_t startY, size_t endY, bool allowNegativeComponents, double& peakValue)
 {
-	CleanTask task;
-	while(taskLane->read(task))
-	{
-		PartialSubtractImage(cleanData.dataImage, cleanData.imgWidth, cleanData.imgHeight, cleanData.psfImage, cleanData.psfWidth, cleanData.psfHeight, task.cleanCompX, task.cleanCompY, _subtractionGain * task.peakLevel, cleanData.startY, cleanData.endY);
-		
-		CleanResult result;
-		if(_cleanMask == 0)
-			result.peakLevel = FindPeak(cleanData.dataImage, cleanData.imgWidth, cleanData.imgHeight, result.nextPeakX, result.nextPeakY, _allowNegativeComponents, cleanData.startY, cleanData.endY, CleanBorderRatio());
-		else
-			result.peakLevel = FindPeak(cleanData.dataImage, cleanData.imgWidth, cleanData.imgHeight, result.nextPeakX, result.nextPeakY, _allowNegativeComponents, cleanData.startY, cleanData.endY, _cleanMask, CleanBorderRatio());
-		
-		resultLane->write(result);
-	}
+	startY = std::max(startY, maskSpans.StartY());
+	endY = std::min(endY, maskSpans.EndY());
+	if(maskSpans.IsFragmented())
+		return FindPeakInRegion(image, maskSpans.Width(), maskSpans.Height(), maskSpans.StartX(), maskSpans.EndX(), startY, endY, maskSpans.Mask(), allowNegativeComponents, peakValue);
+	
+	peakValue = std::numeric_limits<double>::min();
+	const size_t noPeak = maskSpans.Width() * maskSpans.Height();
+	if(endY <= startY)
+		return noPeak;
+	if(allowNegativeComponents)
+		return findPeakInSpans<true>(image, maskSpans, startY, endY, noPeak, peakValue);
+	else
+		return findPeakInSpans<false>(image, maskSpans, startY, endY, noPeak, peakValue);
 }
-
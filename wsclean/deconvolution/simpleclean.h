@@ -3,16 +3,19 @@
 
 #include <string>
 #include <cmath>
+#include <cstdlib>
 #include <limits>
+#include <new>
+#include <vector>
 
 #include "deconvolutionalgorithm.h"
 #include "imageset.h"
+#include "maskspans.h"
+
+#include "../spinbarrier.h"
 
 //#define FORCE_NON_AVX 1
 
-namespace ao {
-	template<typename T> class lane;
-}
 
 class SimpleClean : public TypedDeconvolutionAlgorithm<deconvolution::SingleImageSet>
 {
@@ -45,6 +48,53 @@ class SimpleClean : public TypedDeconvolutionAlgorithm<deconvolution::SingleImag
 
 		static double FindPeak(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, const bool* cleanMask, double borderRatio);
 		
+		/**
+		 * Limits the rows [startY, endY) to the region that FindPeak() without a clean mask
+		 * searches with the given border ratio, and sets the columns [startX, endX) of it.
+		 */
+		static void GetPeakSearchRegion(size_t width, size_t height, double borderRatio, size_t& startX, size_t& endX, size_t& startY, size_t& endY);
+		
+		/**
+		 * Finds the first pixel, in row-major order, with the highest value in the region
+		 * [startX, endX) x [startY, endY). Non-finite values and, when a clean mask is given, pixels
+		 * outside the mask are skipped. With negative components, absolute values are compared.
+		 * Returns the index of the pixel and sets peakValue to its (absolute) value, or returns
+		 * width*height when no value is above zero.
+		 * SIMD instructions are used when available, with an AVX-512 version that is selected
+		 * at runtime.
+		 */
+		static size_t FindPeakInRegion(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, double& peakValue);
+		
+		/**
+		 * Implementations of FindPeakInRegion(). By default, the fastest one that is compiled
+		 * in and that the processor supports is used.
+		 */
+		enum PeakSearchTarget { ScalarPeakSearch, AVXPeakSearch, AVX512PeakSearch };
+		
+		static bool HasPeakSearchTarget(PeakSearchTarget target);
+		
+		/**
+		 * Like FindPeakInRegion(), but with the given implementation, which should be
+		 * available according to HasPeakSearchTarget().
+		 */
+		static size_t FindPeakInRegion(const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents, double& peakValue, PeakSearchTarget target);
+		
+		/**
+		 * Like FindPeakInRegion(), but searches only the pixels of the mask spans on the rows
+		 * [startY, endY).
+		 */
+		static size_t FindPeakInSpans(const double* image, const MaskSpans& maskSpans, size_t startY, size_t endY, bool allowNegativeComponents, double& peakValue);
+		
+		/**
+		 * Converts the clean mask to spans of the area that is searched by FindPeak() with a mask.
+		 */
+		static MaskSpans MakeMaskSpans(const bool* cleanMask, size_t width, size_t height, double borderRatio);
+		
+		/**
+		 * Same as FindPeak() with a mask, for a mask converted with MakeMaskSpans().
+		 */
+		static double FindPeak(const double *image, size_t width, size_t height, size_t &x, size_t &y, bool allowNegativeComponents, size_t startY, size_t endY, const MaskSpans& maskSpans);
+		
 		static void SubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor);
 		
 		static void PartialSubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY);
@@ -67,12 +117,8 @@ class SimpleClean : public TypedDeconvolutionAlgorithm<deconvolution::SingleImag
 		
 		void ExecuteMajorIteration(double* dataImage, double* modelImage, const double* psfImage, size_t width, size_t height, bool& reachedStopGain);
 	private:
-		struct CleanTask
-		{
-			size_t cleanCompX, cleanCompY;
-			double peakLevel;
-		};
-		struct CleanResult
+		// Aligned, so that the results of different threads are on different cache lines
+		struct alignas(64) CleanResult
 		{
 			CleanResult() : nextPeakX(0), nextPeakY(0), peakLevel(0.0)
 			{ }
@@ -81,13 +127,38 @@ class SimpleClean : public TypedDeconvolutionAlgorithm<deconvolution::SingleImag
 		};
 		struct CleanThreadData
 		{
+			size_t threadIndex;
 			size_t startY, endY;
 			double *dataImage;
 			size_t imgWidth, imgHeight;
 			const double *psfImage;
 			size_t psfWidth, psfHeight;
 		};
-		void cleanThreadFunc(ao::lane<CleanTask>* taskLane, ao::lane<CleanResult>* resultLane, CleanThreadData cleanData);
+		struct SharedCleanData
+		{
+			// The standard allocators do not have to respect the alignment of CleanResult,
+			// so the results are allocated with posix_memalign()
+			SharedCleanData(size_t threadCount) : barrier(threadCount), results(0)
+			{
+				void* memory;
+				if(posix_memalign(&memory, alignof(CleanResult), threadCount * 2 * sizeof(CleanResult)) != 0)
+					throw std::bad_alloc();
+				results = reinterpret_cast<CleanResult*>(memory);
+				for(size_t i=0; i!=threadCount * 2; ++i)
+					new (&results[i]) CleanResult();
+			}
+			~SharedCleanData() { free(results); }
+			double* modelImage;
+			double firstThreshold;
+			size_t componentX, componentY, iterationNumber;
+			double peak;
+			SpinBarrier barrier;
+			CleanResult* results;
+		private:
+			SharedCleanData(const SharedCleanData&) = delete;
+			SharedCleanData& operator=(const SharedCleanData&) = delete;
+		};
+		void cleanThreadFunc(CleanThreadData cleanData, SharedCleanData* shared);
 };
 
 #endif
@@ -2,12 +2,15 @@
 
 #include "uvector.h"
 
-#include <fftw3.h>
+#include <boost/thread/thread.hpp>
 
 #include <complex>
 #include <stdexcept>
 
 boost::mutex FFTConvolver::_mutex;
+std::map<std::pair<size_t, size_t>, std::shared_ptr<FFTConvolver::Plans>> FFTConvolver::_plans;
+size_t FFTConvolver::_planUseCount = 0;
+const size_t FFTConvolver::_maxPlanCount = 8;
 
 void FFTConvolver::Convolve(double* image, size_t imgWidth, size_t imgHeight, const double* kernel, size_t kernelSize)
 {
@@ -112,38 +115,152 @@ void FFTConvolver::PrepareKernel(double* dest, const double* source, size_t imgW
 
 void FFTConvolver::ConvolveSameSize(double* image, const double* kernel, size_t imgWidth, size_t imgHeight)
 {
-	const size_t imgSize = imgWidth * imgHeight;
-	const size_t complexSize = (imgWidth/2+1) * imgHeight;
-	double* tempData = reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)));
-	fftw_complex* fftImageData = reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex)));
-	fftw_complex* fftKernelData = reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex)));
-	
-	boost::mutex::scoped_lock lock(_mutex);
-	fftw_plan inToFPlan = fftw_plan_dft_r2c_2d(imgHeight, imgWidth, tempData, fftImageData, FFTW_ESTIMATE);
-	fftw_plan fToOutPlan = fftw_plan_dft_c2r_2d(imgHeight, imgWidth, fftImageData, tempData, FFTW_ESTIMATE);
-	lock.unlock();
+	PreparedKernel preparedKernel;
+	preparedKernel.Prepare(kernel, imgWidth, imgHeight);
+	ConvolveSameSize(image, preparedKernel);
+}
+
+void FFTConvolver::ConvolveSameSize(double* image, const PreparedKernel& kernel)
+{
+	Scratch scratch;
+	convolve(image, kernel, scratch);
+}
+
+void FFTConvolver::ConvolveSameSize(const ao::uvector<double*>& images, const PreparedKernel& kernel, size_t threadCount)
+{
+	threadCount = std::min(threadCount, images.size());
+	if(threadCount <= 1)
+	{
+		Scratch scratch;
+		for(double* image : images)
+			convolve(image, kernel, scratch);
+	}
+	else {
+		// The buffers are owned by this call, so they are released when it returns
+		std::unique_ptr<Scratch[]> scratches(new Scratch[threadCount]);
+		boost::thread_group threads;
+		for(size_t i=0; i!=threadCount; ++i)
+			threads.add_thread(new boost::thread(&FFTConvolver::convolveThread, &images, &kernel, &scratches[i], i, threadCount));
+		threads.join_all();
+	}
+}
+
+void FFTConvolver::convolveThread(const ao::uvector<double*>* images, const PreparedKernel* kernel, Scratch* scratch, size_t threadIndex, size_t threadCount)
+{
+	for(size_t i=threadIndex; i<images->size(); i+=threadCount)
+		convolve((*images)[i], *kernel, *scratch);
+}
+
+void FFTConvolver::convolve(double* image, const PreparedKernel& kernel, Scratch& scratch)
+{
+	const size_t imgSize = kernel._width * kernel._height;
+	const size_t complexSize = (kernel._width/2+1) * kernel._height;
+	std::shared_ptr<const Plans> plans = getPlans(kernel._width, kernel._height);
+	scratch.Reserve(kernel._width, kernel._height);
+	forwardTransform(image, kernel._width, kernel._height, *plans, scratch);
 	
-	memcpy(tempData, image, imgSize * sizeof(double));
-	fftw_execute_dft_r2c(inToFPlan, tempData, fftImageData);
+	std::complex<double>* fftImageData = reinterpret_cast<std::complex<double>*>(scratch.Complex());
+	for(size_t i=0; i!=complexSize; ++i)
+		fftImageData[i] *= kernel._data[i];
 	
-	memcpy(tempData, kernel, imgSize * sizeof(double));
-	fftw_execute_dft_r2c(inToFPlan, tempData, fftKernelData);
+	fftw_execute_dft_c2r(plans->backward, scratch.Complex(), scratch.Real());
+	memcpy(image, scratch.Real(), imgSize * sizeof(double));
+}
+
+void FFTConvolver::PreparedKernel::Prepare(const double* kernel, size_t width, size_t height)
+{
+	_width = width;
+	_height = height;
+	const size_t complexSize = (width/2+1) * height;
+	std::shared_ptr<const Plans> plans = getPlans(width, height);
+	Scratch scratch;
+	scratch.Reserve(width, height);
+	forwardTransform(kernel, width, height, *plans, scratch);
 	
-	double fact = 1.0/imgSize;
+	const double fact = 1.0/(width * height);
+	const std::complex<double>* fftKernelData = reinterpret_cast<const std::complex<double>*>(scratch.Complex());
+	_data.resize(complexSize);
 	for(size_t i=0; i!=complexSize; ++i)
-		reinterpret_cast<std::complex<double>*>(fftImageData)[i] *= fact * reinterpret_cast<std::complex<double>*>(fftKernelData)[i];
-		
-	fftw_execute_dft_c2r(fToOutPlan, reinterpret_cast<fftw_complex*>(fftImageData), tempData);
-	memcpy(image, tempData, imgSize * sizeof(double));
-		
-	fftw_free(fftImageData);
-	fftw_free(fftKernelData);
-	fftw_free(tempData);
-	
-	lock.lock();
-	fftw_destroy_plan(inToFPlan);
-	fftw_destroy_plan(fToOutPlan);
-	lock.unlock();
+		_data[i] = fftKernelData[i] * fact;
+}
+
+void FFTConvolver::forwardTransform(const double* image, size_t width, size_t height, const Plans& plans, Scratch& scratch)
+{
+	// The transform is done on the scratch buffers, because they have the alignment that
+	// the plans were made for
+	memcpy(scratch.Real(), image, width * height * sizeof(double));
+	fftw_execute_dft_r2c(plans.forward, scratch.Real(), scratch.Complex());
+}
+
+std::shared_ptr<const FFTConvolver::Plans> FFTConvolver::getPlans(size_t width, size_t height)
+{
+	// Declared before the lock, so that evicted plans are destroyed after the lock is
+	// released: their destructor takes the lock itself.
+	std::shared_ptr<Plans> evictedPlans;
+	boost::mutex::scoped_lock lock(_mutex);
+	++_planUseCount;
+	std::map<std::pair<size_t, size_t>, std::shared_ptr<Plans>>::iterator iter = _plans.find(std::make_pair(width, height));
+	if(iter == _plans.end())
+	{
+		if(_plans.size() >= _maxPlanCount)
+		{
+			std::map<std::pair<size_t, size_t>, std::shared_ptr<Plans>>::iterator oldest = _plans.begin();
+			for(std::map<std::pair<size_t, size_t>, std::shared_ptr<Plans>>::iterator i=_plans.begin(); i!=_plans.end(); ++i)
+			{
+				if(i->second->lastUse < oldest->second->lastUse)
+					oldest = i;
+			}
+			evictedPlans = oldest->second;
+			_plans.erase(oldest);
+		}
+		std::shared_ptr<Plans> plans(new Plans(width, height));
+		iter = _plans.insert(std::make_pair(std::make_pair(width, height), plans)).first;
+	}
+	iter->second->lastUse = _planUseCount;
+	return iter->second;
+}
+
+/**
+ * Should be called with _mutex locked.
+ */
+FFTConvolver::Plans::Plans(size_t width, size_t height) : lastUse(0)
+{
+	// FFTW_ESTIMATE does not touch the arrays, so temporary ones can be used
+	Scratch planScratch;
+	planScratch.Reserve(width, height);
+	forward = fftw_plan_dft_r2c_2d(height, width, planScratch.Real(), planScratch.Complex(), FFTW_ESTIMATE);
+	backward = fftw_plan_dft_c2r_2d(height, width, planScratch.Complex(), planScratch.Real(), FFTW_ESTIMATE);
+}
+
+FFTConvolver::Plans::~Plans()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	fftw_destroy_plan(forward);
+	fftw_destroy_plan(backward);
+}
+
+FFTConvolver::Scratch::~Scratch()
+{
+	fftw_free(_real);
+	fftw_free(_complex);
+}
+
+void FFTConvolver::Scratch::Reserve(size_t width, size_t height)
+{
+	const size_t realSize = width * height;
+	const size_t complexSize = (width/2+1) * height;
+	if(realSize > _realSize)
+	{
+		fftw_free(_real);
+		_real = reinterpret_cast<double*>(fftw_malloc(realSize * sizeof(double)));
+		_realSize = realSize;
+	}
+	if(complexSize > _complexSize)
+	{
+		fftw_free(_complex);
+		_complex = reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex)));
+		_complexSize = complexSize;
+	}
 }
 
 void FFTConvolver::Reverse(double* image, size_t imgWidth, size_t imgHeight)
@@ -1,13 +1,51 @@
 #ifndef FFT_CONVOLVER_H
 #define FFT_CONVOLVER_H
 
+#include "uvector.h"
+
+#include <complex>
 #include <cstring>
+#include <map>
+#include <memory>
+
+#include <fftw3.h>
 
-#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
+/**
+ * FFT convolution of images. The FFTW plans are made once per image size and shared by all
+ * threads, so that convolutions in different threads run in parallel. Only the plans of the
+ * most recently used image sizes are kept. The FFT buffers are allocated per call and are
+ * freed when it returns, so that no memory is held outside of the image buffers.
+ */
 class FFTConvolver {
 	
 public:
+	/**
+	 * A kernel in Fourier space. Convolving several images with the same prepared kernel saves
+	 * one FFT per convolution.
+	 */
+	class PreparedKernel
+	{
+	public:
+		PreparedKernel() : _width(0), _height(0) { }
+		
+		/**
+		 * Transforms a kernel that is laid out for convolution, i.e., that was made with
+		 * PrepareKernel() or PrepareSmallKernel().
+		 */
+		void Prepare(const double* kernel, size_t width, size_t height);
+		
+		size_t Width() const { return _width; }
+		size_t Height() const { return _height; }
+	private:
+		friend class FFTConvolver;
+		
+		// Includes the normalization of the inverse FFT
+		ao::uvector<std::complex<double>> _data;
+		size_t _width, _height;
+	};
+	
 	/**
 	 * Convolve an image with a smaller kernel. No preparation of either image is needed.
 	 * 
@@ -37,9 +75,72 @@ public:
 	static void PrepareKernel(double* dest, const double* source, size_t imgWidth, size_t imgHeight);
 	static void ConvolveSameSize(double* image, const double* kernel, size_t imgWidth, size_t imgHeight);
 	
+	/**
+	 * Convolve an image of the size of the kernel with a kernel that was prepared with
+	 * PreparedKernel::Prepare().
+	 */
+	static void ConvolveSameSize(double* image, const PreparedKernel& kernel);
+	
+	/**
+	 * Convolve several images with the same kernel, using up to threadCount threads.
+	 * Every thread uses one set of FFT buffers for all of its images.
+	 */
+	static void ConvolveSameSize(const ao::uvector<double*>& images, const PreparedKernel& kernel, size_t threadCount);
+	
 	static void Reverse(double* image, size_t imgWidth, size_t imgHeight);
+	
+	/**
+	 * The lock that FFTConvolver holds while making or destroying FFTW plans. Other classes
+	 * that make plans which can be made concurrently with convolutions should hold it too,
+	 * because the FFTW planner is not thread safe.
+	 */
+	static boost::mutex& PlannerMutex() { return _mutex; }
 private:
+	struct Plans
+	{
+		Plans(size_t width, size_t height);
+		~Plans();
+		fftw_plan forward, backward;
+		// Value of _planUseCount when the plans were last requested
+		size_t lastUse;
+	private:
+		Plans(const Plans&) = delete;
+		Plans& operator=(const Plans&) = delete;
+	};
+	
+	/**
+	 * FFT buffers of one convolution or of one thread. These grow to the largest size that
+	 * they have been used for.
+	 */
+	class Scratch
+	{
+	public:
+		Scratch() : _real(0), _complex(0), _realSize(0), _complexSize(0) { }
+		~Scratch();
+		void Reserve(size_t width, size_t height);
+		double* Real() { return _real; }
+		fftw_complex* Complex() { return _complex; }
+	private:
+		Scratch(const Scratch&) = delete;
+		Scratch& operator=(const Scratch&) = delete;
+		double* _real;
+		fftw_complex* _complex;
+		size_t _realSize, _complexSize;
+	};
+	
+	static std::shared_ptr<const Plans> getPlans(size_t width, size_t height);
+	static void forwardTransform(const double* image, size_t width, size_t height, const Plans& plans, Scratch& scratch);
+	static void convolve(double* image, const PreparedKernel& kernel, Scratch& scratch);
+	static void convolveThread(const ao::uvector<double*>* images, const PreparedKernel* kernel, Scratch* scratch, size_t threadIndex, size_t threadCount);
+	
+	// Protects _plans and _planUseCount, and is held while plans are made or destroyed,
+	// because FFTW planning is not thread safe. Plans that are evicted from _plans are
+	// destroyed when the last convolution that uses them has finished.
 	static boost::mutex _mutex;
+	static std::map<std::pair<size_t, size_t>, std::shared_ptr<Plans>> _plans;
+	static size_t _planUseCount;
+	// Maximum number of image sizes of which the plans are kept
+	static const size_t _maxPlanCount;
 };
 
 #endif
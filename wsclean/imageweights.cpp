@@ -5,9 +5,18 @@
 #include "msproviders/msprovider.h"
 #include "fitswriter.h"
 
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <cstring>
+#include <limits>
+
+#include <unistd.h>
+
+const size_t ImageWeights::_stripeCount = 64;
 
 ImageWeights::ImageWeights(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double superWeight) :
 	_weightMode(weightMode),
@@ -16,13 +25,27 @@ ImageWeights::ImageWeights(const WeightMode& weightMode, size_t imageWidth, size
 	_pixelScaleX(pixelScaleX),
 	_pixelScaleY(pixelScaleY),
 	_totalSum(0.0),
-	_isGriddingFinished(false)
+	_isGriddingFinished(false),
+	_threadCount(sysconf(_SC_NPROCESSORS_ONLN))
 {
 	if(_imageWidth%2 != 0) ++_imageWidth;
 	if(_imageHeight%2 != 0) ++_imageHeight;
 	_grid.assign(_imageWidth*_imageHeight/2, 0.0);
 }
 
+template<typename Function>
+void ImageWeights::runParallel(size_t count, size_t threadCount, Function function)
+{
+	threadCount = std::max<size_t>(1, std::min(threadCount, count));
+	boost::thread_group threads;
+	for(size_t i=0; i!=threadCount; ++i)
+	{
+		const size_t start = (count*i)/threadCount, end = (count*(i+1))/threadCount;
+		threads.add_thread(new boost::thread([=]() { function(start, end); }));
+	}
+	threads.join_all();
+}
+
 void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selection)
 {
 	if(_isGriddingFinished)
@@ -49,7 +72,6 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 		
 	const size_t polarizationCount = shape[0];
 	
-	casacore::Array<casacore::Complex> dataArr(shape);
 	casacore::Array<bool> flagArr(shape);
 	casacore::Array<float> weightArr(shape);
 	size_t timestep = 0;
@@ -58,6 +80,12 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 	if(!hasWeights)
 		weightArr.set(1.0);
 	
+	GridBlock blocks[2];
+	for(size_t i=0; i!=2; ++i)
+		blocks[i].Initialize(bandData.MaxChannels(), polarizationCount);
+	size_t currentBlock = 0;
+	GridThread gridThread;
+	
 	for(size_t row=0; row!=ms.nrow(); ++row)
 	{
 		const int a1 = antenna1Column(row), a2 = antenna2Column(row), fieldId = fieldIdColumn(row);
@@ -74,16 +102,6 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 				weightColumn.get(row, weightArr);
 			const BandData& curBand = bandData[dataDescIdColumn(row)];
 			
-			bool* flagIter = flagArr.cbegin();
-			float* weightIter = weightArr.cbegin();
-			
-			double uInM = uvw(0), vInM = uvw(1);
-			if(vInM < 0.0)
-			{
-				uInM = -uInM;
-				vInM = -vInM;
-			}
-			
 			size_t startChannel, endChannel;
 			if(selection.HasChannelRange())
 			{
@@ -94,38 +112,26 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 				startChannel = 0;
 				endChannel = curBand.ChannelCount();
 			}
-	
-			for(size_t ch=startChannel; ch!=endChannel; ++ch)
+			
+			// Flagged samples are stored with zero weight, which leaves the grid unchanged
+			GridBlock& block = blocks[currentBlock];
+			float* rowWeights = block.AddRow(uvw(0), uvw(1), curBand, startChannel, endChannel);
+			const bool* flagIter = flagArr.cbegin() + startChannel*polarizationCount;
+			const float* weightIter = weightArr.cbegin() + startChannel*polarizationCount;
+			for(size_t i=0; i!=(endChannel-startChannel)*polarizationCount; ++i)
 			{
-				double
-					u = uInM / curBand.ChannelWavelength(ch),
-					v = vInM / curBand.ChannelWavelength(ch);
-				int x, y;
-				uvToXY(u, v, x, y);
-				if(isWithinLimits(x, y))
-				{
-					for(size_t p=0; p!=polarizationCount; ++p)
-					{
-						if(!*flagIter)
-						{
-							size_t index = (size_t) x + (size_t) y*_imageWidth;
-							_grid[index] += *weightIter;
-							_totalSum += *weightIter;
-						}
-						++flagIter;
-						++weightIter;
-					}
-				}
-				else {
-					for(size_t p=0; p!=polarizationCount; ++p)
-					{
-						++flagIter;
-						++weightIter;
-					}
-				}
+				rowWeights[i] = *flagIter ? 0.0 : *weightIter;
+				++flagIter;
+				++weightIter;
 			}
+			
+			if(block.IsFull())
+				startGridding(block, gridThread, currentBlock);
 		}
 	}
+	if(blocks[currentBlock].rowCount != 0)
+		startGridding(blocks[currentBlock], gridThread, currentBlock);
+	gridThread.Join();
 }
 
 void ImageWeights::Grid(MSProvider& msProvider, const MSSelection& selection)
@@ -140,7 +146,12 @@ void ImageWeights::Grid(MSProvider& msProvider, const MSSelection& selection)
 			selectedBand = MultiBandData(bandData, selection.ChannelRangeStart(), selection.ChannelRangeEnd());
 		else
 			selectedBand = bandData;
-		std::vector<float> weightBuffer(selectedBand.MaxChannels());
+		
+		GridBlock blocks[2];
+		for(size_t i=0; i!=2; ++i)
+			blocks[i].Initialize(selectedBand.MaxChannels(), 1);
+		size_t currentBlock = 0;
+		GridThread gridThread;
 		
 		msProvider.Reset();
 		while(msProvider.CurrentRowAvailable())
@@ -148,27 +159,100 @@ void ImageWeights::Grid(MSProvider& msProvider, const MSSelection& selection)
 			double uInM, vInM, wInM;
 			size_t dataDescId;
 			msProvider.ReadMeta(uInM, vInM, wInM, dataDescId);
-			msProvider.ReadWeights(weightBuffer.data());
 			const BandData& curBand = selectedBand[dataDescId];
-			if(vInM < 0.0)
+			GridBlock& block = blocks[currentBlock];
+			msProvider.ReadWeights(block.AddRow(uInM, vInM, curBand, 0, curBand.ChannelCount()));
+			if(block.IsFull())
+				startGridding(block, gridThread, currentBlock);
+			
+			msProvider.NextRow();
+		}
+		if(blocks[currentBlock].rowCount != 0)
+			startGridding(blocks[currentBlock], gridThread, currentBlock);
+		gridThread.Join();
+	}
+}
+
+void ImageWeights::startGridding(GridBlock& block, GridThread& gridThread, size_t& currentBlock)
+{
+	// Gridding a block overlaps with reading the next one
+	gridThread.Join();
+	gridThread.thread.reset(new boost::thread([this, &block]() {
+		gridBlock(block);
+		block.rowCount = 0;
+	}));
+	currentBlock = 1 - currentBlock;
+}
+
+void ImageWeights::gridBlock(GridBlock& block)
+{
+	const size_t halfHeight = _imageHeight/2;
+	if(_stripeSums.empty())
+		_stripeSums.assign(std::min(_stripeCount, halfHeight), 0.0);
+	const size_t stripeCount = _stripeSums.size();
+	
+	// The grid is divided in a fixed number of stripes of uv rows, each owned by one thread
+	const size_t threadCount = std::min(_threadCount, stripeCount);
+	
+	// Calculate the uv cell of every sample, and collect the samples of every range of
+	// rows per thread that owns their stripe
+	const size_t rangeCount = std::max<size_t>(1, std::min(_threadCount, block.rowCount));
+	block.samplesPerThread.resize(rangeCount * threadCount);
+	runParallel(rangeCount, rangeCount, [&](size_t startRange, size_t endRange)
+	{
+		for(size_t range=startRange; range!=endRange; ++range)
+		{
+			ao::uvector<size_t>* samples = &block.samplesPerThread[range * threadCount];
+			for(size_t thread=0; thread!=threadCount; ++thread)
+				samples[thread].clear();
+			const size_t
+				startRow = (block.rowCount*range)/rangeCount,
+				endRow = (block.rowCount*(range+1))/rangeCount;
+			for(size_t row=startRow; row!=endRow; ++row)
 			{
-				uInM = -uInM;
-				vInM = -vInM;
+				const BandData& band = *block.bands[row];
+				for(size_t ch=0; ch!=block.channelCounts[row]; ++ch)
+				{
+					const double wavelength = band.ChannelWavelength(block.startChannels[row] + ch);
+					int x, y;
+					uvToXY(block.u[row] / wavelength, block.v[row] / wavelength, x, y);
+					if(isWithinLimits(x, y))
+					{
+						const size_t sample = row * block.maxChannels + ch;
+						block.cells[sample] = (size_t) x + (size_t) y*_imageWidth;
+						const size_t stripe = size_t(y) * stripeCount / halfHeight;
+						samples[stripe % threadCount].push_back(sample);
+					}
+				}
 			}
-			
-			const float* weightIter = weightBuffer.data();
-			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+		}
+	});
+	
+	// Add the samples to the grid. Each thread adds the samples of the stripes it owns and
+	// goes through the ranges in order, so it adds them in the order of the data. Every cell
+	// and stripe sum therefore receives its samples in the same order, independent of the
+	// number of threads, which makes the result reproducible.
+	runParallel(threadCount, threadCount, [&](size_t startThread, size_t endThread)
+	{
+		for(size_t thread=startThread; thread!=endThread; ++thread)
+		{
+			for(size_t range=0; range!=rangeCount; ++range)
 			{
-				double
-					u = uInM / curBand.ChannelWavelength(ch),
-					v = vInM / curBand.ChannelWavelength(ch);
-				Grid(u, v, *weightIter);
-				++weightIter;
+				const ao::uvector<size_t>& samples = block.samplesPerThread[range * threadCount + thread];
+				for(ao::uvector<size_t>::const_iterator sample=samples.begin(); sample!=samples.end(); ++sample)
+				{
+					const size_t cell = block.cells[*sample];
+					const size_t stripe = (cell / _imageWidth) * stripeCount / halfHeight;
+					const float* weightIter = &block.weights[*sample * block.polarizationCount];
+					for(size_t p=0; p!=block.polarizationCount; ++p)
+					{
+						_grid[cell] += weightIter[p];
+						_stripeSums[stripe] += weightIter[p];
+					}
+				}
 			}
-			
-			msProvider.NextRow();
 		}
-	}
+	});
 }
 
 void ImageWeights::FinishGridding()
@@ -176,6 +260,9 @@ void ImageWeights::FinishGridding()
 	if(_isGriddingFinished)
 		throw std::runtime_error("FinishGridding() called twice");
 	_isGriddingFinished = true;
+	for(ao::uvector<double>::const_iterator i=_stripeSums.begin(); i!=_stripeSums.end(); ++i)
+		_totalSum += *i;
+	_stripeSums.clear();
 	
 	switch(_weightMode.Mode())
 	{
@@ -292,62 +379,121 @@ void ImageWeights::Save(const string& filename) const
 	writer.Write(filename, image.data());
 }
 
+void ImageWeights::Serialize(std::ostream& stream) const
+{
+	const uint64_t width = _imageWidth, height = _imageHeight;
+	const uint8_t isGriddingFinished = _isGriddingFinished ? 1 : 0;
+	stream.write(reinterpret_cast<const char*>(&width), sizeof(width));
+	stream.write(reinterpret_cast<const char*>(&height), sizeof(height));
+	stream.write(reinterpret_cast<const char*>(&_totalSum), sizeof(_totalSum));
+	stream.write(reinterpret_cast<const char*>(&isGriddingFinished), sizeof(isGriddingFinished));
+	stream.write(reinterpret_cast<const char*>(_grid.data()), _grid.size() * sizeof(double));
+}
+
+void ImageWeights::Unserialize(std::istream& stream)
+{
+	uint64_t width, height;
+	uint8_t isGriddingFinished;
+	stream.read(reinterpret_cast<char*>(&width), sizeof(width));
+	stream.read(reinterpret_cast<char*>(&height), sizeof(height));
+	if(!stream.good() || width != _imageWidth || height != _imageHeight)
+		throw std::runtime_error("Stored weights do not have the dimensions of the image weights");
+	stream.read(reinterpret_cast<char*>(&_totalSum), sizeof(_totalSum));
+	stream.read(reinterpret_cast<char*>(&isGriddingFinished), sizeof(isGriddingFinished));
+	stream.read(reinterpret_cast<char*>(_grid.data()), _grid.size() * sizeof(double));
+	if(!stream.good())
+		throw std::runtime_error("Error reading stored weights");
+	_isGriddingFinished = isGriddingFinished != 0;
+}
+
 void ImageWeights::RankFilter(double rankLimit, size_t windowSize)
 {
-	ao::uvector<double> newGrid(_grid);
-	for(size_t y=0; y!=_imageHeight/2; ++y)
+	const size_t width = _imageWidth, height = _imageHeight/2, tableWidth = width+1;
+	// Summed-area tables of the weights and of the number of non-zero cells. The first row
+	// and column are zero, so that element (x, y) holds the total over [0, x) x [0, y).
+	// The totals are accumulated with Kahan summation, so that every stored total is the
+	// exact total rounded once. A window sum is still the difference of large totals, so it
+	// can differ in the last bits from summing the window directly. The counts are exact.
+	if(tableWidth*(height+1) > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("Grid is too large for the rank filter");
+	ao::uvector<double> sumTable(tableWidth*(height+1));
+	ao::uvector<uint32_t> countTable(tableWidth*(height+1));
+	std::fill_n(sumTable.begin(), tableWidth, 0.0);
+	std::fill_n(countTable.begin(), tableWidth, 0);
+	
+	runParallel(height, _threadCount, [&](size_t startY, size_t endY)
 	{
-		for(size_t x=0; x!=_imageWidth; ++x)
+		for(size_t y=startY; y!=endY; ++y)
 		{
-			double w = _grid[y*_imageWidth + x];
-			if(w != 0.0)
+			const double* gridRow = &_grid[y*width];
+			double* sumRow = &sumTable[(y+1)*tableWidth];
+			uint32_t* countRow = &countTable[(y+1)*tableWidth];
+			double sum = 0.0, compensation = 0.0;
+			uint32_t count = 0;
+			sumRow[0] = 0.0;
+			countRow[0] = 0;
+			for(size_t x=0; x!=width; ++x)
 			{
-				double mean = windowMean(x, y, windowSize);
-				if(w > mean*rankLimit)
-					newGrid[y*_imageWidth + x] = mean*rankLimit;
+				const double term = gridRow[x] - compensation, newSum = sum + term;
+				compensation = (newSum - sum) - term;
+				sum = newSum;
+				sumRow[x+1] = sum;
+				if(gridRow[x] != 0.0)
+					++count;
+				countRow[x+1] = count;
 			}
 		}
-	}
-	_grid = newGrid;
-}
-
-double ImageWeights::windowMean(size_t x, size_t y, size_t windowSize)
-{
-	size_t d = windowSize/2;
-	size_t x1, y1, x2, y2;
-	if(x <= d)
-		x1 = 0;
-	else
-		x1 = x - d;
-	
-	if(y <= d)
-		y1 = 0;
-	else
-		y1 = y - d;
-	
-	if(x+d >= _imageWidth)
-		x2 = _imageWidth;
-	else
-		x2 = x + d;
-	
-	if(y+d >= _imageHeight/2)
-		y2 = _imageHeight/2;
-	else
-		y2 = y + d;
+	});
+	// Accumulate over the rows, with a compensation per column. Each thread processes a
+	// block of columns row by row, to keep the memory access sequential.
+	runParallel(tableWidth, _threadCount, [&](size_t startX, size_t endX)
+	{
+		ao::uvector<double> compensation(endX - startX, 0.0);
+		for(size_t y=1; y!=height+1; ++y)
+		{
+			const size_t rowIndex = y*tableWidth, prevRowIndex = (y-1)*tableWidth;
+			for(size_t x=startX; x!=endX; ++x)
+			{
+				double& c = compensation[x - startX];
+				const double
+					sum = sumTable[prevRowIndex + x],
+					term = sumTable[rowIndex + x] - c,
+					newSum = sum + term;
+				c = (newSum - sum) - term;
+				sumTable[rowIndex + x] = newSum;
+				countTable[rowIndex + x] += countTable[prevRowIndex + x];
+			}
+		}
+	});
 	
-	size_t windowCount = 0;
-	double windowSum = 0.0;
-	for(size_t yi=y1; yi<y2; ++yi)
+	const size_t d = windowSize/2;
+	ao::uvector<double> newGrid(_grid);
+	runParallel(height, _threadCount, [&](size_t startY, size_t endY)
 	{
-		for(size_t xi=x1; xi<x2; ++xi)
+		for(size_t y=startY; y!=endY; ++y)
 		{
-			double w = _grid[yi*_imageWidth + xi];
-			if(w != 0.0)
+			const size_t
+				y1 = (y <= d) ? 0 : y - d,
+				y2 = std::min(y + d, height);
+			for(size_t x=0; x!=width; ++x)
 			{
-				++windowCount;
-				windowSum += w;
+				double w = _grid[y*width + x];
+				if(w != 0.0)
+				{
+					const size_t
+						x1 = (x <= d) ? 0 : x - d,
+						x2 = std::min(x + d, width);
+					const size_t
+						i11 = y1*tableWidth + x1, i12 = y1*tableWidth + x2,
+						i21 = y2*tableWidth + x1, i22 = y2*tableWidth + x2;
+					const double windowSum = (sumTable[i22] - sumTable[i12]) - (sumTable[i21] - sumTable[i11]);
+					const uint32_t windowCount = countTable[i22] - countTable[i12] - countTable[i21] + countTable[i11];
+					double mean = windowSum / double(windowCount);
+					if(w > mean*rankLimit)
+						newGrid[y*width + x] = mean*rankLimit;
+				}
 			}
 		}
-	}
-	return windowSum / double(windowCount);
+	});
+	_grid = std::move(newGrid);
 }
@@ -1,12 +1,20 @@
 #ifndef IMAGE_WEIGHTS_H
 #define IMAGE_WEIGHTS_H
 
+#include <algorithm>
 #include <cstddef>
 #include <complex>
+#include <iosfwd>
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 #include "uvector.h"
+
+#include <boost/thread/thread.hpp>
+
+#include <limits>
+#include <memory>
+#include <vector>
 //#include "wsclean/inversionalgorithm.h"
 #include "weightmode.h"
 #include "msselection.h"
@@ -39,6 +47,19 @@ class ImageWeights
 		{
 			return sampleGridValue(u, v);
 		}
+		
+		/**
+		 * Looks up the weights of a uv position in meters for several channels at once.
+		 * This is equal to calling GetWeight(uInM / wavelengths[ch], vInM / wavelengths[ch])
+		 * for every channel. The cells are calculated with the same expression as while
+		 * gridding, so that samples on a cell boundary get the weight of the cell they were
+		 * gridded in.
+		 */
+		void GetWeights(double uInM, double vInM, const double* wavelengths, size_t channelCount, double* weights) const
+		{
+			for(size_t ch=0; ch!=channelCount; ++ch)
+				weights[ch] = sampleGridValue(uInM / wavelengths[ch], vInM / wavelengths[ch]);
+		}
 
 		void Grid(casacore::MeasurementSet& ms, const MSSelection& selection);
 		void Grid(class MSProvider& ms, const MSSelection& selection);
@@ -57,12 +78,32 @@ class ImageWeights
 		
 		void FinishGridding();
 		
+		/**
+		 * Number of threads used by Grid() for measurement sets and by RankFilter().
+		 * Defaults to the number of cpus. The gridded weights do not depend on it.
+		 */
+		void SetThreadCount(size_t threadCount) { _threadCount = std::max<size_t>(1, threadCount); }
+		
 		void SetMaxUVRange(double maxUVInLambda);
 		void SetMinUVRange(double minUVInLambda);
 		
 		void GetGrid(double* image) const;
 		void Save(const std::string& filename) const;
 		
+		/**
+		 * Writes the grid in binary form, so that it can be restored with Unserialize()
+		 * into an ImageWeights object with the same dimensions.
+		 */
+		void Serialize(std::ostream& stream) const;
+		void Unserialize(std::istream& stream);
+		
+		/**
+		 * Limits every non-zero cell to rankLimit times the mean of the non-zero cells in the
+		 * windowSize x windowSize box around it. The window means are calculated with
+		 * summed-area tables, so the cost does not depend on the window size. These are
+		 * accumulated with Kahan summation, but the means can still differ in the last bits
+		 * from summing every window directly.
+		 */
 		void RankFilter(double rankLimit, size_t windowSize);
 		
 		size_t Width() const { return _imageWidth; }
@@ -74,7 +115,8 @@ class ImageWeights
 			_imageHeight(0),
 			_pixelScaleX(0.0),
 			_pixelScaleY(0.0),
-			_totalSum(0.0)
+			_totalSum(0.0),
+			_threadCount(1)
 		{ }
 		void operator=(const ImageWeights&) { }
 		
@@ -105,7 +147,77 @@ class ImageWeights
 			}
 		}
 		
-		double windowMean(size_t x, size_t y, size_t windowSize);
+		/**
+		 * Calls function(start, end) for consecutive ranges of [0, count) on at most
+		 * threadCount threads.
+		 */
+		template<typename Function>
+		static void runParallel(size_t count, size_t threadCount, Function function);
+		
+		/**
+		 * Selected rows that are read from a measurement set and that are gridded together.
+		 * Every row holds the weights of its channels, with polarizationCount values per channel.
+		 */
+		struct GridBlock
+		{
+			void Initialize(size_t _maxChannels, size_t _polarizationCount)
+			{
+				maxChannels = std::max<size_t>(1, _maxChannels);
+				polarizationCount = _polarizationCount;
+				rowCount = 0;
+				capacity = std::max<size_t>(1, (size_t(1)<<20) / (maxChannels*polarizationCount));
+				u.resize(capacity);
+				v.resize(capacity);
+				bands.resize(capacity);
+				startChannels.resize(capacity);
+				channelCounts.resize(capacity);
+				cells.resize(capacity * maxChannels);
+				weights.resize(capacity * maxChannels * polarizationCount);
+			}
+			/**
+			 * Adds a row and returns the buffer for its weights.
+			 */
+			float* AddRow(double uInM, double vInM, const class BandData& band, size_t startChannel, size_t endChannel)
+			{
+				u[rowCount] = uInM;
+				v[rowCount] = vInM;
+				bands[rowCount] = &band;
+				startChannels[rowCount] = startChannel;
+				channelCounts[rowCount] = endChannel - startChannel;
+				float* rowWeights = &weights[rowCount * maxChannels * polarizationCount];
+				++rowCount;
+				return rowWeights;
+			}
+			bool IsFull() const { return rowCount == capacity; }
+			
+			size_t maxChannels, polarizationCount, rowCount, capacity;
+			ao::uvector<double> u, v;
+			std::vector<const class BandData*> bands;
+			ao::uvector<size_t> startChannels, channelCounts, cells;
+			ao::uvector<float> weights;
+			// Indices (row * maxChannels + channel) of the samples that fall on the grid, per
+			// range of rows and per gridding thread, indexed by range * threadCount + thread
+			std::vector<ao::uvector<size_t>> samplesPerThread;
+		};
+		/**
+		 * The thread that grids a block while the next block is read. It is joined when it
+		 * goes out of scope, also when reading throws, because it still uses the block.
+		 */
+		struct GridThread
+		{
+			~GridThread() { Join(); }
+			void Join()
+			{
+				if(thread)
+				{
+					thread->join();
+					thread.reset();
+				}
+			}
+			std::unique_ptr<boost::thread> thread;
+		};
+		void startGridding(GridBlock& block, GridThread& gridThread, size_t& currentBlock);
+		void gridBlock(GridBlock& block);
 		
 		template<typename T>
 		static T frequencyToWavelength(const T frequency)
@@ -123,6 +235,10 @@ class ImageWeights
 		ao::uvector<double> _grid;
 		double _totalSum;
 		bool _isGriddingFinished;
+		size_t _threadCount;
+		// Sums of the weights per stripe of uv rows that were added by gridBlock()
+		ao::uvector<double> _stripeSums;
+		static const size_t _stripeCount;
 };
 
 #endif
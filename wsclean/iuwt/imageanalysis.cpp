@@ -1,5 +1,7 @@
 #include "imageanalysis.h"
 
+#include "../threadpool.h"
+
 #include <stack>
 
 bool ImageAnalysis::IsHighestOnScale0(const IUWTDecomposition& iuwt, IUWTMask& markedMask, size_t& x, size_t& y, size_t endScale, double& highestScale0)
@@ -91,67 +93,67 @@ void ImageAnalysis::Floodfill(const IUWTDecomposition& iuwt, IUWTMask& mask, con
 	
 	areaSize = 0;
 	endScale = std::min<size_t>(endScale, iuwt.NScales());
+	// Each component on the stack is the (already marked) start of a horizontal span. The span
+	// is extended to the left and right, after which the rows above and below and the same row on
+	// the neighbouring scales are scanned for the starts of new spans.
 	std::stack<Component> todo;
 	todo.push(component);
 	mask[component.scale][component.x + component.y*width] = true;
 	while(!todo.empty())
 	{
 		Component c = todo.top();
-		++areaSize;
 		todo.pop();
-		size_t index = c.x + c.y*width;
-		if(c.x > minX)
+		const double* row = &iuwt[c.scale].Coefficients()[c.y*width];
+		bool* maskRow = &mask[c.scale][c.y*width];
+		const double threshold = thresholds[c.scale];
+		size_t x1 = c.x, x2 = c.x+1;
+		while(x1 > minX && exceedsThreshold(row[x1-1], threshold) && !maskRow[x1-1])
 		{
-			if(exceedsThreshold(iuwt[c.scale][index-1], thresholds[c.scale]) && !mask[c.scale][index-1])
-			{
-				mask[c.scale][index-1] = true;
-				todo.push(Component(c.x-1, c.y, c.scale));
-			}
+			--x1;
+			maskRow[x1] = true;
 		}
-		if(c.x < maxX-1)
+		while(x2 < maxX && exceedsThreshold(row[x2], threshold) && !maskRow[x2])
 		{
-			if(exceedsThreshold(iuwt[c.scale][index+1], thresholds[c.scale]) && !mask[c.scale][index+1])
-			{
-				mask[c.scale][index+1] = true;
-				todo.push(Component(c.x+1, c.y, c.scale));
-			}
+			maskRow[x2] = true;
+			++x2;
 		}
+		areaSize += x2 - x1;
+		
 		if(c.y > minY)
-		{
-			if(exceedsThreshold(iuwt[c.scale][index-width], thresholds[c.scale]) && !mask[c.scale][index-width])
-			{
-				mask[c.scale][index-width] = true;
-				todo.push(Component(c.x, c.y-1, c.scale));
-			}
-		}
+			pushSpanSeeds(iuwt, mask, thresholds, x1, x2, c.y-1, c.scale, todo);
 		if(c.y < maxY-1)
-		{
-			if(exceedsThreshold(iuwt[c.scale][index+width], thresholds[c.scale]) && !mask[c.scale][index+width])
-			{
-				mask[c.scale][index+width] = true;
-				todo.push(Component(c.x, c.y+1, c.scale));
-			}
-		}
+			pushSpanSeeds(iuwt, mask, thresholds, x1, x2, c.y+1, c.scale, todo);
 		if(c.scale > int(minScale))
-		{
-			if(exceedsThreshold(iuwt[c.scale-1][index], thresholds[c.scale-1]) && !mask[c.scale-1][index])
-			{
-				mask[c.scale-1][index] = true;
-				todo.push(Component(c.x, c.y, c.scale-1));
-			}
-		}
+			pushSpanSeeds(iuwt, mask, thresholds, x1, x2, c.y, c.scale-1, todo);
 		if(c.scale < int(endScale)-1)
+			pushSpanSeeds(iuwt, mask, thresholds, x1, x2, c.y, c.scale+1, todo);
+	}
+}
+
+void ImageAnalysis::pushSpanSeeds(const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t x1, size_t x2, size_t y, int scale, std::stack<Component>& todo)
+{
+	const size_t width = iuwt.Width();
+	const double* row = &iuwt[scale].Coefficients()[y*width];
+	bool* maskRow = &mask[scale][y*width];
+	const double threshold = thresholds[scale];
+	bool inSpan = false;
+	for(size_t x=x1; x!=x2; ++x)
+	{
+		if(exceedsThreshold(row[x], threshold) && !maskRow[x])
 		{
-			if(exceedsThreshold(iuwt[c.scale+1][index], thresholds[c.scale+1]) && !mask[c.scale+1][index])
+			if(!inSpan)
 			{
-				mask[c.scale+1][index] = true;
-				todo.push(Component(c.x, c.y, c.scale+1));
+				maskRow[x] = true;
+				todo.push(Component(x, y, scale));
+				inSpan = true;
 			}
 		}
+		else
+			inSpan = false;
 	}
 }
 
-void ImageAnalysis::SelectStructures(const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t minScale, size_t endScale, double cleanBorder, size_t& areaSize)
+void ImageAnalysis::SelectStructures(ThreadPool& threadPool, const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t minScale, size_t endScale, double cleanBorder, size_t& areaSize)
 {
 	const size_t width = iuwt.Width(), height = iuwt.Height();
 	const size_t
@@ -160,117 +162,106 @@ void ImageAnalysis::SelectStructures(const IUWTDecomposition& iuwt, IUWTMask& ma
 		minX = xBorder, maxX = width - xBorder,
 		minY = yBorder, maxY = height - yBorder;
 	
-	areaSize = 0;
-	
+	// Every pixel above the threshold inside the border is the seed of a fill, so all the
+	// fills together select exactly those pixels. Hence, the scales can be selected
+	// independently without filling.
+	ao::uvector<size_t> scaleAreaSizes(endScale, 0);
 	for(size_t scale=minScale; scale!=endScale; ++scale)
 	{
-		for(size_t y=minY; y!=maxY; ++y)
+		threadPool.queue([&, scale]()
 		{
-			for(size_t x=minX; x!=maxX; ++x)
+			const double* image = iuwt[scale].Coefficients().data();
+			bool* scaleMask = mask[scale].data();
+			const double threshold = thresholds[scale];
+			size_t count = 0;
+			for(size_t y=minY; y!=maxY; ++y)
 			{
-				size_t index = x + y*width;
-				if(exceedsThreshold(iuwt[scale][index], thresholds[scale]) && !mask[scale][index])
+				for(size_t x=minX; x!=maxX; ++x)
 				{
-					Component component(x, y, scale);
-					size_t subAreaSize = 0;
-					Floodfill(iuwt, mask, thresholds, minScale, endScale, component, cleanBorder, subAreaSize);
-					areaSize += subAreaSize;
+					size_t index = x + y*width;
+					if(exceedsThreshold(image[index], threshold) && !scaleMask[index])
+					{
+						scaleMask[index] = true;
+						++count;
+					}
 				}
 			}
-		}
+			scaleAreaSizes[scale] = count;
+		});
 	}
+	threadPool.wait_for_all_tasks();
+	
+	areaSize = 0;
+	for(size_t scale=minScale; scale!=endScale; ++scale)
+		areaSize += scaleAreaSizes[scale];
 }
 
 void ImageAnalysis::FloodFill2D(const double* image, bool* mask, double threshold, const ImageAnalysis::Component2D& component, size_t width, size_t height, size_t& areaSize)
 {
-	areaSize = 0;
-	std::stack<Component2D> todo;
-	todo.push(component);
-	mask[component.x + component.y*width] = true;
-	while(!todo.empty())
-	{
-		Component2D c = todo.top();
-		++areaSize;
-		todo.pop();
-		size_t index = c.x + c.y*width;
-		if(c.x > 0)
-		{
-			if(exceedsThreshold(image[index-1], threshold) && !mask[index-1])
-			{
-				mask[index-1] = true;
-				todo.push(Component2D(c.x-1, c.y));
-			}
-		}
-		if(c.x < width-1)
-		{
-			if(exceedsThreshold(image[index+1], threshold) && !mask[index+1])
-			{
-				mask[index+1] = true;
-				todo.push(Component2D(c.x+1, c.y));
-			}
-		}
-		if(c.y > 0)
-		{
-			if(exceedsThreshold(image[index-width], threshold) && !mask[index-width])
-			{
-				mask[index-width] = true;
-				todo.push(Component2D(c.x, c.y-1));
-			}
-		}
-		if(c.y < height-1)
-		{
-			if(exceedsThreshold(image[index+width], threshold) && !mask[index+width])
-			{
-				mask[index+width] = true;
-				todo.push(Component2D(c.x, c.y+1));
-			}
-		}
-	}
+	areaSize = floodFill2D<false>(image, mask, threshold, component, width, height, 0);
 }
 
 void ImageAnalysis::FloodFill2D(const double* image, bool* mask, double threshold, const ImageAnalysis::Component2D& component, size_t width, size_t height, std::vector<Component2D>& area)
 {
 	area.clear();
+	floodFill2D<true>(image, mask, threshold, component, width, height, &area);
+}
+
+template<bool AbsThreshold>
+size_t ImageAnalysis::floodFill2D(const double* image, bool* mask, double threshold, const ImageAnalysis::Component2D& component, size_t width, size_t height, std::vector<Component2D>* area)
+{
+	// Scanline fill, see Floodfill()
+	size_t areaSize = 0;
 	std::stack<Component2D> todo;
 	todo.push(component);
 	mask[component.x + component.y*width] = true;
 	while(!todo.empty())
 	{
 		Component2D c = todo.top();
-		area.push_back(c);
 		todo.pop();
-		size_t index = c.x + c.y*width;
-		if(c.x > 0)
+		const double* row = &image[c.y*width];
+		bool* maskRow = &mask[c.y*width];
+		size_t x1 = c.x, x2 = c.x+1;
+		while(x1 > 0 && exceeds<AbsThreshold>(row[x1-1], threshold) && !maskRow[x1-1])
 		{
-			if(exceedsThresholdAbs(image[index-1], threshold) && !mask[index-1])
-			{
-				mask[index-1] = true;
-				todo.push(Component2D(c.x-1, c.y));
-			}
+			--x1;
+			maskRow[x1] = true;
 		}
-		if(c.x < width-1)
+		while(x2 < width && exceeds<AbsThreshold>(row[x2], threshold) && !maskRow[x2])
 		{
-			if(exceedsThresholdAbs(image[index+1], threshold) && !mask[index+1])
-			{
-				mask[index+1] = true;
-				todo.push(Component2D(c.x+1, c.y));
-			}
+			maskRow[x2] = true;
+			++x2;
 		}
-		if(c.y > 0)
+		areaSize += x2 - x1;
+		if(area != 0)
 		{
-			if(exceedsThresholdAbs(image[index-width], threshold) && !mask[index-width])
-			{
-				mask[index-width] = true;
-				todo.push(Component2D(c.x, c.y-1));
-			}
+			for(size_t x=x1; x!=x2; ++x)
+				area->push_back(Component2D(x, c.y));
 		}
-		if(c.y < height-1)
+		
+		for(int dy=-1; dy<=1; dy+=2)
 		{
-			if(exceedsThresholdAbs(image[index+width], threshold) && !mask[index+width])
+			if((dy < 0 && c.y == 0) || (dy > 0 && c.y == height-1))
+				continue;
+			const size_t y = c.y + dy;
+			const double* neighbourRow = &image[y*width];
+			bool* neighbourMaskRow = &mask[y*width];
+			bool inSpan = false;
+			for(size_t x=x1; x!=x2; ++x)
 			{
-				mask[index+width] = true;
-				todo.push(Component2D(c.x, c.y+1));
+				if(exceeds<AbsThreshold>(neighbourRow[x], threshold) && !neighbourMaskRow[x])
+				{
+					if(!inSpan)
+					{
+						neighbourMaskRow[x] = true;
+						todo.push(Component2D(x, y));
+						inSpan = true;
+					}
+				}
+				else
+					inSpan = false;
 			}
 		}
 	}
+	return areaSize;
 }
@@ -3,6 +3,8 @@
 
 #include "iuwtdecomposition.h"
 
+#include <stack>
+
 class ImageAnalysis
 {
 public:
@@ -33,7 +35,11 @@ public:
 		size_t x, y;
 	};
 
-	static void SelectStructures(const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t minScale, size_t endScale, double cleanBorder, size_t& areaSize);
+	/**
+	 * Marks all pixels on scales [minScale, endScale) that exceed the threshold of their scale,
+	 * excluding the border. The scales are processed in parallel.
+	 */
+	static void SelectStructures(class ThreadPool& threadPool, const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t minScale, size_t endScale, double cleanBorder, size_t& areaSize);
 	
 	static bool IsHighestOnScale0(const IUWTDecomposition& iuwt, IUWTMask& markedMask, size_t& x, size_t& y, size_t endScale, double& highestScale0);
 	
@@ -48,6 +54,16 @@ public:
 	static void FloodFill2D(const double* image, bool* mask, double threshold, const Component2D& component, size_t width, size_t height, std::vector<Component2D>& area);
 	
 private:
+	static void pushSpanSeeds(const IUWTDecomposition& iuwt, IUWTMask& mask, const ao::uvector<double>& thresholds, size_t x1, size_t x2, size_t y, int scale, std::stack<Component>& todo);
+	
+	template<bool AbsThreshold>
+	static size_t floodFill2D(const double* image, bool* mask, double threshold, const Component2D& component, size_t width, size_t height, std::vector<Component2D>* area);
+	
+	template<bool AbsThreshold>
+	static bool exceeds(double val, double threshold)
+	{
+		return AbsThreshold ? exceedsThresholdAbs(val, threshold) : exceedsThreshold(val, threshold);
+	}
 	static bool exceedsThreshold(double val, double threshold)
 	{
 		if(threshold >= 0.0)
@@ -2,52 +2,192 @@
 
 #include "../threadpool.h"
 
+#include <immintrin.h>
+
+#include <cstddef>
+
+namespace
+{
+	// The B3-spline kernel of the IUWT
+	const size_t H_SIZE = 5;
+	const double h[H_SIZE] = { 1.0/16.0, 4.0/16.0, 6.0/16.0, 4.0/16.0, 1.0/16.0 };
+	
+	// Number of bytes of input rows that the vertical convolution tries to keep in cache
+	const size_t verticalBlockCacheSize = 256*1024;
+	
+	/**
+	 * Calculates dest[i] = sum_t src[i + offsets[t]] * weights[t] for i in [start, end), or
+	 * subtractFrom[i] minus this sum when Subtract is set. The terms are added in order.
+	 */
+	template<size_t TermCount, bool Subtract>
+	void weightedSumSimple(double* dest, const double* subtractFrom, const double* src, const ptrdiff_t* offsets, const double* weights, size_t start, size_t end)
+	{
+		for(size_t i=start; i<end; ++i)
+		{
+			double sum = src[i + offsets[0]] * weights[0];
+			for(size_t t=1; t!=TermCount; ++t)
+				sum += src[i + offsets[t]] * weights[t];
+			dest[i] = Subtract ? subtractFrom[i] - sum : sum;
+		}
+	}
+	
+#if defined __AVX__ && !defined FORCE_NON_AVX
+	template<size_t TermCount, bool Subtract>
+	void weightedSumAVX(double* dest, const double* subtractFrom, const double* src, const ptrdiff_t* offsets, const double* weights, size_t start, size_t end)
+	{
+		__m256d w[TermCount];
+		for(size_t t=0; t!=TermCount; ++t)
+			w[t] = _mm256_set1_pd(weights[t]);
+		size_t i = start;
+		for(; i+4 <= end; i+=4)
+		{
+			__m256d sum = _mm256_mul_pd(_mm256_loadu_pd(&src[i + offsets[0]]), w[0]);
+			for(size_t t=1; t!=TermCount; ++t)
+				sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&src[i + offsets[t]]), w[t]));
+			if(Subtract)
+				sum = _mm256_sub_pd(_mm256_loadu_pd(&subtractFrom[i]), sum);
+			_mm256_storeu_pd(&dest[i], sum);
+		}
+		weightedSumSimple<TermCount, Subtract>(dest, subtractFrom, src, offsets, weights, i, end);
+	}
+#endif
+	
+#if defined __GNUC__ && defined __x86_64__ && !defined FORCE_NON_AVX
+#define IUWT_AVX512_DISPATCH
+	/**
+	 * AVX-512 version, which is compiled for AVX-512 regardless of the compiler flags and is
+	 * only called after checking that the processor supports it.
+	 */
+	template<size_t TermCount, bool Subtract>
+	__attribute__((target("avx512f")))
+	void weightedSumAVX512(double* dest, const double* subtractFrom, const double* src, const ptrdiff_t* offsets, const double* weights, size_t start, size_t end)
+	{
+		__m512d w[TermCount];
+		for(size_t t=0; t!=TermCount; ++t)
+			w[t] = _mm512_set1_pd(weights[t]);
+		size_t i = start;
+		for(; i+8 <= end; i+=8)
+		{
+			__m512d sum = _mm512_mul_pd(_mm512_loadu_pd(&src[i + offsets[0]]), w[0]);
+			for(size_t t=1; t!=TermCount; ++t)
+				sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(&src[i + offsets[t]]), w[t]));
+			if(Subtract)
+				sum = _mm512_sub_pd(_mm512_loadu_pd(&subtractFrom[i]), sum);
+			_mm512_storeu_pd(&dest[i], sum);
+		}
+		weightedSumSimple<TermCount, Subtract>(dest, subtractFrom, src, offsets, weights, i, end);
+	}
+	
+	bool hasAVX512()
+	{
+		static const bool hasAVX512 = __builtin_cpu_supports("avx512f");
+		return hasAVX512;
+	}
+#endif
+	
+	template<size_t TermCount, bool Subtract>
+	void weightedSum(double* dest, const double* subtractFrom, const double* src, const ptrdiff_t* offsets, const double* weights, size_t start, size_t end)
+	{
+#ifdef IUWT_AVX512_DISPATCH
+		if(hasAVX512())
+			return weightedSumAVX512<TermCount, Subtract>(dest, subtractFrom, src, offsets, weights, start, end);
+#endif
+#if defined __AVX__ && !defined FORCE_NON_AVX
+		weightedSumAVX<TermCount, Subtract>(dest, subtractFrom, src, offsets, weights, start, end);
+#else
+		weightedSumSimple<TermCount, Subtract>(dest, subtractFrom, src, offsets, weights, start, end);
+#endif
+	}
+	
+	template<bool Subtract>
+	void weightedSum(size_t termCount, double* dest, const double* subtractFrom, const double* src, const ptrdiff_t* offsets, const double* weights, size_t start, size_t end)
+	{
+		switch(termCount)
+		{
+			case 3: weightedSum<3, Subtract>(dest, subtractFrom, src, offsets, weights, start, end); break;
+			case 4: weightedSum<4, Subtract>(dest, subtractFrom, src, offsets, weights, start, end); break;
+			default: weightedSum<5, Subtract>(dest, subtractFrom, src, offsets, weights, start, end); break;
+		}
+	}
+	
+	/**
+	 * Applies the kernel values with the given indices, at distances dist, to src and stores
+	 * the result in dest, or subtracts it from subtractFrom when it is non-zero.
+	 */
+	void sumTerms(double* dest, const double* subtractFrom, const double* src, const int* terms, size_t termCount, const ptrdiff_t* dist, size_t start, size_t end)
+	{
+		ptrdiff_t offsets[H_SIZE];
+		double weights[H_SIZE];
+		for(size_t t=0; t!=termCount; ++t)
+		{
+			offsets[t] = dist[terms[t]];
+			weights[t] = h[terms[t]];
+		}
+		if(subtractFrom == 0)
+			weightedSum<false>(termCount, dest, subtractFrom, src, offsets, weights, start, end);
+		else
+			weightedSum<true>(termCount, dest, subtractFrom, src, offsets, weights, start, end);
+	}
+}
+
 void IUWTDecomposition::DecomposeMT(ThreadPool& threadPool, const double* input, double* scratch, bool includeLargest)
 {
-	ao::uvector<double>
-		&i1(_scales.back().Coefficients());
-	i1.resize(_width*_height);
+	// i0 is the image smoothed to the previous scale, and i1 the image smoothed
+	// to the current scale
+	ao::uvector<double> i0, i1(_width*_height);
 	
-	// The first iteration of the loop, unrolled, so that we don't have to
-	// copy the input into i0.
+	// The first scale reads the input directly, so that it does not have to be copied,
+	// unless the input is also used as scratch buffer
+	if(input == scratch)
+	{
+		i0.assign(input, input+_width*_height);
+		input = i0.data();
+	}
 	ao::uvector<double>& coefficients0 = _scales[0].Coefficients();
 	coefficients0.resize(_width*_height);
 	convolveMT(threadPool, i1.data(), input, scratch, _width, _height, 1);
-	convolveMT(threadPool, coefficients0.data(), i1.data(), scratch, _width, _height, 1);
+	// coefficients = input - i1 (x) kernel
+	convolveMT(threadPool, coefficients0.data(), i1.data(), scratch, _width, _height, 1, input);
 	
-	// coefficients = i0 - i2
-	differenceMT(threadPool, coefficients0.data(), input, coefficients0.data(), _width, _height);
+	decomposeScales(threadPool, i0, i1, 1, scratch);
 	
-	// i0 = i1;
-	ao::uvector<double>	i0(i1);
-	
-	for(int scale=1; scale!=int(_scaleCount); ++scale)
+	// The largest (residual) scale is in i1. Its memory is freed if it is not necessary.
+	if(includeLargest)
+		_scales.back().Coefficients().swap(i1);
+	else
+		ao::uvector<double>().swap(_scales.back().Coefficients());
+}
+
+void IUWTDecomposition::ExtendMT(ThreadPool& threadPool, int scaleCount, double* scratch)
+{
+	// The largest scale is the input smoothed to the current number of scales, from
+	// which the decomposition continues
+	ao::uvector<double> i0, i1;
+	i1.swap(_scales.back().Coefficients());
+	const int startScale = _scaleCount;
+	_scales.resize(scaleCount+1);
+	_scaleCount = scaleCount;
+	decomposeScales(threadPool, i0, i1, startScale, scratch);
+	_scales.back().Coefficients().swap(i1);
+}
+
+void IUWTDecomposition::decomposeScales(ThreadPool& threadPool, ao::uvector<double>& i0, ao::uvector<double>& i1, int startScale, double* scratch)
+{
+	for(int scale=startScale; scale!=int(_scaleCount); ++scale)
 	{
+		// i0 = i1
+		i0.swap(i1);
+		i1.resize(_width*_height);
+		
 		ao::uvector<double>& coefficients = _scales[scale].Coefficients();
 		coefficients.resize(_width*_height);
 		convolveMT(threadPool, i1.data(), i0.data(), scratch, _width, _height, scale+1);
-		convolveMT(threadPool, coefficients.data(), i1.data(), scratch, _width, _height, scale+1);
-		
-		// coefficients = i0 - i2
-		differenceMT(threadPool, coefficients.data(), i0.data(), coefficients.data(), _width, _height);
-		
-		// i0 = i1;
-		if(scale+1 != int(_scaleCount))
-			memcpy(i0.data(), i1.data(), sizeof(double)*_width*_height);
+		// coefficients = i0 - i1 (x) kernel
+		convolveMT(threadPool, coefficients.data(), i1.data(), scratch, _width, _height, scale+1, i0.data());
 	}
-	
-	// The largest (residual) scales are in i1, but since the
-	// largest scale is aliased to i1, it's already stored there.
-	// Hence we can skip this:
-	//if(includeLargest)
-	//	_scales.back().Coefficients() = i1;
-	
-	// Do free the memory of the largest scale if it is not necessary:
-	if(!includeLargest)
-		ao::uvector<double>().swap(_scales.back().Coefficients());
 }
 
-void IUWTDecomposition::convolveMT(ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale)
+void IUWTDecomposition::convolveMT(ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale, const double* subtractFrom)
 {
 	ConvolveHorizontalPartialFunc hFunc;
 	hFunc._output = scratch;
@@ -64,6 +204,7 @@ void IUWTDecomposition::convolveMT(ThreadPool& threadPool, double* output, const
 	
 	ConvolveVerticalPartialFunc vFunc;
 	vFunc._output = output;
+	vFunc._subtractFrom = subtractFrom;
 	vFunc._image = scratch;
 	vFunc._width = width;
 	vFunc._height = height;
@@ -95,10 +236,8 @@ void IUWTDecomposition::differenceMT(class ThreadPool& threadPool, double* dest,
 
 void IUWTDecomposition::convolveHorizontalFast(double* output, const double* image, size_t width, size_t height, int scale)
 {
-	const size_t H_SIZE = 5;
-	const double h[H_SIZE] = { 1.0/16.0, 4.0/16.0, 6.0/16.0, 4.0/16.0, 1.0/16.0 };
 	int scaleDist = (1 << scale);
-	int dist[H_SIZE];
+	ptrdiff_t dist[H_SIZE];
 	size_t minX[H_SIZE], maxX[H_SIZE];
 	for(int hIndex=0; hIndex!=H_SIZE; ++hIndex)
 	{
@@ -107,49 +246,21 @@ void IUWTDecomposition::convolveHorizontalFast(double* output, const double* ima
 		minX[hIndex] = std::max<int>(0, -dist[hIndex]);
 		maxX[hIndex] = std::min<int>(width, width - dist[hIndex]);
 	}
+	// Kernel values that fall outside the image are left out near the edges
+	const int
+		terms234[] = { 2, 3, 4 },
+		terms2134[] = { 2, 1, 3, 4 },
+		terms21034[] = { 2, 1, 0, 3, 4 },
+		terms2103[] = { 2, 1, 0, 3 },
+		terms210[] = { 2, 1, 0 };
 	for(size_t y=0; y!=height; ++y)
 	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr = &image[y * width];
-		
-		for(size_t x=0; x!=minX[1]; ++x)
-		{
-			outputPtr[x] = inputPtr[x + dist[2]] * h[2]
-				+ inputPtr[x + dist[3]] * h[3]
-				+ inputPtr[x + dist[4]] * h[4];
-		}
-		
-		for(size_t x=minX[1]; x!=minX[0]; ++x)
-		{
-			outputPtr[x] = inputPtr[x + dist[2]] * h[2]
-				+ inputPtr[x + dist[1]] * h[1]
-				+ inputPtr[x + dist[3]] * h[3]
-				+ inputPtr[x + dist[4]] * h[4];
-		}
-		
-		for(size_t x=minX[0]; x!=maxX[4]; ++x)
-		{
-			outputPtr[x] = inputPtr[x + dist[2]] * h[2]
-				+ inputPtr[x + dist[1]] * h[1]
-				+ inputPtr[x + dist[0]] * h[0]
-				+ inputPtr[x + dist[3]] * h[3]
-				+ inputPtr[x + dist[4]] * h[4];
-		}
-		
-		for(size_t x=maxX[4]; x!=maxX[3]; ++x)
-		{
-			outputPtr[x] = inputPtr[x + dist[2]] * h[2]
-				+ inputPtr[x + dist[1]] * h[1]
-				+ inputPtr[x + dist[0]] * h[0]
-				+ inputPtr[x + dist[3]] * h[3];
-		}
-		
-		for(size_t x=maxX[3]; x!=width; ++x)
-		{
-			outputPtr[x] = inputPtr[x + dist[2]] * h[2]
-				+ inputPtr[x + dist[1]] * h[1]
-				+ inputPtr[x + dist[0]] * h[0];
-		}
+		const size_t rowStart = y * width;
+		sumTerms(output, 0, image, terms234, 3, dist, rowStart, rowStart + minX[1]);
+		sumTerms(output, 0, image, terms2134, 4, dist, rowStart + minX[1], rowStart + minX[0]);
+		sumTerms(output, 0, image, terms21034, 5, dist, rowStart + minX[0], rowStart + maxX[4]);
+		sumTerms(output, 0, image, terms2103, 4, dist, rowStart + maxX[4], rowStart + maxX[3]);
+		sumTerms(output, 0, image, terms210, 3, dist, rowStart + maxX[3], rowStart + width);
 	}
 }
 
@@ -186,102 +297,45 @@ void IUWTDecomposition::convolveVerticalPartialFastFailed(double* output, const
 	}
 }
 	
-void IUWTDecomposition::convolveVerticalPartialFast(double* output, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale)
+void IUWTDecomposition::convolveVerticalPartialFast(double* output, const double* subtractFrom, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale)
 {
-	const size_t H_SIZE = 5;
-	const double h[H_SIZE] = { 1.0/16.0, 4.0/16.0, 6.0/16.0, 4.0/16.0, 1.0/16.0 };
 	int scaleDist = (1 << scale);
-	int dist[H_SIZE];
+	ptrdiff_t rowDist[H_SIZE];
 	size_t minY[H_SIZE], maxY[H_SIZE];
 	for(int hIndex=0; hIndex!=H_SIZE; ++hIndex)
 	{
 		int hShift = hIndex - H_SIZE / 2;
-		dist[hIndex] = (scaleDist-1)*hShift;
-		minY[hIndex] = std::max<int>(0, -dist[hIndex]);
-		maxY[hIndex] = std::min<int>(height, height - dist[hIndex]);
-	}
-	
-	for(size_t y=0; y!=minY[1]; ++y)
-	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr2 = &image[(y+dist[2]) * width];
-		const double* inputPtr3 = &image[(y+dist[3]) * width];
-		const double* inputPtr4 = &image[(y+dist[4]) * width];
-		for(size_t x=startX; x!=endX; ++x)
-		{
-			outputPtr[x] =
-				inputPtr2[x] * h[2] +
-				inputPtr3[x] * h[3] +
-				inputPtr4[x] * h[4];
-		}
-	}
-	
-	for(size_t y=minY[1]; y!=minY[0]; ++y)
-	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr1 = &image[(y+dist[1]) * width];
-		const double* inputPtr2 = &image[(y+dist[2]) * width];
-		const double* inputPtr3 = &image[(y+dist[3]) * width];
-		const double* inputPtr4 = &image[(y+dist[4]) * width];
-		for(size_t x=startX; x!=endX; ++x)
-		{
-			outputPtr[x] =
-				inputPtr1[x] * h[1] +
-				inputPtr2[x] * h[2] +
-				inputPtr3[x] * h[3] +
-				inputPtr4[x] * h[4];
-		}
+		int dist = (scaleDist-1)*hShift;
+		rowDist[hIndex] = ptrdiff_t(dist) * ptrdiff_t(width);
+		minY[hIndex] = std::max<int>(0, -dist);
+		maxY[hIndex] = std::min<int>(height, height - dist);
 	}
+	const int
+		terms234[] = { 2, 3, 4 },
+		terms1234[] = { 1, 2, 3, 4 },
+		terms01234[] = { 0, 1, 2, 3, 4 },
+		terms0123[] = { 0, 1, 2, 3 },
+		terms012[] = { 0, 1, 2 };
 	
-	for(size_t y=minY[0]; y!=maxY[4]; ++y)
+	// An input row is used for output rows that are up to 4*(scaleDist-1) rows apart. The
+	// columns are processed in blocks that are narrow enough to keep those rows in the
+	// cache while the block is processed.
+	const size_t windowRows = 4*(scaleDist-1) + 1;
+	const size_t blockWidth = std::max<size_t>(64, (verticalBlockCacheSize / sizeof(double) / windowRows) & ~size_t(7));
+	for(size_t blockStart=startX; blockStart<endX; blockStart+=blockWidth)
 	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr0 = &image[(y+dist[0]) * width];
-		const double* inputPtr1 = &image[(y+dist[1]) * width];
-		const double* inputPtr2 = &image[(y+dist[2]) * width];
-		const double* inputPtr3 = &image[(y+dist[3]) * width];
-		const double* inputPtr4 = &image[(y+dist[4]) * width];
-		for(size_t x=startX; x!=endX; ++x)
+		const size_t blockEnd = std::min(blockStart + blockWidth, endX);
+		for(size_t y=0; y<height; ++y)
 		{
-			outputPtr[x] =
-				inputPtr0[x] * h[0] +
-				inputPtr1[x] * h[1] +
-				inputPtr2[x] * h[2] +
-				inputPtr3[x] * h[3] +
-				inputPtr4[x] * h[4];
+			const size_t rowStart = y * width;
+			const int* terms;
+			size_t termCount;
+			if(y < minY[1]) { terms = terms234; termCount = 3; }
+			else if(y < minY[0]) { terms = terms1234; termCount = 4; }
+			else if(y < maxY[4]) { terms = terms01234; termCount = 5; }
+			else if(y < maxY[3]) { terms = terms0123; termCount = 4; }
+			else { terms = terms012; termCount = 3; }
+			sumTerms(output, subtractFrom, image, terms, termCount, rowDist, rowStart + blockStart, rowStart + blockEnd);
 		}
 	}
-
-	for(size_t y=maxY[4]; y!=maxY[3]; ++y)
-	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr0 = &image[(y+dist[0]) * width];
-		const double* inputPtr1 = &image[(y+dist[1]) * width];
-		const double* inputPtr2 = &image[(y+dist[2]) * width];
-		const double* inputPtr3 = &image[(y+dist[3]) * width];
-		for(size_t x=startX; x!=endX; ++x)
-		{
-			outputPtr[x] =
-				inputPtr0[x] * h[0] +
-				inputPtr1[x] * h[1] +
-				inputPtr2[x] * h[2] +
-				inputPtr3[x] * h[3];
-		}
-	}
-	
-	for(size_t y=maxY[3]; y!=height; ++y)
-	{
-		double* outputPtr = &output[y * width];
-		const double* inputPtr0 = &image[(y+dist[0]) * width];
-		const double* inputPtr1 = &image[(y+dist[1]) * width];
-		const double* inputPtr2 = &image[(y+dist[2]) * width];
-		for(size_t x=startX; x!=endX; ++x)
-		{
-			outputPtr[x] =
-				inputPtr0[x] * h[0] +
-				inputPtr1[x] * h[1] +
-				inputPtr2[x] * h[2];
-		}
-	}
-	
 }
@@ -82,6 +82,13 @@ public:
 	
 	void DecomposeMT(class ThreadPool& pool, const double* input, double* scratch, bool includeLargest);
 	
+	/**
+	 * Adds scales to a decomposition that was made with includeLargest=true. The result is the
+	 * same as decomposing the input again with the new number of scales, but only the added
+	 * scales are calculated. The largest scale is kept.
+	 */
+	void ExtendMT(class ThreadPool& pool, int scaleCount, double* scratch);
+	
 	void DecomposeST(const double* input, double* scratch)
 	{
 		ao::uvector<double>
@@ -267,7 +274,12 @@ private:
 		}
 	}
 
-	static void convolveMT(class ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale);
+	/**
+	 * Convolves the image with the IUWT kernel of the given scale. When subtractFrom is set,
+	 * output is set to subtractFrom minus the convolved image instead, which saves a pass
+	 * over the image compared to calling differenceMT() afterwards.
+	 */
+	static void convolveMT(class ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale, const double* subtractFrom = 0);
 	
 	static void convolveHorizontalPartial(double* output, const double* image, size_t width, size_t startY, size_t endY, int scale)
 	{
@@ -318,16 +330,17 @@ private:
 		}
 	}
 	
-	static void convolveVerticalPartialFast(double* output, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale);
+	static void convolveVerticalPartialFast(double* output, const double* subtractFrom, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale);
 
 	static void convolveVerticalPartialFastFailed(double* output, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale);
 	
 	struct ConvolveVerticalPartialFunc
 	{
 		void operator()() {
-			convolveVerticalPartialFast(_output, _image, _width, _height, _startX, _endX, _scale);
+			convolveVerticalPartialFast(_output, _subtractFrom, _image, _width, _height, _startX, _endX, _scale);
 		}
 		double* _output;
+		const double* _subtractFrom;
 		const double* _image;
 		size_t _width;
 		size_t _height;
@@ -355,6 +368,10 @@ private:
 		size_t _endY;
 	};
 
+	// Calculates the scales from startScale onwards from the smoothed input in i1. On return,
+	// i1 holds the input smoothed to the largest scale.
+	void decomposeScales(class ThreadPool& threadPool, ao::uvector<double>& i0, ao::uvector<double>& i1, int startScale, double* scratch);
+	
 	static void differenceMT(class ThreadPool& threadPool, double* dest, const double* lhs, const double* rhs, size_t width, size_t height);
 	
 	static void difference(double* dest, const double* lhs, const double* rhs, size_t width, size_t height)
@@ -536,27 +536,36 @@ void IUWTDeconvolutionAlgorithm::constrainedPSFConvolve(double* image, const dou
 
 bool IUWTDeconvolutionAlgorithm::findAndDeconvolveStructure(IUWTDecomposition& iuwt, ao::uvector<double>& dirty, const ao::uvector<double>& psf, const ao::uvector<double>& psfKernel, ao::uvector<double>& scratch, DynamicSet& structureModel, size_t curEndScale, size_t curMinScale, double gain, std::vector<IUWTDeconvolutionAlgorithm::ValComponent>& maxComponents)
 {
-	iuwt.Decompose(*_threadPool, dirty.data(), scratch.data(), false);
-	ao::uvector<double> thresholds(curEndScale);
-	_rmses.resize(curEndScale);
-	for(size_t scale=0; scale!=curEndScale; ++scale)
+	// The residual does not change in iterations that do not find a structure, so the
+	// decomposition is then reused. When the number of scales has grown, only the new
+	// scales are calculated.
+	if(_dirtyIUWT == 0 || _dirtyIUWT->NScales() > curEndScale)
 	{
-		double r = mad(iuwt[scale].Coefficients().data());
-		_rmses[scale] = r;
-		thresholds[scale] = r*(_thresholdLevel*4.0/5.0);
+		_dirtyIUWT.reset(new IUWTDecomposition(curEndScale, _width, _height));
+		_dirtyIUWT->Decompose(*_threadPool, dirty.data(), scratch.data(), true);
+		_rmses.clear();
+		_dirtyMaxComponents.clear();
 	}
-	
-	scratch = dirty;
-	maxComponents.resize(curEndScale);
-	for(size_t scale=0; scale!=curEndScale; ++scale)
+	else if(_dirtyIUWT->NScales() < curEndScale)
+	{
+		_dirtyIUWT->ExtendMT(*_threadPool, curEndScale, scratch.data());
+	}
+	for(size_t scale=_rmses.size(); scale!=curEndScale; ++scale)
 	{
+		_rmses.push_back(mad((*_dirtyIUWT)[scale].Coefficients().data()));
+		
 		size_t x, y;
-		double maxAbsCoef = getMaxAbs(_cleanBorder, iuwt[scale].Coefficients(), x, y, _width, _allowNegativeComponents);
-		maxComponents[scale].x = x;
-		maxComponents[scale].y = y;
-		maxComponents[scale].scale = scale;
-		maxComponents[scale].val = maxAbsCoef;
+		double maxAbsCoef = getMaxAbs(_cleanBorder, (*_dirtyIUWT)[scale].Coefficients(), x, y, _width, _allowNegativeComponents);
+		_dirtyMaxComponents.push_back(ValComponent(x, y, scale, maxAbsCoef));
 	}
+	iuwt = *_dirtyIUWT;
+	
+	ao::uvector<double> thresholds(curEndScale);
+	for(size_t scale=0; scale!=curEndScale; ++scale)
+		thresholds[scale] = _rmses[scale]*(_thresholdLevel*4.0/5.0);
+	
+	scratch = dirty;
+	maxComponents.assign(_dirtyMaxComponents.begin(), _dirtyMaxComponents.begin() + curEndScale);
 	
 	double maxVal = -1.0;
 	size_t maxX = 0, maxY = 0;
@@ -620,7 +629,7 @@ bool IUWTDeconvolutionAlgorithm::fillAndDeconvolveStructure(IUWTDecomposition& i
 {
 	IUWTMask mask(curEndScale, width, height);
 	size_t areaSize;
-	ImageAnalysis::SelectStructures(iuwt, mask, thresholds, curMinScale, curEndScale, _cleanBorder, areaSize);
+	ImageAnalysis::SelectStructures(*_threadPool, iuwt, mask, thresholds, curMinScale, curEndScale, _cleanBorder, areaSize);
 	std::cout << "Flood-filled area contains " << areaSize << " significant components.\n";
 
 	iuwt.ApplyMask(mask);
@@ -868,6 +877,7 @@ void IUWTDeconvolutionAlgorithm::PerformMajorIteration(size_t& iterCounter, size
 	
 	_curBoxXStart = 0; _curBoxXEnd = _width;
 	_curBoxYStart = 0; _curBoxYEnd = _height;
+	_dirtyIUWT.reset();
 		
 	ao::uvector<double> scratch(_width * _height);
 		
@@ -930,6 +940,7 @@ void IUWTDeconvolutionAlgorithm::PerformMajorIteration(size_t& iterCounter, size
 				Subtract(dirtySet[i], scratch);
 			}
 			dirtySet.GetIntegrated(dirty.data(), scratch.data());
+			_dirtyIUWT.reset();
 			
 			while(maxComponents.size() > initialComponents.size())
 			{
@@ -6,6 +6,7 @@
 #include "iuwtdecomposition.h"
 #include "imageanalysis.h"
 
+#include <memory>
 #include <vector>
 
 class IUWTDeconvolutionAlgorithm
@@ -114,6 +115,10 @@ private:
 	double _thresholdLevel, _tolerance;
 	double _psfMaj, _psfMin, _psfPA, _psfVolume;
 	ao::uvector<double> _rmses;
+	// Decomposition of the integrated residual, with the noise level (in _rmses) and the peak
+	// of each scale. It is reused until a structure is subtracted from the residual.
+	std::unique_ptr<IUWTDecomposition> _dirtyIUWT;
+	std::vector<ValComponent> _dirtyMaxComponents;
 	FitsWriter _writer;
 	std::vector<ScaleResponse> _psfResponse;
 	bool _allowNegativeComponents;
@@ -2,22 +2,34 @@
 #include <casacore/measures/Measures/MEpoch.h>
 #include <casacore/measures/TableMeasures/ScalarMeasColumn.h>
 
+#include <casacore/casa/Arrays/Slicer.h>
+#include <casacore/casa/OS/Path.h>
+
+#include <algorithm>
+
+const size_t ContiguousMS::_prefetchBlockCount = 4;
+std::map<std::string, std::weak_ptr<boost::mutex>> ContiguousMS::_tableMutexes;
+boost::mutex ContiguousMS::_tableMutexesMutex;
+
 ContiguousMS::ContiguousMS(const string& msPath, const std::string& dataColumnName, MSSelection selection, PolarizationEnum polOut, bool includeModel) :
-	_timestep(0),
-	_time(0.0),
+	_ioMutex(getTableMutex(msPath)),
+	_tableLock(new boost::mutex::scoped_lock(*_ioMutex)),
 	_dataDescId(0),
+	_rowIndexPosition(0),
 	_isModelColumnPrepared(false),
 	_selection(selection),
 	_polOut(polOut),
 	_ms(msPath),
-	_antenna1Column(_ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1)),
-	_antenna2Column(_ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2)),
-	_fieldIdColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID)),
 	_dataDescIdColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::DATA_DESC_ID)),
-	_timeColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::TIME)),
-	_uvwColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::UVW)),
 	_dataColumn(_ms, dataColumnName),
-	_flagColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::FLAG))
+	_flagColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::FLAG)),
+	_freePrefetchBlocks(_prefetchBlockCount),
+	_filledPrefetchBlocks(_prefetchBlockCount),
+	_currentPrefetchBlock(0),
+	_stopPrefetching(false),
+	_usePrefetching(true),
+	_rowsRequested(0),
+	_lastRequestedPosition(size_t(-1))
 {
 	std::cout << "Opening " << msPath << " with contiguous MS reader.\n";
 	
@@ -29,6 +41,11 @@ ContiguousMS::ContiguousMS(const string& msPath, const std::string& dataColumnNa
 	_flagArray = casacore::Array<bool>(shape);
 	_bandData = MultiBandData(_ms.spectralWindow(), _ms.dataDescription());
 	
+	// Size the prefetch blocks to about 16 MB of input data each
+	_prefetchStride = shape[1];
+	const size_t inputRowSize = shape[0] * shape[1] * (sizeof(std::complex<float>) + sizeof(float) + sizeof(bool));
+	_rowsPerPrefetchBlock = std::max<size_t>(1, std::min<size_t>(1024, (16*1024*1024) / std::max<size_t>(1, inputRowSize)));
+	
 	bool isWeightDefined;
 	if(_ms.isColumn(casacore::MSMainEnums::WEIGHT_SPECTRUM))
 	{
@@ -50,116 +67,103 @@ ContiguousMS::ContiguousMS(const string& msPath, const std::string& dataColumnNa
 	}
 	
 	getRowRange(_ms, selection, _startRow, _endRow);
+	_rowIndex = SelectedRowIndex::Get(_ms, msPath, selection, _startRow, _endRow);
+	_tableLock.reset();
 	Reset();
 }
 
+ContiguousMS::~ContiguousMS()
+{
+	stopPrefetching();
+	_tableLock.reset(new boost::mutex::scoped_lock(*_ioMutex));
+}
+
+std::shared_ptr<boost::mutex> ContiguousMS::getTableMutex(const std::string& msPath)
+{
+	const std::string tableName = casacore::Path(msPath).absoluteName();
+	boost::mutex::scoped_lock lock(_tableMutexesMutex);
+	// Remove the mutexes of tables that are no longer used
+	for(std::map<std::string, std::weak_ptr<boost::mutex>>::iterator i=_tableMutexes.begin(); i!=_tableMutexes.end(); )
+	{
+		if(i->second.expired())
+			i = _tableMutexes.erase(i);
+		else
+			++i;
+	}
+	std::weak_ptr<boost::mutex>& entry = _tableMutexes[tableName];
+	std::shared_ptr<boost::mutex> mutex = entry.lock();
+	if(mutex == 0)
+	{
+		mutex.reset(new boost::mutex());
+		entry = mutex;
+	}
+	return mutex;
+}
+
+void ContiguousMS::ReopenRW()
+{
+	boost::mutex::scoped_lock lock(*_ioMutex);
+	_ms.reopenRW();
+}
+
 void ContiguousMS::Reset()
 {
-	_row = _startRow - 1;
-	_time = 0.0;
-	if(_selection.HasInterval())
-		_timestep = _selection.IntervalStart()-1;
-	else
-		_timestep = -1;
-	NextRow();
+	stopPrefetching();
+	// Only read ahead when the previous pass requested most of the rows
+	if(_rowIndexPosition != 0)
+		_usePrefetching = _rowsRequested*2 >= _rowIndexPosition;
+	_rowsRequested = 0;
+	_lastRequestedPosition = size_t(-1);
+	_rowIndexPosition = 0;
+	setRowFromIndex();
 }
 
 bool ContiguousMS::CurrentRowAvailable()
 {
-	if(_row >= _endRow)
-		return false;
-		
-	int fieldId = _fieldIdColumn(_row);
-	int a1 = _antenna1Column(_row);
-	int a2 = _antenna2Column(_row);
-	casacore::Vector<double> uvw = _uvwColumn(_row);
-	
-	while(!_selection.IsSelected(fieldId, _timestep, a1, a2, uvw)) {
-		++_row;
-		if(_row >= _endRow)
-			return false;
-		
-		fieldId = _fieldIdColumn(_row);
-		a1 = _antenna1Column(_row);
-		a2 = _antenna2Column(_row);
-		uvw = _uvwColumn(_row);
-		if(_time != _timeColumn(_row))
-		{
-			++_timestep;
-			_time = _timeColumn(_row);
-		}
-		
-		_isMetaRead = false;
-		_isDataRead = false;
-		_isWeightRead = false;
-		_isModelRead = false;
-	}
-	
-	return true;
+	return _rowIndexPosition < _rowIndex->size();
 }
 
 void ContiguousMS::NextRow()
 {
-	_isMetaRead = false;
-	_isDataRead = false;
-	_isWeightRead = false;
-	_isModelRead = false;
-	
-	int fieldId, a1, a2;
-	casacore::Vector<double> uvw;
-	do {
-		++_row;
-		if(_row >= _endRow)
-			return;
-		
-		fieldId = _fieldIdColumn(_row);
-		a1 = _antenna1Column(_row);
-		a2 = _antenna2Column(_row);
-		uvw = _uvwColumn(_row);
-		if(_time != _timeColumn(_row))
-		{
-			++_timestep;
-			_time = _timeColumn(_row);
-		}
-	} while(!_selection.IsSelected(fieldId, _timestep, a1, a2, uvw));
+	++_rowIndexPosition;
+	setRowFromIndex();
 }
 
 double ContiguousMS::StartTime()
 {
+	boost::mutex::scoped_lock lock(*_ioMutex);
 	return casacore::MEpoch::ROScalarColumn(_ms, casacore::MS::columnName(casacore::MS::TIME))(_startRow).getValue().get();
 }
 
 void ContiguousMS::ReadMeta(double& u, double& v, double& w, size_t& dataDescId)
 {
-	readMeta();
-	
-	casacore::Vector<double> uvwArray = _uvwColumn(_row);
-	u = uvwArray(0);
-	v = uvwArray(1);
-	w = uvwArray(2);
+	const SelectedRowIndex::Row& row = (*_rowIndex)[_rowIndexPosition];
+	u = row.u;
+	v = row.v;
+	w = row.w;
 	dataDescId = _dataDescId;
 }
 
 void ContiguousMS::ReadData(std::complex<float>* buffer)
 {
-	readMeta();
-	readData();
-	readWeights();
 	size_t startChannel, endChannel;
-	if(_selection.HasChannelRange())
+	getChannelRange(_dataDescId, startChannel, endChannel);
+	const PrefetchBlock* block = currentPrefetchBlock();
+	if(block != 0)
 	{
-		startChannel = _selection.ChannelRangeStart();
-		endChannel = _selection.ChannelRangeEnd();
+		const std::complex<float>* source = block->data.data() + (_rowIndexPosition - block->startPosition) * _prefetchStride;
+		std::copy(source, source + (endChannel - startChannel), buffer);
 	}
 	else {
-		startChannel = 0;
-		endChannel = _bandData[_dataDescId].ChannelCount();
+		readData();
+		readWeights();
+		copyWeightedData(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
 	}
-	copyWeightedData(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
 }
 
 void ContiguousMS::prepareModelColumn()
 {
+	boost::mutex::scoped_lock lock(*_ioMutex);
 	initializeModelColumn(_ms);
 	
 	_modelColumn.reset(new casacore::ArrayColumn<casacore::Complex>(_ms, casacore::MS::columnName(casacore::MSMainEnums::MODEL_DATA)));
@@ -173,19 +177,10 @@ void ContiguousMS::ReadModel(std::complex<float>* buffer)
 	if(!_isModelColumnPrepared)
 		prepareModelColumn();
 	
-	readMeta();
 	readModel();
 	readWeights();
 	size_t startChannel, endChannel;
-	if(_selection.HasChannelRange())
-	{
-		startChannel = _selection.ChannelRangeStart();
-		endChannel = _selection.ChannelRangeEnd();
-	}
-	else {
-		startChannel = 0;
-		endChannel = _bandData[_dataDescId].ChannelCount();
-	}
+	getChannelRange(_dataDescId, startChannel, endChannel);
 	copyWeightedData(buffer,  startChannel, endChannel, _inputPolarizations, _modelArray, _weightArray, _flagArray, _polOut);
 }
 
@@ -194,17 +189,10 @@ void ContiguousMS::WriteModel(size_t rowId, std::complex<float>* buffer)
 	if(!_isModelColumnPrepared)
 		prepareModelColumn();
 	
+	boost::mutex::scoped_lock lock(*_ioMutex);
 	size_t dataDescId = _dataDescIdColumn(rowId);
 	size_t startChannel, endChannel;
-	if(_selection.HasChannelRange())
-	{
-		startChannel = _selection.ChannelRangeStart();
-		endChannel = _selection.ChannelRangeEnd();
-	}
-	else {
-		startChannel = 0;
-		endChannel = _bandData[dataDescId].ChannelCount();
-	}
+	getChannelRange(dataDescId, startChannel, endChannel);
 	
 	_modelColumn->get(rowId, _modelArray);
 	reverseCopyData(_modelArray, startChannel, endChannel, _inputPolarizations, buffer, _polOut);
@@ -213,42 +201,192 @@ void ContiguousMS::WriteModel(size_t rowId, std::complex<float>* buffer)
 
 void ContiguousMS::ReadWeights(std::complex<float>* buffer)
 {
-	readMeta();
-	readData();
-	readWeights();
 	size_t startChannel, endChannel;
-	if(_selection.HasChannelRange())
+	getChannelRange(_dataDescId, startChannel, endChannel);
+	const PrefetchBlock* block = currentPrefetchBlock();
+	if(block != 0)
 	{
-		startChannel = _selection.ChannelRangeStart();
-		endChannel = _selection.ChannelRangeEnd();
+		const float* source = block->weights.data() + (_rowIndexPosition - block->startPosition) * _prefetchStride;
+		copyRealToComplex(buffer, source, endChannel - startChannel);
 	}
 	else {
-		startChannel = 0;
-		endChannel = _bandData[_dataDescId].ChannelCount();
+		readData();
+		readWeights();
+		copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
 	}
-	copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
 }
 
 void ContiguousMS::ReadWeights(float* buffer)
 {
-	readMeta();
-	readData();
-	readWeights();
 	size_t startChannel, endChannel;
-	if(_selection.HasChannelRange())
+	getChannelRange(_dataDescId, startChannel, endChannel);
+	const PrefetchBlock* block = currentPrefetchBlock();
+	if(block != 0)
 	{
-		startChannel = _selection.ChannelRangeStart();
-		endChannel = _selection.ChannelRangeEnd();
+		const float* source = block->weights.data() + (_rowIndexPosition - block->startPosition) * _prefetchStride;
+		std::copy(source, source + (endChannel - startChannel), buffer);
 	}
 	else {
-		startChannel = 0;
-		endChannel = _bandData[_dataDescId].ChannelCount();
+		readData();
+		readWeights();
+		copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
+	}
+}
+
+const ContiguousMS::PrefetchBlock* ContiguousMS::currentPrefetchBlock()
+{
+	if(_lastRequestedPosition != _rowIndexPosition)
+	{
+		++_rowsRequested;
+		_lastRequestedPosition = _rowIndexPosition;
+	}
+	if(!_usePrefetching)
+		return 0;
+	
+	if(_prefetchThread == 0)
+		startPrefetching();
+	while(_currentPrefetchBlock == 0 || _rowIndexPosition >= _currentPrefetchBlock->endPosition)
+	{
+		if(_currentPrefetchBlock != 0)
+			_freePrefetchBlocks.write(_currentPrefetchBlock);
+		if(!_filledPrefetchBlocks.read(_currentPrefetchBlock))
+		{
+			_currentPrefetchBlock = 0;
+			stopPrefetching();
+			if(_prefetchError.empty())
+				throw std::runtime_error("Prefetching of measurement set rows ended prematurely");
+			else
+				throw std::runtime_error("Error while prefetching measurement set rows: " + _prefetchError);
+		}
+	}
+	return _currentPrefetchBlock;
+}
+
+void ContiguousMS::startPrefetching()
+{
+	if(_prefetchBlocks == 0)
+	{
+		_prefetchBlocks.reset(new PrefetchBlock[_prefetchBlockCount]);
+		for(size_t i=0; i!=_prefetchBlockCount; ++i)
+		{
+			_prefetchBlocks[i].data.resize(_rowsPerPrefetchBlock * _prefetchStride);
+			_prefetchBlocks[i].weights.resize(_rowsPerPrefetchBlock * _prefetchStride);
+		}
+	}
+	_freePrefetchBlocks.clear();
+	_filledPrefetchBlocks.clear();
+	for(size_t i=0; i!=_prefetchBlockCount; ++i)
+		_freePrefetchBlocks.write(&_prefetchBlocks[i]);
+	_currentPrefetchBlock = 0;
+	_stopPrefetching = false;
+	_prefetchError.clear();
+	_prefetchThread.reset(new boost::thread(&ContiguousMS::prefetchThreadFunction, this, _rowIndexPosition));
+}
+
+void ContiguousMS::stopPrefetching()
+{
+	if(_prefetchThread != 0)
+	{
+		{
+			boost::mutex::scoped_lock lock(*_ioMutex);
+			_stopPrefetching = true;
+		}
+		_freePrefetchBlocks.write_end();
+		PrefetchBlock* block;
+		while(_filledPrefetchBlocks.read(block)) { }
+		_prefetchThread->join();
+		_prefetchThread.reset();
+		_currentPrefetchBlock = 0;
+	}
+}
+
+void ContiguousMS::prefetchThreadFunction(size_t startPosition)
+{
+	try {
+		const casacore::IPosition shape(_dataArray.shape());
+		casacore::Array<std::complex<float>> dataArray;
+		casacore::Array<float> weightArray;
+		casacore::Array<bool> flagArray;
+		size_t slotCapacity = 0;
+		
+		const SelectedRowIndex& index = *_rowIndex;
+		size_t position = startPosition;
+		PrefetchBlock* block;
+		while(position < index.size() && _freePrefetchBlocks.read(block))
+		{
+			block->startPosition = position;
+			block->endPosition = std::min(position + _rowsPerPrefetchBlock, index.size());
+			const size_t
+				rowCount = block->endPosition - block->startPosition,
+				firstRow = index[block->startPosition].row,
+				rowSpan = index[block->endPosition-1].row - firstRow + 1;
+			// Read the full range of rows with a single call, unless most of them are not selected
+			const bool readRange = rowSpan <= rowCount*2;
+			const size_t slotCount = readRange ? rowSpan : rowCount;
+			if(slotCount != slotCapacity)
+			{
+				const casacore::IPosition blockShape(3, shape[0], shape[1], slotCount);
+				dataArray.resize(blockShape);
+				weightArray.resize(blockShape);
+				flagArray.resize(blockShape);
+				if(!_msHasWeights)
+					weightArray.set(1);
+				slotCapacity = slotCount;
+			}
+			
+			{
+				boost::mutex::scoped_lock lock(*_ioMutex);
+				if(_stopPrefetching)
+					break;
+				if(readRange)
+				{
+					casacore::Slicer rowRange(casacore::IPosition(1, firstRow), casacore::IPosition(1, rowSpan));
+					_dataColumn.getColumnRange(rowRange, dataArray);
+					_flagColumn.getColumnRange(rowRange, flagArray);
+					if(_msHasWeights)
+						_weightColumn->getColumnRange(rowRange, weightArray);
+				}
+				else {
+					for(size_t i=0; i!=rowCount; ++i)
+					{
+						const size_t row = index[block->startPosition + i].row;
+						casacore::Array<std::complex<float>> dataSlot(dataArray[i]);
+						_dataColumn.get(row, dataSlot);
+						casacore::Array<bool> flagSlot(flagArray[i]);
+						_flagColumn.get(row, flagSlot);
+						if(_msHasWeights)
+						{
+							casacore::Array<float> weightSlot(weightArray[i]);
+							_weightColumn->get(row, weightSlot);
+						}
+					}
+				}
+			}
+			
+			for(size_t i=0; i!=rowCount; ++i)
+			{
+				const SelectedRowIndex::Row& row = index[block->startPosition + i];
+				const size_t slot = readRange ? row.row - firstRow : i;
+				size_t startChannel, endChannel;
+				getChannelRange(row.dataDescId, startChannel, endChannel);
+				const casacore::Array<std::complex<float>> dataSlot(dataArray[slot]);
+				const casacore::Array<float> weightSlot(weightArray[slot]);
+				const casacore::Array<bool> flagSlot(flagArray[slot]);
+				copyWeightedData(block->data.data() + i*_prefetchStride, startChannel, endChannel, _inputPolarizations, dataSlot, weightSlot, flagSlot, _polOut);
+				copyWeights(block->weights.data() + i*_prefetchStride, startChannel, endChannel, _inputPolarizations, dataSlot, weightSlot, flagSlot, _polOut);
+			}
+			_filledPrefetchBlocks.write(block);
+			position = block->endPosition;
+		}
+	} catch(std::exception& e) {
+		_prefetchError = e.what();
 	}
-	copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightArray, _flagArray, _polOut);
+	_filledPrefetchBlocks.write_end();
 }
 
 void ContiguousMS::MakeMSRowToRowIdMapping(std::vector<size_t>& msToId, const MSSelection&)
 {
+	boost::mutex::scoped_lock lock(*_ioMutex);
 	size_t nRow = _ms.nrow();
 	msToId.resize(nRow);
 	for(size_t i=0; i!=nRow; ++i)
@@ -2,21 +2,31 @@
 #define CONTIGUOUSMS_H
 
 #include "msprovider.h"
+#include "selectedrowindex.h"
 
+#include "../lane.h"
 #include "../msselection.h"
 #include "../multibanddata.h"
+#include "../uvector.h"
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
 #include <casacore/tables/Tables/ScalarColumn.h>
 
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <map>
 #include <memory>
+#include <string>
 
 class ContiguousMS : public MSProvider
 {
 public:
 	ContiguousMS(const string& msPath, const std::string& dataColumnName, MSSelection selection, PolarizationEnum polOut, bool includeModel);
 	
+	virtual ~ContiguousMS();
+	
 	virtual casacore::MeasurementSet &MS() { return _ms; }
 	
 	virtual size_t RowId() const { return _row; }
@@ -39,20 +49,23 @@ public:
 	
 	virtual void ReadWeights(std::complex<float>* buffer);
 	
-	virtual void ReopenRW()
-	{
-		_ms.reopenRW();
-	}
+	virtual void ReopenRW();
 	
 	virtual double StartTime();
 	
 	virtual void MakeMSRowToRowIdMapping(std::vector<size_t>& msToId, const MSSelection& selection);
 private:
+	// Serializes all casacore access to the table of this instance. Instances that open the
+	// same table share its casacore objects, and therefore share this mutex.
+	std::shared_ptr<boost::mutex> _ioMutex;
+	// Holds _ioMutex while the casacore members are constructed and destructed. It is
+	// declared before those, so that it is constructed before and destructed after them.
+	std::unique_ptr<boost::mutex::scoped_lock> _tableLock;
 	size_t _row;
-	size_t _timestep;
-	double _time;
 	int _dataDescId;
-	bool _isMetaRead, _isDataRead, _isModelRead, _isWeightRead;
+	std::shared_ptr<const SelectedRowIndex> _rowIndex;
+	size_t _rowIndexPosition;
+	bool _isDataRead, _isModelRead, _isWeightRead;
 	bool _isModelColumnPrepared;
 	size_t _startRow, _endRow;
 	std::vector<PolarizationEnum> _inputPolarizations;
@@ -62,9 +75,7 @@ private:
 	MultiBandData _bandData;
 	bool _msHasWeights;
 
-	casacore::ROScalarColumn<int> _antenna1Column, _antenna2Column, _fieldIdColumn, _dataDescIdColumn;
-	casacore::ROScalarColumn<double> _timeColumn;
-	casacore::ROArrayColumn<double> _uvwColumn;
+	casacore::ROScalarColumn<int> _dataDescIdColumn;
 	std::unique_ptr<casacore::ROArrayColumn<float>> _weightColumn;
 	casacore::ROArrayColumn<casacore::Complex> _dataColumn;
 	casacore::ROArrayColumn<bool> _flagColumn;
@@ -74,19 +85,82 @@ private:
 	casacore::Array<float> _weightArray;
 	casacore::Array<bool> _flagArray;
 	
+	/**
+	 * Rows are read ahead by a background thread when data or weights are requested. Blocks of
+	 * consecutive selected rows are read, converted to the output polarization and weighted,
+	 * and are passed to the reading thread through a ring of blocks. Because the model column
+	 * can be read and written while prefetching, all casacore access goes through _ioMutex.
+	 * Instances of different measurement sets have different mutexes, so that they can read
+	 * at the same time.
+	 *
+	 * When the previous pass requested fewer than half of the rows (e.g. when gridding
+	 * in multiple w-layer passes), rows are read on request instead.
+	 */
+	struct PrefetchBlock
+	{
+		size_t startPosition, endPosition;
+		ao::uvector<std::complex<float>> data;
+		ao::uvector<float> weights;
+	};
+	std::unique_ptr<PrefetchBlock[]> _prefetchBlocks;
+	ao::lane<PrefetchBlock*> _freePrefetchBlocks, _filledPrefetchBlocks;
+	PrefetchBlock* _currentPrefetchBlock;
+	std::unique_ptr<boost::thread> _prefetchThread;
+	/**
+	 * Returns the mutex of a table, which is created when no instance uses the table. Tables
+	 * are identified by their absolute name, as in the casacore table cache.
+	 */
+	static std::shared_ptr<boost::mutex> getTableMutex(const std::string& msPath);
+	static std::map<std::string, std::weak_ptr<boost::mutex>> _tableMutexes;
+	static boost::mutex _tableMutexesMutex;
+	bool _stopPrefetching, _usePrefetching;
+	std::string _prefetchError;
+	size_t _prefetchStride, _rowsPerPrefetchBlock;
+	size_t _rowsRequested, _lastRequestedPosition;
+	static const size_t _prefetchBlockCount;
+	
+	void prefetchThreadFunction(size_t startPosition);
+	void startPrefetching();
+	void stopPrefetching();
+	/**
+	 * Returns the prefetched block containing the current row, starting the prefetch thread
+	 * if necessary. Returns 0 when the row should be read synchronously.
+	 */
+	const PrefetchBlock* currentPrefetchBlock();
+	void getChannelRange(size_t dataDescId, size_t& startChannel, size_t& endChannel) const
+	{
+		if(_selection.HasChannelRange())
+		{
+			startChannel = _selection.ChannelRangeStart();
+			endChannel = _selection.ChannelRangeEnd();
+		}
+		else {
+			startChannel = 0;
+			endChannel = _bandData[dataDescId].ChannelCount();
+		}
+	}
+	
 	void prepareModelColumn();
-	void readMeta()
+	void setRowFromIndex()
 	{
-		if(!_isMetaRead)
+		_isDataRead = false;
+		_isWeightRead = false;
+		_isModelRead = false;
+		if(_rowIndexPosition < _rowIndex->size())
 		{
-			_dataDescId = _dataDescIdColumn(_row);
-			_isMetaRead = true;
+			const SelectedRowIndex::Row& row = (*_rowIndex)[_rowIndexPosition];
+			_row = row.row;
+			_dataDescId = row.dataDescId;
+		}
+		else {
+			_row = _endRow;
 		}
 	}
 	void readData()
 	{
 		if(!_isDataRead)
 		{
+			boost::mutex::scoped_lock lock(*_ioMutex);
 			_dataColumn.get(_row, _dataArray);
 			_isDataRead = true;
 		}
@@ -95,6 +169,7 @@ private:
 	{
 		if(!_isWeightRead)
 		{
+			boost::mutex::scoped_lock lock(*_ioMutex);
 			_flagColumn.get(_row, _flagArray);
 			if(_msHasWeights)
 				_weightColumn->get(_row, _weightArray);
@@ -105,6 +180,7 @@ private:
 	{
 		if(!_isModelRead)
 		{
+			boost::mutex::scoped_lock lock(*_ioMutex);
 			_modelColumn->get(_row, _modelArray);
 			_isModelRead = true;
 		}
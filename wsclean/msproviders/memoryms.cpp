@@ -0,0 +1,408 @@
+#include "memoryms.h"
+
+#include "../multibanddata.h"
+#include "../progressbar.h"
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include <casacore/measures/Measures/MEpoch.h>
+
+#include <casacore/measures/TableMeasures/ScalarMeasColumn.h>
+
+#include <casacore/tables/Tables/ArrayColumn.h>
+#include <casacore/tables/Tables/ScalarColumn.h>
+
+template<typename T>
+void MemoryMS::Buffer<T>::Allocate(size_t n, bool useHugePages)
+{
+	release();
+	if(n == 0)
+		return;
+	if(useHugePages)
+	{
+		// Round up to a multiple of the (2 MB) huge page size, so that the kernel can back the
+		// full area with huge pages.
+		const size_t hugePageSize = 2*1024*1024;
+		const size_t length = ((n*sizeof(T) + hugePageSize - 1) / hugePageSize) * hugePageSize;
+		void* area = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(area == MAP_FAILED)
+		{
+			int errsv = errno;
+			char buffer[1024];
+			const char* msg = strerror_r(errsv, buffer, 1024);
+			throw std::runtime_error(std::string("Error allocating memory for reordered data: mmap() returned MAP_FAILED with error message: ") + msg);
+		}
+#ifdef MADV_HUGEPAGE
+		// Failure is not fatal: the area is then backed by normal pages
+		madvise(area, length, MADV_HUGEPAGE);
+#endif
+		_data = reinterpret_cast<T*>(area);
+		_isMapped = true;
+	}
+	else {
+		_data = new T[n];
+		_isMapped = false;
+	}
+	_size = n;
+}
+
+template<typename T>
+void MemoryMS::Buffer<T>::release()
+{
+	if(_data != 0)
+	{
+		if(_isMapped)
+		{
+			const size_t hugePageSize = 2*1024*1024;
+			munmap(_data, ((_size*sizeof(T) + hugePageSize - 1) / hugePageSize) * hugePageSize);
+		}
+		else
+			delete[] _data;
+		_data = 0;
+		_size = 0;
+	}
+}
+
+MemoryMS::MemoryMS(const Handle& handle, size_t partIndex, PolarizationEnum polarization, size_t bandIndex) :
+	_handle(handle),
+	_ms(handle._data->_msPath),
+	_currentRow(0)
+{
+	size_t polIndex = 0;
+	std::set<PolarizationEnum>::const_iterator p = handle._data->_polarizations.begin();
+	while(p != handle._data->_polarizations.end() && *p != polarization)
+	{
+		++p;
+		++polIndex;
+	}
+	if(p == handle._data->_polarizations.end() || partIndex >= handle._data->_channels.size())
+		throw std::runtime_error("Requested part was not reordered in memory");
+	_part = &handle._data->_parts[partIndex * handle._data->_polarizations.size() + polIndex];
+}
+
+void MemoryMS::Reset()
+{
+	_currentRow = 0;
+}
+
+bool MemoryMS::CurrentRowAvailable()
+{
+	return _currentRow < _handle._data->_meta.size();
+}
+
+void MemoryMS::NextRow()
+{
+	++_currentRow;
+}
+
+void MemoryMS::ReadMeta(double& u, double& v, double& w, size_t& dataDescId)
+{
+	const Handle::MetaRecord& record = _handle._data->_meta[_currentRow];
+	u = record.u;
+	v = record.v;
+	w = record.w;
+	dataDescId = record.dataDescId;
+}
+
+void MemoryMS::ReadData(std::complex<float>* buffer)
+{
+	const size_t channelCount = _part->channelCount;
+	memcpy(buffer, _part->data.data() + _currentRow * channelCount, channelCount * sizeof(std::complex<float>));
+}
+
+void MemoryMS::ReadModel(std::complex<float>* buffer)
+{
+	if(!_handle._data->_hasModel)
+		throw std::runtime_error("In-memory MS initialized without model");
+	const size_t channelCount = _part->channelCount;
+	memcpy(buffer, _part->model.data() + _currentRow * channelCount, channelCount * sizeof(std::complex<float>));
+}
+
+void MemoryMS::WriteModel(size_t rowId, std::complex<float>* buffer)
+{
+	if(!_handle._data->_hasModel)
+		throw std::runtime_error("In-memory MS initialized without model");
+	const size_t channelCount = _part->channelCount;
+	const float* weights = _part->weights.data() + rowId * channelCount;
+	std::complex<float>* modelWritePtr = _part->model.data() + rowId * channelCount;
+
+	// In case the value was not sampled in this pass, it will be set to infinite and should not overwrite the current
+	// value in the set.
+	for(size_t i=0; i!=channelCount; ++i)
+	{
+		buffer[i] *= weights[i];
+		if(std::isfinite(buffer[i].real()))
+			modelWritePtr[i] = buffer[i];
+	}
+}
+
+void MemoryMS::ReadWeights(float* buffer)
+{
+	const size_t channelCount = _part->channelCount;
+	memcpy(buffer, _part->weights.data() + _currentRow * channelCount, channelCount * sizeof(float));
+}
+
+void MemoryMS::ReadWeights(std::complex<float>* buffer)
+{
+	const size_t channelCount = _part->channelCount;
+	copyRealToComplex(buffer, _part->weights.data() + _currentRow * channelCount, channelCount);
+}
+
+double MemoryMS::StartTime()
+{
+	return _handle._data->_startTime;
+}
+
+void MemoryMS::MakeMSRowToRowIdMapping(std::vector<size_t>& msToId, const MSSelection& selection)
+{
+	makeMSRowToRowIdMapping(_ms, msToId, selection);
+}
+
+double MemoryMS::EstimateMemorySize(const std::string& msPath, const std::vector<ChannelRange>& channels, const MSSelection& selection, size_t polarizationCount, bool includeModel)
+{
+	casacore::MeasurementSet ms(msPath);
+	size_t startRow, endRow;
+	getRowRange(ms, selection, startRow, endRow);
+	size_t channelCount = 0;
+	for(std::vector<ChannelRange>::const_iterator c=channels.begin(); c!=channels.end(); ++c)
+		channelCount += c->end - c->start;
+	const double bytesPerValue = sizeof(std::complex<float>) + sizeof(float) + (includeModel ? sizeof(std::complex<float>) : 0);
+	return double(endRow - startRow) * (sizeof(Handle::MetaRecord) + double(channelCount) * polarizationCount * bytesPerValue);
+}
+
+MemoryMS::Handle MemoryMS::Partition(const std::string& msPath, const std::vector<ChannelRange>& channels, MSSelection& selection, const std::string& dataColumnName, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, bool useHugePages)
+{
+	const size_t channelParts = channels.size();
+	casacore::MeasurementSet ms(msPath);
+	std::vector<PolarizationEnum> msPolarizations = GetMSPolarizations(ms);
+
+	casacore::ROScalarColumn<int> antenna1Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1));
+	casacore::ROScalarColumn<int> antenna2Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
+	casacore::ROScalarColumn<int> fieldIdColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID));
+	casacore::ROScalarColumn<double> timeColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
+	casacore::MEpoch::ROScalarColumn timeEpochColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
+	casacore::ROArrayColumn<double> uvwColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
+	std::unique_ptr<casacore::ROArrayColumn<float>> weightColumn;
+	casacore::ROArrayColumn<casacore::Complex> dataColumn(ms, dataColumnName);
+	casacore::ROArrayColumn<bool> flagColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FLAG));
+	casacore::ROScalarColumn<int> dataDescIdColumn(ms, ms.columnName(casacore::MSMainEnums::DATA_DESC_ID));
+
+	const casacore::IPosition shape(dataColumn.shape(0));
+
+	bool isWeightDefined;
+	if(ms.isColumn(casacore::MSMainEnums::WEIGHT_SPECTRUM))
+	{
+		weightColumn.reset(new casacore::ROArrayColumn<float>(ms, casacore::MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM)));
+		isWeightDefined = weightColumn->isDefined(0);
+	} else {
+		isWeightDefined = false;
+	}
+	bool msHasWeights = false;
+	casacore::Array<float> weightArray(shape);
+	if(isWeightDefined)
+	{
+		casacore::IPosition modelShape = weightColumn->shape(0);
+		msHasWeights = (modelShape == shape);
+	}
+	if(!msHasWeights)
+	{
+		weightArray.set(1);
+		std::cout << "WARNING: This measurement set has no or an invalid WEIGHT_SPECTRUM column; all visibilities are assumed to have equal weight.\n";
+	}
+
+	size_t startRow, endRow;
+	getRowRange(ms, selection, startRow, endRow);
+
+	// Count selected rows, so that the buffers can be allocated exactly
+	size_t selectedRowCount = 0;
+	size_t timestep = selection.HasInterval() ? selection.IntervalStart() : 0;
+	double time = timeColumn(startRow);
+	for(size_t row=startRow; row!=endRow; ++row)
+	{
+		const int
+			a1 = antenna1Column(row), a2 = antenna2Column(row),
+			fieldId = fieldIdColumn(row);
+		casacore::Vector<double> uvw = uvwColumn(row);
+		if(time != timeColumn(row))
+		{
+			++timestep;
+			time = timeColumn(row);
+		}
+		if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
+			++selectedRowCount;
+	}
+	std::cout << "Reordering " << msPath << " (" << selectedRowCount << " selected rows) into " << channelParts << " x " << polsOut.size() << " parts in memory.\n";
+
+	Handle handle(msPath, channels, includeModel, modelUpdateRequired, polsOut, selection);
+	Handle::HandleData& data = *handle._data;
+	data._startTime = timeEpochColumn(startRow).getValue().get();
+	data._meta.resize(selectedRowCount);
+	size_t partIndex = 0;
+	for(size_t part=0; part!=channelParts; ++part)
+	{
+		const size_t partChannelCount = channels[part].end - channels[part].start;
+		for(size_t p=0; p!=polsOut.size(); ++p)
+		{
+			Handle::Part& memoryPart = data._parts[partIndex];
+			memoryPart.channelCount = partChannelCount;
+			memoryPart.data.Allocate(selectedRowCount * partChannelCount, useHugePages);
+			memoryPart.weights.Allocate(selectedRowCount * partChannelCount, useHugePages);
+			if(includeModel)
+			{
+				memoryPart.model.Allocate(selectedRowCount * partChannelCount, useHugePages);
+				std::fill_n(memoryPart.model.data(), memoryPart.model.size(), std::complex<float>(0.0, 0.0));
+			}
+			++partIndex;
+		}
+	}
+
+	timestep = selection.HasInterval() ? selection.IntervalStart() : 0;
+	time = timeColumn(startRow);
+
+	casacore::Array<std::complex<float>> dataArray(shape);
+	casacore::Array<bool> flagArray(shape);
+	size_t selectedRow = 0;
+	ProgressBar progress("Reordering");
+	for(size_t row=startRow; row!=endRow; ++row)
+	{
+		progress.SetProgress(row-startRow, endRow-startRow);
+		const int
+			a1 = antenna1Column(row), a2 = antenna2Column(row),
+			fieldId = fieldIdColumn(row);
+
+		if(time != timeColumn(row))
+		{
+			++timestep;
+			time = timeColumn(row);
+		}
+		casacore::Vector<double> uvwArray = uvwColumn(row);
+		if(selection.IsSelected(fieldId, timestep, a1, a2, uvwArray))
+		{
+			Handle::MetaRecord& meta = data._meta[selectedRow];
+			meta.u = uvwArray(0);
+			meta.v = uvwArray(1);
+			meta.w = uvwArray(2);
+			meta.dataDescId = dataDescIdColumn(row);
+
+			dataColumn.get(row, dataArray);
+			if(msHasWeights)
+				weightColumn->get(row, weightArray);
+			flagColumn.get(row, flagArray);
+
+			partIndex = 0;
+			for(size_t part=0; part!=channelParts; ++part)
+			{
+				const size_t
+					partStartCh = channels[part].start,
+					partEndCh = channels[part].end,
+					partChannelCount = partEndCh - partStartCh;
+				for(std::set<PolarizationEnum>::const_iterator p=polsOut.begin(); p!=polsOut.end(); ++p)
+				{
+					Handle::Part& memoryPart = data._parts[partIndex];
+					copyWeightedData(memoryPart.data.data() + selectedRow * partChannelCount, partStartCh, partEndCh, msPolarizations, dataArray, weightArray, flagArray, *p);
+					copyWeights(memoryPart.weights.data() + selectedRow * partChannelCount, partStartCh, partEndCh, msPolarizations, dataArray, weightArray, flagArray, *p);
+					++partIndex;
+				}
+			}
+			++selectedRow;
+		}
+	}
+	progress.SetProgress(endRow-startRow, endRow-startRow);
+
+	return handle;
+}
+
+void MemoryMS::writeModelToMS(const Handle& handle)
+{
+	const Handle::HandleData& data = *handle._data;
+	if(!data._hasModel)
+		return;
+	const std::set<PolarizationEnum>& pols = data._polarizations;
+	const size_t channelParts = data._channels.size();
+
+	casacore::MeasurementSet ms(data._msPath, casacore::Table::Update);
+	const std::vector<PolarizationEnum> msPolarizations = GetMSPolarizations(ms);
+	initializeModelColumn(ms);
+	casacore::ROScalarColumn<int> antenna1Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1));
+	casacore::ROScalarColumn<int> antenna2Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
+	casacore::ROScalarColumn<int> fieldIdColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID));
+	casacore::ROScalarColumn<double> timeColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
+	casacore::ArrayColumn<casacore::Complex> modelColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::MODEL_DATA));
+	casacore::ROArrayColumn<double> uvwColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
+
+	size_t maxChannelCount = 0;
+	for(size_t part=0; part!=channelParts; ++part)
+		maxChannelCount = std::max(maxChannelCount, data._channels[part].end - data._channels[part].start);
+	std::vector<std::complex<float>> modelDataBuffer(maxChannelCount);
+	casacore::Array<std::complex<float>> modelDataArray(modelColumn.shape(0));
+
+	size_t startRow, endRow;
+	getRowRange(ms, data._selection, startRow, endRow);
+
+	ProgressBar progress(std::string("Writing changed model back to ") + data._msPath);
+	size_t timestep = data._selection.HasInterval() ? data._selection.IntervalStart() : 0;
+	double time = timeColumn(startRow);
+	size_t selectedRow = 0;
+	for(size_t row=startRow; row!=endRow; ++row)
+	{
+		progress.SetProgress(row-startRow, endRow-startRow);
+		const int
+			a1 = antenna1Column(row), a2 = antenna2Column(row),
+			fieldId = fieldIdColumn(row);
+		casacore::Vector<double> uvw = uvwColumn(row);
+
+		if(time != timeColumn(row))
+		{
+			++timestep;
+			time = timeColumn(row);
+		}
+		if(data._selection.IsSelected(fieldId, timestep, a1, a2, uvw))
+		{
+			modelColumn.get(row, modelDataArray);
+			size_t partIndex = 0;
+			for(size_t part=0; part!=channelParts; ++part)
+			{
+				const size_t
+					partStartCh = data._channels[part].start,
+					partEndCh = data._channels[part].end,
+					partChannelCount = partEndCh - partStartCh;
+				for(std::set<PolarizationEnum>::const_iterator p=pols.begin(); p!=pols.end(); ++p)
+				{
+					const Handle::Part& memoryPart = data._parts[partIndex];
+					const std::complex<float>* model = memoryPart.model.data() + selectedRow * partChannelCount;
+					const float* weights = memoryPart.weights.data() + selectedRow * partChannelCount;
+					for(size_t i=0; i!=partChannelCount; ++i)
+					{
+						if(weights[i] == 0.0)
+							modelDataBuffer[i] = 0.0;
+						else
+							modelDataBuffer[i] = model[i] / weights[i];
+					}
+					reverseCopyData(modelDataArray, partStartCh, partEndCh, msPolarizations, modelDataBuffer.data(), *p);
+					++partIndex;
+				}
+			}
+			modelColumn.put(row, modelDataArray);
+			++selectedRow;
+		}
+	}
+	progress.SetProgress(endRow-startRow, endRow-startRow);
+}
+
+void MemoryMS::Handle::decrease()
+{
+	--(_data->_referenceCount);
+	if(_data->_referenceCount == 0)
+	{
+		if(_data->_modelUpdateRequired)
+			MemoryMS::writeModelToMS(*this);
+		delete _data;
+	}
+}
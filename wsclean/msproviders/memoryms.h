@@ -0,0 +1,161 @@
+#ifndef MEMORY_MS_H
+#define MEMORY_MS_H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <casacore/ms/MeasurementSets/MeasurementSet.h>
+
+#include "../polarizationenum.h"
+#include "../msselection.h"
+
+#include "msprovider.h"
+#include "partitionedms.h"
+
+/**
+ * An MSProvider that reorders the selected data of a measurement set into
+ * memory-resident buffers, one per channel part and polarization, in the same
+ * layout as the temporary files of @ref PartitionedMS. Once reordered,
+ * reading a pass over the data runs at memory bandwidth, which helps when
+ * many major iterations are performed on data that fits in memory.
+ *
+ * The buffers can optionally be backed by transparent huge pages. The model
+ * data is written back to the measurement set when the last @ref Handle is
+ * destroyed, if an update of the model is required.
+ */
+class MemoryMS : public MSProvider
+{
+public:
+	class Handle;
+
+	typedef PartitionedMS::ChannelRange ChannelRange;
+
+	MemoryMS(const Handle& handle, size_t partIndex, PolarizationEnum polarization, size_t bandIndex);
+
+	virtual casacore::MeasurementSet &MS() { return _ms; }
+
+	virtual size_t RowId() const { return _currentRow; }
+
+	virtual bool CurrentRowAvailable();
+
+	virtual void NextRow();
+
+	virtual void Reset();
+
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId);
+
+	virtual void ReadData(std::complex<float>* buffer);
+
+	virtual void ReadModel(std::complex<float>* buffer);
+
+	virtual void WriteModel(size_t rowId, std::complex<float>* buffer);
+
+	virtual void ReadWeights(float* buffer);
+
+	virtual void ReadWeights(std::complex<float>* buffer);
+
+	virtual void ReopenRW() { }
+
+	virtual double StartTime();
+
+	virtual void MakeMSRowToRowIdMapping(std::vector<size_t>& msToId, const MSSelection& selection);
+
+	static Handle Partition(const std::string& msPath, const std::vector<ChannelRange>& channels, MSSelection& selection, const std::string& dataColumnName, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, bool useHugePages);
+
+	/**
+	 * Upper limit of the number of bytes that are required to reorder the
+	 * given selection into memory. The row count of the selected interval
+	 * is used, so this does not require a pass over the data.
+	 */
+	static double EstimateMemorySize(const std::string& msPath, const std::vector<ChannelRange>& channels, const MSSelection& selection, size_t polarizationCount, bool includeModel);
+
+	template<typename T>
+	class Buffer
+	{
+	public:
+		Buffer() : _data(0), _size(0), _isMapped(false) { }
+		~Buffer() { release(); }
+
+		void Allocate(size_t n, bool useHugePages);
+
+		T* data() { return _data; }
+		const T* data() const { return _data; }
+		size_t size() const { return _size; }
+	private:
+		Buffer(const Buffer&) { }
+		void operator=(const Buffer&) { }
+		void release();
+
+		T* _data;
+		size_t _size;
+		bool _isMapped;
+	};
+
+	class Handle {
+	public:
+		friend class MemoryMS;
+
+		Handle(const Handle& handle) : _data(handle._data)
+		{
+			++(_data->_referenceCount);
+		}
+		~Handle() { decrease(); }
+		void operator=(const Handle& handle)
+		{
+			if(handle._data != _data)
+			{
+				decrease();
+				_data = handle._data;
+				++(_data->_referenceCount);
+			}
+		}
+	private:
+		struct MetaRecord
+		{
+			double u, v, w;
+			uint32_t dataDescId;
+		};
+		struct Part
+		{
+			size_t channelCount;
+			Buffer<std::complex<float>> data, model;
+			Buffer<float> weights;
+		};
+		struct HandleData
+		{
+			HandleData(const std::string& msPath, const std::vector<ChannelRange>& channels, bool hasModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polarizations, const MSSelection& selection) :
+			_msPath(msPath), _channels(channels), _hasModel(hasModel), _modelUpdateRequired(modelUpdateRequired),
+			_polarizations(polarizations), _selection(selection), _startTime(0.0),
+			_parts(new Part[channels.size() * polarizations.size()]), _referenceCount(1) { }
+
+			std::string _msPath;
+			std::vector<ChannelRange> _channels;
+			bool _hasModel, _modelUpdateRequired;
+			std::set<PolarizationEnum> _polarizations;
+			MSSelection _selection;
+			double _startTime;
+			std::vector<MetaRecord> _meta;
+			// Ordered as [channel part x polarization]
+			std::unique_ptr<Part[]> _parts;
+			size_t _referenceCount;
+		} *_data;
+
+		void decrease();
+		Handle(const std::string& msPath, const std::vector<ChannelRange>& channels, bool hasModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polarizations, const MSSelection& selection) :
+			_data(new HandleData(msPath, channels, hasModel, modelUpdateRequired, polarizations, selection))
+		{
+		}
+	};
+
+private:
+	static void writeModelToMS(const Handle& handle);
+
+	Handle _handle;
+	casacore::MeasurementSet _ms;
+	Handle::Part* _part;
+	size_t _currentRow;
+};
+
+#endif
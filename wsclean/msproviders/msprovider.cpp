@@ -558,6 +558,40 @@ void MSProvider::getRowRange(casacore::MeasurementSet& ms, const MSSelection& se
 	}
 }
 
+void MSProvider::makeMSRowToRowIdMapping(casacore::MeasurementSet& ms, std::vector<size_t>& msToId, const MSSelection& selection)
+{
+	const size_t nRow = ms.nrow();
+	casacore::ROArrayColumn<double> uvwColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
+	casacore::ROScalarColumn<int> antenna1Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1));
+	casacore::ROScalarColumn<int> antenna2Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
+	casacore::ROScalarColumn<int> fieldIdColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID));
+	casacore::ROScalarColumn<double> timeColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
+	size_t startRow, endRow;
+	getRowRange(ms, selection, startRow, endRow);
+	
+	msToId.assign(startRow, 0);
+	size_t currentRowId = 0;
+	size_t timestep = selection.HasInterval() ? selection.IntervalStart() : 0;
+	double time = timeColumn(startRow);
+	for(size_t row=startRow; row!=endRow; ++row)
+	{
+		msToId.push_back(currentRowId);
+		const int
+			a1 = antenna1Column(row), a2 = antenna2Column(row),
+			fieldId = fieldIdColumn(row);
+		casacore::Vector<double> uvw = uvwColumn(row);
+		if(time != timeColumn(row))
+		{
+			++timestep;
+			time = timeColumn(row);
+		}
+		if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
+			++currentRowId;
+	}
+	for(size_t i=0; i!=nRow-endRow; ++i)
+		msToId.push_back(0);
+}
+
 void MSProvider::initializeModelColumn(casacore::MeasurementSet& ms)
 {
 	casacore::ROArrayColumn<casacore::Complex> dataColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::DATA));
@@ -69,6 +69,8 @@ protected:
 	
 	static void initializeModelColumn(casacore::MeasurementSet& ms);
 	
+	static void makeMSRowToRowIdMapping(casacore::MeasurementSet& ms, std::vector<size_t>& msToId, const MSSelection& selection);
+	
 	MSProvider() { }
 private:
 	MSProvider(const MSProvider&) { }
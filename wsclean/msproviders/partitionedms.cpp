@@ -14,6 +14,7 @@
 #include <cstdio>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <vector>
@@ -76,6 +77,9 @@ PartitionedMS::PartitionedMS(const Handle& handle, size_t partIndex, Polarizatio
 		throw std::runtime_error("Error opening temporary data file");
 	_weightBuffer.resize(_partHeader.channelCount);
 	_modelBuffer.resize(_partHeader.channelCount);
+	_dataRowSize = ReorderStorage::RowSize(_partHeader.StorageFormat(), _partHeader.channelCount*2);
+	_weightRowSize = ReorderStorage::RowSize(_partHeader.StorageFormat(), _partHeader.channelCount);
+	_encodedBuffer.resize(std::max(_dataRowSize, _weightRowSize));
 }
 
 PartitionedMS::~PartitionedMS()
@@ -112,7 +116,7 @@ void PartitionedMS::NextRow()
 	if(_currentRow < _metaHeader.selectedRowCount)
 	{
 		if(_readPtrIsOk)
-			_dataFile.seekg(_partHeader.channelCount * sizeof(std::complex<float>), std::ios::cur);
+			_dataFile.seekg(_dataRowSize, std::ios::cur);
 		else
 			_readPtrIsOk = true;
 		
@@ -122,7 +126,7 @@ void PartitionedMS::NextRow()
 			_metaPtrIsOk = true;
 		
 		if(_weightPtrIsOk && _partHeader.hasWeights)
-			_weightFile.seekg(_partHeader.channelCount * sizeof(float), std::ios::cur);
+			_weightFile.seekg(_weightRowSize, std::ios::cur);
 		_weightPtrIsOk = true;
 	}
 }
@@ -145,23 +149,42 @@ void PartitionedMS::ReadData(std::complex<float>* buffer)
 {
 	if(!_readPtrIsOk)
 	{
-		_dataFile.seekg(-_partHeader.channelCount * sizeof(std::complex<float>), std::ios::cur);
+		_dataFile.seekg(-std::streamoff(_dataRowSize), std::ios::cur);
 	}
 #ifdef REDUNDANT_VALIDATION
 	size_t pos = size_t(_dataFile.tellg()) - sizeof(PartHeader);
-	size_t fact = _partHeader.hasModel ? 2 : 1;
-	if(pos != fact * _currentRow * _partHeader.channelCount * sizeof(std::complex<float>))
+	if(pos != _currentRow * _dataRowSize)
 	{
 		std::ostringstream s;
-		s << "Not on right pos: " << pos << " instead of " << fact * _currentRow * _partHeader.channelCount * sizeof(std::complex<float>) <<
-			" (row " << (pos / (fact * _partHeader.channelCount * sizeof(std::complex<float>))) << " instead of " << _currentRow << ")";
+		s << "Not on right pos: " << pos << " instead of " << _currentRow * _dataRowSize <<
+			" (row " << (pos / _dataRowSize) << " instead of " << _currentRow << ")";
 		throw std::runtime_error(s.str());
 	}
 #endif
-	_dataFile.read(reinterpret_cast<char*>(buffer), _partHeader.channelCount * sizeof(std::complex<float>));
+	readDataRow(buffer);
 	_readPtrIsOk = false;
 }
 
+void PartitionedMS::readDataRow(std::complex<float>* buffer)
+{
+	if(_partHeader.StorageFormat() == ReorderStorage::FloatStorage)
+		_dataFile.read(reinterpret_cast<char*>(buffer), _dataRowSize);
+	else {
+		_dataFile.read(_encodedBuffer.data(), _dataRowSize);
+		ReorderStorage::Decode(_partHeader.StorageFormat(), buffer, _encodedBuffer.data(), _partHeader.channelCount);
+	}
+}
+
+void PartitionedMS::readWeightRow(float* buffer)
+{
+	if(_partHeader.StorageFormat() == ReorderStorage::FloatStorage)
+		_weightFile.read(reinterpret_cast<char*>(buffer), _weightRowSize);
+	else {
+		_weightFile.read(_encodedBuffer.data(), _weightRowSize);
+		ReorderStorage::Decode(_partHeader.StorageFormat(), buffer, _encodedBuffer.data(), _partHeader.channelCount);
+	}
+}
+
 void PartitionedMS::ReadModel(std::complex<float>* buffer)
 {
 #ifdef REDUNDANT_VALIDATION
@@ -178,8 +201,8 @@ void PartitionedMS::WriteModel(size_t rowId, std::complex<float>* buffer)
 	if(!_partHeader.hasModel)
 		throw std::runtime_error("Partitioned MS initialized without model");
 #endif
-	_weightFile.seekg(_partHeader.channelCount * sizeof(float) * rowId, std::ios::beg);
-	_weightFile.read(reinterpret_cast<char*>(_weightBuffer.data()), _partHeader.channelCount * sizeof(float));
+	_weightFile.seekg(_weightRowSize * rowId, std::ios::beg);
+	readWeightRow(_weightBuffer.data());
 	for(size_t i=0; i!=_partHeader.channelCount; ++i)
 		buffer[i] *= _weightBuffer[i];
 	
@@ -198,9 +221,9 @@ void PartitionedMS::WriteModel(size_t rowId, std::complex<float>* buffer)
 void PartitionedMS::ReadWeights(std::complex<float>* buffer)
 {
 	if(!_weightPtrIsOk)
-		_weightFile.seekg(-_partHeader.channelCount * sizeof(float), std::ios::cur);
+		_weightFile.seekg(-std::streamoff(_weightRowSize), std::ios::cur);
 	float* displacedBuffer = reinterpret_cast<float*>(buffer)+_partHeader.channelCount;
-	_weightFile.read(reinterpret_cast<char*>(displacedBuffer), _partHeader.channelCount * sizeof(float));
+	readWeightRow(displacedBuffer);
 	_weightPtrIsOk = false;
 	copyRealToComplex(buffer, displacedBuffer, _partHeader.channelCount);
 }
@@ -208,8 +231,8 @@ void PartitionedMS::ReadWeights(std::complex<float>* buffer)
 void PartitionedMS::ReadWeights(float* buffer)
 {
 	if(!_weightPtrIsOk)
-		_weightFile.seekg(-_partHeader.channelCount * sizeof(float), std::ios::cur);
-	_weightFile.read(reinterpret_cast<char*>(buffer), _partHeader.channelCount * sizeof(float));
+		_weightFile.seekg(-std::streamoff(_weightRowSize), std::ios::cur);
+	readWeightRow(buffer);
 	_weightPtrIsOk = false;
 }
 
@@ -276,8 +299,10 @@ struct PartitionFiles
  * - Data    (single polarization, as requested)
  * - Weights (single, only needed when imaging PSF)
  * - Model, optionally
+ * Data and weights are stored in the requested storage format (see
+ * @ref ReorderStorage); the model is always stored as raw complex floats.
  */
-PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::vector<ChannelRange>& channels, MSSelection& selection, const string& dataColumnName, bool includeWeights, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, const std::string& temporaryDirectory)
+PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::vector<ChannelRange>& channels, MSSelection& selection, const string& dataColumnName, bool includeWeights, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, const std::string& temporaryDirectory, ReorderStorage::Format storageFormat)
 {
 	std::set<size_t> bands;
 	size_t channelParts = channels.size();
@@ -386,6 +411,10 @@ PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::
 	
 	std::vector<std::complex<float>> dataBuffer(polarizationCount * channelCount);
 	std::vector<float> weightBuffer(polarizationCount * channelCount);
+	std::vector<char> encodedBuffer(ReorderStorage::RowSize(storageFormat, channelCount*2));
+	std::vector<float> decodedBuffer(channelCount*2);
+	ReorderStorage::ErrorStatistics dataErrors, weightErrors;
+	const bool isCompressed = (storageFormat != ReorderStorage::FloatStorage);
 	
 	casacore::Array<std::complex<float>> dataArray(shape);
 	casacore::Array<bool> flagArray(shape);
@@ -432,15 +461,24 @@ PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::
 				for(std::set<PolarizationEnum>::const_iterator p=polsOut.begin(); p!=polsOut.end(); ++p)
 				{
 					PartitionFiles& f = files[fileIndex][band];
+					const size_t partChannelCount = partEndCh - partStartCh;
 					copyWeightedData(dataBuffer.data(), partStartCh, partEndCh, msPolarizations, dataArray, weightArray, flagArray, *p);
-					f.data->write(reinterpret_cast<char*>(dataBuffer.data()), (partEndCh - partStartCh) * sizeof(std::complex<float>));
+					if(isCompressed)
+						ReorderStorage::EncodeAndMeasure(storageFormat, encodedBuffer.data(), reinterpret_cast<float*>(dataBuffer.data()), partChannelCount*2, decodedBuffer.data(), dataErrors);
+					else
+						ReorderStorage::Encode(storageFormat, encodedBuffer.data(), dataBuffer.data(), partChannelCount);
+					f.data->write(encodedBuffer.data(), ReorderStorage::RowSize(storageFormat, partChannelCount*2));
 					if(f.data->bad())
 						throw std::runtime_error("Error writing to temporary data file");
 					
 					if(includeWeights)
 					{
 						copyWeights(weightBuffer.data(), partStartCh, partEndCh, msPolarizations, dataArray, weightArray, flagArray, *p);
-						f.weight->write(reinterpret_cast<char*>(weightBuffer.data()), (partEndCh - partStartCh) * sizeof(float));
+						if(isCompressed)
+							ReorderStorage::EncodeAndMeasure(storageFormat, encodedBuffer.data(), weightBuffer.data(), partChannelCount, decodedBuffer.data(), weightErrors);
+						else
+							ReorderStorage::Encode(storageFormat, encodedBuffer.data(), weightBuffer.data(), partChannelCount);
+						f.weight->write(encodedBuffer.data(), ReorderStorage::RowSize(storageFormat, partChannelCount));
 						if(f.weight->bad())
 							throw std::runtime_error("Error writing to temporary weights file");
 					}
@@ -451,11 +489,19 @@ PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::
 	}
 	progress1.SetProgress(ms.nrow(), ms.nrow());
 	
+	if(isCompressed)
+	{
+		std::cout << "Reordered data stored as " << ReorderStorage::ToString(storageFormat) << ": relative rms error of data = " << dataErrors.RelativeRMSError() << ", max abs error = " << dataErrors.MaxError() << " (max abs value " << dataErrors.MaxValue() << ")\n";
+		if(includeWeights)
+			std::cout << "Relative rms error of weights = " << weightErrors.RelativeRMSError() << ", max abs error = " << weightErrors.MaxError() << " (max weight " << weightErrors.MaxValue() << ")\n";
+	}
+	
 	// Write header to parts and write model files
 	PartHeader header;
 	memset(&header, 0, sizeof(PartHeader));
 	header.hasModel = includeModel;
 	header.hasWeights = includeWeights;
+	header.storageFormat = storageFormat;
 	fileIndex = 0;
 	dataBuffer.assign(channelCount, 0.0);
 	std::unique_ptr<ProgressBar> progress2;
@@ -556,6 +602,7 @@ void PartitionedMS::unpartition(const PartitionedMS::Handle& handle)
 		
 		std::vector<std::complex<float>> modelDataBuffer(1 + channelCount / channelParts);
 		std::vector<float> weightBuffer(1 + channelCount / channelParts);
+		std::vector<char> encodedWeightBuffer(ReorderStorage::RowSize(firstPartHeader.StorageFormat(), 1 + channelCount / channelParts));
 		casacore::Array<std::complex<float>> modelDataArray(shape);
 	
 		ProgressBar progress(std::string("Writing changed model back to ") + msPath.data());
@@ -589,9 +636,17 @@ void PartitionedMS::unpartition(const PartitionedMS::Handle& handle)
 						modelFiles[fileIndex]->read(reinterpret_cast<char*>(modelDataBuffer.data()), (partEndCh - partStartCh) * sizeof(std::complex<float>));
 						if(firstPartHeader.hasWeights)
 						{
-							weightFiles[fileIndex]->read(reinterpret_cast<char*>(weightBuffer.data()), (partEndCh - partStartCh) * sizeof(float));
+							weightFiles[fileIndex]->read(encodedWeightBuffer.data(), ReorderStorage::RowSize(firstPartHeader.StorageFormat(), partEndCh - partStartCh));
+							ReorderStorage::Decode(firstPartHeader.StorageFormat(), weightBuffer.data(), encodedWeightBuffer.data(), partEndCh - partStartCh);
+							// A small weight can decode to zero in a compressed format, in which case the
+							// weighted model is zero as well and the model can not be recovered
 							for(size_t i=0; i!=partEndCh - partStartCh; ++i)
-								modelDataBuffer[i] /= weightBuffer[i];
+							{
+								if(weightBuffer[i] == 0.0)
+									modelDataBuffer[i] = 0.0;
+								else
+									modelDataBuffer[i] /= weightBuffer[i];
+							}
 						}
 						if(modelFiles[fileIndex]->bad())
 							throw std::runtime_error("Error writing to temporary data file");
@@ -650,34 +705,5 @@ void PartitionedMS::Handle::decrease()
 
 void PartitionedMS::MakeMSRowToRowIdMapping(std::vector<size_t>& msToId, const MSSelection& selection)
 {
-	const size_t nRow = _ms.nrow();
-	casacore::ROArrayColumn<double> uvwColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
-	casacore::ROScalarColumn<int> antenna1Column(_ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1));
-	casacore::ROScalarColumn<int> antenna2Column(_ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
-	casacore::ROScalarColumn<int> fieldIdColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID));
-	casacore::ROScalarColumn<double> timeColumn(_ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
-	size_t startRow, endRow;
-	getRowRange(_ms, selection, startRow, endRow);
-	
-	msToId.assign(startRow, 0);
-	size_t currentRowId = 0;
-	size_t timestep = selection.HasInterval() ? selection.IntervalStart() : 0;
-	double time = timeColumn(startRow);
-	for(size_t row=startRow; row!=endRow; ++row)
-	{
-		msToId.push_back(currentRowId);
-		const int
-			a1 = antenna1Column(row), a2 = antenna2Column(row),
-			fieldId = fieldIdColumn(row);
-		casacore::Vector<double> uvw = uvwColumn(row);
-		if(time != timeColumn(row))
-		{
-			++timestep;
-			time = timeColumn(row);
-		}
-		if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
-			++currentRowId;
-	}
-	for(size_t i=0; i!=nRow-endRow; ++i)
-		msToId.push_back(0);
+	makeMSRowToRowIdMapping(_ms, msToId, selection);
 }
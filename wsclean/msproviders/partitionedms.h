@@ -13,6 +13,7 @@
 #include "../msselection.h"
 
 #include "msprovider.h"
+#include "reorderstorage.h"
 
 class PartitionedMS : public MSProvider
 {
@@ -61,7 +62,7 @@ public:
 	
 	virtual double StartTime() { return _metaHeader.startTime; }
 	
-	static Handle Partition(const string& msPath, const std::vector<ChannelRange>& channels, class MSSelection& selection, const string& dataColumnName, bool includeWeights, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, const std::string& temporaryDirectory);
+	static Handle Partition(const string& msPath, const std::vector<ChannelRange>& channels, class MSSelection& selection, const string& dataColumnName, bool includeWeights, bool includeModel, bool modelUpdateRequired, const std::set<PolarizationEnum>& polsOut, const std::string& temporaryDirectory, ReorderStorage::Format storageFormat);
 	
 	class Handle {
 	public:
@@ -114,6 +115,8 @@ private:
 	bool _readPtrIsOk, _metaPtrIsOk, _weightPtrIsOk;
 	ao::uvector<float> _weightBuffer;
 	ao::uvector<std::complex<float>> _modelBuffer;
+	ao::uvector<char> _encodedBuffer;
+	size_t _dataRowSize, _weightRowSize;
 	int _fd;
 	
 	struct MetaHeader
@@ -133,8 +136,14 @@ private:
 		uint64_t channelStart;
 		uint32_t bandIndex;
 		bool hasModel, hasWeights;
+		uint32_t storageFormat;
+		
+		ReorderStorage::Format StorageFormat() const { return ReorderStorage::Format(storageFormat); }
 	} _partHeader;
 	
+	void readDataRow(std::complex<float>* buffer);
+	void readWeightRow(float* buffer);
+	
 	static std::string getPartPrefix(const std::string& msPath, size_t partIndex, PolarizationEnum pol, size_t bandIndex, const std::string& tempDir);
 	static std::string getMetaFilename(const std::string& msPath, const std::string& tempDir);
 };
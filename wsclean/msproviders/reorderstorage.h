@@ -0,0 +1,247 @@
+#ifndef REORDER_STORAGE_H
+#define REORDER_STORAGE_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Encodes and decodes the rows of the reordered data and weight files of
+ * @ref PartitionedMS. Besides the default raw float storage, two lossy
+ * formats are supported that halve the size of the temporary files:
+ *
+ * - BFloat16Storage: every float is truncated to its upper 16 bits with
+ *   round-to-nearest-even. The relative error of each value is at most 2^-9.
+ * - ScaledInt16Storage: every row is stored as 16 bit integers relative to
+ *   a per-row float scale, which is the largest absolute value in the row.
+ *   The absolute error of each value is at most half a step of the row
+ *   maximum / 32767, plus the rounding of the float multiplications.
+ *   Non-finite values are stored as zero and do not affect the scale.
+ *
+ * The model files are not affected, since they are memory mapped and updated
+ * in place.
+ */
+class ReorderStorage
+{
+public:
+	enum Format {
+		FloatStorage = 0,
+		BFloat16Storage = 1,
+		ScaledInt16Storage = 2
+	};
+
+	/**
+	 * Keeps track of the error that the encoding introduces, so that the
+	 * loss of a compressed format can be reported after reordering.
+	 */
+	class ErrorStatistics
+	{
+	public:
+		ErrorStatistics() : _count(0), _sumSqValue(0.0), _sumSqError(0.0), _maxError(0.0), _maxValue(0.0)
+		{ }
+
+		/**
+		 * Non-finite original values are not counted.
+		 */
+		void Add(float original, float decoded)
+		{
+			if(!std::isfinite(original))
+				return;
+			double error = std::fabs(double(original) - double(decoded));
+			_sumSqValue += double(original) * double(original);
+			_sumSqError += error * error;
+			_maxError = std::max(_maxError, error);
+			_maxValue = std::max(_maxValue, std::fabs(double(original)));
+			++_count;
+		}
+
+		void Combine(const ErrorStatistics& rhs)
+		{
+			_count += rhs._count;
+			_sumSqValue += rhs._sumSqValue;
+			_sumSqError += rhs._sumSqError;
+			_maxError = std::max(_maxError, rhs._maxError);
+			_maxValue = std::max(_maxValue, rhs._maxValue);
+		}
+
+		size_t Count() const { return _count; }
+		double RMSValue() const { return _count==0 ? 0.0 : std::sqrt(_sumSqValue / _count); }
+		double RMSError() const { return _count==0 ? 0.0 : std::sqrt(_sumSqError / _count); }
+		double MaxError() const { return _maxError; }
+		double MaxValue() const { return _maxValue; }
+		/**
+		 * Ratio of the RMS of the error over the RMS of the values.
+		 */
+		double RelativeRMSError() const { return _sumSqValue==0.0 ? 0.0 : std::sqrt(_sumSqError / _sumSqValue); }
+	private:
+		size_t _count;
+		double _sumSqValue, _sumSqError, _maxError, _maxValue;
+	};
+
+	static Format Parse(const std::string& str)
+	{
+		if(str == "none" || str == "float")
+			return FloatStorage;
+		else if(str == "bf16" || str == "bfloat16")
+			return BFloat16Storage;
+		else if(str == "int16" || str == "scaled-int16")
+			return ScaledInt16Storage;
+		else
+			throw std::runtime_error("Unknown reorder storage format: " + str + " (should be none, bf16 or int16)");
+	}
+
+	static std::string ToString(Format format)
+	{
+		switch(format)
+		{
+			case FloatStorage: return "float";
+			case BFloat16Storage: return "bfloat16";
+			case ScaledInt16Storage: return "scaled int16";
+		}
+		return "unknown";
+	}
+
+	/**
+	 * Number of bytes that one row of @p valueCount floats occupies on disk.
+	 * A complex row of n channels has a valueCount of 2n.
+	 */
+	static size_t RowSize(Format format, size_t valueCount)
+	{
+		switch(format)
+		{
+			case FloatStorage:
+				return valueCount * sizeof(float);
+			case BFloat16Storage:
+				return valueCount * sizeof(uint16_t);
+			case ScaledInt16Storage:
+				return sizeof(float) + valueCount * sizeof(int16_t);
+		}
+		throw std::runtime_error("Invalid reorder storage format");
+	}
+
+	/**
+	 * Encode @p valueCount floats into @p dest, which should hold
+	 * RowSize(format, valueCount) bytes.
+	 */
+	static void Encode(Format format, char* dest, const float* source, size_t valueCount)
+	{
+		switch(format)
+		{
+			case FloatStorage:
+				memcpy(dest, source, valueCount * sizeof(float));
+				break;
+			case BFloat16Storage:
+			{
+				uint16_t* destPtr = reinterpret_cast<uint16_t*>(dest);
+				for(size_t i=0; i!=valueCount; ++i)
+					destPtr[i] = toBFloat16(source[i]);
+			} break;
+			case ScaledInt16Storage:
+			{
+				// Rows have a fixed size, so a non-finite value can not be stored
+				// uncompressed: it is stored as zero instead
+				float maxValue = 0.0;
+				for(size_t i=0; i!=valueCount; ++i)
+				{
+					if(std::isfinite(source[i]))
+						maxValue = std::max(maxValue, std::fabs(source[i]));
+				}
+				float scale = maxValue / 32767.0f;
+				// The rounded scale can make the decoded maximum overflow for values near the largest float
+				if(!std::isfinite(scale * 32767.0f))
+					scale = std::nextafter(scale, 0.0f);
+				// A scale that has no finite inverse (when all values are denormal) stores zeros
+				if(!std::isfinite(1.0f / scale))
+					scale = 0.0;
+				memcpy(dest, &scale, sizeof(float));
+				int16_t* destPtr = reinterpret_cast<int16_t*>(dest + sizeof(float));
+				if(scale == 0.0)
+					std::fill(destPtr, destPtr + valueCount, 0);
+				else {
+					const float invScale = 1.0f / scale;
+					for(size_t i=0; i!=valueCount; ++i)
+					{
+						if(std::isfinite(source[i]))
+							destPtr[i] = int16_t(std::max(-32767L, std::min(32767L, lrintf(source[i] * invScale))));
+						else
+							destPtr[i] = 0;
+					}
+				}
+			} break;
+		}
+	}
+
+	/**
+	 * Inverse of @ref Encode().
+	 */
+	static void Decode(Format format, float* dest, const char* source, size_t valueCount)
+	{
+		switch(format)
+		{
+			case FloatStorage:
+				memcpy(dest, source, valueCount * sizeof(float));
+				break;
+			case BFloat16Storage:
+			{
+				const uint16_t* sourcePtr = reinterpret_cast<const uint16_t*>(source);
+				for(size_t i=0; i!=valueCount; ++i)
+					dest[i] = fromBFloat16(sourcePtr[i]);
+			} break;
+			case ScaledInt16Storage:
+			{
+				float scale;
+				memcpy(&scale, source, sizeof(float));
+				const int16_t* sourcePtr = reinterpret_cast<const int16_t*>(source + sizeof(float));
+				for(size_t i=0; i!=valueCount; ++i)
+					dest[i] = float(sourcePtr[i]) * scale;
+			} break;
+		}
+	}
+
+	static void Encode(Format format, char* dest, const std::complex<float>* source, size_t channelCount)
+	{
+		Encode(format, dest, reinterpret_cast<const float*>(source), channelCount*2);
+	}
+
+	static void Decode(Format format, std::complex<float>* dest, const char* source, size_t channelCount)
+	{
+		Decode(format, reinterpret_cast<float*>(dest), source, channelCount*2);
+	}
+
+	/**
+	 * Encodes a row and adds the difference between the original and the
+	 * decoded values to the statistics. @p scratch should hold @p valueCount floats.
+	 */
+	static void EncodeAndMeasure(Format format, char* dest, const float* source, size_t valueCount, float* scratch, ErrorStatistics& statistics)
+	{
+		Encode(format, dest, source, valueCount);
+		Decode(format, scratch, dest, valueCount);
+		for(size_t i=0; i!=valueCount; ++i)
+			statistics.Add(source[i], scratch[i]);
+	}
+
+private:
+	static uint16_t toBFloat16(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(float));
+		if((bits & 0x7fffffff) > 0x7f800000)
+			return uint16_t((bits >> 16) | 0x0040); // keep NaNs quiet
+		bits += 0x7fff + ((bits >> 16) & 1);
+		return uint16_t(bits >> 16);
+	}
+
+	static float fromBFloat16(uint16_t value)
+	{
+		uint32_t bits = uint32_t(value) << 16;
+		float result;
+		memcpy(&result, &bits, sizeof(float));
+		return result;
+	}
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "selectedrowindex.h"
+
+#include <casacore/ms/MeasurementSets/MeasurementSet.h>
+#include <casacore/tables/Tables/ArrayColumn.h>
+#include <casacore/tables/Tables/ScalarColumn.h>
+
+#include <iostream>
+
+const size_t SelectedRowIndex::_maxCacheSize = 4;
+std::list<SelectedRowIndex::CacheEntry> SelectedRowIndex::_cache;
+boost::mutex SelectedRowIndex::_cacheMutex;
+
+SelectedRowIndex::SelectedRowIndex(casacore::MeasurementSet& ms, const MSSelection& selection, size_t startRow, size_t endRow)
+{
+	casacore::ROScalarColumn<int> antenna1Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1));
+	casacore::ROScalarColumn<int> antenna2Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
+	casacore::ROScalarColumn<int> fieldIdColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FIELD_ID));
+	casacore::ROScalarColumn<int> dataDescIdColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::DATA_DESC_ID));
+	casacore::ROScalarColumn<double> timeColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::TIME));
+	casacore::ROArrayColumn<double> uvwColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
+
+	if(startRow == endRow)
+		return;
+	size_t timestep = selection.HasInterval() ? selection.IntervalStart() : 0;
+	double time = timeColumn(startRow);
+	for(size_t row=startRow; row!=endRow; ++row)
+	{
+		const int
+			a1 = antenna1Column(row), a2 = antenna2Column(row),
+			fieldId = fieldIdColumn(row);
+		casacore::Vector<double> uvw = uvwColumn(row);
+		if(time != timeColumn(row))
+		{
+			++timestep;
+			time = timeColumn(row);
+		}
+		if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
+		{
+			Row selectedRow;
+			selectedRow.row = row;
+			selectedRow.u = uvw(0);
+			selectedRow.v = uvw(1);
+			selectedRow.w = uvw(2);
+			selectedRow.dataDescId = dataDescIdColumn(row);
+			_rows.push_back(selectedRow);
+		}
+	}
+	_rows.shrink_to_fit();
+}
+
+std::shared_ptr<const SelectedRowIndex> SelectedRowIndex::Get(casacore::MeasurementSet& ms, const std::string& msPath, const MSSelection& selection, size_t startRow, size_t endRow)
+{
+	boost::mutex::scoped_lock lock(_cacheMutex);
+	for(std::list<CacheEntry>::iterator i=_cache.begin(); i!=_cache.end(); ++i)
+	{
+		if(i->msPath == msPath && i->selection.HasSameRowSelection(selection))
+		{
+			// Move to front, so that the least recently used index is removed first
+			_cache.splice(_cache.begin(), _cache, i);
+			return _cache.front().index;
+		}
+	}
+
+	std::cout << "Indexing selected rows of " << msPath << "... " << std::flush;
+	CacheEntry entry;
+	entry.msPath = msPath;
+	entry.selection = selection;
+	entry.index.reset(new SelectedRowIndex(ms, selection, startRow, endRow));
+	std::cout << "DONE (" << entry.index->size() << " rows)\n";
+	_cache.push_front(entry);
+	if(_cache.size() > _maxCacheSize)
+		_cache.pop_back();
+	return entry.index;
+}
+
+void SelectedRowIndex::ClearCache()
+{
+	boost::mutex::scoped_lock lock(_cacheMutex);
+	_cache.clear();
+}
@@ -0,0 +1,74 @@
+#ifndef SELECTED_ROW_INDEX_H
+#define SELECTED_ROW_INDEX_H
+
+#include "../msselection.h"
+
+#include <boost/thread/mutex.hpp>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace casacore {
+	class MeasurementSet;
+}
+
+/**
+ * List of the rows of a measurement set that are selected by an @ref MSSelection,
+ * together with the values that are needed for iterating over them (uvw and
+ * data description id). Evaluating the selection requires reading a few columns for
+ * every row in the measurement set, which is expensive when only a small subset is selected.
+ *
+ * Indices are shared through Get(): all providers that iterate over the same
+ * measurement set with the same row selection use the same index. Only the most
+ * recently used indices are kept.
+ */
+class SelectedRowIndex
+{
+public:
+	struct Row
+	{
+		size_t row;
+		double u, v, w;
+		uint32_t dataDescId;
+	};
+
+	typedef std::vector<Row>::const_iterator const_iterator;
+
+	/**
+	 * Returns the index for the given selection, creating it if it is not yet in the cache.
+	 * The row range should be the one that corresponds with the interval of the selection.
+	 * This function is thread safe.
+	 */
+	static std::shared_ptr<const SelectedRowIndex> Get(casacore::MeasurementSet& ms, const std::string& msPath, const MSSelection& selection, size_t startRow, size_t endRow);
+
+	/**
+	 * Removes all indices from the cache. Providers that hold an index keep it until they are destroyed.
+	 */
+	static void ClearCache();
+
+	size_t size() const { return _rows.size(); }
+	bool empty() const { return _rows.empty(); }
+	const Row& operator[](size_t index) const { return _rows[index]; }
+	const_iterator begin() const { return _rows.begin(); }
+	const_iterator end() const { return _rows.end(); }
+
+private:
+	SelectedRowIndex(casacore::MeasurementSet& ms, const MSSelection& selection, size_t startRow, size_t endRow);
+
+	std::vector<Row> _rows;
+
+	struct CacheEntry
+	{
+		std::string msPath;
+		MSSelection selection;
+		std::shared_ptr<const SelectedRowIndex> index;
+	};
+	static const size_t _maxCacheSize;
+	static std::list<CacheEntry> _cache;
+	static boost::mutex _cacheMutex;
+};
+
+#endif
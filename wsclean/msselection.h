@@ -30,6 +30,9 @@ public:
 	
 	size_t FieldId() const { return _fieldId; }
 	
+	double MinUVWInM() const { return _minUVWInM; }
+	double MaxUVWInM() const { return _maxUVWInM; }
+	
 	bool IsSelected(size_t fieldId, size_t timestep, size_t antenna1, size_t antenna2, const casacore::Vector<double>& uvw) const
 	{
 		if(HasMinUVWInM() || HasMaxUVWInM())
@@ -102,6 +105,17 @@ public:
 	{
 		_maxUVWInM = maxUVW;
 	}
+	/**
+	 * Whether both selections select the same rows. Only the channel and band selection
+	 * may differ, since these do not influence which rows are selected.
+	 */
+	bool HasSameRowSelection(const MSSelection& rhs) const
+	{
+		return _fieldId == rhs._fieldId &&
+			_startTimestep == rhs._startTimestep && _endTimestep == rhs._endTimestep &&
+			_minUVWInM == rhs._minUVWInM && _maxUVWInM == rhs._maxUVWInM &&
+			_autoCorrelations == rhs._autoCorrelations;
+	}
 	static MSSelection Everything() { return MSSelection(); }
 private:
 	size_t _fieldId, _bandId;
@@ -1,11 +1,16 @@
 #include "multiscalealgorithm.h"
 
 #include "multiscaletransforms.h"
+#include "subminorloop.h"
 
+#include "../fftconvolver.h"
+
+#include "../deconvolution/peaktracker.h"
 #include "../deconvolution/simpleclean.h"
 
-MultiScaleAlgorithm::MultiScaleAlgorithm(ImageBufferAllocator& allocator, size_t width, size_t height, double beamScale, double threshold, double gain, double mGain, double borderRatio, bool allowNegativeComponents, double scaleBias, size_t threadCount) :
+MultiScaleAlgorithm::MultiScaleAlgorithm(ImageBufferAllocator& allocator, MultiScaleTransforms& transforms, size_t width, size_t height, double beamScale, double threshold, double gain, double mGain, double borderRatio, bool allowNegativeComponents, double scaleBias, size_t threadCount) :
 	_allocator(allocator),
+	_transforms(transforms),
 	_width(width),
 	_height(height),
 	_beamScale(beamScale),
@@ -17,10 +22,19 @@ MultiScaleAlgorithm::MultiScaleAlgorithm(ImageBufferAllocator& allocator, size_t
 	_scaleBias(scaleBias),
 	_threadCount(threadCount),
 	_cleanMask(0),
+	_fastSubMinorLoop(false),
+	_psfCropTolerance(0.0),
 	_verbose(false)
 {
 }
 
+void MultiScaleAlgorithm::SetCleanMask(const bool* cleanMask)
+{
+	_cleanMask = cleanMask;
+	if(_cleanMask != 0)
+		_maskSpans = SimpleClean::MakeMaskSpans(_cleanMask, _width, _height, _borderRatio);
+}
+
 void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIter, DynamicSet& modelSet, DynamicSet& dirtySet, const ao::uvector<const double*>& psfs, bool& reachedMajorThreshold)
 {
 	// Rough overview of the procedure:
@@ -48,8 +62,7 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 	ImageBufferAllocator::Ptr scratch, integratedScratch;
 	_allocator.Allocate(_width*_height, scratch);
 	_allocator.Allocate(_width*_height, integratedScratch);
-	std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]> convolvedPSFs(
-		new std::unique_ptr<ImageBufferAllocator::Ptr[]>[dirtySet.PSFCount()]);
+	ConvolvedPSFs convolvedPSFs(dirtySet.PSFCount());
 	dirtySet.GetIntegratedPSF(integratedScratch.data(), psfs);
 	convolvePSFs(convolvedPSFs[0], integratedScratch.data(), scratch.data(), true);
 
@@ -62,8 +75,6 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 		}
 	}
 	
-	MultiScaleTransforms msTransforms(_width, _height);
-	
 	size_t scaleWithPeak;
 	findActiveScaleConvolvedMaxima(dirtySet, scratch.data(), integratedScratch.data());
 	sortScalesOnMaxima(scaleWithPeak);
@@ -75,12 +86,7 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 		<< _scaleInfos[scaleWithPeak].maxImageValue * _scaleInfos[scaleWithPeak].factor
 		<< " Jy, major iteration threshold=" << firstThreshold << "\n";
 	
-	std::unique_ptr<ImageBufferAllocator::Ptr[]> doubleConvolvedPSFs(
-		new ImageBufferAllocator::Ptr[dirtySet.PSFCount()]);
-	for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
-	{
-		_allocator.Allocate(_width*_height, doubleConvolvedPSFs[i]);
-	}
+	std::vector<CroppedPSF> doubleConvolvedPSFs(dirtySet.PSFCount());
 	
 	DynamicSet individualConvolvedImages(&dirtySet.Table(), dirtySet.Allocator(), _width, _height);
 	
@@ -91,12 +97,6 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 	{
 		// Create double-convolved PSFs & individually convolved images for this scale
 		ao::uvector<double*> transformList;
-		for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
-		{
-			double* psf = getConvolvedPSF(i, scaleWithPeak, psfs, scratch.data(), convolvedPSFs);
-			memcpy(doubleConvolvedPSFs[i].data(), psf, _width*_height*sizeof(double));
-			transformList.push_back(doubleConvolvedPSFs[i].data());
-		}
 		for(size_t i=0; i!=dirtySet.size(); ++i)
 		{
 			memcpy(individualConvolvedImages[i], dirtySet[i], _width*_height*sizeof(double));
@@ -104,8 +104,20 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 		}
 		if(scaleWithPeak != 0)
 		{
-			_tools->MultiScaleTransform(&msTransforms, transformList, scratch.data(), _scaleInfos[scaleWithPeak].scale);
-			//msTransforms.Transform(transformList, scratch.data(), _scaleInfos[scaleWithPeak].scale);
+			_tools->MultiScaleTransform(&_transforms, transformList, _scaleInfos[scaleWithPeak].scale);
+			// The PSFs are convolved one at a time at full size in the scratch buffer, and are
+			// only kept cropped
+			for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
+			{
+				uncropPSF(getConvolvedPSF(i, scaleWithPeak, convolvedPSFs), scratch.data());
+				_tools->MultiScaleTransform(&_transforms, ao::uvector<double*>(1, scratch.data()), _scaleInfos[scaleWithPeak].scale);
+				cropPSF(scratch.data(), doubleConvolvedPSFs[i]);
+			}
+		}
+		else {
+			// Scale 0 is the delta function, so the PSFs are not convolved again
+			for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
+				doubleConvolvedPSFs[i] = getConvolvedPSF(i, scaleWithPeak, convolvedPSFs);
 		}
 		
 		//
@@ -114,31 +126,56 @@ void MultiScaleAlgorithm::PerformMajorIteration(size_t& iterCounter, size_t nIte
 		double firstSubIterationThreshold = std::max(
 			std::fabs(_scaleInfos[scaleWithPeak].maxImageValue * _scaleInfos[scaleWithPeak].factor) * (1.0 - _gain),
 			firstThreshold);
-		while(iterCounter < nIter && std::fabs(_scaleInfos[scaleWithPeak].maxImageValue * _scaleInfos[scaleWithPeak].factor) > firstSubIterationThreshold)
+		if(_fastSubMinorLoop)
 		{
-			ao::uvector<double> componentValues;
-			measureComponentValues(componentValues, scaleWithPeak, individualConvolvedImages);
-			
-			for(size_t imgIndex=0; imgIndex!=dirtySet.size(); ++imgIndex)
+			runSubMinorLoop(iterCounter, nIter, firstSubIterationThreshold, scaleWithPeak, modelSet, dirtySet, individualConvolvedImages, doubleConvolvedPSFs, scratch.data(), integratedScratch.data(), convolvedPSFs);
+		}
+		else {
+			// The integrated image only changes where the double-convolved PSFs are subtracted,
+			// so only that area is integrated again and the peak is tracked instead of searched.
+			individualConvolvedImages.GetIntegrated(integratedScratch.data(), scratch.data());
+			std::unique_ptr<PeakTracker> peakTracker(createPeakTracker(integratedScratch.data()));
+			while(iterCounter < nIter && std::fabs(_scaleInfos[scaleWithPeak].maxImageValue * _scaleInfos[scaleWithPeak].factor) > firstSubIterationThreshold)
 			{
-				// Subtract component from individual, non-deconvolved images
-				double componentGain = componentValues[imgIndex] * _scaleInfos[scaleWithPeak].gain;
+				ao::uvector<double> componentValues;
+				measureComponentValues(componentValues, scaleWithPeak, individualConvolvedImages);
 				
-				double* psf = getConvolvedPSF(dirtySet.PSFIndex(imgIndex), scaleWithPeak, psfs, scratch.data(), convolvedPSFs);
-				tools->SubtractImage(dirtySet[imgIndex], psf, _width, _height, _scaleInfos[scaleWithPeak].maxImageValueX, _scaleInfos[scaleWithPeak].maxImageValueY, componentGain);
+				const size_t componentX = _scaleInfos[scaleWithPeak].maxImageValueX, componentY = _scaleInfos[scaleWithPeak].maxImageValueY;
+				int changedStartX = _width, changedEndX = 0, changedStartY = _height, changedEndY = 0;
+				for(size_t imgIndex=0; imgIndex!=dirtySet.size(); ++imgIndex)
+				{
+					// Subtract component from individual, non-deconvolved images
+					double componentGain = componentValues[imgIndex] * _scaleInfos[scaleWithPeak].gain;
+					
+					const CroppedPSF& psf = getConvolvedPSF(dirtySet.PSFIndex(imgIndex), scaleWithPeak, convolvedPSFs);
+					tools->SubtractImage(dirtySet[imgIndex], _width, _height, psf.image.data(), psf.width, psf.height, _scaleInfos[scaleWithPeak].maxImageValueX, _scaleInfos[scaleWithPeak].maxImageValueY, componentGain);
+					
+					// Subtract double convolved PSFs from convolved images
+					const CroppedPSF& doubleConvolvedPSF = doubleConvolvedPSFs[dirtySet.PSFIndex(imgIndex)];
+					tools->SubtractImage(individualConvolvedImages[imgIndex], _width, _height, doubleConvolvedPSF.image.data(), doubleConvolvedPSF.width, doubleConvolvedPSF.height, _scaleInfos[scaleWithPeak].maxImageValueX, _scaleInfos[scaleWithPeak].maxImageValueY, componentGain);
+					// Same area as the one changed by SimpleClean::PartialSubtractImage()
+					const int
+						offsetX = int(componentX) - int(doubleConvolvedPSF.width/2),
+						offsetY = int(componentY) - int(doubleConvolvedPSF.height/2);
+					changedStartX = std::min(changedStartX, std::max(offsetX, 0));
+					changedEndX = std::max(changedEndX, std::min(offsetX + int(doubleConvolvedPSF.width), int(_width)));
+					changedStartY = std::min(changedStartY, std::max(offsetY, 0));
+					changedEndY = std::max(changedEndY, std::min(offsetY + int(doubleConvolvedPSF.height), int(_height)));
+					
+					// Adjust model
+					addComponentToModel(modelSet[imgIndex], scaleWithPeak, componentValues[imgIndex]);
+				}
 				
-				// Subtract double convolved PSFs from convolved images
-				tools->SubtractImage(individualConvolvedImages[imgIndex], doubleConvolvedPSFs[dirtySet.PSFIndex(imgIndex)].data(), _width, _height, _scaleInfos[scaleWithPeak].maxImageValueX, _scaleInfos[scaleWithPeak].maxImageValueY, componentGain);
+				// Find maximum for this scale
+				if(changedStartX < changedEndX && changedStartY < changedEndY)
+				{
+					individualConvolvedImages.GetIntegrated(integratedScratch.data(), scratch.data(), _width, changedStartX, changedEndX, changedStartY, changedEndY);
+					peakTracker->Invalidate(changedStartX, changedEndX, changedStartY, changedEndY);
+				}
+				findTrackedMaximum(*peakTracker, integratedScratch.data(), scaleWithPeak);
 				
-				// Adjust model
-				addComponentToModel(modelSet[imgIndex], scaleWithPeak, componentValues[imgIndex]);
+				++iterCounter;
 			}
-			
-			// Find maximum for this scale
-			individualConvolvedImages.GetIntegrated(integratedScratch.data(), scratch.data());
-			findSingleScaleMaximum(integratedScratch.data(), scaleWithPeak);
-			
-			++iterCounter;
 		}
 		
 		activateScales(scaleWithPeak);
@@ -172,24 +209,32 @@ void MultiScaleAlgorithm::initializeScaleInfo()
 	}
 }
 
-void MultiScaleAlgorithm::convolvePSFs(std::unique_ptr<ImageBufferAllocator::Ptr[]>& convolvedPSFs, const double* psf, double* tmp, bool isIntegrated)
+void MultiScaleAlgorithm::convolvePSFs(std::vector<CroppedPSF>& convolvedPSFs, const double* psf, double* scratch, bool isIntegrated)
 {
-	MultiScaleTransforms msTransforms(_width, _height);
-	convolvedPSFs.reset(new ImageBufferAllocator::Ptr[_scaleInfos.size()]);
+	convolvedPSFs.resize(_scaleInfos.size());
 	if(isIntegrated)
 		std::cout << "Scale info:\n";
+	// The PSF is transformed once and then convolved with each scale
+	ao::uvector<std::complex<double>> fftPsf;
+	if(_scaleInfos.size() > 1)
+		_transforms.ForwardTransform(psf, fftPsf);
 	for(size_t scaleIndex=0; scaleIndex!=_scaleInfos.size(); ++scaleIndex)
 	{
 		ScaleInfo& scaleEntry = _scaleInfos[scaleIndex];
 		
-		_allocator.Allocate(_width*_height, convolvedPSFs[scaleIndex]);
-		memcpy(convolvedPSFs[scaleIndex].data(), psf, _width*_height*sizeof(double));
+		// Scale 0 is the delta function scale, which leaves the PSF unchanged
+		const double* convolvedPSF;
+		if(scaleIndex == 0)
+			convolvedPSF = psf;
+		else {
+			_transforms.InverseTransform(fftPsf, scratch, scaleEntry.scale);
+			convolvedPSF = scratch;
+		}
+		cropPSF(convolvedPSF, convolvedPSFs[scaleIndex]);
 		
 		if(isIntegrated)
 		{
-			msTransforms.Transform(convolvedPSFs[scaleIndex].data(), tmp, scaleEntry.scale);
-			
-			scaleEntry.psfPeak = convolvedPSFs[scaleIndex][_width/2 + (_height/2)*_width];
+			scaleEntry.psfPeak = convolvedPSF[_width/2 + (_height/2)*_width];
 			// We normalize this factor to 1 for scale 0, so:
 			// factor = (psf / kernel) / (psf0 / kernel0) = psf * kernel0 / (kernel * psf0)
 			//scaleEntry.factor = std::max(1.0,
@@ -203,21 +248,60 @@ void MultiScaleAlgorithm::convolvePSFs(std::unique_ptr<ImageBufferAllocator::Ptr
 			
 			scaleEntry.isActive = true;
 			
-			if(scaleIndex == 0)
-				memcpy(convolvedPSFs[scaleIndex].data(), psf, _width*_height*sizeof(double));
-			
-			std::cout << "- Scale " << round(scaleEntry.scale) << ", bias factor=" << round(scaleEntry.factor*10.0)/10.0 << ", response=" << scaleEntry.psfPeak << ", gain=" << scaleEntry.gain << ", kernel peak=" << scaleEntry.kernelPeak << '\n';
+			std::cout << "- Scale " << round(scaleEntry.scale) << ", bias factor=" << round(scaleEntry.factor*10.0)/10.0 << ", response=" << scaleEntry.psfPeak << ", gain=" << scaleEntry.gain << ", kernel peak=" << scaleEntry.kernelPeak << ", psf size=" << convolvedPSFs[scaleIndex].width << 'x' << convolvedPSFs[scaleIndex].height << '\n';
 		}
-		else {
-			if(scaleIndex != 0)
-				msTransforms.Transform(convolvedPSFs[scaleIndex].data(), tmp, scaleEntry.scale);
+	}
+}
+
+void MultiScaleAlgorithm::cropPSF(const double* psf, CroppedPSF& dest) const
+{
+	// Pixel (x, y) is inside the window with half size r around the centre when
+	// it is inside [centre-r, centre+r) in both directions. The energy is summed per
+	// smallest r that includes the pixel, and r is then decreased as long as the energy
+	// outside the window stays within the tolerance.
+	const size_t centreX = _width/2, centreY = _height/2;
+	const size_t maxRadius = std::max(std::max(centreX, _width-centreX), std::max(centreY, _height-centreY));
+	ao::uvector<double> energyPerRadius(maxRadius+1, 0.0);
+	double totalEnergy = 0.0;
+	for(size_t y=0; y!=_height; ++y)
+	{
+		const size_t radiusY = (y < centreY) ? centreY - y : y - centreY + 1;
+		const double* row = &psf[y*_width];
+		for(size_t x=0; x!=_width; ++x)
+		{
+			const size_t radiusX = (x < centreX) ? centreX - x : x - centreX + 1;
+			const double energy = row[x] * row[x];
+			energyPerRadius[std::max(radiusX, radiusY)] += energy;
+			totalEnergy += energy;
 		}
 	}
+	size_t radius = maxRadius;
+	double outsideEnergy = 0.0;
+	while(radius > 1 && outsideEnergy + energyPerRadius[radius] <= _psfCropTolerance * totalEnergy)
+	{
+		outsideEnergy += energyPerRadius[radius];
+		--radius;
+	}
+	
+	// A dimension is not cropped when the window does not fit in it
+	dest.width = (radius >= std::min(centreX, _width-centreX)) ? _width : radius*2;
+	dest.height = (radius >= std::min(centreY, _height-centreY)) ? _height : radius*2;
+	const size_t startX = centreX - dest.width/2, startY = centreY - dest.height/2;
+	dest.image.resize(dest.width * dest.height);
+	for(size_t y=0; y!=dest.height; ++y)
+		memcpy(&dest.image[y*dest.width], &psf[startX + (startY+y)*_width], dest.width*sizeof(double));
+}
+
+void MultiScaleAlgorithm::uncropPSF(const CroppedPSF& psf, double* dest) const
+{
+	const size_t startX = _width/2 - psf.width/2, startY = _height/2 - psf.height/2;
+	std::fill(dest, dest + _width*_height, 0.0);
+	for(size_t y=0; y!=psf.height; ++y)
+		memcpy(&dest[startX + (startY+y)*_width], &psf.image[y*psf.width], psf.width*sizeof(double));
 }
 
 void MultiScaleAlgorithm::findActiveScaleConvolvedMaxima(const DynamicSet& imageSet, double* scratch, double* integratedScratch)
 {
-	MultiScaleTransforms msTransforms(_width, _height);
 	//ImageBufferAllocator::Ptr convolvedImage;
 	//_allocator.Allocate(_width*_height, convolvedImage);
 	imageSet.GetIntegrated(integratedScratch, scratch);
@@ -243,7 +327,7 @@ void MultiScaleAlgorithm::findActiveScaleConvolvedMaxima(const DynamicSet& image
 		}
 	}
 	std::vector<ThreadedDeconvolutionTools::PeakData> results;
-	_tools->FindMultiScalePeak(&msTransforms, &_allocator, integratedScratch, transformScales, results, _allowNegativeComponents, _cleanMask, _borderRatio);
+	_tools->FindMultiScalePeak(&_transforms, &_allocator, integratedScratch, transformScales, results, _allowNegativeComponents, _cleanMask == 0 ? 0 : &_maskSpans, _borderRatio);
 	
 	for(size_t i=0; i!=results.size(); ++i)
 	{
@@ -260,6 +344,30 @@ void MultiScaleAlgorithm::findSingleScaleMaximum(const double* convolvedImage, s
 	scaleEntry.maxImageValue = findPeak(convolvedImage, scaleEntry.maxImageValueX, scaleEntry.maxImageValueY);
 }
 
+PeakTracker* MultiScaleAlgorithm::createPeakTracker(const double* integratedImage) const
+{
+	// The tracker searches the same area as findPeak(). Only Invalidate() is used, so no PSF is given.
+	size_t startX, endX, startY = 0, endY = _height;
+	if(_cleanMask == 0)
+		SimpleClean::GetPeakSearchRegion(_width, _height, _borderRatio, startX, endX, startY, endY);
+	else {
+		// Same area as the mask spans
+		const size_t horBorderSize = round(_width*_borderRatio);
+		startX = horBorderSize;
+		endX = std::max(_width - horBorderSize, startX);
+	}
+	return new PeakTracker(integratedImage, _width, _height, startX, endX, startY, endY, _cleanMask, _allowNegativeComponents, 0, 0, 0);
+}
+
+void MultiScaleAlgorithm::findTrackedMaximum(PeakTracker& peakTracker, const double* convolvedImage, size_t scaleIndex)
+{
+	ScaleInfo& scaleEntry = _scaleInfos[scaleIndex];
+	scaleEntry.maxImageValue = peakTracker.FindPeak(scaleEntry.maxImageValueX, scaleEntry.maxImageValueY);
+	// Without a peak, the image is searched to get the same result as findPeak()
+	if(!std::isfinite(scaleEntry.maxImageValue))
+		findSingleScaleMaximum(convolvedImage, scaleIndex);
+}
+
 void MultiScaleAlgorithm::sortScalesOnMaxima(size_t& scaleWithPeak)
 {
 	// Find max component
@@ -324,9 +432,103 @@ void MultiScaleAlgorithm::addComponentToModel(double* model, size_t scaleWithPea
 		MultiScaleTransforms::AddShapeComponent(model, _width, _height, _scaleInfos[scaleWithPeak].scale, _scaleInfos[scaleWithPeak].maxImageValueX, _scaleInfos[scaleWithPeak].maxImageValueY, componentGain);
 }
 
-double* MultiScaleAlgorithm::getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ao::uvector<const double*>& psfs, double* scratch,const std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]>& convolvedPSFs)
+void MultiScaleAlgorithm::runSubMinorLoop(size_t& iterCounter, size_t nIter, double threshold, size_t scaleWithPeak, DynamicSet& modelSet, DynamicSet& dirtySet, const DynamicSet& convolvedImages, const std::vector<CroppedPSF>& doubleConvolvedPSFs, double* scratch, double* integratedScratch, const ConvolvedPSFs& convolvedPSFs)
+{
+	ScaleInfo& scaleInfo = _scaleInfos[scaleWithPeak];
+	convolvedImages.GetIntegrated(integratedScratch, scratch);
+	SubMinorModel subMinorModel(_width, _height);
+	size_t peakIndex = subMinorModel.Initialize(convolvedImages, integratedScratch, threshold / scaleInfo.factor, _allowNegativeComponents, scaleInfo.maxImageValueX, scaleInfo.maxImageValueY, _cleanMask == 0 ? 0 : &_maskSpans, _borderRatio);
+	if(_verbose)
+		std::cout << "Sub-minor loop at scale " << scaleInfo.scale << " uses " << subMinorModel.size() << " pixels.\n";
+	
+	DynamicSet& residuals = subMinorModel.Residuals();
+	ao::uvector<double> componentValues(dirtySet.size());
+	while(iterCounter < nIter && std::fabs(scaleInfo.maxImageValue * scaleInfo.factor) > threshold)
+	{
+		for(size_t imgIndex=0; imgIndex!=dirtySet.size(); ++imgIndex)
+			componentValues[imgIndex] = residuals[imgIndex][peakIndex];
+		
+		for(size_t imgIndex=0; imgIndex!=dirtySet.size(); ++imgIndex)
+		{
+			double componentGain = componentValues[imgIndex] * scaleInfo.gain;
+			const CroppedPSF& psf = doubleConvolvedPSFs[dirtySet.PSFIndex(imgIndex)];
+			subMinorModel.SubtractPSF(imgIndex, psf.image.data(), psf.width, psf.height, peakIndex, componentGain);
+			subMinorModel.AddComponent(imgIndex, peakIndex, componentGain);
+			addComponentToModel(modelSet[imgIndex], scaleWithPeak, componentValues[imgIndex]);
+		}
+		
+		scaleInfo.maxImageValue = subMinorModel.FindPeak(peakIndex, _allowNegativeComponents);
+		if(peakIndex == subMinorModel.size())
+		{
+			scaleInfo.maxImageValueX = _width;
+			scaleInfo.maxImageValueY = _height;
+		}
+		else {
+			scaleInfo.maxImageValueX = subMinorModel.X(peakIndex);
+			scaleInfo.maxImageValueY = subMinorModel.Y(peakIndex);
+		}
+		
+		++iterCounter;
+	}
+	
+	// Subtract the components found in this loop from the full residual images
+	for(size_t imgIndex=0; imgIndex!=dirtySet.size(); ++imgIndex)
+	{
+		const CroppedPSF& psf = getConvolvedPSF(dirtySet.PSFIndex(imgIndex), scaleWithPeak, convolvedPSFs);
+		subtractComponents(dirtySet[imgIndex], psf, subMinorModel, imgIndex);
+	}
+}
+
+void MultiScaleAlgorithm::subtractComponents(double* image, const CroppedPSF& psf, const SubMinorModel& subMinorModel, size_t imageIndex)
+{
+	const double* components = subMinorModel.Components(imageIndex);
+	size_t componentCount = 0;
+	for(size_t i=0; i!=subMinorModel.size(); ++i)
+	{
+		if(components[i] != 0.0)
+			++componentCount;
+	}
+	
+	// The images are padded to twice their size for the FFT, so that the circular
+	// convolution does not wrap PSF sidelobes around the edges. Such a convolution costs
+	// roughly as much as subtracting a full-size PSF log2(size) times per FFT, and three
+	// FFTs are performed. A cropped PSF is cheaper to subtract directly.
+	const size_t
+		paddedWidth = _width * 2, paddedHeight = _height * 2,
+		shiftX = _width - psf.width/2, shiftY = _height - psf.height/2;
+	const double psfFraction = double(psf.width * psf.height) / double(_width * _height);
+	if(componentCount * psfFraction <= 3.0 * std::log2(double(paddedWidth * paddedHeight)))
+	{
+		for(size_t i=0; i!=subMinorModel.size(); ++i)
+		{
+			if(components[i] != 0.0)
+				_tools->SubtractImage(image, _width, _height, psf.image.data(), psf.width, psf.height, subMinorModel.X(i), subMinorModel.Y(i), components[i]);
+		}
+	}
+	else {
+		ao::uvector<double> padded(paddedWidth * paddedHeight, 0.0), kernel(paddedWidth * paddedHeight);
+		for(size_t y=0; y!=psf.height; ++y)
+			std::copy(&psf.image[y * psf.width], &psf.image[(y+1) * psf.width], &padded[(y + shiftY) * paddedWidth + shiftX]);
+		FFTConvolver::PrepareKernel(kernel.data(), padded.data(), paddedWidth, paddedHeight);
+		
+		std::fill(padded.begin(), padded.end(), 0.0);
+		for(size_t i=0; i!=subMinorModel.size(); ++i)
+			padded[subMinorModel.X(i) + subMinorModel.Y(i) * paddedWidth] = components[i];
+		FFTConvolver::ConvolveSameSize(padded.data(), kernel.data(), paddedWidth, paddedHeight);
+		
+		for(size_t y=0; y!=_height; ++y)
+		{
+			const double* convolvedRow = &padded[y * paddedWidth];
+			double* imageRow = &image[y * _width];
+			for(size_t x=0; x!=_width; ++x)
+				imageRow[x] -= convolvedRow[x];
+		}
+	}
+}
+
+const MultiScaleAlgorithm::CroppedPSF& MultiScaleAlgorithm::getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ConvolvedPSFs& convolvedPSFs)
 {
-	return convolvedPSFs[psfIndex][scaleIndex].data();
+	return convolvedPSFs[psfIndex][scaleIndex];
 }
 
 double MultiScaleAlgorithm::findPeak(const double* image, size_t& x, size_t& y)
@@ -334,5 +536,5 @@ double MultiScaleAlgorithm::findPeak(const double* image, size_t& x, size_t& y)
 	if(_cleanMask == 0)
 		return SimpleClean::FindPeak(image, _width, _height, x, y, _allowNegativeComponents, 0, _height, _borderRatio);
 	else
-		return SimpleClean::FindPeak(image, _width, _height, x, y, _allowNegativeComponents, 0, _height, _cleanMask, _borderRatio);
+		return SimpleClean::FindPeak(image, _width, _height, x, y, _allowNegativeComponents, 0, _height, _maskSpans);
 }
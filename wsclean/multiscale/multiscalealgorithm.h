@@ -9,19 +9,35 @@
 #include "../uvector.h"
 
 #include "../deconvolution/dynamicset.h"
+#include "../deconvolution/maskspans.h"
 
 #include "../wsclean/imagebufferallocator.h"
 
 class MultiScaleAlgorithm
 {
 public:
-	MultiScaleAlgorithm(class ImageBufferAllocator& allocator, size_t width, size_t height, double beamScale, double threshold, double gain, double mGain, double borderRatio, bool allowNegativeComponents, double scaleBias, size_t threadCount);
+	MultiScaleAlgorithm(class ImageBufferAllocator& allocator, class MultiScaleTransforms& transforms, size_t width, size_t height, double beamScale, double threshold, double gain, double mGain, double borderRatio, bool allowNegativeComponents, double scaleBias, size_t threadCount);
 	
-	void SetCleanMask(const bool* cleanMask) { _cleanMask = cleanMask; }
+	void SetCleanMask(const bool* cleanMask);
+	
+	/**
+	 * Whether the sub-minor loop only considers the pixels that are above its threshold
+	 * when it starts, see SubMinorModel. This approximates the full sub-minor loop, like
+	 * Clark's minor loop. Default: false.
+	 */
+	void SetFastSubMinorLoop(bool fastSubMinorLoop) { _fastSubMinorLoop = fastSubMinorLoop; }
+	
+	/**
+	 * The scale-convolved PSFs are cropped to the smallest window around their centre that
+	 * loses at most this fraction of their energy (sum of squares). The default of 0 only
+	 * crops borders without energy, which does not change the result.
+	 */
+	void SetPSFCropTolerance(double psfCropTolerance) { _psfCropTolerance = psfCropTolerance; }
 	
 	void PerformMajorIteration(size_t& iterCounter, size_t nIter, DynamicSet& modelSet, DynamicSet& dirtySet, const ao::uvector<const double*>& psfs, bool& reachedMajorThreshold);
 private:
 	class ImageBufferAllocator& _allocator;
+	class MultiScaleTransforms& _transforms;
 	size_t _width, _height;
 	double _beamScale, _threshold, _gain, _mGain;
 	double _borderRatio;
@@ -29,6 +45,10 @@ private:
 	double _scaleBias;
 	size_t _threadCount;
 	const bool* _cleanMask;
+	// The clean mask as spans, searched instead of the full image
+	MaskSpans _maskSpans;
+	bool _fastSubMinorLoop;
+	double _psfCropTolerance;
 	bool _verbose;
 	ThreadedDeconvolutionTools* _tools;
 	
@@ -42,18 +62,41 @@ private:
 		bool isActive;
 	};
 	std::vector<MultiScaleAlgorithm::ScaleInfo> _scaleInfos;
+	
+	/**
+	 * A PSF cropped to a window around its centre, which is at (width/2, height/2).
+	 */
+	struct CroppedPSF
+	{
+		ao::uvector<double> image;
+		size_t width, height;
+	};
+	// Indexed by PSF index and then by scale index
+	typedef std::vector<std::vector<CroppedPSF>> ConvolvedPSFs;
 
 	void initializeScaleInfo();
-	void convolvePSFs(std::unique_ptr<ImageBufferAllocator::Ptr[]>& convolvedPSFs, const double* psf, double* tmp, bool isIntegrated);
+	void convolvePSFs(std::vector<CroppedPSF>& convolvedPSFs, const double* psf, double* scratch, bool isIntegrated);
+	void cropPSF(const double* psf, CroppedPSF& dest) const;
+	void uncropPSF(const CroppedPSF& psf, double* dest) const;
 	void findActiveScaleConvolvedMaxima(const DynamicSet& imageSet, double* scratch, double* integratedScratch);
 	void findSingleScaleMaximum(const double* convolvedImage, size_t scaleIndex);
+	/**
+	 * Returns a tracker of the peak that findPeak() finds in the integrated image.
+	 */
+	class PeakTracker* createPeakTracker(const double* integratedImage) const;
+	/**
+	 * Same as findSingleScaleMaximum(), with the peak found by the tracker.
+	 */
+	void findTrackedMaximum(class PeakTracker& peakTracker, const double* convolvedImage, size_t scaleIndex);
 	void sortScalesOnMaxima(size_t& scaleWithPeak);
 	void activateScales(size_t scaleWithLastPeak);
 	void measureComponentValues(ao::uvector<double>& componentValues, size_t scaleIndex, DynamicSet& imageSet);
 	void addComponentToModel(double* model, size_t scaleWithPeak, double componentValue);
+	void runSubMinorLoop(size_t& iterCounter, size_t nIter, double threshold, size_t scaleWithPeak, DynamicSet& modelSet, DynamicSet& dirtySet, const DynamicSet& convolvedImages, const std::vector<CroppedPSF>& doubleConvolvedPSFs, double* scratch, double* integratedScratch, const ConvolvedPSFs& convolvedPSFs);
+	void subtractComponents(double* image, const CroppedPSF& psf, const class SubMinorModel& subMinorModel, size_t imageIndex);
 	double findPeak(const double *image, size_t &x, size_t &y);
 	
-	double* getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ao::uvector<const double*>& psfs, double* scratch, const std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]>& convolvedPSFs);
+	const CroppedPSF& getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ConvolvedPSFs& convolvedPSFs);
 	
 };
 
@@ -2,31 +2,106 @@
 
 #include "../fftconvolver.h"
 
-void MultiScaleTransforms::Transform(const ao::uvector<double*>& images, double* scratch, double scale)
+MultiScaleTransforms::MultiScaleTransforms(size_t width, size_t height) :
+	_width(width), _height(height),
+	_fftSize((width/2+1) * height)
 {
+	double* tempData = reinterpret_cast<double*>(fftw_malloc(_width * _height * sizeof(double)));
+	fftw_complex* fftData = reinterpret_cast<fftw_complex*>(fftw_malloc(_fftSize * sizeof(fftw_complex)));
+	boost::mutex::scoped_lock lock(FFTConvolver::PlannerMutex());
+	_forwardPlan = fftw_plan_dft_r2c_2d(_height, _width, tempData, fftData, FFTW_ESTIMATE);
+	_backwardPlan = fftw_plan_dft_c2r_2d(_height, _width, fftData, tempData, FFTW_ESTIMATE);
+	fftw_free(fftData);
+	fftw_free(tempData);
+}
+
+MultiScaleTransforms::~MultiScaleTransforms()
+{
+	for(std::map<double, std::complex<double>*>::iterator i=_kernels.begin(); i!=_kernels.end(); ++i)
+		fftw_free(i->second);
+	boost::mutex::scoped_lock lock(FFTConvolver::PlannerMutex());
+	fftw_destroy_plan(_forwardPlan);
+	fftw_destroy_plan(_backwardPlan);
+}
+
+const std::complex<double>* MultiScaleTransforms::getKernel(double scale)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	std::map<double, std::complex<double>*>::const_iterator kernelIter = _kernels.find(scale);
+	if(kernelIter != _kernels.end())
+		return kernelIter->second;
+	
 	ao::uvector<double> shape;
 	size_t kernelSize;
 	makeShapeFunction(scale, shape, kernelSize);
 	
-	memset(scratch, 0, sizeof(double) * _width * _height);
+	double* kernel = reinterpret_cast<double*>(fftw_malloc(_width * _height * sizeof(double)));
+	memset(kernel, 0, sizeof(double) * _width * _height);
+	FFTConvolver::PrepareSmallKernel(kernel, _width, _height, shape.data(), kernelSize);
+	
+	std::complex<double>* fftKernel = reinterpret_cast<std::complex<double>*>(fftw_malloc(_fftSize * sizeof(std::complex<double>)));
+	fftw_execute_dft_r2c(_forwardPlan, kernel, reinterpret_cast<fftw_complex*>(fftKernel));
+	fftw_free(kernel);
+	
+	const double fact = 1.0 / (_width * _height);
+	for(size_t i=0; i!=_fftSize; ++i)
+		fftKernel[i] *= fact;
+	
+	_kernels.insert(std::make_pair(scale, fftKernel));
+	return fftKernel;
+}
+
+void MultiScaleTransforms::Transform(const ao::uvector<double*>& images, double scale)
+{
+	const std::complex<double>* fftKernel = getKernel(scale);
+	const size_t imgSize = _width * _height;
+	double* tempData = reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)));
+	std::complex<double>* fftImage = reinterpret_cast<std::complex<double>*>(fftw_malloc(_fftSize * sizeof(std::complex<double>)));
 	
-	FFTConvolver::PrepareSmallKernel(scratch, _width, _height, shape.data(), kernelSize);
 	for(double*const* imageIter = images.begin(); imageIter!=images.end(); ++imageIter)
-		FFTConvolver::ConvolveSameSize(*imageIter, scratch, _width, _height);
+	{
+		memcpy(tempData, *imageIter, imgSize * sizeof(double));
+		fftw_execute_dft_r2c(_forwardPlan, tempData, reinterpret_cast<fftw_complex*>(fftImage));
+		
+		for(size_t i=0; i!=_fftSize; ++i)
+			fftImage[i] *= fftKernel[i];
+		
+		fftw_execute_dft_c2r(_backwardPlan, reinterpret_cast<fftw_complex*>(fftImage), tempData);
+		memcpy(*imageIter, tempData, imgSize * sizeof(double));
+	}
+	
+	fftw_free(fftImage);
+	fftw_free(tempData);
 }
 
-void MultiScaleTransforms::PrepareTransform(double* kernel, double scale)
+void MultiScaleTransforms::ForwardTransform(const double* image, ao::uvector<std::complex<double>>& fftImage)
 {
-	ao::uvector<double> shape;
-	size_t kernelSize;
-	makeShapeFunction(scale, shape, kernelSize);
+	const size_t imgSize = _width * _height;
+	double* tempData = reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)));
+	std::complex<double>* fftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(_fftSize * sizeof(std::complex<double>)));
 	
-	memset(kernel, 0, sizeof(double) * _width * _height);
+	memcpy(tempData, image, imgSize * sizeof(double));
+	fftw_execute_dft_r2c(_forwardPlan, tempData, reinterpret_cast<fftw_complex*>(fftData));
+	fftImage.assign(fftData, fftData + _fftSize);
 	
-	FFTConvolver::PrepareSmallKernel(kernel, _width, _height, shape.data(), kernelSize);
+	fftw_free(fftData);
+	fftw_free(tempData);
 }
 
-void MultiScaleTransforms::FinishTransform(double* image, const double* kernel)
+void MultiScaleTransforms::InverseTransform(const ao::uvector<std::complex<double>>& fftImage, double* output, double scale)
 {
-	FFTConvolver::ConvolveSameSize(image, kernel, _width, _height);
+	const std::complex<double>* fftKernel = getKernel(scale);
+	const size_t imgSize = _width * _height;
+	double* tempData = reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)));
+	std::complex<double>* fftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(_fftSize * sizeof(std::complex<double>)));
+	
+	// The c2r transform overwrites its input, so the product is stored separately
+	for(size_t i=0; i!=_fftSize; ++i)
+		fftData[i] = fftImage[i] * fftKernel[i];
+	
+	fftw_execute_dft_c2r(_backwardPlan, reinterpret_cast<fftw_complex*>(fftData), tempData);
+	memcpy(output, tempData, imgSize * sizeof(double));
+	
+	fftw_free(fftData);
+	fftw_free(tempData);
 }
@@ -2,27 +2,54 @@
 #define MULTI_SCALE_TRANSFORMS_H
 
 #include <cmath>
+#include <complex>
 #include <initializer_list>
+#include <map>
+
+#include <fftw3.h>
+
+#include <boost/thread/mutex.hpp>
 
 #include "../uvector.h"
 
+/**
+ * Convolves images with the multi-scale shape functions. The FFT plans and the
+ * Fourier transforms of the scale kernels are made once and kept for the lifetime
+ * of the object, so that a convolution costs one forward FFT, one multiplication
+ * and one inverse FFT. The transforms may be called from several threads at once.
+ */
 class MultiScaleTransforms
 {
 public:
-	MultiScaleTransforms(size_t width, size_t height) :
-	_width(width), _height(height)
-	{ }
+	MultiScaleTransforms(size_t width, size_t height);
+	~MultiScaleTransforms();
 	
-	void PrepareTransform(double* kernel, double scale);
-	void FinishTransform(double* image, const double* kernel);
+	/**
+	 * Makes sure the kernel for the given scale is available. This is not required
+	 * before transforming, but avoids that threads wait for each other while one of
+	 * them calculates the kernel.
+	 */
+	void PrepareTransform(double scale) { getKernel(scale); }
 	
-	void Transform(double* image, double* scratch, double scale)
+	void Transform(double* image, double scale)
 	{
 		ao::uvector<double*> images(1, image);
-		Transform(images, scratch, scale);
+		Transform(images, scale);
 	}
 	
-	void Transform(const ao::uvector<double*>& images, double* scratch, double scale);
+	void Transform(const ao::uvector<double*>& images, double scale);
+	
+	/**
+	 * Calculates the Fourier transform of an image, so that it can be convolved with
+	 * several scales using InverseTransform() without transforming it again.
+	 */
+	void ForwardTransform(const double* image, ao::uvector<std::complex<double>>& fftImage);
+	
+	/**
+	 * Convolves an image, given as the result of ForwardTransform(), with the
+	 * given scale and stores the result in output.
+	 */
+	void InverseTransform(const ao::uvector<std::complex<double>>& fftImage, double* output, double scale);
 	
 	size_t Width() const { return _width; }
 	size_t Height() const { return _height; }
@@ -81,7 +108,17 @@ public:
 	}
 	
 private:
+	MultiScaleTransforms(const MultiScaleTransforms&) = delete;
+	MultiScaleTransforms& operator=(const MultiScaleTransforms&) = delete;
+	
+	const std::complex<double>* getKernel(double scale);
+	
 	size_t _width, _height;
+	size_t _fftSize;
+	fftw_plan _forwardPlan, _backwardPlan;
+	// Fourier transformed kernels, including the normalization of the inverse FFT
+	std::map<double, std::complex<double>*> _kernels;
+	boost::mutex _mutex;
 	
 	static void makeShapeFunction(double scaleSizeInPixels, ao::uvector<double>& output, size_t& n)
 	{
@@ -0,0 +1,117 @@
+#include "subminorloop.h"
+
+#include "../deconvolution/maskspans.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+size_t SubMinorModel::Initialize(const DynamicSet& convolvedImages, const double* integratedImage, double threshold, bool allowNegativeComponents, size_t peakX, size_t peakY, const MaskSpans* maskSpans, double borderRatio)
+{
+	_xs.clear();
+	_ys.clear();
+	const size_t peakIndex = peakX + peakY * _width;
+	if(maskSpans != 0)
+	{
+		for(size_t s=0; s!=maskSpans->SpanCount(); ++s)
+		{
+			const MaskSpans::Span& span = (*maskSpans)[s];
+			selectPixels(integratedImage, threshold, allowNegativeComponents, span.startX, span.endX, span.y, peakIndex);
+		}
+	}
+	else {
+		// Same area as searched by SimpleClean::FindPeak() without a mask
+		const size_t horBorderSize = round(_width*borderRatio), verBorderSize = round(_height*borderRatio);
+		size_t xiStart = horBorderSize, xiEnd = _width - horBorderSize;
+		size_t yiStart = verBorderSize, yiEnd = _height - verBorderSize;
+		if(xiEnd < xiStart) xiEnd = xiStart;
+		if(yiEnd < yiStart) yiEnd = yiStart;
+		for(size_t y=yiStart; y!=yiEnd; ++y)
+			selectPixels(integratedImage, threshold, allowNegativeComponents, xiStart, xiEnd, y, peakIndex);
+	}
+
+	// Find the peak pixel, and add it when it was not selected, which can happen when
+	// it is on the edge of the search area
+	size_t peakActiveIndex = 0;
+	while(peakActiveIndex != _xs.size() &&
+		(_ys[peakActiveIndex] < peakY || (_ys[peakActiveIndex] == peakY && _xs[peakActiveIndex] < peakX)))
+		++peakActiveIndex;
+	if(peakActiveIndex == _xs.size() || _xs[peakActiveIndex] != peakX || _ys[peakActiveIndex] != peakY)
+	{
+		_xs.insert(_xs.begin() + peakActiveIndex, peakX);
+		_ys.insert(_ys.begin() + peakActiveIndex, peakY);
+	}
+
+	const size_t count = _xs.size();
+	_residuals.reset(new DynamicSet(&convolvedImages.Table(), convolvedImages.Allocator(), count, 1));
+	_components.reset(new DynamicSet(&convolvedImages.Table(), convolvedImages.Allocator(), count, 1));
+	for(size_t imageIndex=0; imageIndex!=convolvedImages.size(); ++imageIndex)
+	{
+		const double* image = convolvedImages[imageIndex];
+		double* residual = (*_residuals)[imageIndex];
+		for(size_t i=0; i!=count; ++i)
+			residual[i] = image[_xs[i] + _ys[i] * _width];
+		std::fill((*_components)[imageIndex], (*_components)[imageIndex] + count, 0.0);
+	}
+	_integrated.resize(count);
+	_scratch.resize(count);
+	return peakActiveIndex;
+}
+
+void SubMinorModel::selectPixels(const double* integratedImage, double threshold, bool allowNegativeComponents, size_t startX, size_t endX, size_t y, size_t peakIndex)
+{
+	const double* row = &integratedImage[y * _width];
+	for(size_t x=startX; x!=endX; ++x)
+	{
+		double value = row[x];
+		if(allowNegativeComponents)
+			value = std::fabs(value);
+		if((std::isfinite(value) && value > threshold) || x + y * _width == peakIndex)
+		{
+			_xs.push_back(x);
+			_ys.push_back(y);
+		}
+	}
+}
+
+void SubMinorModel::SubtractPSF(size_t imageIndex, const double* psf, size_t psfWidth, size_t psfHeight, size_t peakIndex, double factor)
+{
+	// A PSF value (dx, dy) is subtracted when 0 <= dx < 2*(psfWidth/2) and 0 <= dy < 2*(psfHeight/2),
+	// which is the area that PartialSubtractImage() subtracts
+	const int
+		offsetX = int(_xs[peakIndex]) - int(psfWidth/2),
+		offsetY = int(_ys[peakIndex]) - int(psfHeight/2),
+		psfEndX = int(psfWidth/2)*2,
+		psfEndY = int(psfHeight/2)*2;
+	double* residual = (*_residuals)[imageIndex];
+	for(size_t i=0; i!=_xs.size(); ++i)
+	{
+		const int
+			dx = int(_xs[i]) - offsetX,
+			dy = int(_ys[i]) - offsetY;
+		if(dx >= 0 && dx < psfEndX && dy >= 0 && dy < psfEndY)
+			residual[i] -= psf[dx + dy * psfWidth] * factor;
+	}
+}
+
+double SubMinorModel::FindPeak(size_t& peakIndex, bool allowNegativeComponents)
+{
+	_residuals->GetIntegrated(_integrated.data(), _scratch.data());
+	double peakMax = std::numeric_limits<double>::min();
+	peakIndex = _integrated.size();
+	for(size_t i=0; i!=_integrated.size(); ++i)
+	{
+		double value = _integrated[i];
+		if(allowNegativeComponents)
+			value = std::fabs(value);
+		if(std::isfinite(value) && value > peakMax)
+		{
+			peakIndex = i;
+			peakMax = value;
+		}
+	}
+	if(peakIndex == _integrated.size())
+		return std::numeric_limits<double>::quiet_NaN();
+	else
+		return _integrated[peakIndex];
+}
@@ -0,0 +1,84 @@
+#ifndef SUB_MINOR_LOOP_H
+#define SUB_MINOR_LOOP_H
+
+#include "../deconvolution/dynamicset.h"
+
+#include "../uvector.h"
+
+#include <memory>
+
+/**
+ * The pixels that are considered during a sub-minor loop of the multi-scale algorithm.
+ *
+ * When the loop starts, the pixels are selected of which the integrated scale-convolved
+ * value is above the threshold of the loop. Only the values of the scale-convolved
+ * images at these pixels are kept. Subtracting a component and finding the next peak
+ * therefore take time proportional to the number of selected pixels instead of to the
+ * image size. The components found are collected, so that they can be subtracted from
+ * the full residual images once the loop has finished.
+ *
+ * This is similar to the minor cycle of Clark clean: a pixel that was below the threshold
+ * at the start of the loop can not become a component during the loop, even if its value
+ * would have grown above the threshold. Such a pixel is found in the next minor iteration.
+ */
+class SubMinorModel
+{
+public:
+	SubMinorModel(size_t width, size_t height) :
+		_width(width), _height(height)
+	{ }
+
+	/**
+	 * Selects the pixels of which the (absolute, with allowNegativeComponents) integrated
+	 * value is above the threshold, and copies the values of the convolved images at
+	 * these pixels. The pixel at (peakX, peakY) is always selected.
+	 * @param maskSpans The pixels that may be cleaned, or zero to clean all pixels outside the border.
+	 * @returns The index of the selected pixel at (peakX, peakY).
+	 */
+	size_t Initialize(const DynamicSet& convolvedImages, const double* integratedImage, double threshold, bool allowNegativeComponents, size_t peakX, size_t peakY, const class MaskSpans* maskSpans, double borderRatio);
+
+	size_t size() const { return _xs.size(); }
+	size_t X(size_t index) const { return _xs[index]; }
+	size_t Y(size_t index) const { return _ys[index]; }
+
+	/**
+	 * Values of the convolved images at the selected pixels.
+	 */
+	DynamicSet& Residuals() { return *_residuals; }
+
+	/**
+	 * Subtracts factor times the psf, centred on selected pixel peakIndex, from residual
+	 * image imageIndex. The centre of the psf is at (psfWidth/2, psfHeight/2), and the
+	 * subtracted area is the same as that of SimpleClean::PartialSubtractImage().
+	 */
+	void SubtractPSF(size_t imageIndex, const double* psf, size_t psfWidth, size_t psfHeight, size_t peakIndex, double factor);
+
+	/**
+	 * Adds flux to the component of image imageIndex at selected pixel index.
+	 */
+	void AddComponent(size_t imageIndex, size_t index, double flux)
+	{
+		(*_components)[imageIndex][index] += flux;
+	}
+
+	/**
+	 * Flux per selected pixel that was added with AddComponent().
+	 */
+	const double* Components(size_t imageIndex) const { return (*_components)[imageIndex]; }
+
+	/**
+	 * Finds the selected pixel with the highest integrated value. Returns its value and sets
+	 * peakIndex, or returns NaN and sets peakIndex to size() when there are no finite values.
+	 */
+	double FindPeak(size_t& peakIndex, bool allowNegativeComponents);
+
+private:
+	void selectPixels(const double* integratedImage, double threshold, bool allowNegativeComponents, size_t startX, size_t endX, size_t y, size_t peakIndex);
+
+	size_t _width, _height;
+	ao::uvector<size_t> _xs, _ys;
+	std::unique_ptr<DynamicSet> _residuals, _components;
+	ao::uvector<double> _integrated, _scratch;
+};
+
+#endif
@@ -31,7 +31,7 @@ ThreadedDeconvolutionTools::~ThreadedDeconvolutionTools()
 	}
 }
 
-void ThreadedDeconvolutionTools::SubtractImage(double* image, const double* psf, size_t width, size_t height, size_t x, size_t y, double factor)
+void ThreadedDeconvolutionTools::SubtractImage(double* image, size_t width, size_t height, const double* psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor)
 {
 	for(size_t thr=0; thr!=_threadCount; ++thr)
 	{
@@ -40,6 +40,8 @@ void ThreadedDeconvolutionTools::SubtractImage(double* image, const double* psf,
 		task->psf = psf;
 		task->width = width;
 		task->height = height;
+		task->psfWidth = psfWidth;
+		task->psfHeight = psfHeight;
 		task->x = x;
 		task->y = y;
 		task->factor = factor;
@@ -64,21 +66,21 @@ void ThreadedDeconvolutionTools::SubtractImage(double* image, const double* psf,
 
 ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::SubtractionTask::operator()()
 {
-	SimpleClean::PartialSubtractImage(image, psf, width, height, x, y, factor, startY, endY);
+	SimpleClean::PartialSubtractImage(image, width, height, psf, psfWidth, psfHeight, x, y, factor, startY, endY);
 	return 0;
 }
 
-void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double* scratch, double scale)
+void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double scale)
 {
 	size_t imageIndex = 0;
 	size_t nextThread = 0;
-	msTransforms->PrepareTransform(scratch, scale);
+	msTransforms->PrepareTransform(scale);
 	while(imageIndex < images.size())
 	{
-		FinishMultiScaleTransformTask* task = new FinishMultiScaleTransformTask();
+		MultiScaleTransformTask* task = new MultiScaleTransformTask();
 		task->msTransforms = msTransforms;
 		task->image = images[imageIndex];
-		task->kernel = scratch;
+		task->scale = scale;
 		_taskLanes[nextThread]->write(task);
 		
 		++nextThread;
@@ -102,29 +104,16 @@ void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTra
 	}
 }
 
-ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::FinishMultiScaleTransformTask::operator()()
-{
-	msTransforms->FinishTransform(image, kernel);
-	return 0;
-}
-
-void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, ImageBufferAllocator* allocator, const ao::uvector<double*>& images, ao::uvector<double> scales)
+void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, ao::uvector<double> scales)
 {
 	size_t imageIndex = 0;
 	size_t nextThread = 0;
 	
-	size_t scratchCount = std::min(images.size(), _threadCount);
-	std::unique_ptr<ImageBufferAllocator::Ptr[]> scratchImages(
-		new ImageBufferAllocator::Ptr[scratchCount]);
-	for(size_t i=0; i!=scratchCount; ++i)
-		allocator->Allocate(msTransforms->Width() * msTransforms->Height(), scratchImages[i]);
-	
 	while(imageIndex < images.size())
 	{
 		MultiScaleTransformTask* task = new MultiScaleTransformTask();
 		task->msTransforms = msTransforms;
 		task->image = images[imageIndex];
-		task->scratch = scratchImages[nextThread].data();
 		task->scale = scales[imageIndex];
 		_taskLanes[nextThread]->write(task);
 		
@@ -151,11 +140,11 @@ void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTra
 
 ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::MultiScaleTransformTask::operator()()
 {
-	msTransforms->Transform(image, scratch, scale);
+	msTransforms->Transform(image, scale);
 	return 0;
 }
 
-void ThreadedDeconvolutionTools::FindMultiScalePeak(MultiScaleTransforms* msTransforms, ImageBufferAllocator* allocator, const double* image, const ao::uvector<double>& scales, std::vector<ThreadedDeconvolutionTools::PeakData>& results, bool allowNegativeComponents, const bool* mask, double borderRatio)
+void ThreadedDeconvolutionTools::FindMultiScalePeak(MultiScaleTransforms* msTransforms, ImageBufferAllocator* allocator, const double* image, const ao::uvector<double>& scales, std::vector<ThreadedDeconvolutionTools::PeakData>& results, bool allowNegativeComponents, const MaskSpans* maskSpans, double borderRatio)
 {
 	size_t imageIndex = 0;
 	size_t nextThread = 0;
@@ -167,24 +156,25 @@ void ThreadedDeconvolutionTools::FindMultiScalePeak(MultiScaleTransforms* msTran
 	size_t size = std::min(scales.size(), _threadCount);
 	std::unique_ptr<ImageBufferAllocator::Ptr[]> imageData(
 		new ImageBufferAllocator::Ptr[size]);
-	std::unique_ptr<ImageBufferAllocator::Ptr[]> scratchData(
-		new ImageBufferAllocator::Ptr[size]);
 	for(size_t i=0; i!=size; ++i)
-	{
 		allocator->Allocate(dataSize, imageData[i]);
-		allocator->Allocate(dataSize, scratchData[i]);
-	}
+	
+	// All scales convolve the same image, so it is transformed only once
+	ao::uvector<std::complex<double>> fftImage;
+	if(!scales.empty())
+		msTransforms->ForwardTransform(image, fftImage);
+	for(size_t i=0; i!=scales.size(); ++i)
+		msTransforms->PrepareTransform(scales[i]);
 	
 	while(imageIndex < scales.size())
 	{
 		FindMultiScalePeakTask* task = new FindMultiScalePeakTask();
 		task->msTransforms = msTransforms;
-		memcpy(imageData[nextThread].data(), image, dataSize*sizeof(double));
+		task->fftImage = &fftImage;
 		task->image = imageData[nextThread].data();
-		task->scratch = scratchData[nextThread].data();
 		task->scale = scales[imageIndex];
 		task->allowNegativeComponents = allowNegativeComponents;
-		task->mask = mask;
+		task->maskSpans = maskSpans;
 		task->borderRatio = borderRatio;
 		_taskLanes[nextThread]->write(task);
 		
@@ -219,12 +209,12 @@ void ThreadedDeconvolutionTools::FindMultiScalePeak(MultiScaleTransforms* msTran
 
 ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::FindMultiScalePeakTask::operator()()
 {
-	msTransforms->Transform(image, scratch, scale);
+	msTransforms->InverseTransform(*fftImage, image, scale);
 	size_t width = msTransforms->Width(), height = msTransforms->Height();
 	FindMultiScalePeakResult* result = new FindMultiScalePeakResult();
-	if(mask == 0)
+	if(maskSpans == 0)
 		result->value = SimpleClean::FindPeak(image, width, height, result->x, result->y, allowNegativeComponents, 0, height, borderRatio);
 	else
-		result->value = SimpleClean::FindPeak(image, width, height, result->x, result->y, allowNegativeComponents, 0, height, mask, borderRatio);
+		result->value = SimpleClean::FindPeak(image, width, height, result->x, result->y, allowNegativeComponents, 0, height, *maskSpans);
 	return result;
 }
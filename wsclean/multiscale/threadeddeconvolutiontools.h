@@ -1,6 +1,7 @@
 #ifndef THREADED_DECONVOLUTION_TOOLS_H
 #define THREADED_DECONVOLUTION_TOOLS_H
 
+#include <complex>
 #include <vector>
 
 #include "../lane.h"
@@ -20,15 +21,23 @@ public:
 		size_t x, y;
 	};
 	
-	void SubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor);
+	void SubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor)
+	{
+		SubtractImage(image, width, height, psf, width, height, x, y, factor);
+	}
+	
+	/**
+	 * Subtracts a PSF that can be smaller than the image, centred on (psfWidth/2, psfHeight/2).
+	 */
+	void SubtractImage(double *image, size_t width, size_t height, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor);
 	
 	// This one is for many transforms of the same scale
-	void MultiScaleTransform(class MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double* scratch, double scale);
+	void MultiScaleTransform(class MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double scale);
 	
 	// This one is for transform of different scales
-	void MultiScaleTransform(class MultiScaleTransforms* msTransforms, class ImageBufferAllocator* allocator, const ao::uvector<double*>& images, ao::uvector<double> scales);
+	void MultiScaleTransform(class MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, ao::uvector<double> scales);
 	
-	void FindMultiScalePeak(class MultiScaleTransforms* msTransforms, class ImageBufferAllocator* allocator, const double* image, const ao::uvector<double>& scales, std::vector<PeakData>& results, bool allowNegativeComponents, const bool* mask, double borderRatio);
+	void FindMultiScalePeak(class MultiScaleTransforms* msTransforms, class ImageBufferAllocator* allocator, const double* image, const ao::uvector<double>& scales, std::vector<PeakData>& results, bool allowNegativeComponents, const class MaskSpans* maskSpans, double borderRatio);
 	
 private:
 	struct ThreadResult {
@@ -47,34 +56,26 @@ private:
 		
 		double *image;
 		const double *psf;
-		size_t width, height, x, y;
+		size_t width, height, psfWidth, psfHeight, x, y;
 		double factor;
 		size_t startY, endY;
 	};
-	struct FinishMultiScaleTransformTask : public ThreadTask {
-		virtual ThreadResult* operator()();
-		
-		class MultiScaleTransforms* msTransforms;
-		double* image;
-		double* kernel;
-	};
 	struct MultiScaleTransformTask : public ThreadTask {
 		virtual ThreadResult* operator()();
 		
 		class MultiScaleTransforms* msTransforms;
 		double* image;
-		double* scratch;
 		double scale;
 	};
 	struct FindMultiScalePeakTask : public ThreadTask {
 		virtual ThreadResult* operator()();
 		
 		class MultiScaleTransforms* msTransforms;
+		const ao::uvector<std::complex<double>>* fftImage;
 		double* image;
-		double* scratch;
 		double scale;
 		bool allowNegativeComponents;
-		const bool* mask;
+		const class MaskSpans* maskSpans;
 		double borderRatio;
 	};
 	
@@ -0,0 +1,105 @@
+#ifndef SPIN_BARRIER_H
+#define SPIN_BARRIER_H
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <atomic>
+#include <cstddef>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Barrier for a fixed group of threads that meet very often, e.g. once every
+ * minor iteration of a clean.
+ *
+ * A waiting thread first spins on the generation counter, so that a barrier that
+ * is reached within a few microseconds by all threads does not involve the
+ * mutex or the scheduler. When spinning does not pay off, the thread blocks
+ * on a condition variable. The number of spins adapts: it is doubled after a wait
+ * that was finished by spinning and halved after a wait that had to block.
+ * When there are more threads than processors, spinning is disabled.
+ */
+class SpinBarrier
+{
+public:
+	explicit SpinBarrier(size_t threadCount, size_t maxSpinCount = 1<<14) :
+		_threadCount(threadCount),
+		_arrivedCount(0),
+		_generation(0),
+		_sleepingCount(0),
+		_maxSpinCount(maxSpinCount),
+		_minSpinCount(maxSpinCount / 64)
+	{
+		if(threadCount > boost::thread::hardware_concurrency())
+		{
+			_maxSpinCount = 0;
+			_minSpinCount = 0;
+		}
+		_spinCount = _maxSpinCount;
+	}
+
+	/**
+	 * Blocks until all threads have called wait(). Writes done before the call
+	 * are visible to all threads after the call.
+	 */
+	void wait()
+	{
+		const size_t generation = _generation.load(std::memory_order_acquire);
+		if(_arrivedCount.fetch_add(1, std::memory_order_acq_rel) + 1 == _threadCount)
+		{
+			// Last thread: release the others. The count is reset before the generation
+			// changes, so no thread can arrive at the next barrier before the reset.
+			_arrivedCount.store(0, std::memory_order_relaxed);
+			_generation.store(generation + 1, std::memory_order_seq_cst);
+			if(_sleepingCount.load(std::memory_order_seq_cst) != 0)
+			{
+				boost::mutex::scoped_lock lock(_mutex);
+				_condition.notify_all();
+			}
+		}
+		else {
+			const size_t spinCount = _spinCount.load(std::memory_order_relaxed);
+			for(size_t i=0; i!=spinCount; ++i)
+			{
+				if(_generation.load(std::memory_order_acquire) != generation)
+				{
+					if(spinCount < _maxSpinCount)
+						_spinCount.store(spinCount * 2, std::memory_order_relaxed);
+					return;
+				}
+				pause();
+			}
+			if(spinCount/2 >= _minSpinCount)
+				_spinCount.store(spinCount / 2, std::memory_order_relaxed);
+
+			boost::mutex::scoped_lock lock(_mutex);
+			_sleepingCount.fetch_add(1, std::memory_order_seq_cst);
+			while(_generation.load(std::memory_order_seq_cst) == generation)
+				_condition.wait(lock);
+			_sleepingCount.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+private:
+	SpinBarrier(const SpinBarrier&) = delete;
+	SpinBarrier& operator=(const SpinBarrier&) = delete;
+
+	static void pause()
+	{
+#if defined __SSE2__
+		_mm_pause();
+#endif
+	}
+
+	const size_t _threadCount;
+	std::atomic<size_t> _arrivedCount, _generation, _sleepingCount, _spinCount;
+	size_t _maxSpinCount, _minSpinCount;
+	boost::mutex _mutex;
+	boost::condition_variable _condition;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * Round-trips ImageWeights through Serialize() and Unserialize() and checks that the
+ * restored grid is identical. Returns a non-zero exit code on failure.
+ */
+#include "../imageweights.h"
+
+#include "../uvector.h"
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	size_t failureCount = 0;
+
+	void reportFailure(const std::string& message)
+	{
+		if(failureCount < 10)
+			std::cout << "FAILED: " << message << '\n';
+		++failureCount;
+	}
+
+	void fillRandomly(std::mt19937& rng, ImageWeights& weights, size_t sampleCount)
+	{
+		std::uniform_real_distribution<double> uDist(-0.5, 0.5), vDist(0.0, 0.5), weightDist(0.0, 10.0);
+		for(size_t i=0; i!=sampleCount; ++i)
+			weights.Grid(uDist(rng) * weights.Width(), vDist(rng) * weights.Height(), weightDist(rng));
+	}
+
+	void testRoundTrip(std::mt19937& rng, const WeightMode& mode, size_t width, size_t height, bool finishGridding)
+	{
+		ImageWeights original(mode, width, height, 1.0/width, 1.0/height);
+		fillRandomly(rng, original, width * height / 4);
+		if(finishGridding)
+			original.FinishGridding();
+		std::stringstream stream;
+		original.Serialize(stream);
+		const std::string serialized = stream.str();
+
+		// The restored object starts with other weights, which should all be replaced
+		ImageWeights restored(mode, width, height, 1.0/width, 1.0/height);
+		fillRandomly(rng, restored, width * height / 4);
+		std::istringstream input(serialized);
+		restored.Unserialize(input);
+
+		ao::uvector<double> originalGrid(original.Width() * original.Height()), restoredGrid(restored.Width() * restored.Height());
+		original.GetGrid(originalGrid.data());
+		restored.GetGrid(restoredGrid.data());
+		std::ostringstream description;
+		description << width << " x " << height << " grid" << (finishGridding ? " after FinishGridding()" : "");
+		if(originalGrid != restoredGrid)
+			reportFailure("restored " + description.str() + " differs from the original");
+
+		std::ostringstream reserialized;
+		restored.Serialize(reserialized);
+		if(reserialized.str() != serialized)
+			reportFailure("serializing the restored " + description.str() + " gives different bytes");
+	}
+
+	void testInvalidInput(std::mt19937& rng)
+	{
+		ImageWeights original(WeightMode::UniformWeighted, 64, 32, 1.0/64, 1.0/32);
+		fillRandomly(rng, original, 500);
+		std::ostringstream stream;
+		original.Serialize(stream);
+		const std::string serialized = stream.str();
+
+		ImageWeights otherSize(WeightMode::UniformWeighted, 32, 64, 1.0/32, 1.0/64);
+		std::istringstream input(serialized);
+		try {
+			otherSize.Unserialize(input);
+			reportFailure("weights with other dimensions were accepted");
+		} catch(std::runtime_error&) { }
+
+		ImageWeights sameSize(WeightMode::UniformWeighted, 64, 32, 1.0/64, 1.0/32);
+		std::istringstream truncated(serialized.substr(0, serialized.size() - 1));
+		try {
+			sameSize.Unserialize(truncated);
+			reportFailure("truncated weights were accepted");
+		} catch(std::runtime_error&) { }
+	}
+}
+
+int main(int, char*[])
+{
+	std::mt19937 rng(42);
+	const size_t sizes[][2] = {
+		{ 2, 2 },
+		{ 64, 32 },
+		{ 158, 262 }
+	};
+	const WeightMode modes[] = {
+		WeightMode::NaturalWeighted,
+		WeightMode::UniformWeighted,
+		WeightMode::Briggs(0.5)
+	};
+	for(const size_t* size : sizes)
+	{
+		for(const WeightMode& mode : modes)
+		{
+			testRoundTrip(rng, mode, size[0], size[1], false);
+			testRoundTrip(rng, mode, size[0], size[1], true);
+		}
+	}
+	testInvalidInput(rng);
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " checks failed.\n";
+		return 1;
+	}
+	std::cout << "All weights were restored identically.\n";
+	return 0;
+}
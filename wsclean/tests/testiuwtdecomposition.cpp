@@ -0,0 +1,112 @@
+/**
+ * Compares the vectorised IUWT decomposition of DecomposeMT() and ExtendMT() with the
+ * coefficients of DecomposeST() on random images. Returns a non-zero exit code on failure.
+ */
+#include "../iuwt/iuwtdecomposition.h"
+
+#include "../threadpool.h"
+#include "../uvector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+namespace {
+	size_t failureCount = 0;
+
+	/**
+	 * Every coefficient should be within 1e-12 times the largest absolute input value of the
+	 * coefficient calculated by DecomposeST(). The vectorised kernels add the terms of the
+	 * kernel in another order, so the coefficients can differ by rounding.
+	 */
+	void compare(const IUWTDecomposition& result, const IUWTDecomposition& expected, double maxInput, const std::string& description)
+	{
+		const double tolerance = 1e-12 * maxInput;
+		// The largest scale, at index NScales(), is included
+		for(int scale=0; scale!=int(expected.NScales())+1; ++scale)
+		{
+			const ao::uvector<double>
+				&values = result[scale].Coefficients(),
+				&expectedValues = expected[scale].Coefficients();
+			for(size_t i=0; i!=expectedValues.size(); ++i)
+			{
+				if(!(std::fabs(values[i] - expectedValues[i]) <= tolerance))
+				{
+					if(failureCount < 10)
+					{
+						std::cout << "FAILED: " << description << " of " << expected.Width() << " x " << expected.Height()
+							<< " image, scale " << scale << ", pixel (" << i % expected.Width() << ", " << i / expected.Width()
+							<< ") is " << values[i] << ", expected " << expectedValues[i] << '\n';
+					}
+					++failureCount;
+					return;
+				}
+			}
+		}
+	}
+
+	void testDecomposition(std::mt19937& rng, ThreadPool& threadPool, size_t width, size_t height)
+	{
+		std::uniform_real_distribution<double> valueDist(-1.0, 1.0);
+		std::bernoulli_distribution isSource(0.01);
+		ao::uvector<double> image(width * height);
+		double maxInput = 0.0;
+		for(double& value : image)
+		{
+			value = valueDist(rng);
+			if(isSource(rng))
+				value *= 100.0;
+			maxInput = std::max(maxInput, std::fabs(value));
+		}
+		const int scaleCount = IUWTDecomposition::EndScale(std::min(width, height));
+		ao::uvector<double> scratch(width * height);
+
+		IUWTDecomposition expected(scaleCount, width, height);
+		expected.DecomposeST(image.data(), scratch.data());
+
+		IUWTDecomposition result(scaleCount, width, height);
+		result.DecomposeMT(threadPool, image.data(), scratch.data(), true);
+		compare(result, expected, maxInput, "DecomposeMT()");
+
+		// The input may also be the scratch buffer
+		ao::uvector<double> inputAndScratch(image);
+		IUWTDecomposition inPlaceResult(scaleCount, width, height);
+		inPlaceResult.DecomposeMT(threadPool, inputAndScratch.data(), inputAndScratch.data(), true);
+		compare(inPlaceResult, expected, maxInput, "DecomposeMT() with the input as scratch");
+
+		if(scaleCount > 2)
+		{
+			IUWTDecomposition extended(scaleCount-2, width, height);
+			extended.DecomposeMT(threadPool, image.data(), scratch.data(), true);
+			extended.ExtendMT(threadPool, scaleCount, scratch.data());
+			compare(extended, expected, maxInput, "ExtendMT()");
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	std::mt19937 rng(42);
+	ThreadPool threadPool;
+	// Widths that are not multiples of the vector sizes
+	const size_t sizes[][2] = {
+		{ 16, 16 },
+		{ 37, 21 },
+		{ 130, 67 },
+		{ 256, 256 },
+		{ 509, 300 }
+	};
+	for(const size_t* size : sizes)
+	{
+		for(size_t repeat=0; repeat!=3; ++repeat)
+			testDecomposition(rng, threadPool, size[0], size[1]);
+	}
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " decompositions failed.\n";
+		return 1;
+	}
+	std::cout << "All decompositions match DecomposeST().\n";
+	return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * Compares every SIMD implementation of SimpleClean::FindPeakInRegion() that is available
+ * on this machine with the scalar implementation. Returns a non-zero exit code on failure.
+ */
+#include "../deconvolution/simpleclean.h"
+
+#include "../uvector.h"
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+
+namespace {
+	size_t failureCount = 0;
+	
+	const char* targetName(SimpleClean::PeakSearchTarget target)
+	{
+		switch(target)
+		{
+			case SimpleClean::ScalarPeakSearch: return "scalar";
+			case SimpleClean::AVXPeakSearch: return "AVX";
+			case SimpleClean::AVX512PeakSearch: return "AVX-512";
+		}
+		return "unknown";
+	}
+	
+	/**
+	 * Makes an image with values from a small set of positive and negative levels, so that
+	 * the peak is often found at several positions.
+	 */
+	void makeImage(ao::uvector<double>& image, std::mt19937& rng, bool addNonFinite)
+	{
+		std::uniform_int_distribution<int> level(-12, 12);
+		std::uniform_int_distribution<int> special(0, 99);
+		for(double& value : image)
+		{
+			value = level(rng) * 0.125;
+			if(addNonFinite)
+			{
+				switch(special(rng))
+				{
+					case 0: value = std::numeric_limits<double>::quiet_NaN(); break;
+					case 1: value = std::numeric_limits<double>::infinity(); break;
+					case 2: value = -std::numeric_limits<double>::infinity(); break;
+				}
+			}
+		}
+	}
+	
+	void compareTarget(SimpleClean::PeakSearchTarget target, const double* image, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, const bool* cleanMask, bool allowNegativeComponents)
+	{
+		double expectedValue, value;
+		const size_t expectedIndex = SimpleClean::FindPeakInRegion(image, width, height, startX, endX, startY, endY, cleanMask, allowNegativeComponents, expectedValue, SimpleClean::ScalarPeakSearch);
+		const size_t index = SimpleClean::FindPeakInRegion(image, width, height, startX, endX, startY, endY, cleanMask, allowNegativeComponents, value, target);
+		if(index != expectedIndex || value != expectedValue)
+		{
+			if(failureCount < 10)
+			{
+				std::cout << "FAILED: " << targetName(target) << " found index " << index << " with value " << value
+					<< ", scalar found index " << expectedIndex << " with value " << expectedValue
+					<< " (image " << width << " x " << height << ", region [" << startX << ", " << endX << ") x [" << startY << ", " << endY << ")"
+					<< (cleanMask ? ", masked" : "") << (allowNegativeComponents ? ", negative components" : "") << ")\n";
+			}
+			++failureCount;
+		}
+	}
+	
+	void testTarget(SimpleClean::PeakSearchTarget target)
+	{
+		std::mt19937 rng(42);
+		const size_t sizes[][2] = { {1, 1}, {3, 5}, {7, 7}, {9, 4}, {17, 13}, {31, 33}, {65, 63}, {127, 129} };
+		for(const size_t* size : sizes)
+		{
+			const size_t width = size[0], height = size[1];
+			ao::uvector<double> image(width * height);
+			ao::uvector<bool> mask(width * height);
+			std::uniform_int_distribution<size_t> xDist(0, width), yDist(0, height);
+			std::bernoulli_distribution maskDist(0.6);
+			for(size_t repeat=0; repeat!=50; ++repeat)
+			{
+				makeImage(image, rng, repeat%5 == 4);
+				for(size_t i=0; i!=mask.size(); ++i)
+					mask[i] = maskDist(rng);
+				size_t startX = xDist(rng), endX = xDist(rng), startY = yDist(rng), endY = yDist(rng);
+				if(startX > endX) std::swap(startX, endX);
+				if(startY > endY) std::swap(startY, endY);
+				if(repeat == 0)
+				{
+					startX = 0; endX = width;
+					startY = 0; endY = height;
+				}
+				for(int allowNegative=0; allowNegative!=2; ++allowNegative)
+				{
+					compareTarget(target, image.data(), width, height, startX, endX, startY, endY, 0, allowNegative);
+					compareTarget(target, image.data(), width, height, startX, endX, startY, endY, mask.data(), allowNegative);
+				}
+			}
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	const SimpleClean::PeakSearchTarget targets[] = { SimpleClean::AVXPeakSearch, SimpleClean::AVX512PeakSearch };
+	for(SimpleClean::PeakSearchTarget target : targets)
+	{
+		if(SimpleClean::HasPeakSearchTarget(target))
+		{
+			std::cout << "Testing " << targetName(target) << " peak search.\n";
+			testTarget(target);
+		}
+		else {
+			std::cout << "Skipping " << targetName(target) << " peak search: not available.\n";
+		}
+	}
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " comparisons failed.\n";
+		return 1;
+	}
+	std::cout << "All comparisons passed.\n";
+	return 0;
+}
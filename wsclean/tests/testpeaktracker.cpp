@@ -0,0 +1,117 @@
+/**
+ * Compares the peaks found by PeakTracker during a Hogbom-like clean with the peaks found
+ * by scanning the full region. Returns a non-zero exit code on failure.
+ */
+#include "../deconvolution/peaktracker.h"
+#include "../deconvolution/simpleclean.h"
+
+#include "../uvector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+namespace {
+	size_t failureCount = 0;
+	
+	/**
+	 * Values are multiples of 1/8 and PSF values multiples of 1/4, and half of the peak is
+	 * subtracted, so that the subtractions are exact and peaks of equal value stay equal.
+	 * Every third iteration, the values in a random area are replaced instead.
+	 */
+	void testClean(std::mt19937& rng, size_t width, size_t height, size_t startX, size_t endX, size_t startY, size_t endY, bool useMask, bool allowNegativeComponents)
+	{
+		std::uniform_int_distribution<int> level(-64, 64), psfLevel(-1, 2);
+		std::bernoulli_distribution maskDist(0.5);
+		ao::uvector<double> image(width * height);
+		for(double& value : image)
+			value = level(rng) * 0.125;
+		ao::uvector<bool> mask(width * height);
+		for(size_t i=0; i!=mask.size(); ++i)
+			mask[i] = maskDist(rng);
+		const bool* cleanMask = useMask ? mask.data() : 0;
+		
+		const size_t psfWidth = 21, psfHeight = 19;
+		ao::uvector<double> psf(psfWidth * psfHeight);
+		for(double& value : psf)
+			value = psfLevel(rng) * 0.25;
+		psf[psfWidth/2 + (psfHeight/2)*psfWidth] = 1.0;
+		
+		PeakTracker tracker(image.data(), width, height, startX, endX, startY, endY, cleanMask, allowNegativeComponents, psf.data(), psfWidth, psfHeight);
+		for(size_t iteration=0; iteration!=100; ++iteration)
+		{
+			size_t x, y;
+			const double peak = tracker.FindPeak(x, y);
+			double expectedPeak;
+			const size_t expectedIndex = SimpleClean::FindPeakInRegion(image.data(), width, height, startX, endX, startY, endY, cleanMask, allowNegativeComponents, expectedPeak, SimpleClean::ScalarPeakSearch);
+			const bool hasPeak = std::isfinite(peak);
+			const bool hasExpectedPeak = expectedIndex != width * height;
+			if(hasPeak != hasExpectedPeak || (hasPeak && (x + y*width != expectedIndex || std::fabs(peak) != expectedPeak)))
+			{
+				if(failureCount < 10)
+				{
+					std::cout << "FAILED: iteration " << iteration << " of image " << width << " x " << height
+						<< ", region [" << startX << ", " << endX << ") x [" << startY << ", " << endY << ")"
+						<< (useMask ? ", masked" : "") << (allowNegativeComponents ? ", negative components" : "")
+						<< ": tracker found (" << x << ", " << y << ") with value " << peak
+						<< ", scan found index " << expectedIndex << " with value " << expectedPeak << '\n';
+				}
+				++failureCount;
+				return;
+			}
+			if(!hasPeak)
+				return;
+			if(iteration % 3 == 2)
+			{
+				// Replace the values in a random area, which can raise the peak
+				std::uniform_int_distribution<size_t> xDist(0, width-1), yDist(0, height-1);
+				size_t startX = xDist(rng), endX = xDist(rng) + 1, startY = yDist(rng), endY = yDist(rng) + 1;
+				if(endX < startX) std::swap(startX, endX);
+				if(endY < startY) std::swap(startY, endY);
+				for(size_t changeY=startY; changeY<endY; ++changeY)
+				{
+					for(size_t changeX=startX; changeX<endX; ++changeX)
+						image[changeX + changeY*width] = level(rng) * 0.25;
+				}
+				tracker.Invalidate(startX, endX, startY, endY);
+			}
+			else {
+				const double factor = 0.5 * peak;
+				SimpleClean::PartialSubtractImage(image.data(), width, height, psf.data(), psfWidth, psfHeight, x, y, factor, 0, height);
+				tracker.Subtract(x, y, factor);
+			}
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	std::mt19937 rng(42);
+	// Sizes that are not multiples of the tile size, and regions that do not start at zero
+	const size_t regions[][6] = {
+		{ 1, 1, 0, 1, 0, 1 },
+		{ 63, 65, 0, 63, 0, 65 },
+		{ 157, 131, 0, 157, 0, 131 },
+		{ 201, 199, 13, 190, 7, 171 },
+		{ 257, 129, 64, 193, 1, 128 }
+	};
+	for(const size_t* region : regions)
+	{
+		for(int useMask=0; useMask!=2; ++useMask)
+		{
+			for(int allowNegative=0; allowNegative!=2; ++allowNegative)
+			{
+				for(size_t repeat=0; repeat!=3; ++repeat)
+					testClean(rng, region[0], region[1], region[2], region[3], region[4], region[5], useMask, allowNegative);
+			}
+		}
+	}
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " cleans failed.\n";
+		return 1;
+	}
+	std::cout << "All cleans found the same peaks.\n";
+	return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * Compares the rank filter of ImageWeights, which uses summed-area tables, with the mean
+ * of every window summed directly, on random grids. Returns a non-zero exit code on failure.
+ */
+#include "../imageweights.h"
+
+#include "../uvector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+namespace {
+	size_t failureCount = 0;
+
+	/**
+	 * Mean of the non-zero cells in the window around (x, y), summed cell by cell over the
+	 * same window as the rank filter.
+	 */
+	double windowMean(const double* grid, size_t width, size_t height, size_t x, size_t y, size_t windowSize)
+	{
+		const size_t d = windowSize/2;
+		const size_t
+			x1 = (x <= d) ? 0 : x - d,
+			y1 = (y <= d) ? 0 : y - d,
+			x2 = std::min(x + d, width),
+			y2 = std::min(y + d, height);
+		size_t windowCount = 0;
+		double windowSum = 0.0;
+		for(size_t yi=y1; yi<y2; ++yi)
+		{
+			for(size_t xi=x1; xi<x2; ++xi)
+			{
+				double w = grid[yi*width + xi];
+				if(w != 0.0)
+				{
+					++windowCount;
+					windowSum += w;
+				}
+			}
+		}
+		return windowSum / double(windowCount);
+	}
+
+	/**
+	 * The weights are gridded in the cell centres, with pixel scales that make the uv
+	 * coordinates equal to the cell coordinates. Every total in the summed-area tables is
+	 * rounded once, so a window sum can be off by a few times the rounding error of the
+	 * total of the grid. The filtered cells should therefore be within 1e-14 times the
+	 * total of the grid, times the rank limit, of the directly calculated limits. The sizes
+	 * should be even, since ImageWeights rounds them up to even sizes.
+	 */
+	void testFilter(std::mt19937& rng, size_t width, size_t height, size_t windowSize, double rankLimit, size_t threadCount)
+	{
+		std::uniform_real_distribution<double> weightDist(0.0, 10.0);
+		std::bernoulli_distribution isFilled(0.5), isOutlier(0.01);
+		ImageWeights weights(WeightMode::UniformWeighted, width, height, 1.0/width, 1.0/height);
+		weights.SetThreadCount(threadCount);
+		for(size_t y=0; y!=height/2; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				if(isFilled(rng))
+				{
+					double weight = weightDist(rng);
+					if(isOutlier(rng))
+						weight *= 1000.0;
+					weights.Grid(double(x) - double(width/2) + 0.5, double(y) + 0.5, weight);
+				}
+			}
+		}
+		// The lower half of the image holds the grid rows in order
+		ao::uvector<double> image(width * height);
+		weights.GetGrid(image.data());
+		const ao::uvector<double> grid(image.begin() + width*(height/2), image.end());
+		double total = 0.0;
+		for(double w : grid)
+			total += w;
+		const double tolerance = 1e-14 * total * rankLimit;
+
+		weights.RankFilter(rankLimit, windowSize);
+		weights.GetGrid(image.data());
+		const double* filtered = &image[width*(height/2)];
+		for(size_t y=0; y!=height/2; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				const double w = grid[y*width + x];
+				double expected = w;
+				if(w != 0.0)
+				{
+					const double mean = windowMean(grid.data(), width, height/2, x, y, windowSize);
+					if(w > mean*rankLimit)
+						expected = mean*rankLimit;
+				}
+				const double value = filtered[y*width + x];
+				if(!(std::fabs(value - expected) <= tolerance))
+				{
+					if(failureCount < 10)
+					{
+						std::cout << "FAILED: grid " << width << " x " << height/2 << ", window " << windowSize
+							<< ", rank limit " << rankLimit << ", " << threadCount << " threads: cell ("
+							<< x << ", " << y << ") is " << value << ", expected " << expected << '\n';
+					}
+					++failureCount;
+				}
+			}
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	std::mt19937 rng(42);
+	const size_t sizes[][2] = {
+		{ 2, 2 },
+		{ 64, 64 },
+		{ 158, 262 },
+		{ 200, 160 }
+	};
+	const size_t windowSizes[] = { 1, 2, 3, 16, 33, 200 };
+	const double rankLimits[] = { 1.0, 2.5 };
+	for(const size_t* size : sizes)
+	{
+		for(size_t windowSize : windowSizes)
+		{
+			for(double rankLimit : rankLimits)
+			{
+				testFilter(rng, size[0], size[1], windowSize, rankLimit, 1);
+				testFilter(rng, size[0], size[1], windowSize, rankLimit, 3);
+			}
+		}
+	}
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " cells failed.\n";
+		return 1;
+	}
+	std::cout << "All filtered cells match the directly calculated window means.\n";
+	return 0;
+}
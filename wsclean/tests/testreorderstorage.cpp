@@ -0,0 +1,116 @@
+/**
+ * Checks the error of the scaled int16 format of ReorderStorage on random rows. Returns a
+ * non-zero exit code on failure.
+ */
+#include "../msproviders/reorderstorage.h"
+
+#include "../uvector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+
+namespace {
+	size_t failureCount = 0;
+
+	void reportFailure(const std::string& description, size_t valueCount, size_t index, float value, float decoded)
+	{
+		if(failureCount < 10)
+		{
+			std::cout << "FAILED: " << description << " row of " << valueCount << " values: value " << index
+				<< " is " << value << ", decoded as " << decoded << '\n';
+		}
+		++failureCount;
+	}
+
+	/**
+	 * Encodes and decodes a row. Finite values should be within half a quantization step of
+	 * the row maximum / 32767, plus 1% of a step for the rounding of the float
+	 * multiplications. Non-finite values should be decoded as zero.
+	 */
+	void testRow(const ao::uvector<float>& row, const std::string& description)
+	{
+		const ReorderStorage::Format format = ReorderStorage::ScaledInt16Storage;
+		ao::uvector<char> encoded(ReorderStorage::RowSize(format, row.size()));
+		ao::uvector<float> decoded(row.size());
+		ReorderStorage::Encode(format, encoded.data(), row.data(), row.size());
+		ReorderStorage::Decode(format, decoded.data(), encoded.data(), row.size());
+
+		double maxValue = 0.0;
+		for(float value : row)
+		{
+			if(std::isfinite(value))
+				maxValue = std::max(maxValue, std::fabs(double(value)));
+		}
+		const double maxError = maxValue / 32767.0 * 0.51;
+		for(size_t i=0; i!=row.size(); ++i)
+		{
+			if(std::isfinite(row[i]))
+			{
+				if(!(std::fabs(double(row[i]) - double(decoded[i])) <= maxError))
+					reportFailure(description, row.size(), i, row[i], decoded[i]);
+			}
+			else if(decoded[i] != 0.0)
+				reportFailure(description, row.size(), i, row[i], decoded[i]);
+		}
+	}
+}
+
+int main(int, char*[])
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> valueDist(-1.0, 1.0);
+	std::uniform_int_distribution<int> exponentDist(-30, 30);
+	std::uniform_int_distribution<size_t> lengthDist(1, 1000);
+	std::bernoulli_distribution isNonFinite(0.01);
+	const float nonFinite[] = {
+		std::numeric_limits<float>::quiet_NaN(),
+		std::numeric_limits<float>::infinity(),
+		-std::numeric_limits<float>::infinity()
+	};
+	for(size_t repeat=0; repeat!=1000; ++repeat)
+	{
+		ao::uvector<float> row(lengthDist(rng));
+		const float scale = std::pow(10.0f, float(exponentDist(rng)));
+		for(float& value : row)
+			value = valueDist(rng) * scale;
+		testRow(row, "random");
+
+		// The largest value is exactly representable in both signs
+		row[rng() % row.size()] = scale;
+		row[rng() % row.size()] = -scale;
+		testRow(row, "random with extremes");
+
+		for(float& value : row)
+		{
+			if(isNonFinite(rng))
+				value = nonFinite[rng() % 3];
+		}
+		testRow(row, "random with non-finite values");
+	}
+	testRow(ao::uvector<float>(100, 0.0f), "zero");
+	testRow(ao::uvector<float>(100, std::numeric_limits<float>::quiet_NaN()), "NaN");
+	testRow(ao::uvector<float>(100, std::numeric_limits<float>::max()), "maximum float");
+
+	// A row of denormal values has no scale with a finite inverse and is stored as zeros
+	ao::uvector<float> denormalRow(100, std::numeric_limits<float>::denorm_min() * 3.0f);
+	ao::uvector<char> encoded(ReorderStorage::RowSize(ReorderStorage::ScaledInt16Storage, denormalRow.size()));
+	ao::uvector<float> decoded(denormalRow.size());
+	ReorderStorage::Encode(ReorderStorage::ScaledInt16Storage, encoded.data(), denormalRow.data(), denormalRow.size());
+	ReorderStorage::Decode(ReorderStorage::ScaledInt16Storage, decoded.data(), encoded.data(), denormalRow.size());
+	for(size_t i=0; i!=decoded.size(); ++i)
+	{
+		if(decoded[i] != 0.0)
+			reportFailure("denormal", decoded.size(), i, denormalRow[i], decoded[i]);
+	}
+
+	if(failureCount != 0)
+	{
+		std::cout << failureCount << " values failed.\n";
+		return 1;
+	}
+	std::cout << "All decoded values are within the error bound.\n";
+	return 0;
+}
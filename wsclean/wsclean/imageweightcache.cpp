@@ -0,0 +1,234 @@
+#include "imageweightcache.h"
+
+#include "../msproviders/msprovider.h"
+
+#include "../uvector.h"
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+void ImageWeightCache::recalculateWeights(InversionAlgorithm& inversion)
+{
+	ResetWeights();
+	std::map<size_t, Storage>::const_iterator storage = _storage.find(_currentWeightChannel);
+	if(storage != _storage.end())
+	{
+		if(loadWeights(*_imageWeights, storage->second))
+			return;
+		ResetWeights();
+	}
+	
+	std::cout << "Precalculating weights for " << _weightMode.ToString() << " weighting... " << std::flush;
+	for(size_t i=0; i!=inversion.MeasurementSetCount(); ++i)
+	{
+		_imageWeights->Grid(inversion.MeasurementSet(i), inversion.Selection(i));
+		if(inversion.MeasurementSetCount() > 1)
+			std::cout << i << ' ' << std::flush;
+	}
+	_imageWeights->FinishGridding();
+	InitializeWeightTapers();
+	std::cout << "DONE\n";
+	if(storage != _storage.end())
+		storeWeights(*_imageWeights, storage->second);
+}
+
+bool ImageWeightCache::loadWeights(ImageWeights& weights, const Storage& storage) const
+{
+	std::ifstream file(storage.filename, std::ios::in | std::ios::binary);
+	if(!file.good())
+		return false;
+	uint64_t descriptionSize = 0;
+	file.read(reinterpret_cast<char*>(&descriptionSize), sizeof(descriptionSize));
+	if(!file.good() || descriptionSize != storage.description.size())
+		return false;
+	std::string description(descriptionSize, ' ');
+	file.read(&description[0], descriptionSize);
+	if(!file.good() || description != storage.description)
+		return false;
+	try {
+		weights.Unserialize(file);
+	} catch(std::exception& e)
+	{
+		std::cout << "Could not read stored weights from " << storage.filename << ": " << e.what() << '\n';
+		return false;
+	}
+	std::cout << "Read weights from " << storage.filename << ".\n";
+	return true;
+}
+
+void ImageWeightCache::storeWeights(const ImageWeights& weights, const Storage& storage) const
+{
+	// Write to a temporary name first, so that an interrupted run does not leave a partial file
+	const std::string tmpFilename = storage.filename + ".tmp";
+	std::ofstream file(tmpFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+	const uint64_t descriptionSize = storage.description.size();
+	file.write(reinterpret_cast<const char*>(&descriptionSize), sizeof(descriptionSize));
+	file.write(storage.description.data(), descriptionSize);
+	weights.Serialize(file);
+	file.close();
+	if(!file.good() || std::rename(tmpFilename.c_str(), storage.filename.c_str()) != 0)
+	{
+		std::remove(tmpFilename.c_str());
+		std::cout << "Warning: could not store weights in " << storage.filename << '\n';
+	}
+}
+
+void ImageWeightCache::selectPrecalculatedInterval(size_t outIntervalIndex)
+{
+	if(outIntervalIndex != _precalculatedInterval)
+	{
+		_precalculatedWeights.clear();
+		_precalculatedInterval = outIntervalIndex;
+	}
+	// Make sure the next call to Update() selects one of the new grids
+	_currentWeightChannel = std::numeric_limits<size_t>::max();
+	_currentWeightInterval = std::numeric_limits<size_t>::max();
+}
+
+std::vector<size_t> ImageWeightCache::LoadStoredWeights(size_t outIntervalIndex, const std::vector<size_t>& outChannelIndices)
+{
+	selectPrecalculatedInterval(outIntervalIndex);
+	std::vector<size_t> missingChannels;
+	for(std::vector<size_t>::const_iterator ch=outChannelIndices.begin(); ch!=outChannelIndices.end(); ++ch)
+	{
+		std::map<size_t, Storage>::const_iterator storage = _storage.find(*ch);
+		bool isLoaded = false;
+		if(storage != _storage.end())
+		{
+			std::unique_ptr<ImageWeights> weights(createWeights());
+			isLoaded = loadWeights(*weights, storage->second);
+			if(isLoaded)
+				_precalculatedWeights[*ch] = std::move(weights);
+		}
+		if(!isLoaded)
+			missingChannels.push_back(*ch);
+	}
+	return missingChannels;
+}
+
+void ImageWeightCache::Precalculate(size_t outIntervalIndex, const std::vector<size_t>& outChannelIndices, const std::vector<Source>& sources, size_t threadCount)
+{
+	selectPrecalculatedInterval(outIntervalIndex);
+	if(outChannelIndices.empty())
+		return;
+	std::cout << "Precalculating weights of " << outChannelIndices.size() << " channels for " << _weightMode.ToString() << " weighting... " << std::flush;
+	for(std::vector<size_t>::const_iterator ch=outChannelIndices.begin(); ch!=outChannelIndices.end(); ++ch)
+		_precalculatedWeights[*ch].reset(createWeights());
+	
+	threadCount = std::max<size_t>(1, std::min(threadCount, outChannelIndices.size()));
+	std::map<size_t, size_t> channelOwners;
+	for(size_t i=0; i!=outChannelIndices.size(); ++i)
+		channelOwners[outChannelIndices[i]] = i % threadCount;
+
+	if(_weightMode.RequiresGridding())
+	{
+		// Sources with a single output channel are read by the thread that owns the channel,
+		// so that every grid is only written by one thread.
+		std::vector<std::vector<const Source*>> ownedSources(threadCount);
+		for(std::vector<Source>::const_iterator source=sources.begin(); source!=sources.end(); ++source)
+		{
+			if(source->targets.size() == 1)
+				ownedSources[channelOwners.find(source->targets.front().outChannelIndex)->second].push_back(&*source);
+			else if(!source->targets.empty())
+				gridSharedSource(*source, channelOwners, threadCount);
+		}
+
+		boost::thread_group threads;
+		for(size_t t=0; t!=threadCount; ++t)
+		{
+			const std::vector<const Source*>& threadSources = ownedSources[t];
+			threads.add_thread(new boost::thread([this, &threadSources]() {
+				for(std::vector<const Source*>::const_iterator source=threadSources.begin(); source!=threadSources.end(); ++source)
+					gridSource(**source);
+			}));
+		}
+		threads.join_all();
+	}
+
+	for(std::vector<size_t>::const_iterator ch=outChannelIndices.begin(); ch!=outChannelIndices.end(); ++ch)
+	{
+		ImageWeights& weights = *_precalculatedWeights.find(*ch)->second;
+		weights.FinishGridding();
+		initializeWeightTapers(weights);
+		std::map<size_t, Storage>::const_iterator storage = _storage.find(*ch);
+		if(storage != _storage.end())
+			storeWeights(weights, storage->second);
+	}
+	std::cout << "DONE\n";
+}
+
+void ImageWeightCache::gridSource(const Source& source)
+{
+	const Source::Target& target = source.targets.front();
+	ImageWeights& weights = *_precalculatedWeights.find(target.outChannelIndex)->second;
+	std::vector<float> weightBuffer(source.selectedBand.MaxChannels());
+	MSProvider& provider = *source.provider;
+
+	provider.Reset();
+	while(provider.CurrentRowAvailable())
+	{
+		double uInM, vInM, wInM;
+		size_t dataDescId;
+		provider.ReadMeta(uInM, vInM, wInM, dataDescId);
+		provider.ReadWeights(weightBuffer.data());
+		const BandData& curBand = source.selectedBand[dataDescId];
+		const size_t endChannel = std::min(target.endChannel, curBand.ChannelCount());
+		for(size_t ch=target.startChannel; ch<endChannel; ++ch)
+			weights.Grid(uInM / curBand.ChannelWavelength(ch), vInM / curBand.ChannelWavelength(ch), weightBuffer[ch]);
+
+		provider.NextRow();
+	}
+}
+
+void ImageWeightCache::gridSharedSource(const Source& source, const std::map<size_t, size_t>& channelOwners, size_t threadCount)
+{
+	const size_t maxChannels = source.selectedBand.MaxChannels();
+	const size_t rowsPerBlock = std::max<size_t>(1, (size_t(1)<<22) / std::max<size_t>(1, maxChannels));
+	ao::uvector<double> uBlock(rowsPerBlock), vBlock(rowsPerBlock);
+	ao::uvector<size_t> dataDescIdBlock(rowsPerBlock);
+	ao::uvector<float> weightBlock(rowsPerBlock * maxChannels);
+	MSProvider& provider = *source.provider;
+
+	provider.Reset();
+	while(provider.CurrentRowAvailable())
+	{
+		size_t rowCount = 0;
+		while(rowCount != rowsPerBlock && provider.CurrentRowAvailable())
+		{
+			double wInM;
+			provider.ReadMeta(uBlock[rowCount], vBlock[rowCount], wInM, dataDescIdBlock[rowCount]);
+			provider.ReadWeights(&weightBlock[rowCount * maxChannels]);
+			++rowCount;
+			provider.NextRow();
+		}
+
+		// Every thread grids the rows into the output channels it owns
+		boost::thread_group threads;
+		for(size_t t=0; t!=threadCount; ++t)
+		{
+			threads.add_thread(new boost::thread([&, t, rowCount]() {
+				for(std::vector<Source::Target>::const_iterator target=source.targets.begin(); target!=source.targets.end(); ++target)
+				{
+					if(channelOwners.find(target->outChannelIndex)->second != t)
+						continue;
+					ImageWeights& weights = *_precalculatedWeights.find(target->outChannelIndex)->second;
+					for(size_t row=0; row!=rowCount; ++row)
+					{
+						const BandData& curBand = source.selectedBand[dataDescIdBlock[row]];
+						const float* rowWeights = &weightBlock[row * maxChannels];
+						const size_t endChannel = std::min(target->endChannel, curBand.ChannelCount());
+						for(size_t ch=target->startChannel; ch<endChannel; ++ch)
+							weights.Grid(uBlock[row] / curBand.ChannelWavelength(ch), vBlock[row] / curBand.ChannelWavelength(ch), rowWeights[ch]);
+					}
+				}
+			}));
+		}
+		threads.join_all();
+	}
+}
@@ -4,14 +4,21 @@
 #include "inversionalgorithm.h"
 
 #include "../imageweights.h"
+#include "../multibanddata.h"
 #include "../weightmode.h"
 
 #include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <vector>
 
 class ImageWeightCache
 {
 public:
-	ImageWeightCache(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double minUVInLambda, double maxUVInLambda, double rankFilterLevel, size_t rankFilterSize) :
+	ImageWeightCache(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double minUVInLambda, double maxUVInLambda, double rankFilterLevel, size_t rankFilterSize, size_t threadCount) :
 		_weightMode(weightMode),
 		_imageWidth(imageWidth),
 		_imageHeight(imageHeight),
@@ -21,67 +28,217 @@ public:
 		_maxUVInLambda(maxUVInLambda),
 		_rankFilterLevel(rankFilterLevel),
 		_rankFilterSize(rankFilterSize),
+		_threadCount(threadCount),
+		_currentWeights(0),
 		_currentWeightChannel(std::numeric_limits<size_t>::max()),
-		_currentWeightInterval(std::numeric_limits<size_t>::max())
+		_currentWeightInterval(std::numeric_limits<size_t>::max()),
+		_precalculatedInterval(std::numeric_limits<size_t>::max()),
+		_isFrozen(false)
 	{
 	}
 	
+	/**
+	 * A measurement set provider that is read during precalculation, and the output channels
+	 * its channels contribute to. Channel indices are relative to the selected band of the provider.
+	 */
+	struct Source
+	{
+		struct Target
+		{
+			size_t outChannelIndex, startChannel, endChannel;
+		};
+		class MSProvider* provider;
+		MultiBandData selectedBand;
+		std::vector<Target> targets;
+	};
+	
 	void Update(InversionAlgorithm& inversion, size_t outChannelIndex, size_t outIntervalIndex)
 	{
+		if(!_weightMode.RequiresGridding())
+		{
+			// These weights do not depend on the data, so they are made once without reading
+			// the data and are used for all channels and intervals
+			if(_dataIndependentWeights == 0)
+			{
+				_dataIndependentWeights.reset(createWeights());
+				_dataIndependentWeights->FinishGridding();
+				initializeWeightTapers(*_dataIndependentWeights);
+			}
+			_currentWeights = _dataIndependentWeights.get();
+			return;
+		}
 		if(outChannelIndex != _currentWeightChannel || outIntervalIndex != _currentWeightInterval)
 		{
+			if(_isFrozen && !HasPrecalculatedWeights(outChannelIndex, outIntervalIndex))
+			{
+				std::ostringstream str;
+				str << "The image weights of output channel " << outChannelIndex << " were not precalculated, and can not be calculated while other groups are gridded concurrently";
+				throw std::runtime_error(str.str());
+			}
 			_currentWeightChannel = outChannelIndex;
 			_currentWeightInterval = outIntervalIndex;
 			
-			recalculateWeights(inversion);
+			// Uses the same test as HasPrecalculatedWeights(), so that callers can rely on it
+			if(HasPrecalculatedWeights(outChannelIndex, outIntervalIndex))
+				_currentWeights = _precalculatedWeights.find(outChannelIndex)->second.get();
+			else
+				recalculateWeights(inversion);
 		}
 	}
 	
+	/**
+	 * Whether the weights of the given output channel were precalculated or loaded, in which
+	 * case Update() selects them without regridding and Weights() stays valid afterwards.
+	 */
+	bool HasPrecalculatedWeights(size_t outChannelIndex, size_t outIntervalIndex) const
+	{
+		return outIntervalIndex == _precalculatedInterval && _precalculatedWeights.count(outChannelIndex) != 0;
+	}
+	
+	/**
+	 * Whether the weights depend on the data. When they do not, e.g. with natural weighting,
+	 * nothing needs to be precalculated and Update() never reads the data.
+	 */
+	bool RequiresGridding() const { return _weightMode.RequiresGridding(); }
+
+	/**
+	 * While frozen, Update() only selects precalculated weights and the weights are never
+	 * reset, because gridders that run concurrently may still use the current weights.
+	 */
+	void SetFrozen(bool isFrozen) { _isFrozen = isFrozen; }
+	
+	/**
+	 * Reads the stored weights (see SetStorage()) of the given output channels and keeps them
+	 * like precalculated weights.
+	 * @returns the channels that have no valid stored weights.
+	 */
+	std::vector<size_t> LoadStoredWeights(size_t outIntervalIndex, const std::vector<size_t>& outChannelIndices);
+	
+	/**
+	 * Calculates the weights of all given output channels of an interval at once and keeps them,
+	 * so that Update() does not have to grid the data again when the channel changes. Every source
+	 * is read once. Sources that contribute to several output channels are gridded by all threads,
+	 * each thread owning a subset of the output channels; other sources are read in parallel.
+	 */
+	void Precalculate(size_t outIntervalIndex, const std::vector<size_t>& outChannelIndices, const std::vector<Source>& sources, size_t threadCount);
+	
+	/**
+	 * Approximate number of bytes used by the weight grids of the given number of channels.
+	 */
+	double EstimateMemorySize(size_t channelCount) const
+	{
+		const double superWeight = _weightMode.SuperWeight();
+		return double(channelCount) * (_imageWidth/superWeight) * (_imageHeight/superWeight) * 0.5 * sizeof(double);
+	}
+	
+	/**
+	 * Stores the weights of an output channel in a file once they have been calculated,
+	 * and reads them from that file instead of gridding the data when it exists. The
+	 * description should list everything that the weights depend on: it is
+	 * written to the file and compared when reading it back.
+	 */
+	void SetStorage(size_t outChannelIndex, const std::string& filename, const std::string& description)
+	{
+		Storage& storage = _storage[outChannelIndex];
+		storage.filename = filename;
+		storage.description = description;
+	}
+	
+	/**
+	 * Like SetStorage(), but for the weights that are gridded with ResetWeights()
+	 * for MFS weighting.
+	 */
+	void SetMFSStorage(const std::string& filename, const std::string& description)
+	{
+		_mfsStorage.filename = filename;
+		_mfsStorage.description = description;
+	}
+	
+	/**
+	 * Resets the weights and reads the stored MFS weights when available.
+	 * @returns true when the weights were read and need not be gridded.
+	 */
+	bool LoadMFSWeights()
+	{
+		ResetWeights();
+		if(!_mfsStorage.filename.empty() && loadWeights(*_imageWeights, _mfsStorage))
+			return true;
+		ResetWeights();
+		return false;
+	}
+	
+	void StoreMFSWeights() const
+	{
+		if(!_mfsStorage.filename.empty())
+			storeWeights(*_imageWeights, _mfsStorage);
+	}
+	
 	void ResetWeights()
 	{
-		_imageWeights.reset(new ImageWeights(_weightMode, _imageWidth, _imageHeight, _pixelScaleX, _pixelScaleY, _weightMode.SuperWeight()));
+		if(_isFrozen)
+			throw std::runtime_error("The image weights can not be reset while they are used by concurrent gridders");
+		_imageWeights.reset(createWeights());
+		_currentWeights = _imageWeights.get();
 	};
 	
 	ImageWeights& Weights()
 	{
-		return *_imageWeights;
+		return *_currentWeights;
 	}
 	
 	void InitializeWeightTapers()
 	{
-		if(_minUVInLambda!=0.0)
-			_imageWeights->SetMinUVRange(_minUVInLambda);
-		if(_maxUVInLambda!=0.0)
-			_imageWeights->SetMaxUVRange(_maxUVInLambda);
-		if(_rankFilterLevel >= 1.0)
-			_imageWeights->RankFilter(_rankFilterLevel, _rankFilterSize);
+		initializeWeightTapers(*_currentWeights);
 	}
 
 private:
-	void recalculateWeights(InversionAlgorithm& inversion)
+	void selectPrecalculatedInterval(size_t outIntervalIndex);
+	
+	ImageWeights* createWeights() const
 	{
-		std::cout << "Precalculating weights for " << _weightMode.ToString() << " weighting... " << std::flush;
-		ResetWeights();
-		for(size_t i=0; i!=inversion.MeasurementSetCount(); ++i)
-		{
-			_imageWeights->Grid(inversion.MeasurementSet(i), inversion.Selection(i));
-			if(inversion.MeasurementSetCount() > 1)
-				std::cout << i << ' ' << std::flush;
-		}
-		_imageWeights->FinishGridding();
-		InitializeWeightTapers();
-		std::cout << "DONE\n";
+		ImageWeights* weights = new ImageWeights(_weightMode, _imageWidth, _imageHeight, _pixelScaleX, _pixelScaleY, _weightMode.SuperWeight());
+		weights->SetThreadCount(_threadCount);
+		return weights;
 	}
 	
+	void initializeWeightTapers(ImageWeights& weights)
+	{
+		if(_minUVInLambda!=0.0)
+			weights.SetMinUVRange(_minUVInLambda);
+		if(_maxUVInLambda!=0.0)
+			weights.SetMaxUVRange(_maxUVInLambda);
+		if(_rankFilterLevel >= 1.0)
+			weights.RankFilter(_rankFilterLevel, _rankFilterSize);
+	}
+	
+	struct Storage
+	{
+		std::string filename, description;
+	};
+	
+	void recalculateWeights(InversionAlgorithm& inversion);
+	bool loadWeights(ImageWeights& weights, const Storage& storage) const;
+	void storeWeights(const ImageWeights& weights, const Storage& storage) const;
+	void gridSharedSource(const Source& source, const std::map<size_t, size_t>& channelOwners, size_t threadCount);
+	void gridSource(const Source& source);
+	
 	std::unique_ptr<ImageWeights> _imageWeights;
+	std::unique_ptr<ImageWeights> _dataIndependentWeights;
+	std::map<size_t, std::unique_ptr<ImageWeights>> _precalculatedWeights;
+	std::map<size_t, Storage> _storage;
+	Storage _mfsStorage;
 	const WeightMode _weightMode;
 	size_t _imageWidth, _imageHeight;
 	double _pixelScaleX, _pixelScaleY;
 	double _minUVInLambda, _maxUVInLambda;
 	double _rankFilterLevel;
 	size_t _rankFilterSize;
+	size_t _threadCount;
 	
+	ImageWeights* _currentWeights;
 	size_t _currentWeightChannel, _currentWeightInterval;
+	size_t _precalculatedInterval;
+	bool _isFrozen;
 };
 
 #endif
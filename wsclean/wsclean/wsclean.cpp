@@ -10,6 +10,7 @@
 #include "../fitswriter.h"
 #include "../gaussianfitter.h"
 #include "../imageweights.h"
+#include "../lane.h"
 #include "../modelrenderer.h"
 #include "../msselection.h"
 #include "../msproviders/contiguousms.h"
@@ -25,8 +26,19 @@
 
 #include "imageweightcache.h"
 
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <fftw3.h>
+#include <fitsio.h>
+
+#include <cstdint>
+#include <exception>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <sstream>
 
 std::string commandLine;
 
@@ -55,12 +67,16 @@ WSClean::WSClean() :
 	_forceReorder(false), _forceNoReorder(false),
 	_modelUpdateRequired(true),
 	_mfsWeighting(false),
+	_reorderStorageFormat(ReorderStorage::FloatStorage),
+	_reorderInMemory(false), _useHugePages(false),
+	_memoryResidentSize(0.0),
+	_parallelReading(1), _parallelGroups(1), _prefetchGroups(0),
+	_storeWeights(false),
 	_gridMode(WStackingGridder::KaiserBessel),
 	_filenames(),
 	_commandLine(),
-	_inversionWatch(false), _predictingWatch(false), _deconvolutionWatch(false),
 	_isFirstInversion(true), _doReorder(false),
-	_currentIntervalIndex(0), _majorIterationNr(0),
+	_currentIntervalIndex(0),
 	_normalizeForWeighting(true),
 	_visibilityWeightingMode(InversionAlgorithm::NormalVisibilityWeighting)
 {
@@ -71,24 +87,24 @@ WSClean::~WSClean()
 {
 }
 
-void WSClean::initFitsWriter(FitsWriter& writer)
+void WSClean::initFitsWriter(GroupState& group, FitsWriter& writer)
 {
 	double
-		ra = _inversionAlgorithm->PhaseCentreRA(),
-		dec = _inversionAlgorithm->PhaseCentreDec(),
-		pixelScaleX = _inversionAlgorithm->PixelSizeX(),
-		pixelScaleY = _inversionAlgorithm->PixelSizeY(),
-		freqHigh = _inversionAlgorithm->HighestFrequencyChannel(),
-		freqLow = _inversionAlgorithm->LowestFrequencyChannel(),
+		ra = group.inversionAlgorithm->PhaseCentreRA(),
+		dec = group.inversionAlgorithm->PhaseCentreDec(),
+		pixelScaleX = group.inversionAlgorithm->PixelSizeX(),
+		pixelScaleY = group.inversionAlgorithm->PixelSizeY(),
+		freqHigh = group.inversionAlgorithm->HighestFrequencyChannel(),
+		freqLow = group.inversionAlgorithm->LowestFrequencyChannel(),
 		freqCentre = (freqHigh + freqLow) * 0.5,
-		bandwidth = _inversionAlgorithm->BandEnd() - _inversionAlgorithm->BandStart(),
-		beamSize = _inversionAlgorithm->BeamSize(),
-		dateObs = _inversionAlgorithm->StartTime();
+		bandwidth = group.inversionAlgorithm->BandEnd() - group.inversionAlgorithm->BandStart(),
+		beamSize = group.inversionAlgorithm->BeamSize(),
+		dateObs = group.inversionAlgorithm->StartTime();
 		
-	writer.SetImageDimensions(_inversionAlgorithm->ImageWidth(), _inversionAlgorithm->ImageHeight(), ra, dec, pixelScaleX, pixelScaleY);
+	writer.SetImageDimensions(group.inversionAlgorithm->ImageWidth(), group.inversionAlgorithm->ImageHeight(), ra, dec, pixelScaleX, pixelScaleY);
 	writer.SetFrequency(freqCentre, bandwidth);
 	writer.SetDate(dateObs);
-	writer.SetPolarization(_inversionAlgorithm->Polarization());
+	writer.SetPolarization(group.inversionAlgorithm->Polarization());
 	writer.SetOrigin("WSClean", "W-stacking imager written by Andre Offringa");
 	writer.AddHistory(commandLine);
 	if(_manualBeamMajorSize != 0.0) {
@@ -97,14 +113,14 @@ void WSClean::initFitsWriter(FitsWriter& writer)
 	else {
 		writer.SetBeamInfo(beamSize, beamSize, 0.0);
 	}
-	if(_inversionAlgorithm->HasDenormalPhaseCentre())
-		writer.SetPhaseCentreShift(_inversionAlgorithm->PhaseCentreDL(), _inversionAlgorithm->PhaseCentreDM());
+	if(group.inversionAlgorithm->HasDenormalPhaseCentre())
+		writer.SetPhaseCentreShift(group.inversionAlgorithm->PhaseCentreDL(), group.inversionAlgorithm->PhaseCentreDM());
 	
-	writer.SetExtraKeyword("WSCIMGWG", _inversionAlgorithm->ImageWeight());
-	writer.SetExtraKeyword("WSCNWLAY", _inversionAlgorithm->WGridSize());
-	writer.SetExtraKeyword("WSCDATAC", _inversionAlgorithm->DataColumnName());
-	writer.SetExtraKeyword("WSCWEIGH", _inversionAlgorithm->Weighting().ToString());
-	writer.SetExtraKeyword("WSCGKRNL", _inversionAlgorithm->AntialiasingKernelSize());
+	writer.SetExtraKeyword("WSCIMGWG", group.inversionAlgorithm->ImageWeight());
+	writer.SetExtraKeyword("WSCNWLAY", group.inversionAlgorithm->WGridSize());
+	writer.SetExtraKeyword("WSCDATAC", group.inversionAlgorithm->DataColumnName());
+	writer.SetExtraKeyword("WSCWEIGH", group.inversionAlgorithm->Weighting().ToString());
+	writer.SetExtraKeyword("WSCGKRNL", group.inversionAlgorithm->AntialiasingKernelSize());
 	if(_endChannel!=0)
 	{
 		writer.SetExtraKeyword("WSCCHANS", _startChannel);
@@ -152,26 +168,25 @@ void WSClean::updateCleanParameters(FitsWriter& writer, size_t minorIterationNr,
 	writer.SetExtraKeyword("WSCMAJOR", majorIterationNr);
 }
 
-void WSClean::imagePSF(size_t currentChannelIndex)
+void WSClean::imagePSF(GroupState& group, size_t currentChannelIndex, bool isFirstInversion)
 {
 	std::cout << std::flush << " == Constructing PSF ==\n";
-	_inversionWatch.Start();
-	_inversionAlgorithm->SetDoImagePSF(true);
-	_inversionAlgorithm->SetVerbose(_isFirstInversion);
-	_inversionAlgorithm->Invert();
+	group.inversionWatch.Start();
+	group.inversionAlgorithm->SetDoImagePSF(true);
+	group.inversionAlgorithm->SetVerbose(isFirstInversion);
+	group.inversionAlgorithm->Invert();
 		
-	DeconvolutionAlgorithm::RemoveNaNsInPSF(_inversionAlgorithm->ImageRealResult(), _imgWidth, _imgHeight);
-	initFitsWriter(_fitsWriter);
-	_psfImages.SetFitsWriter(_fitsWriter);
-	_psfImages.Store(_inversionAlgorithm->ImageRealResult(), *_polarizations.begin(), currentChannelIndex, false);
-	_inversionWatch.Pause();
+	DeconvolutionAlgorithm::RemoveNaNsInPSF(group.inversionAlgorithm->ImageRealResult(), _imgWidth, _imgHeight);
+	initFitsWriter(group, group.fitsWriter);
+	group.psfImages->SetFitsWriter(group.fitsWriter);
+	group.psfImages->Store(group.inversionAlgorithm->ImageRealResult(), *_polarizations.begin(), currentChannelIndex, false);
+	group.inversionWatch.Pause();
 	
 	if(_isUVImageSaved)
 	{
-		saveUVImage(_inversionAlgorithm->ImageRealResult(), *_polarizations.begin(), currentChannelIndex, false, "uvpsf");
+		saveUVImage(group, group.inversionAlgorithm->ImageRealResult(), *_polarizations.begin(), currentChannelIndex, false, "uvpsf");
 	}
 	
-	_isFirstInversion = false;
 	if(_manualBeamMajorSize != 0.0)
 	{
 		_infoPerChannel[currentChannelIndex].beamMaj = _manualBeamMajorSize;
@@ -183,9 +198,9 @@ void WSClean::imagePSF(size_t currentChannelIndex)
 		GaussianFitter beamFitter;
 		std::cout << "Fitting beam... " << std::flush;
 		beamFitter.Fit2DGaussianCentred(
-			_inversionAlgorithm->ImageRealResult(),
+			group.inversionAlgorithm->ImageRealResult(),
 			_imgWidth, _imgHeight,
-			_inversionAlgorithm->BeamSize()*2.0/(_pixelScaleX+_pixelScaleY),
+			group.inversionAlgorithm->BeamSize()*2.0/(_pixelScaleX+_pixelScaleY),
 			bMaj, bMin, bPA);
 		if(bMaj < 1.0) bMaj = 1.0;
 		if(bMin < 1.0) bMin = 1.0;
@@ -193,7 +208,7 @@ void WSClean::imagePSF(size_t currentChannelIndex)
 		bMin = bMin*0.5*(_pixelScaleX+_pixelScaleY);
 		std::cout << "major=" << Angle::ToNiceString(bMaj) << ", minor=" <<
 		Angle::ToNiceString(bMin) << ", PA=" << Angle::ToNiceString(bPA) << ", theoretical=" <<
-		Angle::ToNiceString(_inversionAlgorithm->BeamSize())<< ".\n";
+		Angle::ToNiceString(group.inversionAlgorithm->BeamSize())<< ".\n";
 		
 		_infoPerChannel[currentChannelIndex].beamMaj = bMaj;
 		if(_circularBeam)
@@ -207,65 +222,65 @@ void WSClean::imagePSF(size_t currentChannelIndex)
 		}
 	}
 	else {
-		_infoPerChannel[currentChannelIndex].beamMaj = _inversionAlgorithm->BeamSize();
-		_infoPerChannel[currentChannelIndex].beamMin = _inversionAlgorithm->BeamSize();
+		_infoPerChannel[currentChannelIndex].beamMaj = group.inversionAlgorithm->BeamSize();
+		_infoPerChannel[currentChannelIndex].beamMin = group.inversionAlgorithm->BeamSize();
 		_infoPerChannel[currentChannelIndex].beamPA = 0.0;
-		std::cout << "Beam size is " << Angle::ToNiceString(_inversionAlgorithm->BeamSize()) << '\n';
+		std::cout << "Beam size is " << Angle::ToNiceString(group.inversionAlgorithm->BeamSize()) << '\n';
 	}
-	_fitsWriter.SetBeamInfo(
+	group.fitsWriter.SetBeamInfo(
 		_infoPerChannel[currentChannelIndex].beamMaj,
 		_infoPerChannel[currentChannelIndex].beamMin,
 		_infoPerChannel[currentChannelIndex].beamPA);
 		
 	std::cout << "Writing psf image... " << std::flush;
 	const std::string name(getPSFPrefix(currentChannelIndex) + "-psf.fits");
-	_fitsWriter.Write(name, _inversionAlgorithm->ImageRealResult());
+	group.fitsWriter.Write(name, group.inversionAlgorithm->ImageRealResult());
 	std::cout << "DONE\n";
 }
 
-void WSClean::imageGridding()
+void WSClean::imageGridding(GroupState& group)
 {
 	std::cout << "Writing gridding correction image... " << std::flush;
 	double* gridding = _imageAllocator.Allocate(_imgWidth * _imgHeight);
-	_inversionAlgorithm->GetGriddingCorrectionImage(&gridding[0]);
+	group.inversionAlgorithm->GetGriddingCorrectionImage(&gridding[0]);
 	FitsWriter fitsWriter;
-	initFitsWriter(fitsWriter);
-	fitsWriter.SetImageDimensions(_inversionAlgorithm->ActualInversionWidth(), _inversionAlgorithm->ActualInversionHeight());
+	initFitsWriter(group, fitsWriter);
+	fitsWriter.SetImageDimensions(group.inversionAlgorithm->ActualInversionWidth(), group.inversionAlgorithm->ActualInversionHeight());
 	fitsWriter.Write(_prefixName + "-gridding.fits", &gridding[0]);
 	_imageAllocator.Free(gridding);
 	std::cout << "DONE\n";
 }
 
-void WSClean::imageMainFirst(PolarizationEnum polarization, size_t joinedChannelIndex)
+void WSClean::imageMainFirst(GroupState& group, PolarizationEnum polarization, size_t joinedChannelIndex, bool isFirstInversion)
 {
 	std::cout << std::flush << " == Constructing image ==\n";
-	_inversionWatch.Start();
+	group.inversionWatch.Start();
 	if(_nWLayers != 0)
-		_inversionAlgorithm->SetWGridSize(_nWLayers);
+		group.inversionAlgorithm->SetWGridSize(_nWLayers);
 	else
-		_inversionAlgorithm->SetNoWGridSize();
-	_inversionAlgorithm->SetDoImagePSF(false);
-	_inversionAlgorithm->SetVerbose(_isFirstInversion);
-	_inversionAlgorithm->Invert();
-	_inversionWatch.Pause();
-	_inversionAlgorithm->SetVerbose(false);
+		group.inversionAlgorithm->SetNoWGridSize();
+	group.inversionAlgorithm->SetDoImagePSF(false);
+	group.inversionAlgorithm->SetVerbose(isFirstInversion);
+	group.inversionAlgorithm->Invert();
+	group.inversionWatch.Pause();
+	group.inversionAlgorithm->SetVerbose(false);
 	
-	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _inversionAlgorithm->ImageRealResult());
+	storeAndCombineXYandYX(group.residualImages, polarization, joinedChannelIndex, false, group.inversionAlgorithm->ImageRealResult());
 	if(Polarization::IsComplex(polarization))
-		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, _inversionAlgorithm->ImageImaginaryResult());
+		storeAndCombineXYandYX(group.residualImages, polarization, joinedChannelIndex, true, group.inversionAlgorithm->ImageImaginaryResult());
 }
 
-void WSClean::imageMainNonFirst(PolarizationEnum polarization, size_t joinedChannelIndex)
+void WSClean::imageMainNonFirst(GroupState& group, PolarizationEnum polarization, size_t joinedChannelIndex)
 {
 	std::cout << std::flush << " == Constructing image ==\n";
-	_inversionWatch.Start();
-	_inversionAlgorithm->SetDoSubtractModel(true);
-	_inversionAlgorithm->Invert();
-	_inversionWatch.Pause();
+	group.inversionWatch.Start();
+	group.inversionAlgorithm->SetDoSubtractModel(true);
+	group.inversionAlgorithm->Invert();
+	group.inversionWatch.Pause();
 	
-	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _inversionAlgorithm->ImageRealResult());
+	storeAndCombineXYandYX(group.residualImages, polarization, joinedChannelIndex, false, group.inversionAlgorithm->ImageRealResult());
 	if(Polarization::IsComplex(polarization))
-		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, _inversionAlgorithm->ImageImaginaryResult());
+		storeAndCombineXYandYX(group.residualImages, polarization, joinedChannelIndex, true, group.inversionAlgorithm->ImageImaginaryResult());
 }
 
 void WSClean::storeAndCombineXYandYX(CachedImageSet& dest, PolarizationEnum polarization, size_t joinedChannelIndex, bool isImaginary, const double* image)
@@ -294,7 +309,7 @@ void WSClean::storeAndCombineXYandYX(CachedImageSet& dest, PolarizationEnum pola
 	}
 }
 
-void WSClean::predict(PolarizationEnum polarization, size_t joinedChannelIndex)
+void WSClean::predict(GroupState& group, PolarizationEnum polarization, size_t joinedChannelIndex)
 {
 	std::cout << std::flush << " == Converting model image to visibilities ==\n";
 	const size_t size = _imgWidth*_imgHeight;
@@ -304,33 +319,33 @@ void WSClean::predict(PolarizationEnum polarization, size_t joinedChannelIndex)
 		
 	if(polarization == Polarization::YX)
 	{
-		_modelImages.Load(modelImageReal, Polarization::XY, joinedChannelIndex, false);
+		group.modelImages.Load(modelImageReal, Polarization::XY, joinedChannelIndex, false);
 		modelImageImaginary = _imageAllocator.Allocate(size);
-		_modelImages.Load(modelImageImaginary, Polarization::XY, joinedChannelIndex, true);
+		group.modelImages.Load(modelImageImaginary, Polarization::XY, joinedChannelIndex, true);
 		for(size_t i=0; i!=size; ++i)
 			modelImageImaginary[i] = -modelImageImaginary[i];
 	}
 	else {
-		_modelImages.Load(modelImageReal, polarization, joinedChannelIndex, false);
+		group.modelImages.Load(modelImageReal, polarization, joinedChannelIndex, false);
 		if(Polarization::IsComplex(polarization))
 		{
 			modelImageImaginary = _imageAllocator.Allocate(size);
-			_modelImages.Load(modelImageImaginary, polarization, joinedChannelIndex, true);
+			group.modelImages.Load(modelImageImaginary, polarization, joinedChannelIndex, true);
 		}
 	}
 	
-	_predictingWatch.Start();
-	_inversionAlgorithm->SetAddToModel(false);
+	group.predictingWatch.Start();
+	group.inversionAlgorithm->SetAddToModel(false);
 	if(Polarization::IsComplex(polarization))
-		_inversionAlgorithm->Predict(modelImageReal, modelImageImaginary);
+		group.inversionAlgorithm->Predict(modelImageReal, modelImageImaginary);
 	else
-		_inversionAlgorithm->Predict(modelImageReal);
-	_predictingWatch.Pause();
+		group.inversionAlgorithm->Predict(modelImageReal);
+	group.predictingWatch.Pause();
 	_imageAllocator.Free(modelImageReal);
 	_imageAllocator.Free(modelImageImaginary);
 }
 
-void WSClean::dftPredict(const ImagingTable& squaredGroup)
+void WSClean::dftPredict(GroupState& group, const ImagingTable& squaredGroup)
 {
 	std::cout << std::flush << " == Predicting visibilities ==\n";
 	const size_t size = _imgWidth*_imgHeight;
@@ -345,20 +360,20 @@ void WSClean::dftPredict(const ImagingTable& squaredGroup)
 		const ImagingTableEntry& entry = squaredGroup[i];
 		if(entry.polarization == Polarization::YX)
 		{
-			_modelImages.Load(modelImageReal, Polarization::XY, entry.outputChannelIndex, false);
+			group.modelImages.Load(modelImageReal, Polarization::XY, entry.outputChannelIndex, false);
 			modelImageImaginary = _imageAllocator.Allocate(size);
-			_modelImages.Load(modelImageImaginary, Polarization::XY, entry.outputChannelIndex, true);
+			group.modelImages.Load(modelImageImaginary, Polarization::XY, entry.outputChannelIndex, true);
 			for(size_t i=0; i!=size; ++i)
 				modelImageImaginary[i] = -modelImageImaginary[i];
 			image->Add(entry.polarization, modelImageReal, modelImageImaginary);
 			_imageAllocator.Free(modelImageReal);
 		}
 		else {
-			_modelImages.Load(modelImageReal, entry.polarization, entry.outputChannelIndex, false);
+			group.modelImages.Load(modelImageReal, entry.polarization, entry.outputChannelIndex, false);
 			if(Polarization::IsComplex(entry.polarization))
 			{
 				modelImageImaginary = _imageAllocator.Allocate(size);
-				_modelImages.Load(modelImageImaginary, entry.polarization, entry.outputChannelIndex, true);
+				group.modelImages.Load(modelImageImaginary, entry.polarization, entry.outputChannelIndex, true);
 				image->Add(entry.polarization, modelImageReal, modelImageImaginary);
 				_imageAllocator.Free(modelImageReal);
 			}
@@ -372,12 +387,12 @@ void WSClean::dftPredict(const ImagingTable& squaredGroup)
 	casacore::MeasurementSet firstMS(_filenames.front());
 	BandData firstBand(firstMS.spectralWindow());
 	DFTPredictionInput input;
-	image->FindComponents(input, _inversionAlgorithm->PhaseCentreRA(), _inversionAlgorithm->PhaseCentreDec(), _pixelScaleX, _pixelScaleY, _inversionAlgorithm->PhaseCentreDL(), _inversionAlgorithm->PhaseCentreDM(), firstBand.ChannelCount());
+	image->FindComponents(input, group.inversionAlgorithm->PhaseCentreRA(), group.inversionAlgorithm->PhaseCentreDec(), _pixelScaleX, _pixelScaleY, group.inversionAlgorithm->PhaseCentreDL(), group.inversionAlgorithm->PhaseCentreDM(), firstBand.ChannelCount());
 	// Free the input model images
 	image.reset();
 	std::cout << "Number of components to be predicted: " << input.ComponentCount() << '\n';
 	
-	_predictingWatch.Start();
+	group.predictingWatch.Start();
 	
 	for(size_t filenameIndex=0; filenameIndex!=_filenames.size(); ++filenameIndex)
 	{
@@ -468,24 +483,30 @@ void WSClean::dftPredict(const ImagingTable& squaredGroup)
 		}
 	}
 	
-	_predictingWatch.Pause();
+	group.predictingWatch.Pause();
 }
 
-void WSClean::initializeImageWeights(const ImagingTableEntry& entry)
+void WSClean::initializeImageWeights(GroupState& group, const ImagingTableEntry& entry)
 {
+	boost::mutex::scoped_lock lock(_imageWeightMutex);
 	if(!_mfsWeighting)
 	{
-		_imageWeightCache->Update(*_inversionAlgorithm, entry.outputChannelIndex, entry.outputTimestepIndex);
+		_imageWeightCache->Update(*group.inversionAlgorithm, entry.outputChannelIndex, _currentIntervalIndex);
 		if(_isWeightImageSaved)
 			_imageWeightCache->Weights().Save(_prefixName+"-weights.fits");
 	}
-	_inversionAlgorithm->SetPrecalculatedWeightInfo(&_imageWeightCache->Weights());
+	group.inversionAlgorithm->SetPrecalculatedWeightInfo(&_imageWeightCache->Weights());
 }
 
 void WSClean::initializeMFSImageWeights()
 {
+	if(_imageWeightCache->LoadMFSWeights())
+	{
+		if(_isWeightImageSaved)
+			_imageWeightCache->Weights().Save(_prefixName+"-weights.fits");
+		return;
+	}
 	std::cout << "Precalculating MFS weights for " << _weightMode.ToString() << " weighting...\n";
-	_imageWeightCache->ResetWeights();
 	if(_doReorder)
 	{
 		for(size_t sg=0; sg!=_imagingTable.SquaredGroupCount(); ++sg)
@@ -494,7 +515,6 @@ void WSClean::initializeMFSImageWeights()
 			const ImagingTableEntry& entry = subTable.Front();
 			for(size_t msIndex=0; msIndex!=_filenames.size(); ++msIndex)
 			{
-				const ImagingTableEntry::MSInfo& ms = entry.msData[msIndex];
 				for(size_t b=0; b!=_msBands[msIndex].BandCount(); ++b)
 				{
 					MSSelection partSelection(_globalSelection);
@@ -502,8 +522,8 @@ void WSClean::initializeMFSImageWeights()
 					bool hasSelection = selectChannels(partSelection, msIndex, b, subTable.Front());
 					if(hasSelection)
 					{
-						PartitionedMS msProvider(_partitionedMSHandles[msIndex], ms.bands[b].partIndex, entry.polarization, b);
-						_imageWeightCache->Weights().Grid(msProvider, partSelection);
+						std::unique_ptr<MSProvider> msProvider(initializeMSProvider(entry, partSelection, msIndex, b));
+						_imageWeightCache->Weights().Grid(*msProvider, partSelection);
 					}
 				}
 			}
@@ -519,31 +539,203 @@ void WSClean::initializeMFSImageWeights()
 	}
 	_imageWeightCache->Weights().FinishGridding();
 	_imageWeightCache->InitializeWeightTapers();
+	_imageWeightCache->StoreMFSWeights();
 	if(_isWeightImageSaved)
 		_imageWeightCache->Weights().Save(_prefixName+"-weights.fits");
 }
 
-void WSClean::prepareInversionAlgorithm(PolarizationEnum polarization)
+void WSClean::precalculateImageWeights()
 {
-	static_cast<WSMSGridder&>(*_inversionAlgorithm).SetGridMode(_gridMode);
-	_inversionAlgorithm->SetImageWidth(_imgWidth);
-	_inversionAlgorithm->SetImageHeight(_imgHeight);
-	_inversionAlgorithm->SetPixelSizeX(_pixelScaleX);
-	_inversionAlgorithm->SetPixelSizeY(_pixelScaleY);
+	// Weights that do not depend on the data are made without reading it
+	if(!_weightMode.RequiresGridding())
+		return;
+	
+	// The weights of a channel are calculated from the first entry with that channel, as
+	// is done by ImageWeightCache::Update().
+	std::vector<const ImagingTableEntry*> channelEntries;
+	std::vector<size_t> outChannelIndices;
+	for(size_t e=0; e!=_imagingTable.EntryCount(); ++e)
+	{
+		const ImagingTableEntry& entry = _imagingTable[e];
+		if(std::find(outChannelIndices.begin(), outChannelIndices.end(), entry.outputChannelIndex) == outChannelIndices.end())
+		{
+			channelEntries.push_back(&entry);
+			outChannelIndices.push_back(entry.outputChannelIndex);
+		}
+	}
+	if(outChannelIndices.size() < 2)
+		return;
+	
+	const double requiredSize = _imageWeightCache->EstimateMemorySize(outChannelIndices.size());
+	const double budget = std::max(memoryLimit() - _memoryResidentSize, 0.0) * 0.25;
+	if(requiredSize > budget)
+	{
+		std::cout << "Weights of all channels require " << round(requiredSize/(1024.0*1024.0*1024.0)*10.0)/10.0 << " GB: weights will be calculated per channel.\n";
+		return;
+	}
+	
+	const std::vector<size_t> missingChannels = _imageWeightCache->LoadStoredWeights(_currentIntervalIndex, outChannelIndices);
+	if(missingChannels.empty())
+		return;
+	for(size_t i=0; i!=outChannelIndices.size(); )
+	{
+		if(std::find(missingChannels.begin(), missingChannels.end(), outChannelIndices[i]) == missingChannels.end())
+		{
+			outChannelIndices.erase(outChannelIndices.begin() + i);
+			channelEntries.erase(channelEntries.begin() + i);
+		}
+		else
+			++i;
+	}
+	
+	std::vector<std::unique_ptr<MSProvider>> msProviders;
+	std::vector<ImageWeightCache::Source> sources;
+	for(size_t msIndex=0; msIndex!=_filenames.size(); ++msIndex)
+	{
+		for(size_t b=0; b!=_msBands[msIndex].BandCount(); ++b)
+		{
+			if(_doReorder)
+			{
+				// Reordered data is stored per output channel
+				for(size_t i=0; i!=channelEntries.size(); ++i)
+				{
+					MSSelection selection(_globalSelection);
+					if(selectChannels(selection, msIndex, b, *channelEntries[i]))
+					{
+						msProviders.emplace_back(initializeMSProvider(*channelEntries[i], selection, msIndex, b));
+						ImageWeightCache::Source source;
+						source.provider = msProviders.back().get();
+						source.selectedBand = MultiBandData(_msBands[msIndex], selection.ChannelRangeStart(), selection.ChannelRangeEnd());
+						ImageWeightCache::Source::Target target;
+						target.outChannelIndex = outChannelIndices[i];
+						target.startChannel = 0;
+						target.endChannel = selection.ChannelRangeEnd() - selection.ChannelRangeStart();
+						source.targets.push_back(target);
+						sources.push_back(source);
+					}
+				}
+			}
+			else {
+				// Read the channels of all output channels in a single pass over the measurement set
+				std::vector<ImageWeightCache::Source::Target> targets;
+				size_t startChannel = std::numeric_limits<size_t>::max(), endChannel = 0;
+				for(size_t i=0; i!=channelEntries.size(); ++i)
+				{
+					MSSelection selection(_globalSelection);
+					if(selectChannels(selection, msIndex, b, *channelEntries[i]))
+					{
+						ImageWeightCache::Source::Target target;
+						target.outChannelIndex = outChannelIndices[i];
+						target.startChannel = selection.ChannelRangeStart();
+						target.endChannel = selection.ChannelRangeEnd();
+						targets.push_back(target);
+						startChannel = std::min(startChannel, target.startChannel);
+						endChannel = std::max(endChannel, target.endChannel);
+					}
+				}
+				if(!targets.empty())
+				{
+					MSSelection selection(_globalSelection);
+					selection.SetChannelRange(startChannel, endChannel);
+					msProviders.emplace_back(new ContiguousMS(_filenames[msIndex], _columnName, selection, channelEntries.front()->polarization, false));
+					ImageWeightCache::Source source;
+					source.provider = msProviders.back().get();
+					source.selectedBand = MultiBandData(_msBands[msIndex], startChannel, endChannel);
+					for(std::vector<ImageWeightCache::Source::Target>::iterator target=targets.begin(); target!=targets.end(); ++target)
+					{
+						target->startChannel -= startChannel;
+						target->endChannel -= startChannel;
+					}
+					source.targets = targets;
+					sources.push_back(source);
+				}
+			}
+		}
+	}
+	_imageWeightCache->Precalculate(_currentIntervalIndex, outChannelIndices, sources, _threadCount);
+}
+
+void WSClean::initializeWeightStorage()
+{
+	// Everything the weights of a channel depend on, except for the uv coverage of the
+	// measurement sets, which is assumed to be unchanged as long as the paths are equal
+	std::ostringstream common;
+	common.precision(16);
+	common << "weighting=" << _weightMode.ToString() << " superweight=" << _weightMode.SuperWeight() << '\n'
+		<< "image=" << _imgWidth << 'x' << _imgHeight << " scale=" << _pixelScaleX << ',' << _pixelScaleY << '\n'
+		<< "uv-range=" << _minUVInLambda << ',' << _maxUVInLambda << '\n'
+		<< "uvw-range-m=" << _globalSelection.MinUVWInM() << ',' << _globalSelection.MaxUVWInM() << '\n'
+		<< "rank-filter=" << _rankFilterLevel << ',' << _rankFilterSize << '\n'
+		<< "field=" << _globalSelection.FieldId() << " interval=" << _globalSelection.IntervalStart() << ',' << _globalSelection.IntervalEnd() << '\n';
+	for(size_t i=0; i!=_filenames.size(); ++i)
+		common << "ms=" << boost::filesystem::absolute(_filenames[i]).string() << '\n';
+	
+	std::ostringstream mfs;
+	mfs.precision(16);
+	mfs << common.str() << "mfs";
+	std::vector<size_t> outChannelIndices;
+	for(size_t e=0; e!=_imagingTable.EntryCount(); ++e)
+	{
+		const ImagingTableEntry& entry = _imagingTable[e];
+		if(std::find(outChannelIndices.begin(), outChannelIndices.end(), entry.outputChannelIndex) == outChannelIndices.end())
+		{
+			outChannelIndices.push_back(entry.outputChannelIndex);
+			std::ostringstream description;
+			description.precision(16);
+			description << common.str()
+				<< "polarization=" << Polarization::TypeToShortString(entry.polarization) << '\n'
+				<< "frequencies=" << entry.lowestFrequency << ',' << entry.highestFrequency;
+			_imageWeightCache->SetStorage(entry.outputChannelIndex, weightStorageFilename(description.str()), description.str());
+			mfs << ' ' << entry.lowestFrequency << ',' << entry.highestFrequency;
+		}
+	}
+	_imageWeightCache->SetMFSStorage(weightStorageFilename(mfs.str()), mfs.str());
+}
+
+std::string WSClean::weightStorageFilename(const std::string& description) const
+{
+	// 64-bit FNV-1a hash of the description
+	uint64_t hash = 14695981039346656037ULL;
+	for(std::string::const_iterator c=description.begin(); c!=description.end(); ++c)
+	{
+		hash ^= uint64_t(static_cast<unsigned char>(*c));
+		hash *= 1099511628211ULL;
+	}
+	boost::filesystem::path msPath(_filenames.front()), prefixPath;
+	if(_temporaryDirectory.empty())
+		prefixPath = msPath;
+	else
+		prefixPath = boost::filesystem::path(_temporaryDirectory) / msPath.filename();
+	std::string prefix(prefixPath.string());
+	while(!prefix.empty() && *prefix.rbegin() == '/')
+		prefix.resize(prefix.size()-1);
+	std::ostringstream filename;
+	filename << prefix << "-weights-" << std::hex << std::setw(16) << std::setfill('0') << hash << ".dat";
+	return filename.str();
+}
+
+void WSClean::prepareInversionAlgorithm(GroupState& group, PolarizationEnum polarization)
+{
+	static_cast<WSMSGridder&>(*group.inversionAlgorithm).SetGridMode(_gridMode);
+	static_cast<WSMSGridder&>(*group.inversionAlgorithm).SetReaderCount(_parallelReading);
+	group.inversionAlgorithm->SetImageWidth(_imgWidth);
+	group.inversionAlgorithm->SetImageHeight(_imgHeight);
+	group.inversionAlgorithm->SetPixelSizeX(_pixelScaleX);
+	group.inversionAlgorithm->SetPixelSizeY(_pixelScaleY);
 	if(_nWLayers != 0)
-		_inversionAlgorithm->SetWGridSize(_nWLayers);
+		group.inversionAlgorithm->SetWGridSize(_nWLayers);
 	else
-		_inversionAlgorithm->SetNoWGridSize();
-	_inversionAlgorithm->SetAntialiasingKernelSize(_antialiasingKernelSize);
-	_inversionAlgorithm->SetOverSamplingFactor(_overSamplingFactor);
-	_inversionAlgorithm->SetPolarization(polarization);
-	_inversionAlgorithm->SetIsComplex(polarization == Polarization::XY || polarization == Polarization::YX);
-	_inversionAlgorithm->SetDataColumnName(_columnName);
-	_inversionAlgorithm->SetWeighting(_weightMode);
-	_inversionAlgorithm->SetWLimit(_wLimit/100.0);
-	_inversionAlgorithm->SetSmallInversion(_smallInversion);
-	_inversionAlgorithm->SetNormalizeForWeighting(_normalizeForWeighting);
-	_inversionAlgorithm->SetVisibilityWeightingMode(_visibilityWeightingMode);
+		group.inversionAlgorithm->SetNoWGridSize();
+	group.inversionAlgorithm->SetAntialiasingKernelSize(_antialiasingKernelSize);
+	group.inversionAlgorithm->SetOverSamplingFactor(_overSamplingFactor);
+	group.inversionAlgorithm->SetPolarization(polarization);
+	group.inversionAlgorithm->SetIsComplex(polarization == Polarization::XY || polarization == Polarization::YX);
+	group.inversionAlgorithm->SetDataColumnName(_columnName);
+	group.inversionAlgorithm->SetWeighting(_weightMode);
+	group.inversionAlgorithm->SetWLimit(_wLimit/100.0);
+	group.inversionAlgorithm->SetSmallInversion(_smallInversion);
+	group.inversionAlgorithm->SetNormalizeForWeighting(_normalizeForWeighting);
+	group.inversionAlgorithm->SetVisibilityWeightingMode(_visibilityWeightingMode);
 }
 
 void WSClean::checkPolarizations()
@@ -565,12 +757,33 @@ void WSClean::checkPolarizations()
 		throw std::runtime_error("You are imaging only one of XY or YX polarizations. This is not possible -- you have to specify both XY and YX polarizations (the output of imaging both polarizations will be the XY and imaginary XY images).");
 }
 
+double WSClean::memoryLimit() const
+{
+	double memSize = double(sysconf(_SC_PHYS_PAGES)) * double(sysconf(_SC_PAGE_SIZE)) * _memFraction;
+	if(_absMemLimit != 0.0)
+		memSize = std::min(memSize, _absMemLimit * 1024.0*1024.0*1024.0);
+	return memSize;
+}
+
+double WSClean::gridderAbsMemLimit() const
+{
+	// Memory that is taken by in-memory reordered data is not available for the w-layers
+	if(_memoryResidentSize == 0.0)
+		return _absMemLimit;
+	else
+		return std::max(memoryLimit() - _memoryResidentSize, memoryLimit() * 0.1) / (1024.0*1024.0*1024.0);
+}
+
 void WSClean::performReordering(bool isPredictMode)
 {
 	_partitionedMSHandles.clear();
+	_memoryMSHandles.clear();
+	_memoryResidentSize = 0.0;
+	const bool includeModel = _deconvolution.MGain() != 1.0 || isPredictMode;
+	std::vector<std::vector<PartitionedMS::ChannelRange>> channelsPerMS(_filenames.size());
 	for(size_t i=0; i != _filenames.size(); ++i)
 	{
-		std::vector<PartitionedMS::ChannelRange> channels;
+		std::vector<PartitionedMS::ChannelRange>& channels = channelsPerMS[i];
 		size_t nextIndex = 0;
 		for(size_t j=0; j!=_imagingTable.SquaredGroupCount(); ++j)
 		{
@@ -602,7 +815,33 @@ void WSClean::performReordering(bool isPredictMode)
 				}
 			}
 		}
-		_partitionedMSHandles.push_back(PartitionedMS::Partition(_filenames[i], channels, _globalSelection, _columnName, true, _deconvolution.MGain() != 1.0 || isPredictMode, _modelUpdateRequired, _polarizations, _temporaryDirectory));
+	}
+	
+	bool inMemory = false;
+	if(_reorderInMemory)
+	{
+		double requiredSize = 0.0;
+		for(size_t i=0; i != _filenames.size(); ++i)
+			requiredSize += MemoryMS::EstimateMemorySize(_filenames[i], channelsPerMS[i], _globalSelection, _polarizations.size(), includeModel);
+		// Keep at least half of the memory available for gridding and deconvolution
+		const double budget = memoryLimit() * 0.5;
+		inMemory = requiredSize <= budget;
+		const double requiredInGB = requiredSize / (1024.0*1024.0*1024.0);
+		if(inMemory)
+		{
+			std::cout << "Reordered data requires at most " << round(requiredInGB*10.0)/10.0 << " GB and will be kept in memory.\n";
+			_memoryResidentSize = requiredSize;
+		}
+		else
+			std::cout << "Reordered data requires up to " << round(requiredInGB*10.0)/10.0 << " GB, which exceeds the in-memory budget of " << round(budget/(1024.0*1024.0*1024.0)*10.0)/10.0 << " GB: reordering to disk instead.\n";
+	}
+	
+	for(size_t i=0; i != _filenames.size(); ++i)
+	{
+		if(inMemory)
+			_memoryMSHandles.push_back(MemoryMS::Partition(_filenames[i], channelsPerMS[i], _globalSelection, _columnName, includeModel, _modelUpdateRequired, _polarizations, _useHugePages));
+		else
+			_partitionedMSHandles.push_back(PartitionedMS::Partition(_filenames[i], channelsPerMS[i], _globalSelection, _columnName, true, includeModel, _modelUpdateRequired, _polarizations, _temporaryDirectory, _reorderStorageFormat));
 	}
 }
 
@@ -638,15 +877,18 @@ void WSClean::RunClean()
 		
 		_infoPerChannel.assign(_channelsOut, ChannelInfo());
 		
-		_imageWeightCache.reset(new ImageWeightCache(_weightMode, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _minUVInLambda, _maxUVInLambda, _rankFilterLevel, _rankFilterSize));
+		_imageWeightCache.reset(new ImageWeightCache(_weightMode, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _minUVInLambda, _maxUVInLambda, _rankFilterLevel, _rankFilterSize, _threadCount));
+		if(_storeWeights && _weightMode.RequiresGridding())
+			initializeWeightStorage();
 		
 		if(_mfsWeighting)
 			initializeMFSImageWeights();
+		else
+			precalculateImageWeights();
 		
-		for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount(); ++groupIndex)
-		{
-			runIndependentGroup(_imagingTable.GetIndependentGroup(groupIndex));
-		}
+		runIndependentGroups();
+		// Row indices of this interval are not used again
+		SelectedRowIndex::ClearCache();
 		
 		if(_channelsOut > 1)
 		{
@@ -698,12 +940,14 @@ void WSClean::RunPredict()
 		
 		if(_doReorder) performReordering(true);
 		
-		_imageWeightCache.reset(new ImageWeightCache(_weightMode, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _minUVInLambda, _maxUVInLambda, _rankFilterLevel, _rankFilterSize));
+		_imageWeightCache.reset(new ImageWeightCache(_weightMode, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _minUVInLambda, _maxUVInLambda, _rankFilterLevel, _rankFilterSize, _threadCount));
 		
+		GroupState group(_deconvolution, _threadCount, _memFraction, gridderAbsMemLimit());
 		for(size_t groupIndex=0; groupIndex!=_imagingTable.SquaredGroupCount(); ++groupIndex)
 		{
-			predictGroup(_imagingTable.GetSquaredGroup(groupIndex));
+			predictGroup(group, _imagingTable.GetSquaredGroup(groupIndex));
 		}
+		SelectedRowIndex::ClearCache();
 	}
 }
 
@@ -731,47 +975,262 @@ bool WSClean::selectChannels(MSSelection& selection, size_t msIndex, size_t band
 	}
 }
 
-void WSClean::runIndependentGroup(const ImagingTable& groupTable)
+std::string WSClean::concurrencyRestriction() const
+{
+	bool weightsPrecalculated = _mfsWeighting || !_imageWeightCache->RequiresGridding();
+	if(!weightsPrecalculated)
+	{
+		weightsPrecalculated = true;
+		for(size_t e=0; e!=_imagingTable.EntryCount(); ++e)
+		{
+			if(!_imageWeightCache->HasPrecalculatedWeights(_imagingTable[e].outputChannelIndex, _currentIntervalIndex))
+				weightsPrecalculated = false;
+		}
+	}
+	
+	std::string reason;
+	if(!_doReorder)
+		reason = "the data is not reordered";
+	else if(_dftPrediction)
+		reason = "DFT prediction is used";
+	else if(_deconvolution.UseMoreSane() || _deconvolution.UseIUWT())
+		reason = "MoreSane and IUWT deconvolution can not run concurrently";
+	else if(!_deconvolution.CASAMask().empty())
+		reason = "a CASA mask is used";
+	else if(!weightsPrecalculated)
+		reason = "the image weights of all channels could not be precalculated";
+	else if(!fits_is_reentrant())
+		reason = "cfitsio is not reentrant";
+#ifndef HAVE_FFTW_THREADSAFE_PLANNER
+	if(reason.empty())
+		reason = "FFTW has no thread-safe planner";
+#endif
+	return reason;
+}
+
+size_t WSClean::parallelGroupCount(size_t taskCount) const
+{
+	if(_parallelGroups <= 1 || taskCount <= 1)
+		return 1;
+	
+	const std::string reason = concurrencyRestriction();
+	if(!reason.empty())
+	{
+		std::cout << "Independent groups are run one at a time, because " << reason << ".\n";
+		return 1;
+	}
+	
+	size_t count = std::min(std::min(_parallelGroups, taskCount), _threadCount);
+	// Each concurrent group needs its own images for deconvolution and at least a few w-layers
+	const double perGroupSize = double(_imgWidth) * double(_imgHeight) * sizeof(double) * (8.0 + 4.0 * _polarizations.size());
+	const double budget = std::max(memoryLimit() - _memoryResidentSize, 0.0);
+	count = std::max<size_t>(1, std::min<size_t>(count, size_t(budget / perGroupSize)));
+	return count;
+}
+
+size_t WSClean::prefetchGroupCount() const
+{
+	if(_prefetchGroups == 0 || _imagingTable.IndependentGroupCount() <= 1)
+		return 0;
+	
+	const std::string reason = concurrencyRestriction();
+	if(!reason.empty())
+	{
+		std::cout << "Groups are not imaged during deconvolution, because " << reason << ".\n";
+		return 0;
+	}
+	
+	// A waiting group keeps its PSF, model and residual images, which are only held in
+	// memory when there is a single polarization and channel, but are counted regardless
+	const double perGroupSize = double(_imgWidth) * double(_imgHeight) * sizeof(double) * 3.0;
+	const double budget = std::max(memoryLimit() - _memoryResidentSize, 0.0) * 0.25;
+	return std::max<size_t>(1, std::min<size_t>(_prefetchGroups, size_t(budget / perGroupSize)));
+}
+
+void WSClean::runIndependentGroups()
+{
+	// A group that does not start with the first polarization reuses the PSF of the
+	// group before it, and is therefore run in the same task
+	std::vector<std::vector<size_t>> tasks;
+	for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount(); ++groupIndex)
+	{
+		if(tasks.empty() || _imagingTable.GetIndependentGroup(groupIndex).Front().polarization == *_polarizations.begin())
+			tasks.push_back(std::vector<size_t>());
+		tasks.back().push_back(groupIndex);
+	}
+	
+	const size_t parallelCount = parallelGroupCount(tasks.size());
+	const size_t prefetchCount = parallelCount == 1 ? prefetchGroupCount() : 0;
+	if(prefetchCount != 0)
+	{
+		runIndependentGroupsPipelined(prefetchCount);
+		return;
+	}
+	if(parallelCount == 1)
+	{
+		GroupState group(_deconvolution, _threadCount, _memFraction, gridderAbsMemLimit());
+		for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount(); ++groupIndex)
+		{
+			runIndependentGroup(group, _imagingTable.GetIndependentGroup(groupIndex));
+		}
+		return;
+	}
+	
+#ifdef HAVE_FFTW_THREADSAFE_PLANNER
+	fftw_make_planner_thread_safe();
+#endif
+	const size_t threadsPerGroup = std::max<size_t>(1, _threadCount / parallelCount);
+	const double memFraction = _memFraction / parallelCount;
+	const double absMemLimit = gridderAbsMemLimit() / parallelCount;
+	std::cout << "Running " << parallelCount << " independent groups concurrently, each with " << threadsPerGroup << " threads.\n";
+	
+	// The gridders of all groups point to the weights of the cache, so these may not change
+	_imageWeightCache->SetFrozen(true);
+	boost::mutex taskMutex;
+	size_t nextTask = 0;
+	std::exception_ptr failure;
+	boost::thread_group threads;
+	for(size_t i=0; i!=parallelCount; ++i)
+	{
+		threads.add_thread(new boost::thread([&]() {
+			try {
+				Deconvolution deconvolution(_deconvolution);
+				GroupState group(deconvolution, threadsPerGroup, memFraction, absMemLimit);
+				while(true)
+				{
+					size_t taskIndex;
+					{
+						boost::mutex::scoped_lock lock(taskMutex);
+						if(nextTask == tasks.size() || failure)
+							return;
+						taskIndex = nextTask;
+						++nextTask;
+					}
+					for(std::vector<size_t>::const_iterator groupIndex=tasks[taskIndex].begin(); groupIndex!=tasks[taskIndex].end(); ++groupIndex)
+						runIndependentGroup(group, _imagingTable.GetIndependentGroup(*groupIndex));
+				}
+			} catch(...) {
+				boost::mutex::scoped_lock lock(taskMutex);
+				if(!failure)
+					failure = std::current_exception();
+			}
+		}));
+	}
+	threads.join_all();
+	_imageWeightCache->SetFrozen(false);
+	if(failure)
+		std::rethrow_exception(failure);
+}
+
+void WSClean::runIndependentGroupsPipelined(size_t queueSize)
+{
+#ifdef HAVE_FFTW_THREADSAFE_PLANNER
+	fftw_make_planner_thread_safe();
+#endif
+	// The gridding of the next group can coincide with the major iterations of the
+	// current group, so each gets half of the threads and memory
+	const size_t threadCount = std::max<size_t>(1, _threadCount / 2);
+	const double memFraction = _memFraction * 0.5;
+	const double absMemLimit = gridderAbsMemLimit() * 0.5;
+	std::cout << "Imaging up to " << queueSize << " groups ahead of the deconvolution, using " << threadCount << " threads for each.\n";
+	
+	// Both threads point gridders to the weights of the cache, so these may not change
+	_imageWeightCache->SetFrozen(true);
+	
+	ao::lane<GroupState*> imagedGroups(queueSize);
+	std::atomic<bool> stopImaging(false);
+	std::exception_ptr imagingFailure;
+	boost::thread imagingThread([&]() {
+		try {
+			std::shared_ptr<CachedImageSet> psfImages;
+			for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount() && !stopImaging; ++groupIndex)
+			{
+				const ImagingTable groupTable = _imagingTable.GetIndependentGroup(groupIndex);
+				std::unique_ptr<GroupState> group(new GroupState(_deconvolution, threadCount, memFraction, absMemLimit));
+				if(psfImages && groupTable.Front().polarization != *_polarizations.begin())
+					group->psfImages = psfImages;
+				imageIndependentGroup(*group, groupTable);
+				// The gridder is recreated by the next inversion; its buffers need not wait in the queue
+				group->inversionAlgorithm->FreeImagingData();
+				psfImages = group->psfImages;
+				imagedGroups.write(group.release());
+			}
+		} catch(...) {
+			imagingFailure = std::current_exception();
+		}
+		imagedGroups.write_end();
+	});
+	
+	GroupState* imagedGroup;
+	try {
+		for(size_t groupIndex=0; imagedGroups.read(imagedGroup); ++groupIndex)
+		{
+			std::unique_ptr<GroupState> group(imagedGroup);
+			deconvolveIndependentGroup(*group, _imagingTable.GetIndependentGroup(groupIndex));
+		}
+	} catch(...) {
+		// Let the imaging thread finish its current group and discard the groups it has made
+		stopImaging = true;
+		while(imagedGroups.read(imagedGroup))
+			delete imagedGroup;
+		imagingThread.join();
+		_imageWeightCache->SetFrozen(false);
+		throw;
+	}
+	imagingThread.join();
+	_imageWeightCache->SetFrozen(false);
+	if(imagingFailure)
+		std::rethrow_exception(imagingFailure);
+}
+
+void WSClean::runIndependentGroup(GroupState& group, const ImagingTable& groupTable)
+{
+	imageIndependentGroup(group, groupTable);
+	deconvolveIndependentGroup(group, groupTable);
+}
+
+void WSClean::imageIndependentGroup(GroupState& group, const ImagingTable& groupTable)
 {
-	_inversionAlgorithm.reset(new WSMSGridder(&_imageAllocator, _threadCount, _memFraction, _absMemLimit));
+	group.inversionAlgorithm.reset(new WSMSGridder(&_imageAllocator, group.threadCount, group.memFraction, group.absMemLimit));
 	
-	_modelImages.Initialize(_fitsWriter, _polarizations.size(), _channelsOut, _prefixName + "-model", _imageAllocator);
-	_residualImages.Initialize(_fitsWriter, _polarizations.size(), _channelsOut, _prefixName + "-residual", _imageAllocator);
+	group.modelImages.Initialize(group.fitsWriter, _polarizations.size(), _channelsOut, _prefixName + "-model", _imageAllocator);
+	group.residualImages.Initialize(group.fitsWriter, _polarizations.size(), _channelsOut, _prefixName + "-residual", _imageAllocator);
 	if(groupTable.Front().polarization == *_polarizations.begin())
-		_psfImages.Initialize(_fitsWriter, 1, groupTable.SquaredGroupCount(), _prefixName + "-psf", _imageAllocator);
+		group.psfImages->Initialize(group.fitsWriter, 1, groupTable.SquaredGroupCount(), _prefixName + "-psf", _imageAllocator);
 	
-	const std::string rootPrefix = _prefixName;
-		
 	for(size_t joinedIndex=0; joinedIndex!=groupTable.EntryCount(); ++joinedIndex)
 	{
 		const ImagingTableEntry& entry = groupTable[joinedIndex];
-		runFirstInversion(entry);
+		runFirstInversion(group, entry);
 	}
-	
-	_deconvolution.InitializeDeconvolutionAlgorithm(groupTable, *_polarizations.begin(), &_imageAllocator, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _channelsOut, _inversionAlgorithm->BeamSize(), _threadCount);
+}
+
+void WSClean::deconvolveIndependentGroup(GroupState& group, const ImagingTable& groupTable)
+{
+	group.deconvolution.InitializeDeconvolutionAlgorithm(groupTable, *_polarizations.begin(), &_imageAllocator, _imgWidth, _imgHeight, _pixelScaleX, _pixelScaleY, _channelsOut, group.inversionAlgorithm->BeamSize(), group.threadCount);
 
-	initFitsWriter(_fitsWriter);
-	setCleanParameters(_fitsWriter);
-	updateCleanParameters(_fitsWriter, 0, 0);
+	initFitsWriter(group, group.fitsWriter);
+	setCleanParameters(group.fitsWriter);
+	updateCleanParameters(group.fitsWriter, 0, 0);
 		
-	if(_deconvolution.NIter() > 0)
+	if(group.deconvolution.NIter() > 0)
 	{
 		// Start major cleaning loop
-		_majorIterationNr = 1;
+		group.majorIterationNr = 1;
 		bool reachedMajorThreshold = false;
 		do {
-			_deconvolution.InitializeImages(_residualImages, _modelImages, _psfImages);
-			_deconvolutionWatch.Start();
-			_deconvolution.Perform(groupTable, reachedMajorThreshold, _majorIterationNr);
-			_deconvolutionWatch.Pause();
+			group.deconvolution.InitializeImages(group.residualImages, group.modelImages, *group.psfImages);
+			group.deconvolutionWatch.Start();
+			group.deconvolution.Perform(groupTable, reachedMajorThreshold, group.majorIterationNr);
+			group.deconvolutionWatch.Pause();
 			
-			if(_majorIterationNr == 1 && _deconvolution.MGain() != 1.0)
-				writeFirstResidualImages(groupTable);
+			if(group.majorIterationNr == 1 && group.deconvolution.MGain() != 1.0)
+				writeFirstResidualImages(group, groupTable);
 	
 			if(!reachedMajorThreshold)
-				writeModelImages(groupTable);
+				writeModelImages(group, groupTable);
 	
-			if(_deconvolution.MGain() != 1.0)
+			if(group.deconvolution.MGain() != 1.0)
 			{
 				for(size_t sGroupIndex=0; sGroupIndex!=groupTable.SquaredGroupCount(); ++sGroupIndex)
 				{
@@ -779,41 +1238,41 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 					size_t currentChannelIndex = sGroupTable.Front().outputChannelIndex;
 					if(_dftPrediction)
 					{
-						dftPredict(sGroupTable);
+						dftPredict(group, sGroupTable);
 						for(size_t e=0; e!=sGroupTable.EntryCount(); ++e)
 						{
-							prepareInversionAlgorithm(sGroupTable[e].polarization);
-							initializeCurMSProviders(sGroupTable[e]);
-							initializeImageWeights(sGroupTable[e]);
+							prepareInversionAlgorithm(group, sGroupTable[e].polarization);
+							initializeCurMSProviders(group, sGroupTable[e]);
+							initializeImageWeights(group, sGroupTable[e]);
 		
-							imageMainNonFirst(sGroupTable[e].polarization, currentChannelIndex);
-							clearCurMSProviders();
+							imageMainNonFirst(group, sGroupTable[e].polarization, currentChannelIndex);
+							clearCurMSProviders(group);
 						}
 					}
 					else {
 						for(size_t e=0; e!=sGroupTable.EntryCount(); ++e)
 						{
-							prepareInversionAlgorithm(sGroupTable[e].polarization);
-							initializeCurMSProviders(sGroupTable[e]);
-							initializeImageWeights(sGroupTable[e]);
+							prepareInversionAlgorithm(group, sGroupTable[e].polarization);
+							initializeCurMSProviders(group, sGroupTable[e]);
+							initializeImageWeights(group, sGroupTable[e]);
 		
-							predict(sGroupTable[e].polarization, currentChannelIndex);
+							predict(group, sGroupTable[e].polarization, currentChannelIndex);
 							
-							imageMainNonFirst(sGroupTable[e].polarization, currentChannelIndex);
-							clearCurMSProviders();
+							imageMainNonFirst(group, sGroupTable[e].polarization, currentChannelIndex);
+							clearCurMSProviders(group);
 						} // end of polarization loop
 					}
 				} // end of joined channels loop
 				
-				++_majorIterationNr;
+				++group.majorIterationNr;
 			}
 			
 		} while(reachedMajorThreshold);
 		
-		std::cout << _majorIterationNr << " major iterations were performed.\n";
+		std::cout << group.majorIterationNr << " major iterations were performed.\n";
 	}
 	
-	_inversionAlgorithm->FreeImagingData();
+	group.inversionAlgorithm->FreeImagingData();
 	
 	// Restore model to residuals and save all images
 	for(size_t joinedIndex=0; joinedIndex!=groupTable.EntryCount(); ++joinedIndex)
@@ -830,14 +1289,14 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 		{
 			bool isImaginary = (imageIter == 1);
 			double* restoredImage = _imageAllocator.Allocate(_imgWidth*_imgHeight);
-			_residualImages.Load(restoredImage, curPol, currentChannelIndex, isImaginary);
-			if(_deconvolution.NIter() != 0)
-				writeFits("residual.fits", restoredImage, curPol, currentChannelIndex, isImaginary);
+			group.residualImages.Load(restoredImage, curPol, currentChannelIndex, isImaginary);
+			if(group.deconvolution.NIter() != 0)
+				writeFits(group, "residual.fits", restoredImage, curPol, currentChannelIndex, isImaginary);
 			if(_isUVImageSaved)
-				saveUVImage(restoredImage, curPol, currentChannelIndex, isImaginary, "uv");
+				saveUVImage(group, restoredImage, curPol, currentChannelIndex, isImaginary, "uv");
 			double* modelImage = _imageAllocator.Allocate(_imgWidth*_imgHeight);
-				_modelImages.Load(modelImage, curPol, currentChannelIndex, isImaginary);
-			ModelRenderer renderer(_fitsWriter.RA(), _fitsWriter.Dec(), _pixelScaleX, _pixelScaleY, _fitsWriter.PhaseCentreDL(), _fitsWriter.PhaseCentreDM());
+				group.modelImages.Load(modelImage, curPol, currentChannelIndex, isImaginary);
+			ModelRenderer renderer(group.fitsWriter.RA(), group.fitsWriter.Dec(), _pixelScaleX, _pixelScaleY, group.fitsWriter.PhaseCentreDL(), group.fitsWriter.PhaseCentreDM());
 			double beamMaj = _infoPerChannel[currentChannelIndex].beamMaj;
 			double beamMin = _infoPerChannel[currentChannelIndex].beamMin;
 			double beamPA = _infoPerChannel[currentChannelIndex].beamPA;
@@ -845,7 +1304,7 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 				"(beam=" + Angle::ToNiceString(beamMin) + "-" +
 				Angle::ToNiceString(beamMaj) + ", PA=" +
 				Angle::ToNiceString(beamPA) + ")";
-			if(_deconvolution.MultiScale() || _deconvolution.FastMultiScale() || _deconvolution.UseMoreSane() || _deconvolution.UseIUWT())
+			if(group.deconvolution.MultiScale() || group.deconvolution.FastMultiScale() || group.deconvolution.UseMoreSane() || group.deconvolution.UseIUWT())
 			{
 				std::cout << "Rendering sources to restored image " + beamStr + "... " << std::flush;
 				renderer.Restore(restoredImage, modelImage, _imgWidth, _imgHeight, beamMaj, beamMin, beamPA, Polarization::StokesI);
@@ -854,7 +1313,7 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 			else {
 				Model model;
 				// A model cannot hold instrumental pols (xx/xy/yx/yy), hence always use Stokes I here
-				DeconvolutionAlgorithm::GetModelFromImage(model, modelImage, _imgWidth, _imgHeight, _fitsWriter.RA(), _fitsWriter.Dec(), _pixelScaleX, _pixelScaleY, _fitsWriter.PhaseCentreDL(), _fitsWriter.PhaseCentreDM(), 0.0, _fitsWriter.Frequency(), Polarization::StokesI);
+				DeconvolutionAlgorithm::GetModelFromImage(model, modelImage, _imgWidth, _imgHeight, group.fitsWriter.RA(), group.fitsWriter.Dec(), _pixelScaleX, _pixelScaleY, group.fitsWriter.PhaseCentreDL(), group.fitsWriter.PhaseCentreDM(), 0.0, group.fitsWriter.Frequency(), Polarization::StokesI);
 				
 				if(beamMaj == beamMin) {
 					std::cout << "Rendering " << model.SourceCount() << " circular sources to restored image " + beamStr + "... " << std::flush;
@@ -867,7 +1326,7 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 				std::cout << "DONE\n";
 			}
 			std::cout << "Writing restored image... " << std::flush;
-			writeFits("image.fits", restoredImage, curPol, currentChannelIndex, isImaginary);
+			writeFits(group, "image.fits", restoredImage, curPol, currentChannelIndex, isImaginary);
 			std::cout << "DONE\n";
 			_imageAllocator.Free(restoredImage);
 			_imageAllocator.Free(modelImage);
@@ -875,15 +1334,13 @@ void WSClean::runIndependentGroup(const ImagingTable& groupTable)
 	} // end joined index loop
 	
 	_imageAllocator.ReportStatistics();
-	std::cout << "Inversion: " << _inversionWatch.ToString() << ", prediction: " << _predictingWatch.ToString() << ", deconvolution: " << _deconvolutionWatch.ToString() << '\n';
-	
-	_prefixName = rootPrefix;
+	std::cout << "Inversion: " << group.inversionWatch.ToString() << ", prediction: " << group.predictingWatch.ToString() << ", deconvolution: " << group.deconvolutionWatch.ToString() << '\n';
 	
 	// Needs to be destructed before image allocator, or image allocator will report error caused by leaked memory
-	_inversionAlgorithm.reset();
+	group.inversionAlgorithm.reset();
 }
 
-void WSClean::writeFirstResidualImages(const ImagingTable& groupTable)
+void WSClean::writeFirstResidualImages(GroupState& group, const ImagingTable& groupTable)
 {
 	std::cout << "Writing first iteration image(s)...\n";
 	ImageBufferAllocator::Ptr ptr;
@@ -893,17 +1350,17 @@ void WSClean::writeFirstResidualImages(const ImagingTable& groupTable)
 		const ImagingTableEntry& entry = groupTable[e];
 		size_t ch = entry.outputChannelIndex;
 		if(entry.polarization == Polarization::YX) {
-			_residualImages.Load(ptr.data(), Polarization::XY, ch, true);
-			writeFits("first-residual.fits", ptr.data(), Polarization::XY, ch, true);
+			group.residualImages.Load(ptr.data(), Polarization::XY, ch, true);
+			writeFits(group, "first-residual.fits", ptr.data(), Polarization::XY, ch, true);
 		}
 		else {
-			_residualImages.Load(ptr.data(), entry.polarization, ch, false);
-			writeFits("first-residual.fits", ptr.data(), entry.polarization, ch, false);
+			group.residualImages.Load(ptr.data(), entry.polarization, ch, false);
+			writeFits(group, "first-residual.fits", ptr.data(), entry.polarization, ch, false);
 		}
 	}
 }
 
-void WSClean::writeModelImages(const ImagingTable& groupTable)
+void WSClean::writeModelImages(GroupState& group, const ImagingTable& groupTable)
 {
 	std::cout << "Writing model image...\n";
 	ImageBufferAllocator::Ptr ptr;
@@ -913,21 +1370,21 @@ void WSClean::writeModelImages(const ImagingTable& groupTable)
 		const ImagingTableEntry& entry = groupTable[e];
 		size_t ch = entry.outputChannelIndex;
 		if(entry.polarization == Polarization::YX) {
-			_modelImages.Load(ptr.data(), Polarization::XY, ch, true);
-			writeFits("model.fits", ptr.data(), Polarization::XY, ch, true);
+			group.modelImages.Load(ptr.data(), Polarization::XY, ch, true);
+			writeFits(group, "model.fits", ptr.data(), Polarization::XY, ch, true);
 		}
 		else {
-			_modelImages.Load(ptr.data(), entry.polarization, ch, false);
-			writeFits("model.fits", ptr.data(), entry.polarization, ch, false);
+			group.modelImages.Load(ptr.data(), entry.polarization, ch, false);
+			writeFits(group, "model.fits", ptr.data(), entry.polarization, ch, false);
 		}
 	}
 }
 
-void WSClean::predictGroup(const ImagingTable& imagingGroup)
+void WSClean::predictGroup(GroupState& group, const ImagingTable& imagingGroup)
 {
-	_inversionAlgorithm.reset(new WSMSGridder(&_imageAllocator, _threadCount, _memFraction, _absMemLimit));
+	group.inversionAlgorithm.reset(new WSMSGridder(&_imageAllocator, group.threadCount, group.memFraction, group.absMemLimit));
 	
-	_modelImages.Initialize(_fitsWriter, _polarizations.size(), 1, _prefixName + "-model", _imageAllocator);
+	group.modelImages.Initialize(group.fitsWriter, _polarizations.size(), 1, _prefixName + "-model", _imageAllocator);
 	
 	const std::string rootPrefix = _prefixName;
 		
@@ -938,8 +1395,8 @@ void WSClean::predictGroup(const ImagingTable& imagingGroup)
 		for(size_t i=0; i!=entry.imageCount; ++i)
 		{
 			FitsReader reader(getPrefix(entry.polarization, entry.outputChannelIndex, i==1) + "-model.fits");
-			_fitsWriter = FitsWriter(reader);
-			_modelImages.SetFitsWriter(_fitsWriter);
+			group.fitsWriter = FitsWriter(reader);
+			group.modelImages.SetFitsWriter(group.fitsWriter);
 			std::cout << "Reading " << reader.Filename() << "...\n";
 			double* buffer = _imageAllocator.Allocate(_imgWidth*_imgHeight);
 			if(reader.ImageWidth()!=_imgWidth || reader.ImageHeight()!=_imgHeight)
@@ -950,39 +1407,46 @@ void WSClean::predictGroup(const ImagingTable& imagingGroup)
 				if(!std::isfinite(buffer[j]))
 					throw std::runtime_error("The input image contains non-finite values -- can't predict from an image with non-finite values");
 			}
-			_modelImages.Store(buffer, entry.polarization, 0, i==1);
+			group.modelImages.Store(buffer, entry.polarization, 0, i==1);
 			_imageAllocator.Free(buffer);
 		}
 		
-		prepareInversionAlgorithm(entry.polarization);
-		initializeCurMSProviders(entry);
-		initializeImageWeights(entry);
+		prepareInversionAlgorithm(group, entry.polarization);
+		initializeCurMSProviders(group, entry);
+		initializeImageWeights(group, entry);
 
-		predict(entry.polarization, 0);
+		predict(group, entry.polarization, 0);
 		
-		clearCurMSProviders();
+		clearCurMSProviders(group);
 	} // end of polarization loop
 	
 	_imageAllocator.ReportStatistics();
-	std::cout << "Inversion: " << _inversionWatch.ToString() << ", prediction: " << _predictingWatch.ToString() << ", cleaning: " << _deconvolutionWatch.ToString() << '\n';
+	std::cout << "Inversion: " << group.inversionWatch.ToString() << ", prediction: " << group.predictingWatch.ToString() << ", cleaning: " << group.deconvolutionWatch.ToString() << '\n';
 	
 	_prefixName = rootPrefix;
 	
 	// Needs to be destructed before image allocator, or image allocator will report error caused by leaked memory
-	_inversionAlgorithm.reset();
+	group.inversionAlgorithm.reset();
 }
 
 MSProvider* WSClean::initializeMSProvider(const ImagingTableEntry& entry, const MSSelection& selection, size_t filenameIndex, size_t bandIndex)
 {
 	if(_doReorder)
-		return new PartitionedMS(_partitionedMSHandles[filenameIndex], entry.msData[filenameIndex].bands[bandIndex].partIndex, entry.polarization, bandIndex);
+	{
+		if(!_memoryMSHandles.empty())
+			return new MemoryMS(_memoryMSHandles[filenameIndex], entry.msData[filenameIndex].bands[bandIndex].partIndex, entry.polarization, bandIndex);
+		else
+			return new PartitionedMS(_partitionedMSHandles[filenameIndex], entry.msData[filenameIndex].bands[bandIndex].partIndex, entry.polarization, bandIndex);
+	}
 	else
 		return new ContiguousMS(_filenames[filenameIndex], _columnName, selection, entry.polarization, _deconvolution.MGain() != 1.0);
 }
 
-void WSClean::initializeCurMSProviders(const ImagingTableEntry& entry)
+void WSClean::initializeCurMSProviders(GroupState& group, const ImagingTableEntry& entry)
 {
-	_inversionAlgorithm->ClearMeasurementSetList();
+	// The handles of reordered sets are reference counted without locking
+	boost::mutex::scoped_lock lock(_msProviderMutex);
+	group.inversionAlgorithm->ClearMeasurementSetList();
 	for(size_t i=0; i != _filenames.size(); ++i)
 	{
 		for(size_t b=0; b!=_msBands[i].BandCount(); ++b)
@@ -991,55 +1455,57 @@ void WSClean::initializeCurMSProviders(const ImagingTableEntry& entry)
 			if(selectChannels(selection, i, b, entry))
 			{
 				MSProvider* msProvider = initializeMSProvider(entry, selection, i, b);
-				_inversionAlgorithm->AddMeasurementSet(msProvider, selection);
-				_currentPolMSes.push_back(msProvider);
+				group.inversionAlgorithm->AddMeasurementSet(msProvider, selection);
+				group.currentPolMSes.push_back(msProvider);
 			}
 		}
 	}
 }
 
-void WSClean::clearCurMSProviders()
+void WSClean::clearCurMSProviders(GroupState& group)
 {
-	for(std::vector<MSProvider*>::iterator i=_currentPolMSes.begin(); i != _currentPolMSes.end(); ++i)
+	boost::mutex::scoped_lock lock(_msProviderMutex);
+	for(std::vector<MSProvider*>::iterator i=group.currentPolMSes.begin(); i != group.currentPolMSes.end(); ++i)
 		delete *i;
-	_currentPolMSes.clear();
+	group.currentPolMSes.clear();
 }
 
-void WSClean::runFirstInversion(const ImagingTableEntry& entry)
+void WSClean::runFirstInversion(GroupState& group, const ImagingTableEntry& entry)
 {
-	initializeCurMSProviders(entry);
-	initializeImageWeights(entry);
+	initializeCurMSProviders(group, entry);
+	initializeImageWeights(group, entry);
 	
-	prepareInversionAlgorithm(entry.polarization);
+	prepareInversionAlgorithm(group, entry.polarization);
 	
-	const bool firstBeforePSF = _isFirstInversion;
+	// Only the first inversion of a run is verbose and saves the gridding correction image
+	const bool isFirstInversion = _isFirstInversion.exchange(false);
 
 	bool isFirstPol = entry.polarization == *_polarizations.begin();
 	bool doMakePSF = _deconvolution.NIter() > 0 || _makePSF;
 	if(doMakePSF && isFirstPol)
-		imagePSF(entry.outputChannelIndex);
+		imagePSF(group, entry.outputChannelIndex, isFirstInversion);
 	
-	initFitsWriter(_fitsWriter);
-	_modelImages.SetFitsWriter(_fitsWriter);
-	_residualImages.SetFitsWriter(_fitsWriter);
+	initFitsWriter(group, group.fitsWriter);
+	group.modelImages.SetFitsWriter(group.fitsWriter);
+	group.residualImages.SetFitsWriter(group.fitsWriter);
 	
-	imageMainFirst(entry.polarization, entry.outputChannelIndex);
+	imageMainFirst(group, entry.polarization, entry.outputChannelIndex, isFirstInversion && !(doMakePSF && isFirstPol));
 	
 	// If this was the first polarization of this channel, we need to set
 	// the info for this channel
 	if(isFirstPol)
 	{
-		_infoPerChannel[entry.outputChannelIndex].weight = _inversionAlgorithm->ImageWeight();
-		_infoPerChannel[entry.outputChannelIndex].bandStart = _inversionAlgorithm->BandStart();
-		_infoPerChannel[entry.outputChannelIndex].bandEnd = _inversionAlgorithm->BandEnd();
+		_infoPerChannel[entry.outputChannelIndex].weight = group.inversionAlgorithm->ImageWeight();
+		_infoPerChannel[entry.outputChannelIndex].bandStart = group.inversionAlgorithm->BandStart();
+		_infoPerChannel[entry.outputChannelIndex].bandEnd = group.inversionAlgorithm->BandEnd();
 		// If no PSF is made, also set the beam size. If the PSF was made, these would already be set
 		// after imaging the PSF.
 		if(!doMakePSF)
 		{
 			if(_manualBeamMajorSize == 0.0)
 			{
-				_infoPerChannel[entry.outputChannelIndex].beamMaj = _inversionAlgorithm->BeamSize();
-				_infoPerChannel[entry.outputChannelIndex].beamMin = _inversionAlgorithm->BeamSize();
+				_infoPerChannel[entry.outputChannelIndex].beamMaj = group.inversionAlgorithm->BeamSize();
+				_infoPerChannel[entry.outputChannelIndex].beamMin = group.inversionAlgorithm->BeamSize();
 				_infoPerChannel[entry.outputChannelIndex].beamPA = 0.0;
 			}
 			else {
@@ -1050,19 +1516,17 @@ void WSClean::runFirstInversion(const ImagingTableEntry& entry)
 		}
 	}
 	
-	if(_isGriddingImageSaved && firstBeforePSF && _inversionAlgorithm->HasGriddingCorrectionImage())
-		imageGridding();
-	
-	_isFirstInversion = false;
+	if(_isGriddingImageSaved && isFirstInversion && group.inversionAlgorithm->HasGriddingCorrectionImage())
+		imageGridding(group);
 	
 	// Set model to zero: already done if this is YX of XY/YX imaging combi
 	if(!(entry.polarization == Polarization::YX && _polarizations.count(Polarization::XY)!=0))
 	{
 		double* modelImage = _imageAllocator.Allocate(_imgWidth * _imgHeight);
 		memset(modelImage, 0, _imgWidth * _imgHeight * sizeof(double));
-		_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, false);
+		group.modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, false);
 		if(Polarization::IsComplex(entry.polarization))
-			_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, true);
+			group.modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, true);
 		_imageAllocator.Free(modelImage);
 	}
 	
@@ -1074,18 +1538,18 @@ void WSClean::runFirstInversion(const ImagingTableEntry& entry)
 		if(savedPol == Polarization::YX && _polarizations.count(Polarization::XY)!=0)
 			savedPol = Polarization::XY;
 		double* dirtyImage = _imageAllocator.Allocate(_imgWidth * _imgHeight);
-		_residualImages.Load(dirtyImage, savedPol, entry.outputChannelIndex, false);
+		group.residualImages.Load(dirtyImage, savedPol, entry.outputChannelIndex, false);
 		std::cout << "Writing dirty image...\n";
-		writeFits("dirty.fits", dirtyImage, savedPol, entry.outputChannelIndex, false);
+		writeFits(group, "dirty.fits", dirtyImage, savedPol, entry.outputChannelIndex, false);
 		if(Polarization::IsComplex(entry.polarization))
 		{
-			_residualImages.Load(dirtyImage, savedPol, entry.outputChannelIndex, true);
-			writeFits("dirty.fits", dirtyImage, savedPol, entry.outputChannelIndex, true);
+			group.residualImages.Load(dirtyImage, savedPol, entry.outputChannelIndex, true);
+			writeFits(group, "dirty.fits", dirtyImage, savedPol, entry.outputChannelIndex, true);
 		}
 		_imageAllocator.Free(dirtyImage);
 	}
 	
-	clearCurMSProviders();
+	clearCurMSProviders(group);
 }
 
 void WSClean::makeMFSImage(const string& suffix, PolarizationEnum pol, bool isImaginary)
@@ -1136,7 +1600,7 @@ void WSClean::makeMFSImage(const string& suffix, PolarizationEnum pol, bool isIm
 	writer.Write(getMFSPrefix(pol, isImaginary) + '-' + suffix, mfsImage.data());
 }
 
-void WSClean::writeFits(const string& suffix, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary)
+void WSClean::writeFits(GroupState& group, const string& suffix, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary)
 {
 	const double
 		bandStart = _infoPerChannel[channelIndex].bandStart,
@@ -1144,11 +1608,11 @@ void WSClean::writeFits(const string& suffix, const double* image, PolarizationE
 		centreFrequency = 0.5*(bandStart+bandEnd),
 		bandwidth = bandEnd-bandStart;
 	const std::string name(getPrefix(pol, channelIndex, isImaginary) + '-' + suffix);
-	initFitsWriter(_fitsWriter);
-	_fitsWriter.SetPolarization(pol);
-	_fitsWriter.SetFrequency(centreFrequency, bandwidth);
-	_fitsWriter.SetExtraKeyword("WSCIMGWG", _infoPerChannel[channelIndex].weight);
-	_fitsWriter.SetBeamInfo(
+	initFitsWriter(group, group.fitsWriter);
+	group.fitsWriter.SetPolarization(pol);
+	group.fitsWriter.SetFrequency(centreFrequency, bandwidth);
+	group.fitsWriter.SetExtraKeyword("WSCIMGWG", _infoPerChannel[channelIndex].weight);
+	group.fitsWriter.SetBeamInfo(
 		_infoPerChannel[channelIndex].beamMaj,
 		_infoPerChannel[channelIndex].beamMin,
 		_infoPerChannel[channelIndex].beamPA);
@@ -1157,10 +1621,10 @@ void WSClean::writeFits(const string& suffix, const double* image, PolarizationE
 		polIndex = 0;
 	else
 		Polarization::TypeToIndex(pol, _polarizations, polIndex);
-	setCleanParameters(_fitsWriter);
-	if(_deconvolution.IsInitialized())
-		updateCleanParameters(_fitsWriter, _deconvolution.GetAlgorithm().IterationNumber(), _majorIterationNr);
-	_fitsWriter.Write(name, image);
+	setCleanParameters(group.fitsWriter);
+	if(group.deconvolution.IsInitialized())
+		updateCleanParameters(group.fitsWriter, group.deconvolution.GetAlgorithm().IterationNumber(), group.majorIterationNr);
+	group.fitsWriter.Write(name, image);
 }
 
 MSSelection WSClean::selectInterval(MSSelection& fullSelection)
@@ -1203,15 +1667,15 @@ MSSelection WSClean::selectInterval(MSSelection& fullSelection)
 	}
 }
 
-void WSClean::saveUVImage(const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary, const std::string& prefix)
+void WSClean::saveUVImage(GroupState& group, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary, const std::string& prefix)
 {
 	ao::uvector<double>
 		realUV(_imgWidth*_imgHeight, std::numeric_limits<double>::quiet_NaN()),
 		imagUV(_imgWidth*_imgHeight, std::numeric_limits<double>::quiet_NaN());
 	FFTResampler fft(_imgWidth, _imgHeight, _imgWidth, _imgHeight, 1, true);
 	fft.SingleFT(image, realUV.data(), imagUV.data());
-	writeFits(prefix+"-real.fits", realUV.data(), pol, channelIndex, isImaginary);
-	writeFits(prefix+"-imag.fits", imagUV.data(), pol, channelIndex, isImaginary);
+	writeFits(group, prefix+"-real.fits", realUV.data(), pol, channelIndex, isImaginary);
+	writeFits(group, prefix+"-imag.fits", imagUV.data(), pol, channelIndex, isImaginary);
 }
 
 void WSClean::makeImagingTable()
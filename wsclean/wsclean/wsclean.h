@@ -2,6 +2,7 @@
 #define WSCLEAN_H
 
 #include "../msproviders/msprovider.h"
+#include "../msproviders/memoryms.h"
 #include "../msproviders/partitionedms.h"
 
 #include "../msselection.h"
@@ -17,6 +18,10 @@
 #include "imagebufferallocator.h"
 #include "imagingtable.h"
 
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <memory>
 #include <set>
 
 class WSClean
@@ -70,6 +75,24 @@ public:
 	void SetTemporaryDirectory(const std::string& tempDir) { _temporaryDirectory = tempDir; }
 	void SetForceReorder(bool forceReorder) { _forceReorder = forceReorder; }
 	void SetForceNoReorder(bool forceNoReorder) { _forceNoReorder = forceNoReorder; }
+	void SetReorderStorageFormat(ReorderStorage::Format storageFormat) { _reorderStorageFormat = storageFormat; }
+	void SetReorderInMemory(bool reorderInMemory) { _reorderInMemory = reorderInMemory; }
+	void SetUseHugePages(bool useHugePages) { _useHugePages = useHugePages; }
+	void SetParallelReading(size_t parallelReading) { _parallelReading = parallelReading; }
+	/**
+	 * Number of independent groups (e.g. output channels that are not joined) that are
+	 * imaged and deconvolved concurrently, each with a share of the threads and memory.
+	 * Only used when the data is reordered. Default: 1.
+	 */
+	void SetParallelGroups(size_t parallelGroups) { _parallelGroups = parallelGroups; }
+	/**
+	 * Number of groups whose first inversions are made in the background while the
+	 * previous group is deconvolved. Imaging and deconvolution then each use half of the
+	 * threads and memory. Only used when groups run one at a time and the data is
+	 * reordered. Default: 0 (no overlap).
+	 */
+	void SetPrefetchGroups(size_t prefetchGroups) { _prefetchGroups = prefetchGroups; }
+	void SetStoreWeights(bool storeWeights) { _storeWeights = storeWeights; }
 	void SetModelUpdateRequired(bool modelUpdateRequired) { _modelUpdateRequired = modelUpdateRequired; }
 	void SetMemFraction(double memFraction) { _memFraction = memFraction; }
 	void SetMemAbsLimit(double absMemLimit) { _absMemLimit = absMemLimit; }
@@ -107,26 +130,92 @@ public:
 		_visibilityWeightingMode = mode;
 	}
 private:
-	void runIndependentGroup(const ImagingTable& groupTable);
-	void predictGroup(const ImagingTable& imagingGroup);
+	/**
+	 * Everything that is specific to the independent group that is being imaged. When
+	 * groups run concurrently, each of them has its own state.
+	 */
+	struct GroupState
+	{
+		GroupState(Deconvolution& _deconvolution, size_t _threadCount, double _memFraction, double _absMemLimit) :
+			deconvolution(_deconvolution),
+			threadCount(_threadCount),
+			memFraction(_memFraction), absMemLimit(_absMemLimit),
+			psfImages(new CachedImageSet()),
+			inversionWatch(false), predictingWatch(false), deconvolutionWatch(false),
+			majorIterationNr(0)
+		{ }
+		
+		Deconvolution& deconvolution;
+		// Resources the gridder and deconvolution of this group may use
+		size_t threadCount;
+		double memFraction, absMemLimit;
+		
+		std::unique_ptr<class InversionAlgorithm> inversionAlgorithm;
+		// Shared with the groups of the other polarizations, which reuse the PSF
+		std::shared_ptr<CachedImageSet> psfImages;
+		CachedImageSet modelImages, residualImages;
+		FitsWriter fitsWriter;
+		std::vector<MSProvider*> currentPolMSes;
+		Stopwatch inversionWatch, predictingWatch, deconvolutionWatch;
+		size_t majorIterationNr;
+	};
+	
+	/**
+	 * Runs all independent groups of the imaging table, several at a time when
+	 * parallelGroupCount() allows it.
+	 */
+	void runIndependentGroups();
+	/**
+	 * Images the next groups in a background thread while the main thread deconvolves,
+	 * keeping at most queueSize imaged groups waiting.
+	 */
+	void runIndependentGroupsPipelined(size_t queueSize);
+	/**
+	 * Number of independent groups that can run concurrently. Writes to standard output
+	 * why groups run one at a time when more were requested.
+	 */
+	size_t parallelGroupCount(size_t taskCount) const;
+	/**
+	 * Number of imaged groups that may wait for deconvolution, or zero when groups
+	 * are not imaged in the background.
+	 */
+	size_t prefetchGroupCount() const;
+	/**
+	 * Why gridding and deconvolution of different groups can not run at the same time,
+	 * or an empty string when they can.
+	 */
+	std::string concurrencyRestriction() const;
+	void runIndependentGroup(GroupState& group, const ImagingTable& groupTable);
+	/**
+	 * Makes the PSF and dirty images of a group: the part of runIndependentGroup() that
+	 * does not depend on other groups.
+	 */
+	void imageIndependentGroup(GroupState& group, const ImagingTable& groupTable);
+	void deconvolveIndependentGroup(GroupState& group, const ImagingTable& groupTable);
+	void predictGroup(GroupState& group, const ImagingTable& imagingGroup);
 	
-	void runFirstInversion(const ImagingTableEntry& entry);
-	void prepareInversionAlgorithm(PolarizationEnum polarization);
+	void runFirstInversion(GroupState& group, const ImagingTableEntry& entry);
+	void prepareInversionAlgorithm(GroupState& group, PolarizationEnum polarization);
 	
 	void checkPolarizations();
 	void performReordering(bool isPredictMode);
+	double memoryLimit() const;
+	double gridderAbsMemLimit() const;
 	
-	void initFitsWriter(class FitsWriter& writer);
+	void initFitsWriter(GroupState& group, class FitsWriter& writer);
 	void copyWSCleanKeywords(FitsReader& reader, FitsWriter& writer);
 	//void copyDoubleKeywordIfExists(FitsReader& reader, FitsWriter& writer, const char* keywordName);
 	void setCleanParameters(class FitsWriter& writer);
 	void updateCleanParameters(class FitsWriter& writer, size_t minorIterationNr, size_t majorIterationNr);
 	void initializeWeightTapers();
-	void initializeImageWeights(const ImagingTableEntry& entry);
+	void initializeImageWeights(GroupState& group, const ImagingTableEntry& entry);
 	void initializeMFSImageWeights();
+	void precalculateImageWeights();
+	void initializeWeightStorage();
+	std::string weightStorageFilename(const std::string& description) const;
 	MSProvider* initializeMSProvider(const ImagingTableEntry& entry, const MSSelection& selection, size_t filenameIndex, size_t bandIndex);
-	void initializeCurMSProviders(const ImagingTableEntry& entry);
-	void clearCurMSProviders();
+	void initializeCurMSProviders(GroupState& group, const ImagingTableEntry& entry);
+	void clearCurMSProviders(GroupState& group);
 	void storeAndCombineXYandYX(CachedImageSet& dest, PolarizationEnum polarization, size_t joinedChannelIndex, bool isImaginary, const double* image);
 	bool selectChannels(MSSelection& selection, size_t msIndex, size_t bandIndex, const ImagingTableEntry& entry);
 	MSSelection selectInterval(MSSelection& fullSelection);
@@ -135,18 +224,18 @@ private:
 	void makeImagingTableEntry(const std::vector<double>& channels, size_t outChannelIndex, ImagingTableEntry& entry);
 	void addPolarizationsToImagingTable(size_t& joinedGroupIndex, size_t& squaredGroupIndex, size_t outChannelIndex, const ImagingTableEntry& templateEntry);
 	
-	void imagePSF(size_t currentChannelIndex);
-	void imageGridding();
-	void imageMainFirst(PolarizationEnum polarization, size_t channelIndex);
-	void imageMainNonFirst(PolarizationEnum polarization, size_t channelIndex);
-	void predict(PolarizationEnum polarization, size_t channelIndex);
-	void dftPredict(const ImagingTable& squaredGroup);
+	void imagePSF(GroupState& group, size_t currentChannelIndex, bool isFirstInversion);
+	void imageGridding(GroupState& group);
+	void imageMainFirst(GroupState& group, PolarizationEnum polarization, size_t channelIndex, bool isFirstInversion);
+	void imageMainNonFirst(GroupState& group, PolarizationEnum polarization, size_t channelIndex);
+	void predict(GroupState& group, PolarizationEnum polarization, size_t channelIndex);
+	void dftPredict(GroupState& group, const ImagingTable& squaredGroup);
 	
 	void makeMFSImage(const string& suffix, PolarizationEnum pol, bool isImaginary);
-	void writeFits(const string& suffix, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary);
-	void saveUVImage(const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary, const std::string& prefix);
-	void writeFirstResidualImages(const ImagingTable& groupTable);
-	void writeModelImages(const ImagingTable& groupTable);
+	void writeFits(GroupState& group, const string& suffix, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary);
+	void saveUVImage(GroupState& group, const double* image, PolarizationEnum pol, size_t channelIndex, bool isImaginary, const std::string& prefix);
+	void writeFirstResidualImages(GroupState& group, const ImagingTable& groupTable);
+	void writeModelImages(GroupState& group, const ImagingTable& groupTable);
 	
 	std::string fourDigitStr(size_t val) const
 	{
@@ -230,6 +319,11 @@ private:
 	bool _smallInversion, _makePSF, _isWeightImageSaved, _isUVImageSaved, _isGriddingImageSaved, _dftPrediction, _dftWithBeam;
 	std::string _temporaryDirectory;
 	bool _forceReorder, _forceNoReorder, _modelUpdateRequired, _mfsWeighting;
+	ReorderStorage::Format _reorderStorageFormat;
+	bool _reorderInMemory, _useHugePages;
+	double _memoryResidentSize;
+	size_t _parallelReading, _parallelGroups, _prefetchGroups;
+	bool _storeWeights;
 	enum WStackingGridder::GridModeEnum _gridMode;
 	std::vector<std::string> _filenames;
 	std::string _commandLine;
@@ -247,16 +341,15 @@ private:
 	};
 	std::vector<ChannelInfo> _infoPerChannel;
 	
-	std::unique_ptr<class InversionAlgorithm> _inversionAlgorithm;
 	std::unique_ptr<class ImageWeightCache> _imageWeightCache;
 	ImageBufferAllocator _imageAllocator;
-	Stopwatch _inversionWatch, _predictingWatch, _deconvolutionWatch;
-	bool _isFirstInversion, _doReorder;
-	size_t _currentIntervalIndex, _majorIterationNr;
-	CachedImageSet _psfImages, _modelImages, _residualImages;
+	std::atomic<bool> _isFirstInversion;
+	bool _doReorder;
+	size_t _currentIntervalIndex;
 	std::vector<PartitionedMS::Handle> _partitionedMSHandles;
-	FitsWriter _fitsWriter;
-	std::vector<MSProvider*> _currentPolMSes;
+	std::vector<MemoryMS::Handle> _memoryMSHandles;
+	// Guard the weight cache and the ms handles when groups run concurrently
+	boost::mutex _imageWeightMutex, _msProviderMutex;
 	std::vector<MultiBandData> _msBands;
 	bool _normalizeForWeighting;
 	enum InversionAlgorithm::VisibilityWeightingMode _visibilityWeightingMode;
@@ -24,13 +24,15 @@
 
 #include <boost/thread/thread.hpp>
 
+boost::mutex WSMSGridder::_metaDataMutex;
+
 WSMSGridder::MSData::MSData() : matchingRows(0), totalRowsProcessed(0)
 { }
 
 WSMSGridder::MSData::~MSData()
 { }
 
-WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit) : InversionAlgorithm(), _phaseCentreRA(0.0), _phaseCentreDec(0.0), _phaseCentreDL(0.0), _phaseCentreDM(0.0), _denormalPhaseCentre(false), _hasFrequencies(false), _freqHigh(0.0), _freqLow(0.0), _bandStart(0.0), _bandEnd(0.0), _beamSize(0.0), _totalWeight(0.0), _startTime(0.0), _gridMode(WStackingGridder::NearestNeighbour), _cpuCount(threadCount), _laneBufferSize(_cpuCount*2), _imageBufferAllocator(imageAllocator)
+WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit) : InversionAlgorithm(), _phaseCentreRA(0.0), _phaseCentreDec(0.0), _phaseCentreDL(0.0), _phaseCentreDM(0.0), _denormalPhaseCentre(false), _hasFrequencies(false), _freqHigh(0.0), _freqLow(0.0), _bandStart(0.0), _bandEnd(0.0), _beamSize(0.0), _totalWeight(0.0), _startTime(0.0), _gridMode(WStackingGridder::NearestNeighbour), _cpuCount(threadCount), _laneBufferSize(_cpuCount*2), _readerCount(1), _imageBufferAllocator(imageAllocator)
 {
 	long int pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
 	_memSize = (int64_t) pageCount * (int64_t) pageSize;
@@ -56,6 +58,9 @@ WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCoun
 		
 void WSMSGridder::initializeMeasurementSet(size_t msIndex, WSMSGridder::MSData& msData)
 {
+	// Casacore is not thread safe, and gridders of independent groups can run concurrently.
+	// The lock is held until the casacore columns below are destructed.
+	boost::mutex::scoped_lock metaDataLock(_metaDataMutex);
 	MSProvider& msProvider = MeasurementSet(msIndex);
 	msData.msProvider = &msProvider;
 	casacore::MeasurementSet& ms(msProvider.MS());
@@ -90,7 +95,17 @@ void WSMSGridder::initializeMeasurementSet(size_t msIndex, WSMSGridder::MSData&
 		msData.endChannel = msData.bandData.FirstBand().ChannelCount();
 	}
 	casacore::MEpoch::ROScalarColumn timeColumn(ms, ms.columnName(casacore::MSMainEnums::TIME));
-	const MultiBandData selectedBand = msData.SelectedBand();
+	msData.selectedBand = msData.SelectedBand();
+	const MultiBandData& selectedBand = msData.selectedBand;
+	msData.wavelengths.resize(selectedBand.DataDescCount());
+	for(size_t dataDescId=0; dataDescId!=selectedBand.DataDescCount(); ++dataDescId)
+	{
+		const BandData& band = selectedBand[dataDescId];
+		ao::uvector<double>& wavelengths = msData.wavelengths[dataDescId];
+		wavelengths.resize(band.ChannelCount());
+		for(size_t ch=0; ch!=band.ChannelCount(); ++ch)
+			wavelengths[ch] = band.ChannelWavelength(ch);
+	}
 	if(_hasFrequencies)
 	{
 		_freqLow = std::min(_freqLow, selectedBand.LowestFrequency());
@@ -283,12 +298,12 @@ void WSMSGridder::countSamplesPerLayer(MSData& msData)
 	std::cout << '\n';
 }
 
-void WSMSGridder::gridMeasurementSet(MSData &msData)
+void WSMSGridder::gridMeasurementSet(MSData &msData, double& totalWeight)
 {
-	const MultiBandData selectedBand(msData.SelectedBand());
-	_gridder->PrepareBand(selectedBand);
+	const MultiBandData& selectedBand(msData.selectedBand);
 	std::vector<std::complex<float>> modelBuffer(selectedBand.MaxChannels());
 	std::vector<float> weightBuffer(selectedBand.MaxChannels());
+	ao::uvector<double> imageWeightBuffer(selectedBand.MaxChannels());
 	
 	lane_write_buffer<InversionWorkItem> writeBuffer(&*_inversionWorkLane, 128);
 	
@@ -310,6 +325,7 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 			newItem.v = vInMeters;
 			newItem.w = wInMeters;
 			newItem.dataDescId = dataDescId;
+			newItem.band = &curBand;
 			newItem.data = new std::complex<float>[curBand.ChannelCount()];
 			
 			if(DoImagePSF())
@@ -337,58 +353,7 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 				}
 			}
 			msData.msProvider->ReadWeights(weightBuffer.data());
-			switch(VisibilityWeightingMode())
-			{
-				case NormalVisibilityWeighting:
-					// The MS provider has already preweighted the
-					// visibilities for their weight, so we do not
-					// have to do anything.
-					break;
-				case SquaredVisibilityWeighting:
-					for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
-						newItem.data[ch] *= weightBuffer[ch];
-					break;
-				case UnitVisibilityWeighting:
-					for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
-					{
-						if(weightBuffer[ch] == 0.0)
-							newItem.data[ch] = 0.0;
-						else
-							newItem.data[ch] /= weightBuffer[ch];
-					}
-					break;
-			}
-			switch(Weighting().Mode())
-			{
-				case WeightMode::UniformWeighted:
-				case WeightMode::BriggsWeighted:
-				case WeightMode::NaturalWeighted:
-				{
-					std::complex<float>* dataIter = newItem.data;
-					float* weightIter = weightBuffer.data();
-					for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
-					{
-						double
-							u = newItem.u / curBand.ChannelWavelength(ch),
-							v = newItem.v / curBand.ChannelWavelength(ch),
-							weight = PrecalculatedWeightInfo()->GetWeight(u, v);
-						*dataIter *= weight;
-						_totalWeight += weight * *weightIter;
-						++dataIter;
-						++weightIter;
-					}
-				} break;
-				case WeightMode::DistanceWeighted:
-				{
-					float* weightIter = weightBuffer.data();
-					double mwaWeight = sqrt(newItem.u*newItem.u + newItem.v*newItem.v + newItem.w*newItem.w);
-					for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
-					{
-						_totalWeight += *weightIter * mwaWeight;
-						++weightIter;
-					}
-				} break;
-			}
+			totalWeight += weightRow(newItem.data, weightBuffer.data(), imageWeightBuffer.data(), msData.wavelengths[dataDescId], newItem.u, newItem.v, newItem.w);
 			
 			writeBuffer.write(newItem);
 			
@@ -403,7 +368,55 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 	msData.totalRowsProcessed += rowsRead;
 }
 
-void WSMSGridder::workThreadParallel(const MultiBandData* selectedBand)
+double WSMSGridder::weightRow(std::complex<float>* data, const float* weights, double* imageWeights, const ao::uvector<double>& wavelengths, double u, double v, double w) const
+{
+	const size_t channelCount = wavelengths.size();
+	const bool isDistanceWeighted = Weighting().IsDistance();
+	if(isDistanceWeighted)
+		std::fill_n(imageWeights, channelCount, 1.0);
+	else
+		PrecalculatedWeightInfo()->GetWeights(u, v, wavelengths.data(), channelCount, imageWeights);
+	
+	double weightSum = 0.0;
+	switch(VisibilityWeightingMode())
+	{
+		case NormalVisibilityWeighting:
+			// The MS provider has already preweighted the
+			// visibilities for their weight, so we do not
+			// have to do anything.
+			weightSum = applyRowWeights<NormalVisibilityWeighting>(data, weights, imageWeights, channelCount);
+			break;
+		case SquaredVisibilityWeighting:
+			weightSum = applyRowWeights<SquaredVisibilityWeighting>(data, weights, imageWeights, channelCount);
+			break;
+		case UnitVisibilityWeighting:
+			weightSum = applyRowWeights<UnitVisibilityWeighting>(data, weights, imageWeights, channelCount);
+			break;
+	}
+	if(isDistanceWeighted)
+		weightSum *= sqrt(u*u + v*v + w*w);
+	return weightSum;
+}
+
+template<enum InversionAlgorithm::VisibilityWeightingMode Mode>
+double WSMSGridder::applyRowWeights(std::complex<float>* data, const float* weights, const double* imageWeights, size_t channelCount)
+{
+	// The mode is a template parameter, so that this loop has no branches on the mode
+	double weightSum = 0.0;
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		double factor = imageWeights[ch];
+		if(Mode == SquaredVisibilityWeighting)
+			factor *= weights[ch];
+		else if(Mode == UnitVisibilityWeighting)
+			factor = (weights[ch] == 0.0) ? 0.0 : factor / weights[ch];
+		data[ch] *= float(factor);
+		weightSum += imageWeights[ch] * weights[ch];
+	}
+	return weightSum;
+}
+
+void WSMSGridder::workThreadParallel(size_t maxChannelCount)
 {
 	std::unique_ptr<ao::lane<InversionWorkSample>[]> lanes(new ao::lane<InversionWorkSample>[_cpuCount]);
 	boost::thread_group group;
@@ -414,10 +427,10 @@ void WSMSGridder::workThreadParallel(const MultiBandData* selectedBand)
 	// did not help.
 	std::unique_ptr<lane_write_buffer<InversionWorkSample>[]>
 		bufferedLanes(new lane_write_buffer<InversionWorkSample>[_cpuCount]);
-	size_t bufferedLaneSize = std::max<size_t>(selectedBand->FirstBand().ChannelCount(), _laneBufferSize);
+	size_t bufferedLaneSize = std::max<size_t>(maxChannelCount, _laneBufferSize);
 	for(size_t i=0; i!=_cpuCount; ++i)
 	{
-		lanes[i].resize(selectedBand->FirstBand().ChannelCount() * _laneBufferSize);
+		lanes[i].resize(maxChannelCount * _laneBufferSize);
 		bufferedLanes[i].reset(&lanes[i], bufferedLaneSize);
 		
 		group.add_thread(new boost::thread(&WSMSGridder::workThreadPerSample, this, &lanes[i]));
@@ -428,7 +441,7 @@ void WSMSGridder::workThreadParallel(const MultiBandData* selectedBand)
 	InversionWorkItem workItem;
 	while(readBuffer.read(workItem))
 	{
-		const BandData& curBand = (*selectedBand)[workItem.dataDescId];
+		const BandData& curBand = *workItem.band;
 		InversionWorkSample sampleData;
 		for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
 		{
@@ -458,19 +471,18 @@ void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane)
 	}
 }
 
-void WSMSGridder::predictMeasurementSet(MSData &msData)
+void WSMSGridder::predictMeasurementSet(MSData &msData, size_t calcThreadCount)
 {
 	msData.msProvider->ReopenRW();
-	const MultiBandData selectedBandData(msData.SelectedBand());
-	_gridder->PrepareBand(selectedBandData);
+	const MultiBandData& selectedBandData(msData.selectedBand);
 	
 	size_t rowsProcessed = 0;
 	
-	ao::lane<PredictionWorkItem> calcLane(_laneBufferSize+_cpuCount), writeLane(_laneBufferSize);
+	ao::lane<PredictionWorkItem> calcLane(_laneBufferSize+calcThreadCount), writeLane(_laneBufferSize);
 	lane_write_buffer<PredictionWorkItem> bufferedCalcLane(&calcLane, _laneBufferSize);
 	boost::thread writeThread(&WSMSGridder::predictWriteThread, this, &writeLane, &msData);
 	boost::thread_group calcThreads;
-	for(size_t i=0; i!=_cpuCount; ++i)
+	for(size_t i=0; i!=calcThreadCount; ++i)
 		calcThreads.add_thread(new boost::thread(&WSMSGridder::predictCalcThread, this, &calcLane, &writeLane));
 
 		
@@ -508,7 +520,8 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 		newItem.v = vs[i];
 		newItem.w = ws[i];
 		newItem.dataDescId = dataIds[i];
-		newItem.data = new std::complex<float>[selectedBandData[dataIds[i]].ChannelCount()];
+		newItem.band = &selectedBandData[dataIds[i]];
+		newItem.data = new std::complex<float>[newItem.band->ChannelCount()];
 		newItem.rowId = rowIds[i];
 				
 		bufferedCalcLane.write(newItem);
@@ -530,7 +543,13 @@ void WSMSGridder::predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao:
 	PredictionWorkItem item;
 	while(inputLane->read(item))
 	{
-		_gridder->SampleData(item.data, item.dataDescId, item.u, item.v, item.w);
+		// The band is taken from the work item instead of the gridder, so that
+		// several measurement sets can be predicted at the same time.
+		for(size_t ch=0; ch!=item.band->ChannelCount(); ++ch)
+		{
+			const double wavelength = item.band->ChannelWavelength(ch);
+			_gridder->SampleDataSample(item.data[ch], item.u / wavelength, item.v / wavelength, item.w / wavelength);
+		}
 		
 		writeBuffer.write(item);
 	}
@@ -547,6 +566,48 @@ void WSMSGridder::predictWriteThread(ao::lane<PredictionWorkItem>* predictionWor
 	}
 }
 
+std::vector<std::vector<size_t>> WSMSGridder::makeReaderGroups(const MSData* msDataVector) const
+{
+	std::vector<std::vector<size_t>> groups;
+	std::vector<std::string> tableNames;
+	for(size_t i=0; i!=MeasurementSetCount(); ++i)
+	{
+		const std::string tableName = msDataVector[i].msProvider->MS().tableName();
+		std::vector<std::string>::const_iterator name = std::find(tableNames.begin(), tableNames.end(), tableName);
+		if(name == tableNames.end())
+		{
+			tableNames.push_back(tableName);
+			groups.push_back(std::vector<size_t>(1, i));
+		}
+		else {
+			groups[name - tableNames.begin()].push_back(i);
+		}
+	}
+	return groups;
+}
+
+void WSMSGridder::gridReaderThread(MSData* msDataVector, ReaderQueue* queue, double* msWeights)
+{
+	size_t groupIndex;
+	while(queue->Next(groupIndex))
+	{
+		const std::vector<size_t>& group = queue->groups[groupIndex];
+		for(std::vector<size_t>::const_iterator i=group.begin(); i!=group.end(); ++i)
+			gridMeasurementSet(msDataVector[*i], msWeights[*i]);
+	}
+}
+
+void WSMSGridder::predictReaderThread(MSData* msDataVector, ReaderQueue* queue, size_t calcThreadCount)
+{
+	size_t groupIndex;
+	while(queue->Next(groupIndex))
+	{
+		const std::vector<size_t>& group = queue->groups[groupIndex];
+		for(std::vector<size_t>::const_iterator i=group.begin(); i!=group.end(); ++i)
+			predictMeasurementSet(msDataVector[*i], calcThreadCount);
+	}
+}
+
 void WSMSGridder::Invert()
 {
 	MSData* msDataVector = new MSData[MeasurementSetCount()];
@@ -576,6 +637,12 @@ void WSMSGridder::Invert()
 			countSamplesPerLayer(msDataVector[i]);
 	}
 	
+	size_t maxChannelCount = 0;
+	for(size_t i=0; i!=MeasurementSetCount(); ++i)
+		maxChannelCount = std::max(maxChannelCount, msDataVector[i].selectedBand.MaxChannels());
+	const std::vector<std::vector<size_t>> readerGroups = makeReaderGroups(msDataVector);
+	const size_t readerCount = std::min(_readerCount, readerGroups.size());
+	
 	_totalWeight = 0.0;
 	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
 	{
@@ -586,21 +653,28 @@ void WSMSGridder::Invert()
 		
 		_gridder->StartInversionPass(pass);
 		
-		for(size_t i=0; i!=MeasurementSetCount(); ++i)
-		{
-			_inversionWorkLane->clear();
-			
-			MSData& msData = msDataVector[i];
-			
-			const MultiBandData selectedBand(msData.SelectedBand());
-			
-			boost::thread thread(&WSMSGridder::workThreadParallel, this, &selectedBand);
+		boost::thread thread(&WSMSGridder::workThreadParallel, this, maxChannelCount);
 		
-			gridMeasurementSet(msData);
-			
-			_inversionWorkLane->write_end();
-			thread.join();
+		if(readerCount == 1)
+		{
+			for(size_t i=0; i!=MeasurementSetCount(); ++i)
+				gridMeasurementSet(msDataVector[i], _totalWeight);
+		}
+		else {
+			// Weights are summed per measurement set and added in order, to keep the result
+			// independent of the order in which the readers finish.
+			std::vector<double> msWeights(MeasurementSetCount(), 0.0);
+			ReaderQueue queue(readerGroups);
+			boost::thread_group readers;
+			for(size_t i=0; i!=readerCount; ++i)
+				readers.add_thread(new boost::thread(&WSMSGridder::gridReaderThread, this, msDataVector, &queue, msWeights.data()));
+			readers.join_all();
+			for(size_t i=0; i!=MeasurementSetCount(); ++i)
+				_totalWeight += msWeights[i];
 		}
+		
+		_inversionWorkLane->write_end();
+		thread.join();
 		_inversionWorkLane.reset();
 		
 		std::cout << "Fourier transforms...\n";
@@ -688,6 +762,9 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 			countSamplesPerLayer(msDataVector[i]);
 	}
 	
+	const std::vector<std::vector<size_t>> readerGroups = makeReaderGroups(msDataVector);
+	const size_t readerCount = std::min(_readerCount, readerGroups.size());
+	
 	double *resizedReal = 0, *resizedImag = 0;
 	if(ImageWidth()!=_actualInversionWidth || ImageHeight()!=_actualInversionHeight)
 	{
@@ -724,8 +801,18 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 		_gridder->StartPredictionPass(pass);
 		
 		std::cout << "Predicting...\n";
-		for(size_t i=0; i!=MeasurementSetCount(); ++i)
-			predictMeasurementSet(msDataVector[i]);
+		if(readerCount == 1)
+		{
+			for(size_t i=0; i!=MeasurementSetCount(); ++i)
+				predictMeasurementSet(msDataVector[i], _cpuCount);
+		}
+		else {
+			ReaderQueue queue(readerGroups);
+			boost::thread_group readers;
+			for(size_t i=0; i!=readerCount; ++i)
+				readers.add_thread(new boost::thread(&WSMSGridder::predictReaderThread, this, msDataVector, &queue, std::max<size_t>(1, _cpuCount / readerCount)));
+			readers.join_all();
+		}
 	}
 	
 	if(ImageWidth()!=_actualInversionWidth || ImageHeight()!=_actualInversionHeight)
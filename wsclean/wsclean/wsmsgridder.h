@@ -6,9 +6,14 @@
 
 #include "../lane.h"
 #include "../multibanddata.h"
+#include "../uvector.h"
 
+#include <algorithm>
 #include <complex>
 #include <memory>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
 
 #include <casacore/casa/Arrays/Array.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
@@ -50,6 +55,13 @@ class WSMSGridder : public InversionAlgorithm
 		enum WStackingGridder::GridModeEnum GridMode() const { return _gridMode; }
 		void SetGridMode(WStackingGridder::GridModeEnum gridMode) { _gridMode = gridMode; }
 		
+		/**
+		 * Set the number of measurement sets that are read concurrently while gridding
+		 * or predicting. Providers that refer to the same measurement set are always
+		 * read by the same thread. The default of one reads all measurement sets in order.
+		 */
+		void SetReaderCount(size_t readerCount) { _readerCount = std::max<size_t>(1, readerCount); }
+		
 		virtual bool HasGriddingCorrectionImage() const { return _gridMode == WStackingGridder::KaiserBessel; }
 		virtual void GetGriddingCorrectionImage(double *image) const { _gridder->GetGriddingCorrectionImage(image); }
 		
@@ -65,6 +77,7 @@ class WSMSGridder : public InversionAlgorithm
 		{
 			double u, v, w;
 			size_t dataDescId;
+			const BandData* band;
 			std::complex<float> *data;
 		};
 		struct InversionWorkSample
@@ -77,6 +90,7 @@ class WSMSGridder : public InversionAlgorithm
 			double u, v, w;
 			std::complex<float> *data;
 			size_t rowId, dataDescId;
+			const BandData* band;
 		};
 		
 		struct MSData
@@ -85,7 +99,9 @@ class WSMSGridder : public InversionAlgorithm
 				MSData();
 				~MSData();
 				class MSProvider *msProvider;
-				MultiBandData bandData;
+				MultiBandData bandData, selectedBand;
+				/** Wavelengths of the selected channels, per data description id */
+				std::vector<ao::uvector<double>> wavelengths;
 				size_t startChannel, endChannel;
 				size_t matchingRows, totalRowsProcessed;
 				double minW, maxW;
@@ -99,10 +115,34 @@ class WSMSGridder : public InversionAlgorithm
 		};
 		
 		void initializeMeasurementSet(size_t msIndex, MSData &msData);
-		void gridMeasurementSet(MSData &msData);
+		void gridMeasurementSet(MSData &msData, double& totalWeight);
 		void countSamplesPerLayer(MSData &msData);
 
-		void predictMeasurementSet(MSData &msData);
+		void predictMeasurementSet(MSData &msData, size_t calcThreadCount);
+		
+		/**
+		 * Groups the measurement sets by the table they are read from, so that
+		 * concurrent readers never access the same table.
+		 */
+		std::vector<std::vector<size_t>> makeReaderGroups(const MSData* msDataVector) const;
+		struct ReaderQueue
+		{
+			ReaderQueue(const std::vector<std::vector<size_t>>& _groups) : groups(_groups), nextGroup(0) { }
+			bool Next(size_t& groupIndex)
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				if(nextGroup == groups.size())
+					return false;
+				groupIndex = nextGroup;
+				++nextGroup;
+				return true;
+			}
+			const std::vector<std::vector<size_t>>& groups;
+			size_t nextGroup;
+			boost::mutex mutex;
+		};
+		void gridReaderThread(MSData* msDataVector, ReaderQueue* queue, double* msWeights);
+		void predictReaderThread(MSData* msDataVector, ReaderQueue* queue, size_t calcThreadCount);
 
 		void workThread(ao::lane<InversionWorkItem>* workLane)
 		{
@@ -114,13 +154,22 @@ class WSMSGridder : public InversionAlgorithm
 			}
 		}
 		
-		void workThreadParallel(const MultiBandData* selectedBand);
+		void workThreadParallel(size_t maxChannelCount);
 		void workThreadPerSample(ao::lane<InversionWorkSample>* workLane);
 		
 		void predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane);
 		void predictWriteThread(ao::lane<PredictionWorkItem>* samplingWorkLane, const MSData* msData);
 		static void rotateVisibilities(const BandData &bandData, double shiftFactor, std::complex<float>* dataIter);
+		/**
+		 * Applies the visibility weighting and the image weighting to the visibilities of one row
+		 * in a single pass over the channels, and returns the sum of the applied weights.
+		 * @param imageWeights Buffer for the image weights of the channels.
+		 */
+		double weightRow(std::complex<float>* data, const float* weights, double* imageWeights, const ao::uvector<double>& wavelengths, double u, double v, double w) const;
+		template<enum VisibilityWeightingMode Mode>
+		static double applyRowWeights(std::complex<float>* data, const float* weights, const double* imageWeights, size_t channelCount);
 
+		static boost::mutex _metaDataMutex;
 		std::unique_ptr<WStackingGridder> _gridder;
 		std::unique_ptr<ao::lane<InversionWorkItem>> _inversionWorkLane;
 		double _phaseCentreRA, _phaseCentreDec, _phaseCentreDL, _phaseCentreDM;
@@ -131,7 +180,7 @@ class WSMSGridder : public InversionAlgorithm
 		double _totalWeight;
 		double _startTime;
 		WStackingGridder::GridModeEnum _gridMode;
-		size_t _cpuCount, _laneBufferSize;
+		size_t _cpuCount, _laneBufferSize, _readerCount;
 		int64_t _memSize;
 		ImageBufferAllocator* _imageBufferAllocator;
 		size_t _actualInversionWidth, _actualInversionHeight;
@@ -39,11 +39,36 @@ int main(int argc, char *argv[])
 			"   Default: 100.\n"
 			"-absmem <memory limit>\n"
 			"   Like -mem, but this specifies a fixed amount of memory in gigabytes.\n"
+			"-parallel-reading <n>\n"
+			"   Read up to n measurement sets at the same time while gridding and predicting. Parts of the same\n"
+			"   measurement set are always read by the same thread. Default: 1.\n"
+			"-parallel-groups <n>\n"
+			"   Image and clean up to n independent groups (e.g. output channels that are not joined) at the same\n"
+			"   time, each with a part of the threads and memory. Requires reordered data. Default: 1.\n"
+			"-prefetch-groups <n>\n"
+			"   Make the PSF and dirty images of up to n next groups in the background while a group is being\n"
+			"   cleaned, so that reading and gridding overlap with deconvolution. Both then use half of the threads\n"
+			"   and memory. Requires reordered data. Default: 0.\n"
 			"-reorder\n"
 			"-no-reorder\n"
 			"   Force or disable reordering of Measurement Set. This can be faster when the measurement set needs to\n"
 			"   be iterated several times, such as with many major iterations or in channel imaging mode.\n"
 			"   Default: only reorder when in channel imaging mode.\n"
+			"-reorder-compression <none, bf16 or int16>\n"
+			"   Store the reordered data and weights with reduced precision, which halves the size of the\n"
+			"   temporary files. bf16 keeps a relative precision of 2^-9 per value, int16 stores each row as\n"
+			"   16-bit integers relative to the largest value in the row. The introduced error is reported\n"
+			"   after reordering. Default: none.\n"
+			"-reorder-in-memory\n"
+			"   Keep the reordered data in memory instead of writing it to temporary files, when it fits in half of\n"
+			"   the memory limit (see -mem and -absmem). Otherwise, the data is reordered to disk as usual.\n"
+			"-hugepages\n"
+			"   Request transparent huge pages for the in-memory reordered data.\n"
+			"-store-weights\n"
+			"   Store the calculated uniform or Briggs weights in the temporary directory (see -tempdir) and read\n"
+			"   them back in later runs with the same measurement sets, selection, image size and weighting settings.\n"
+			"   The stored files are named <ms>-weights-<key>.dat and should be removed when the flags or weights\n"
+			"   of the measurement sets change.\n"
 			"-tempdir <directory>\n"
 			"   Set the temporary directory used when reordering files. Default: same directory as input measurement set.\n"
 			"-saveweights\n"
@@ -164,6 +189,11 @@ int main(int argc, char *argv[])
 			"-joinchannels\n"
 			"   Perform cleaning by searching for peaks in the MFS image, but subtract components from individual channels.\n"
 			"   This will turn on mfsweighting by default. Default: off.\n"
+			"-clark\n"
+			"   Use the Clark algorithm for point-source cleaning. Minor iterations are performed on the brightest pixels\n"
+			"   with a patch of the PSF, and the components are subtracted from the full image with an FFT. This is\n"
+			"   much faster than the default (Hogbom) algorithm on large images with many components. Can be combined\n"
+			"   with -joinpolarizations and -joinchannels. Default: off.\n"
 			"-multiscale\n"
 			"   Clean on different scales. This is a new experimental algorithm. Default: off.\n"
 			"   This parameter invokes the v1.9 multiscale algorithm, which is slower but more accurate\n"
@@ -180,6 +210,14 @@ int main(int argc, char *argv[])
 			"-multiscale-scale-bias\n"
 			"   Parameter to prevent cleaning small scales in the large-scale iterations. A higher\n"
 			"   bias will give more focus to larger scales. Default: 0.6\n"
+			"-multiscale-fast-subminor\n"
+			"   Use a faster sub-minor loop in -multiscale, which only considers the pixels that are above the\n"
+			"   threshold of a sub-minor loop when it starts, like the minor loop of -clark. This is an\n"
+			"   approximation: results differ slightly from the default sub-minor loop.\n"
+			"-multiscale-psf-crop-tolerance <fraction>\n"
+			"   The scale-convolved PSFs of -multiscale are cropped to the smallest window that loses at most this\n"
+			"   fraction of their energy. A value above zero makes cleaning faster, but changes the result\n"
+			"   slightly. Default: 0, which only crops borders without energy.\n"
 			"-cleanborder <percentage>\n"
 			"   Set the border size in which no cleaning is performed, in percentage of the width/height of the image.\n"
 			"   With an image size of 1000 and clean border of 1%, each border is 10 pixels. Default: 5 (%).\n"
@@ -203,6 +241,10 @@ int main(int argc, char *argv[])
 			"-moresane-sl <sl1,sl2,...>\n"
 			"   MoreSane --sigmalevel setting for each major loop iteration. Useful to start at high\n"
 			"   levels and go down with subsequent loops, e.g. 20,10,5\n"
+			"-moresane-persistent\n"
+			"   Keep MoreSane loaded in a single Python process and exchange images through shared\n"
+			"   memory, instead of starting MoreSane for each major iteration. Requires numpy and\n"
+			"   astropy (or pyfits) in the Python that runs MoreSane.\n"
 			"\n"
 			"  ** RESTORATION OPTIONS **\n"
 			"-beamsize <arcsec>\n"
@@ -312,6 +354,10 @@ int main(int argc, char *argv[])
 		{
 			wsclean.DeconvolutionInfo().SetStopOnNegativeComponents(true);
 		}
+		else if(param == "clark")
+		{
+			wsclean.DeconvolutionInfo().SetUseClark(true);
+		}
 		else if(param == "iuwt")
 		{
 			wsclean.DeconvolutionInfo().SetUseIUWT(true);
@@ -334,6 +380,10 @@ int main(int argc, char *argv[])
 			boost::split(slevels, argv[argi], boost::is_any_of(","));
 			wsclean.DeconvolutionInfo().SetMoreSaneSigmaLevels(slevels);
 		}
+		else if(param == "moresane-persistent")
+		{
+			wsclean.DeconvolutionInfo().SetMoreSanePersistent(true);
+		}
 		else if(param == "makepsf")
 		{
 			wsclean.SetMakePSF(true);
@@ -432,6 +482,15 @@ int main(int argc, char *argv[])
 			++argi;
 			wsclean.DeconvolutionInfo().SetMultiscaleScaleBias(atof(argv[argi]));
 		}
+		else if(param == "multiscale-fast-subminor")
+		{
+			wsclean.DeconvolutionInfo().SetMultiscaleFastSubMinorLoop(true);
+		}
+		else if(param == "multiscale-psf-crop-tolerance")
+		{
+			++argi;
+			wsclean.DeconvolutionInfo().SetMultiscalePSFCropTolerance(atof(argv[argi]));
+		}
 		else if(param == "weighting-rank-filter")
 		{
 			++argi;
@@ -542,6 +601,40 @@ int main(int argc, char *argv[])
 			wsclean.SetForceNoReorder(true);
 			wsclean.SetForceReorder(false);
 		}
+		else if(param == "reorder-compression")
+		{
+			++argi;
+			std::string formatStr = argv[argi];
+			boost::to_lower(formatStr);
+			wsclean.SetReorderStorageFormat(ReorderStorage::Parse(formatStr));
+		}
+		else if(param == "reorder-in-memory")
+		{
+			wsclean.SetReorderInMemory(true);
+		}
+		else if(param == "hugepages")
+		{
+			wsclean.SetUseHugePages(true);
+		}
+		else if(param == "store-weights")
+		{
+			wsclean.SetStoreWeights(true);
+		}
+		else if(param == "parallel-reading")
+		{
+			++argi;
+			wsclean.SetParallelReading(atoi(argv[argi]));
+		}
+		else if(param == "parallel-groups")
+		{
+			++argi;
+			wsclean.SetParallelGroups(atoi(argv[argi]));
+		}
+		else if(param == "prefetch-groups")
+		{
+			++argi;
+			wsclean.SetPrefetchGroups(atoi(argv[argi]));
+		}
 		else if(param == "update-model-required")
 		{
 			wsclean.SetModelUpdateRequired(true);